@@ -31,12 +31,14 @@ layout(location = 3) in vec3 frag_pos;
 layout(location = 4) in vec3 camera_pos;
 layout(location = 5) flat in float roughness;
 layout(location = 6) in vec3 view_z;
-layout(location = 7) flat in Material mat;
+layout(location = 7) flat in uint material_index;
+layout(location = 8) in vec4 prev_clip_pos;
 
 layout(location = 0) out vec4 color;
 layout(location = 1) out vec4 normal_roughness;
 layout(location = 2) out vec4 basecolor_metalness;
 layout(location = 3) out vec4 world_position;
+layout(location = 4) out vec2 motion_vector;
 
 const vec3 SILVER = vec3(0.95, 0.93, 0.88);
 
@@ -51,6 +53,7 @@ layout( push_constant, scalar ) uniform constants
     float probe_spacing;
     vec3 probe_min;
     vec2 jitter;
+    vec2 inverse_screen_size;
 } control;
 
 uint get_probe_linear_index(ivec3 p)
@@ -203,6 +206,7 @@ void main()
     vec3 evaluated_sh = vec3(0.0);
 #endif
 
+    Material mat = material_array.materials[material_index];
     vec4 base_color = mat.base_color_tex != -1 ? texture(textures[mat.base_color_tex], texcoord) : mat.base_color_factor;
     if (base_color.a < 0.5) discard;
     vec3 metallic_roughness = texture(textures[mat.metallic_roughness_tex], texcoord).rgb;
@@ -260,6 +264,11 @@ void main()
     // }
     world_position = vec4(frag_pos, 1.0);
 
+    // Screen UV offset from the jittered pixel center to where this point was last frame, y down like the
+    // compute passes. Same as projecting the world position with the previous view projection, for moving objects too
+    vec2 prev_uv = prev_clip_pos.xy / prev_clip_pos.w * vec2(0.5, -0.5) + 0.5;
+    motion_vector = prev_uv - gl_FragCoord.xy * control.inverse_screen_size;
+
     // color = vec4(envmap_sample, 1.0);
     // SH_2 sh = SH_samples.samples[0];
     // vec3 evaluated_sh = eval_sh(sh, N);
@@ -12,7 +12,10 @@ layout (location = 3) out vec3 frag_pos;
 layout (location = 4) flat out vec3 camera_pos;
 layout (location = 5) flat out float roughness;
 layout (location = 6) out vec3 view_z;
-layout (location = 7) flat out Material mat;
+// The fragment shader reads the material itself, a Material varying would take a location per member
+layout (location = 7) flat out uint material_index;
+// Unjittered previous frame clip position for the motion vectors
+layout (location = 8) out vec4 prev_clip_pos;
 
 layout( push_constant, scalar ) uniform constants
 {
@@ -25,9 +28,10 @@ layout( push_constant, scalar ) uniform constants
 
 void main()
 {
-    int geom_id = int((gl_InstanceIndex) & 0x3FFF);
-    int material_id = int((gl_InstanceIndex >> 14) & 0x3FF);
-    mat = material_array.materials[material_id];
+    // firstInstance of each draw is the instance's index, gl_VertexIndex already includes the base vertex
+    Instance_Data instance = instance_table.instances[gl_InstanceIndex];
+    uint material_id = instance.material_index;
+    material_index = material_id;
 
     Material mat = material_array.materials[material_id];
     base_color = mat.base_color_factor.rgb;
@@ -36,12 +40,14 @@ void main()
     proj[2][1] += (control.jitter.y - 0.5) * control.screen_size.y;
 
     mat4 xform =  proj * camera_data.current.view;
-    vec3 pos = vertex_buffer_array[geom_id].verts[gl_VertexIndex].pos;
-    normal = vertex_buffer_array[geom_id].verts[gl_VertexIndex].normal;
-    texcoord = vertex_buffer_array[geom_id].verts[gl_VertexIndex].texcoord;
+    vec3 pos = (instance.transform * vec4(vertex_buffer.verts[gl_VertexIndex].pos, 1.0)).xyz;
+    normal = transform_normal(instance.transform, unpack_normal(vertex_buffer.verts[gl_VertexIndex].normal));
+    texcoord = unpackHalf2x16(vertex_buffer.verts[gl_VertexIndex].texcoord);
     vec4 view_pos = camera_data.current.view * vec4(pos, 1.0);
     view_z = view_pos.xyz;
     vec4 hpos = xform * vec4(pos, 1.0);
+    vec3 prev_pos = (instance.previous_transform * vec4(vertex_buffer.verts[gl_VertexIndex].pos, 1.0)).xyz;
+    prev_clip_pos = camera_data.previous.viewproj * vec4(prev_pos, 1.0);
     frag_pos = pos;
     mat4 inv_view = inverse(camera_data.current.view);
     camera_pos = inv_view[3].xyz;
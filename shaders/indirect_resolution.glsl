@@ -0,0 +1,43 @@
+#ifndef INDIRECT_RESOLUTION_GLSL
+#define INDIRECT_RESOLUTION_GLSL
+
+// Needs shared.h for the mode defines, include it first
+
+// Reduced resolution indirect rays. Every ray pixel q traces one full resolution pixel and stores the result at q.
+// Half resolution traces one pixel of every 2x2 quad and walks the quad diagonally first in four frames,
+// checkerboard traces every other pixel of every row and flips the pattern every frame.
+// upsample_indirect.comp fills in the rest
+
+ivec2 indirect_trace_size(ivec2 size, uint mode)
+{
+    if (mode == INDIRECT_RESOLUTION_HALF)
+        return (size + 1) / 2;
+    if (mode == INDIRECT_RESOLUTION_CHECKERBOARD)
+        return ivec2((size.x + 1) / 2, size.y);
+    return size;
+}
+
+// Full resolution pixel traced by ray pixel q this frame, clamped to the screen on odd sizes
+ivec2 indirect_traced_pixel(ivec2 q, ivec2 size, uint mode, uint frame_number)
+{
+    const ivec2 quad_pattern[4] = ivec2[](ivec2(0, 0), ivec2(1, 1), ivec2(1, 0), ivec2(0, 1));
+
+    ivec2 p = q;
+    if (mode == INDIRECT_RESOLUTION_HALF)
+        p = 2 * q + quad_pattern[frame_number & 3];
+    else if (mode == INDIRECT_RESOLUTION_CHECKERBOARD)
+        p = ivec2(2 * q.x + ((q.y + int(frame_number)) & 1), q.y);
+    return min(p, size - 1);
+}
+
+// Ray pixel whose footprint contains full resolution pixel p
+ivec2 indirect_ray_pixel(ivec2 p, uint mode)
+{
+    if (mode == INDIRECT_RESOLUTION_HALF)
+        return p / 2;
+    if (mode == INDIRECT_RESOLUTION_CHECKERBOARD)
+        return ivec2(p.x / 2, p.y);
+    return p;
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef LIGHTS_GLSL
+#define LIGHTS_GLSL
+
+// Next event estimation toward emissive triangles. The light table picks triangles in proportion to their power in
+// O(1) with Vose's alias method, then a point uniformly on the picked triangle. Emission leaves the front side only.
+// The including shader includes scene.glsl and declares global_constants first, for the table's size and power
+
+struct Emissive_Sample
+{
+    vec3 pos;
+    vec3 normal; // Geometric
+    vec3 emission;
+    float pdf; // Area measure
+};
+
+// Light table entry picked with u
+uint pick_emissive_triangle(vec2 u)
+{
+    uint count = global_constants.data.emissive_triangle_count;
+    uint i = min(uint(u.x * float(count)), count - 1);
+    return u.y < emissive_triangle_table.triangles[i].alias_probability ? i : emissive_triangle_table.triangles[i].alias;
+}
+
+// Point u on the triangle of light table entry i, pdf including the pick
+Emissive_Sample emissive_triangle_sample(uint i, vec2 u)
+{
+    Emissive_Triangle t = emissive_triangle_table.triangles[i];
+    Instance_Data instance = instance_table.instances[t.instance_index];
+    Primitive_Info prim_info = primitive_info.primitives[instance.primitive_index];
+    uvec3 inds = index_buffer.indices[t.triangle_index + prim_info.vertex_offset / 3].index + prim_info.base_vertex;
+    vec3 v0 = (instance.transform * vec4(vertex_buffer.verts[inds.x].pos, 1.0)).xyz;
+    vec3 v1 = (instance.transform * vec4(vertex_buffer.verts[inds.y].pos, 1.0)).xyz;
+    vec3 v2 = (instance.transform * vec4(vertex_buffer.verts[inds.z].pos, 1.0)).xyz;
+
+    float su = sqrt(u.x);
+    vec3 c = cross(v1 - v0, v2 - v0);
+    float double_area = length(c);
+
+    Emissive_Sample s;
+    s.pos = v0 * (1.0 - su) + v1 * (su * (1.0 - u.y)) + v2 * (su * u.y);
+    s.normal = c / double_area;
+    s.emission = material_array.materials[instance.material_index].emissive_factor;
+    s.pdf = t.pdf / (0.5 * double_area);
+    return s;
+}
+
+// u.xy picks the triangle, u.zw the point on it. Only call with a non-empty table
+Emissive_Sample sample_emissive_triangle(vec4 u)
+{
+    return emissive_triangle_sample(pick_emissive_triangle(u.xy), u.zw);
+}
+
+// Area measure pdf of sample_emissive_triangle returning a point with this emission, for the MIS weight of an emitter
+// hit by chance. Equal to the sampled pdf as long as instances aren't scaled after load
+float emissive_area_pdf(vec3 emission)
+{
+    return emitted_power(emission, 1.0) / global_constants.data.emissive_total_power;
+}
+
+// Solid angle measure pdf from the area one, 0 for the back side
+float area_to_solid_angle_pdf(float pdf, float dist, float cos_light)
+{
+    return cos_light > 0.0 ? pdf * dist * dist / cos_light : 0.0;
+}
+
+bool emissive_sampling_enabled()
+{
+    return global_constants.data.emissive_sampling != 0 && global_constants.data.emissive_triangle_count != 0;
+}
+
+#endif
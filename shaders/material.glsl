@@ -11,6 +11,7 @@ struct Material
     vec4 base_color_factor;
     float metallic_factor;
     float roughness_factor;
+    vec3 emissive_factor;
 };
 
 // Shading material info
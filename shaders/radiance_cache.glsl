@@ -0,0 +1,132 @@
+#ifndef RADIANCE_CACHE_GLSL
+#define RADIANCE_CACHE_GLSL
+
+// World space hash grid of outgoing indirect diffuse radiance, in the spirit of NVIDIA's SHaRC. A cell is keyed by
+// the position quantized to a grid whose spacing follows the distance to the camera, and by the dominant axis of the
+// normal. The key hashes to a bucket of RADIANCE_CACHE_BUCKET_SIZE slots, a second hash of it (the checksum) tells
+// the cells in a bucket apart. A zero checksum marks a free slot.
+// radiance_cache_update.comp adds samples to the cells it finds or inserts, radiance_cache_resolve.comp blends them
+// into the cell radiance and frees cells that went stale. Lookups never insert.
+// The including shader includes shared.h and math.glsl, enables scalar block layout and defines RADIANCE_CACHE_KEYS_BINDING and
+// RADIANCE_CACHE_CELLS_BINDING
+
+layout(binding = RADIANCE_CACHE_KEYS_BINDING, set = 0) buffer radiance_cache_keys_t
+{
+    uint checksums[];
+} radiance_cache_keys;
+
+layout(binding = RADIANCE_CACHE_CELLS_BINDING, set = 0, scalar) buffer radiance_cache_cells_t
+{
+    Radiance_Cache_Cell cells[];
+} radiance_cache_cells;
+
+struct Radiance_Cache_Key
+{
+    uint hash;
+    uint checksum;
+};
+
+// Chris Wellons' lowbias32
+uint radiance_cache_hash(uint x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// Power of two level of the cell at pos, cells cover about cell_scale of the distance to the camera
+int radiance_cache_level(vec3 pos, vec3 camera_pos, float cell_scale)
+{
+    float d = max(distance(pos, camera_pos), 1e-3);
+    return clamp(int(ceil(log2(d * cell_scale))), -RADIANCE_CACHE_LEVEL_RANGE, RADIANCE_CACHE_LEVEL_RANGE - 1);
+}
+
+Radiance_Cache_Key radiance_cache_key(vec3 pos, vec3 normal, vec3 camera_pos, float cell_scale)
+{
+    int level = radiance_cache_level(pos, camera_pos, cell_scale);
+    uvec3 q = uvec3(ivec3(floor(pos * exp2(float(-level)))));
+
+    vec3 a = abs(normal);
+    uint axis = a.x > a.y && a.x > a.z ? 0u : (a.y > a.z ? 1u : 2u);
+    uint normal_bits = axis * 2u + (normal[axis] < 0.0 ? 1u : 0u);
+    uint meta = uint(level + RADIANCE_CACHE_LEVEL_RANGE) * 6u + normal_bits;
+
+    // Two independent chains, so keys sharing a bucket rarely share a checksum too
+    Radiance_Cache_Key key;
+    key.hash = radiance_cache_hash(radiance_cache_hash(radiance_cache_hash(radiance_cache_hash(meta) ^ q.x) ^ q.y) ^ q.z);
+    uint c = radiance_cache_hash(meta ^ 0x9e3779b9u);
+    c = radiance_cache_hash(c + q.x * 0x85ebca6bu);
+    c = radiance_cache_hash(c + q.y * 0xc2b2ae35u);
+    c = radiance_cache_hash(c + q.z * 0x27d4eb2fu);
+    key.checksum = max(c, 1u);
+    return key;
+}
+
+uint radiance_cache_bucket(Radiance_Cache_Key key)
+{
+    return (key.hash % uint(RADIANCE_CACHE_SIZE / RADIANCE_CACHE_BUCKET_SIZE)) * RADIANCE_CACHE_BUCKET_SIZE;
+}
+
+// Slot of the key's cell, -1 if it has none. Scans the whole bucket since freed slots can sit in front of a cell
+int radiance_cache_find(Radiance_Cache_Key key)
+{
+    uint bucket = radiance_cache_bucket(key);
+    for (uint i = 0; i < RADIANCE_CACHE_BUCKET_SIZE; ++i)
+    {
+        if (radiance_cache_keys.checksums[bucket + i] == key.checksum)
+            return int(bucket + i);
+    }
+    return -1;
+}
+
+// Slot of the key's cell, claimed if it has none yet. -1 when the bucket is full
+int radiance_cache_insert(Radiance_Cache_Key key)
+{
+    int slot = radiance_cache_find(key);
+    if (slot >= 0)
+        return slot;
+
+    uint bucket = radiance_cache_bucket(key);
+    for (uint i = 0; i < RADIANCE_CACHE_BUCKET_SIZE; ++i)
+    {
+        // Another thread inserting the same key ends up in the same free slot
+        uint previous = atomicCompSwap(radiance_cache_keys.checksums[bucket + i], 0u, key.checksum);
+        if (previous == 0u || previous == key.checksum)
+            return int(bucket + i);
+    }
+    return -1;
+}
+
+void radiance_cache_add_sample(int slot, vec3 radiance)
+{
+    // The count keeps going past the cap, the resolve clamps it back
+    if (atomicAdd(radiance_cache_cells.cells[slot].accumulated_count, 1u) >= RADIANCE_CACHE_MAX_FRAME_SAMPLES)
+        return;
+
+    uvec3 v = uvec3(clamp(radiance, vec3(0.0), vec3(RADIANCE_CACHE_MAX_RADIANCE)) * RADIANCE_CACHE_FIXED_POINT_SCALE);
+    atomicAdd(radiance_cache_cells.cells[slot].accumulated_radiance[0], v.x);
+    atomicAdd(radiance_cache_cells.cells[slot].accumulated_radiance[1], v.y);
+    atomicAdd(radiance_cache_cells.cells[slot].accumulated_radiance[2], v.z);
+}
+
+// Resolved radiance of the cell at pos. jitter in [0, 1)^2 moves the lookup by up to half a cell in the tangent
+// plane, which trades the blocky cell borders for noise the denoiser removes
+bool radiance_cache_lookup(vec3 pos, vec3 normal, vec3 camera_pos, float cell_scale, vec2 jitter, out vec3 radiance)
+{
+    radiance = vec3(0.0);
+
+    float cell_size = exp2(float(radiance_cache_level(pos, camera_pos, cell_scale)));
+    pos += create_tangent_space(normal) * vec3(jitter - 0.5, 0.0) * cell_size;
+
+    int slot = radiance_cache_find(radiance_cache_key(pos, normal, camera_pos, cell_scale));
+    if (slot < 0 || radiance_cache_cells.cells[slot].sample_count < RADIANCE_CACHE_MIN_SAMPLES)
+        return false;
+
+    radiance = radiance_cache_cells.cells[slot].radiance;
+    return true;
+}
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef RESTIR_GLSL
+#define RESTIR_GLSL
+
+// Reservoir based spatiotemporal resampling of the indirect diffuse signal, after ReSTIR (Bitterli et al. 2020) for
+// the emitters lighting a pixel directly and ReSTIR GI (Ouyang et al. 2021) for its path sample.
+// indirect_diffuse.comp writes each pixel's initial reservoirs: the emitter one resamples RESTIR_DI_CANDIDATES light
+// table samples down to one and shadow tests it, the path one holds the first hit of the cosine ray and the radiance
+// leaving it. Both count as one sample. restir_temporal.comp merges them with the previous frame's final reservoirs at
+// the reprojected pixel, restir_spatial.comp with a few neighbors' and shades the result for the denoiser.
+// Reuse only happens between pixels whose G-buffer agrees. Merges weigh reservoirs by their sample count rather than
+// with MIS, and reused samples are only shadow tested at the final shading, so this is the biased flavour.
+// Targets are the unshadowed integrands of the demodulated diffuse signal: Le cos cos / (pi d^2) in area measure for
+// emitters and Lo cos / pi in solid angle for path samples.
+// Slice 0 of the buffers holds the current frame's reservoirs, slice 1 the final ones the next frame reuses.
+// The including shader includes shared.h, math.glsl and lights.glsl, enables scalar block layout and defines
+// RESTIR_DI_RESERVOIRS_BINDING and RESTIR_GI_RESERVOIRS_BINDING
+
+layout(binding = RESTIR_DI_RESERVOIRS_BINDING, set = 0, scalar) buffer restir_di_reservoirs_t
+{
+    Packed_DI_Reservoir reservoirs[];
+} restir_di_reservoirs;
+
+layout(binding = RESTIR_GI_RESERVOIRS_BINDING, set = 0, scalar) buffer restir_gi_reservoirs_t
+{
+    Packed_GI_Reservoir reservoirs[];
+} restir_gi_reservoirs;
+
+#define RESTIR_CURRENT_SLICE 0u
+#define RESTIR_FINAL_SLICE 1u
+
+struct DI_Reservoir
+{
+    uint light; // Light table entry
+    vec2 uv; // Point on its triangle
+    float W;
+    float M;
+};
+
+struct GI_Reservoir
+{
+    vec3 position;
+    vec3 normal;
+    vec3 radiance;
+    float W;
+    float M;
+};
+
+DI_Reservoir empty_di_reservoir()
+{
+    return DI_Reservoir(0u, vec2(0.0), 0.0, 0.0);
+}
+
+GI_Reservoir empty_gi_reservoir()
+{
+    return GI_Reservoir(vec3(0.0), vec3(0.0, 0.0, 1.0), vec3(0.0), 0.0, 0.0);
+}
+
+uint restir_index(ivec2 p, ivec2 size, uint slice)
+{
+    return slice * uint(size.x * size.y) + uint(p.y * size.x + p.x);
+}
+
+DI_Reservoir load_di_reservoir(uint i)
+{
+    Packed_DI_Reservoir r = restir_di_reservoirs.reservoirs[i];
+    return DI_Reservoir(r.light, unpackUnorm2x16(r.uv), r.W, r.M);
+}
+
+void store_di_reservoir(uint i, DI_Reservoir r)
+{
+    restir_di_reservoirs.reservoirs[i] = Packed_DI_Reservoir(r.light, packUnorm2x16(r.uv), r.W, r.M);
+}
+
+GI_Reservoir load_gi_reservoir(uint i)
+{
+    Packed_GI_Reservoir r = restir_gi_reservoirs.reservoirs[i];
+    vec2 b_M = unpackHalf2x16(r.radiance_b_M);
+    vec3 radiance = vec3(unpackHalf2x16(r.radiance_rg), b_M.x);
+    return GI_Reservoir(r.position, decode_unit_vector(unpackUnorm2x16(r.normal), false, true), radiance, r.W, b_M.y);
+}
+
+void store_gi_reservoir(uint i, GI_Reservoir r)
+{
+    vec3 radiance = min(r.radiance, vec3(65000.0)); // Half float range
+    restir_gi_reservoirs.reservoirs[i] = Packed_GI_Reservoir(r.position, packUnorm2x16(encode_unit_vector(r.normal, false)),
+        packHalf2x16(radiance.rg), packHalf2x16(vec2(radiance.b, r.M)), r.W);
+}
+
+// Scalar the reservoirs resample by
+float restir_target(vec3 integrand)
+{
+    return dot(integrand, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// Unshadowed emitter integrand at X with normal N, with the direction and distance of the shadow ray
+vec3 di_integrand(vec3 X, vec3 N, Emissive_Sample s, out vec3 dir, out float dist)
+{
+    vec3 to_light = s.pos - X;
+    dist = length(to_light);
+    dir = to_light / dist;
+    float cos_light = dot(s.normal, -dir);
+    float cos_surface = dot(N, dir);
+    if (cos_light <= 0.0 || cos_surface <= 0.0)
+        return vec3(0.0);
+
+    return s.emission * cos_surface * cos_light / (M_PI * dist * dist);
+}
+
+// Unshadowed path sample integrand at X with normal N. Zero when X is behind the sample, it only knows the radiance
+// leaving its front side
+vec3 gi_integrand(vec3 X, vec3 N, GI_Reservoir r)
+{
+    vec3 dir = normalize(r.position - X);
+    if (dot(r.normal, -dir) <= 0.0)
+        return vec3(0.0);
+
+    return r.radiance * max(dot(N, dir), 0.0) / M_PI;
+}
+
+// Change of the solid angle the path sample covers when X_src's sample is reused at X_dst. Zero beyond
+// RESTIR_MAX_JACOBIAN, those would pull a lot of variance in
+float gi_jacobian(vec3 X_dst, vec3 X_src, GI_Reservoir r)
+{
+    vec3 to_dst = X_dst - r.position;
+    vec3 to_src = X_src - r.position;
+    float dist2_dst = dot(to_dst, to_dst);
+    float dist2_src = dot(to_src, to_src);
+    float cos_dst = abs(dot(r.normal, to_dst)) * inversesqrt(dist2_dst);
+    float cos_src = abs(dot(r.normal, to_src)) * inversesqrt(dist2_src);
+
+    float jacobian = cos_dst * dist2_src / max(cos_src * dist2_dst, 1e-8);
+    return jacobian > RESTIR_MAX_JACOBIAN || jacobian < 1.0 / RESTIR_MAX_JACOBIAN ? 0.0 : jacobian;
+}
+
+// Streams a reservoir of resampling weight w into the one being built, true when u picks its sample
+bool restir_merge(inout float weight_sum, float w, float u)
+{
+    weight_sum += w;
+    return w > 0.0 && u * weight_sum < w;
+}
+
+// Contribution weight of the picked sample once everything is merged
+float restir_contribution_weight(float weight_sum, float M, float target)
+{
+    return target > 0.0 && M > 0.0 ? weight_sum / (M * target) : 0.0;
+}
+
+// G-buffer test for reusing the reservoirs of a pixel with normal N_other and view depth z_other
+bool restir_similar(vec3 N, float z, vec3 N_other, float z_other)
+{
+    return dot(N, N_other) > RESTIR_NORMAL_THRESHOLD && abs(z - z_other) < RESTIR_DEPTH_THRESHOLD * z;
+}
+
+#endif
@@ -20,14 +20,15 @@ layout(binding = 3, set = 0) uniform sampler2D environment_map;
 layout(binding = 4, set = 0) uniform samplerCube envmap_cube;
 
 layout (set = 1, binding = 0) uniform sampler2D textures[];
-layout (set = 1, binding = 1, scalar) readonly buffer vertex_buffer_array_t
+// Geometry pool, indices are relative to Primitive_Info::base_vertex
+layout (set = 1, binding = 1, scalar) readonly buffer vertex_buffer_t
 {
-    Vertex_Data verts[];
-} vertex_buffer_array[];
-layout (set = 1, binding = 2, scalar) readonly buffer index_buffer_array_t
+    Packed_Vertex verts[];
+} vertex_buffer;
+layout (set = 1, binding = 2, scalar) readonly buffer index_buffer_t
 {
     Index_Data indices[];
-} index_buffer_array[];
+} index_buffer;
 layout (set = 1, binding = 3, scalar) readonly buffer material_array_t
 {
     Material materials[];
@@ -36,29 +37,39 @@ layout (set = 1, binding = 3, scalar) readonly buffer material_array_t
 layout(set = 1, binding = 4, scalar) readonly buffer primitive_info_t
 {
     Primitive_Info primitives[];
-} primitive_info_array[];
+} primitive_info;
 
-Vertex get_interpolated_vertex(int custom_instance_id, int primitive_id, vec2 barycentrics)
+layout(set = 1, binding = 5, scalar) readonly buffer instance_table_t
+{
+    Instance_Data instances[];
+} instance_table;
+
+// Light table, see lights.glsl
+layout(set = 1, binding = 6, scalar) readonly buffer emissive_triangle_table_t
 {
-    int geom_id = int((custom_instance_id) & 0x3FFF);
-    int prim_id = int((custom_instance_id >> 14) & 0x3FF);
+    Emissive_Triangle triangles[];
+} emissive_triangle_table;
 
-    Primitive_Info prim_info = primitive_info_array[geom_id].primitives[prim_id];
+Vertex get_interpolated_vertex(int custom_instance_id, int primitive_id, vec2 barycentrics)
+{
+    // The custom index is the instance's index in the instance table
+    Instance_Data instance = instance_table.instances[custom_instance_id];
+    Primitive_Info prim_info = primitive_info.primitives[instance.primitive_index];
 
-    uint material_id = prim_info.material_index;
+    uint material_id = instance.material_index;
 
-    uvec3 inds = index_buffer_array[geom_id].indices[primitive_id + prim_info.vertex_offset / 3].index;
-    vec3 v0 = vertex_buffer_array[geom_id].verts[inds.x].pos;
-    vec3 v1 = vertex_buffer_array[geom_id].verts[inds.y].pos;
-    vec3 v2 = vertex_buffer_array[geom_id].verts[inds.z].pos;
+    uvec3 inds = index_buffer.indices[primitive_id + prim_info.vertex_offset / 3].index + prim_info.base_vertex;
+    vec3 v0 = (instance.transform * vec4(vertex_buffer.verts[inds.x].pos, 1.0)).xyz;
+    vec3 v1 = (instance.transform * vec4(vertex_buffer.verts[inds.y].pos, 1.0)).xyz;
+    vec3 v2 = (instance.transform * vec4(vertex_buffer.verts[inds.z].pos, 1.0)).xyz;
 
-    vec3 n0 = vertex_buffer_array[geom_id].verts[inds.x].normal;
-    vec3 n1 = vertex_buffer_array[geom_id].verts[inds.y].normal;
-    vec3 n2 = vertex_buffer_array[geom_id].verts[inds.z].normal;
+    vec3 n0 = transform_normal(instance.transform, unpack_normal(vertex_buffer.verts[inds.x].normal));
+    vec3 n1 = transform_normal(instance.transform, unpack_normal(vertex_buffer.verts[inds.y].normal));
+    vec3 n2 = transform_normal(instance.transform, unpack_normal(vertex_buffer.verts[inds.z].normal));
 
-    vec2 t0 = vertex_buffer_array[geom_id].verts[inds.x].texcoord;
-    vec2 t1 = vertex_buffer_array[geom_id].verts[inds.y].texcoord;
-    vec2 t2 = vertex_buffer_array[geom_id].verts[inds.z].texcoord;
+    vec2 t0 = unpackHalf2x16(vertex_buffer.verts[inds.x].texcoord);
+    vec2 t1 = unpackHalf2x16(vertex_buffer.verts[inds.y].texcoord);
+    vec2 t2 = unpackHalf2x16(vertex_buffer.verts[inds.z].texcoord);
 
     vec3 N = normalize((1.0 - barycentrics.x - barycentrics.y) * n0 + barycentrics.x * n1 + barycentrics.y * n2);
     vec3 P = (1.0 - barycentrics.x - barycentrics.y) * v0 + barycentrics.x * v1 + barycentrics.y * v2;
@@ -81,6 +92,7 @@ Vertex get_interpolated_vertex(int custom_instance_id, int primitive_id, vec2 ba
     v.material.base_color = albedo;
     v.material.metallic = metallic_roughness.x;
     v.material.roughness = metallic_roughness.y;
+    v.material.emissive = mat.emissive_factor;
 
     return v;
 }
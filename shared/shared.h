@@ -11,8 +11,10 @@
 #include "glm/glm/glm.hpp"
 #include "glm/glm/gtc/constants.hpp"
 #include "glm/glm/gtx/compatibility.hpp"
+#include "glm/glm/gtc/packing.hpp"
 
 #define OUT_PARAMETER(X) X&
+#define INLINE inline
 
 using namespace glm;
 
@@ -21,6 +23,7 @@ inline float saturate(float x) { return clamp(x, 0.0f, 1.0f); }
 
 #else
 #define OUT_PARAMETER(X) out X
+#define INLINE
 #define float2 vec2
 #define float3 vec3
 #define float4 vec4
@@ -39,15 +42,105 @@ struct Camera_Data
     uvec4 frame_index;
 };
 
+// Vertex layout of the geometry pool, 24 bytes. Positions stay float so BLAS builds read the pool directly
+struct Packed_Vertex
+{
+    vec3 pos;
+    uint normal; // Octahedral, snorm16x2
+    uint tangent; // Octahedral in snorm8 xy, bitangent sign in z
+    uint texcoord; // half2
+};
+
+// Same mapping as encode_unit_vector / decode_unit_vector in math.glsl, written so it compiles as C++ too
+INLINE vec2 encode_octahedral(vec3 n)
+{
+    float l1 = abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 p = l1 > 0.0f ? vec2(n.x, n.y) / l1 : vec2(0.0f);
+    vec2 wrapped = vec2((1.0f - abs(p.y)) * (p.x >= 0.0f ? 1.0f : -1.0f), (1.0f - abs(p.x)) * (p.y >= 0.0f ? 1.0f : -1.0f));
+    return n.z >= 0.0f ? p : wrapped;
+}
+
+INLINE vec3 decode_octahedral(vec2 p)
+{
+    vec3 n = vec3(p.x, p.y, 1.0f - abs(p.x) - abs(p.y));
+    float t = clamp(-n.z, 0.0f, 1.0f);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
+    return normalize(n);
+}
+
+INLINE uint pack_normal(vec3 n)
+{
+    return packSnorm2x16(encode_octahedral(n));
+}
+
+INLINE vec3 unpack_normal(uint p)
+{
+    return decode_octahedral(unpackSnorm2x16(p));
+}
+
+INLINE uint pack_tangent(vec4 t)
+{
+    vec2 p = encode_octahedral(vec3(t.x, t.y, t.z));
+    return packSnorm4x8(vec4(p.x, p.y, t.w >= 0.0f ? 1.0f : -1.0f, 0.0f));
+}
+
+INLINE vec4 unpack_tangent(uint p)
+{
+    vec4 v = unpackSnorm4x8(p);
+    return vec4(decode_octahedral(vec2(v.x, v.y)), v.z >= 0.0f ? 1.0f : -1.0f);
+}
+
 struct Primitive_Info
 {
     uint material_index;
-    uint vertex_count;
-    uint vertex_offset;
+    uint vertex_count; // Index count
+    uint vertex_offset; // First index in the geometry pool
+    uint base_vertex; // Added to the indices, first vertex of the mesh in the geometry pool
     /*uint pad;
     mat4 model;*/
 };
 
+// Cluster of up to 64 triangles, the unit of GPU culling (cull_meshlets.comp). Built at import by build_mesh_meshlets
+struct Meshlet
+{
+    vec4 bounding_sphere; // xyz center, w radius
+    vec4 cone; // xyz axis, w cutoff. See compute_meshlet_bounds
+    uint first_index; // In Mesh::indices on the CPU, in the geometry pool on the GPU
+    uint index_count;
+    uint primitive_index; // In Mesh::primitives on the CPU, Primitive_Info index on the GPU
+    uint lod; // Drawn only when its primitive has this LOD selected
+};
+
+// One per TLAS instance and instanced draw, the TLAS custom index and the draws' firstInstance index these,
+// so nothing is packed into the 24 bit custom index. Meshes are in their own space, transform is always
+// translation * rotation * scale (see create_instanced_meshes)
+struct Instance_Data
+{
+    mat4 transform;
+    mat4 previous_transform; // Last frame's transform, for motion vectors
+    uint primitive_index; // Primitive_Info
+    uint material_index; // Into the material buffer, the primitive's material unless the instance overrides it
+    uint mesh_index; // Of the instance's mesh in the renderer's scene_meshes
+    uint pad;
+};
+
+// Inverse transpose of an Instance_Data transform without the inverse. Its columns are orthogonal, so dividing
+// by their squared lengths undoes the scale twice and leaves rotation * inverse scale
+INLINE vec3 transform_normal(mat4 transform, vec3 n)
+{
+    mat3 m = mat3(transform);
+    vec3 inv_scale_sq = vec3(1.0f / dot(m[0], m[0]), 1.0f / dot(m[1], m[1]), 1.0f / dot(m[2], m[2]));
+    return normalize(m * (n * inv_scale_sq));
+}
+
+// A meshlet placed by an instance, cull_meshlets.comp runs one thread per these
+struct Meshlet_Instance
+{
+    uint meshlet_index;
+    uint instance_index;
+};
+
 struct Global_Constants_Data
 {
     vec3 sun_direction;
@@ -92,8 +185,60 @@ struct Global_Constants_Data
     float spec_accum_curve;
     uint indirect_diffuse;
     uint indirect_specular;
+    uint radiance_cache;
+    float radiance_cache_cell_scale;
+    uint emissive_sampling; // Next event estimation toward emissive triangles, otherwise they are only hit by chance
+    uint emissive_triangle_count;
+    float emissive_total_power; // Sum of the light table's triangle powers
+    uint restir; // indirect_diffuse.comp writes ReSTIR candidates, see restir.glsl
+};
+
+// Cell of the world space radiance cache, see radiance_cache.glsl
+struct Radiance_Cache_Cell
+{
+    vec3 radiance; // Outgoing indirect diffuse radiance
+    uint sample_count; // Behind radiance, capped at the history length
+    uint accumulated_radiance[3]; // This frame's samples in RADIANCE_CACHE_FIXED_POINT_SCALE fixed point, up to RADIANCE_CACHE_MAX_FRAME_SAMPLES
+    uint accumulated_count;
+    uint last_update_frame;
+};
+
+// Triangle of the emissive light table, built at scene load. Triangles are picked in proportion to their power
+// with the alias table folded into the entries, see lights.glsl
+struct Emissive_Triangle
+{
+    uint instance_index; // Instance_Data, the triangle moves with its instance
+    uint triangle_index; // In the instance's primitive
+    float pdf; // Of picking this triangle
+    float alias_probability; // Of keeping this entry instead of taking alias
+    uint alias;
+};
+
+// Per pixel reservoirs of the ReSTIR passes, see restir.glsl. Emitter light at the pixel (DI) and the indirect
+// diffuse path sample (GI) get one buffer each, with two slices of a reservoir per pixel
+struct Packed_DI_Reservoir
+{
+    uint light; // Light table entry
+    uint uv; // Point on the triangle as the u of emissive_triangle_sample, unorm16x2
+    float W; // Contribution weight
+    float M; // Candidates behind the sample
+};
+
+struct Packed_GI_Reservoir
+{
+    vec3 position; // Path vertex seen from the pixel
+    uint normal; // At position, octahedral unorm16x2
+    uint radiance_rg; // Radiance leaving position toward the pixel, half2x16
+    uint radiance_b_M; // Radiance blue and M, half2x16
+    float W;
 };
 
+// Luminance times area, what the light table weights triangles by
+INLINE float emitted_power(vec3 emission, float area)
+{
+    return dot(emission, vec3(0.2126f, 0.7152f, 0.0722f)) * area;
+}
+
 // Screen output defines
 #define FINAL 0
 #define NOISY_INPUT 1
@@ -108,4 +253,32 @@ struct Global_Constants_Data
 #define POST_BLUR_CONSTANT_ID 2
 
 #define BLUR_CHANNEL_DIFFUSE 0
-#define BLUR_CHANNEL_SPECULAR 1
\ No newline at end of file
+#define BLUR_CHANNEL_SPECULAR 1
+
+// Indirect ray resolution modes, see indirect_resolution.glsl
+#define INDIRECT_RESOLUTION_FULL 0
+#define INDIRECT_RESOLUTION_HALF 1
+#define INDIRECT_RESOLUTION_CHECKERBOARD 2
+
+// History fix mip chain, see history_fix_mip_gen.comp
+#define HISTORY_FIX_MIP_LEVELS 8
+#define HISTORY_FIX_REDUCTION_AVERAGE 0
+#define HISTORY_FIX_REDUCTION_DEPTH_WEIGHTED 1
+
+// World space radiance cache, see radiance_cache.glsl
+#define RADIANCE_CACHE_SIZE (1 << 18) // Cells, a multiple of the bucket size
+#define RADIANCE_CACHE_BUCKET_SIZE 16 // Slots a key can land in
+#define RADIANCE_CACHE_LEVEL_RANGE 16 // Cell sizes go from 2^-16 to 2^15
+#define RADIANCE_CACHE_UPDATE_TILE 4 // One update path per 4x4 pixels and frame
+#define RADIANCE_CACHE_FIXED_POINT_SCALE 1024.0
+#define RADIANCE_CACHE_MAX_RADIANCE 64.0 // Samples are clamped to this
+// Samples a cell takes per frame, the rest are dropped. With the clamp and the fixed point scale a sample adds up to
+// 2^16 to the u32 sums, which would wrap past 2^16 samples per cell and frame
+#define RADIANCE_CACHE_MAX_FRAME_SAMPLES 32768
+#define RADIANCE_CACHE_MIN_SAMPLES 4 // Before lookups use a cell
+
+// ReSTIR, see restir.glsl
+#define RESTIR_DI_CANDIDATES 4 // Light table samples resampled into a pixel's initial emitter reservoir
+#define RESTIR_NORMAL_THRESHOLD 0.9 // Reuse needs normals closer than this cosine
+#define RESTIR_DEPTH_THRESHOLD 0.1 // and view depths closer than this fraction
+#define RESTIR_MAX_JACOBIAN 10.0 // Neighbor path samples whose solid angle changes more than this are skipped
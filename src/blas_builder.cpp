@@ -0,0 +1,216 @@
+#include "blas_builder.h"
+#include "vk_helpers.h"
+#include "logging.h"
+#include <algorithm>
+
+// VkAccelerationStructureCreateInfoKHR::offset has to be a multiple of 256
+constexpr VkDeviceSize ACCELERATION_STRUCTURE_OFFSET_ALIGNMENT = 256;
+
+static VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+// Freed at the end of the build instead of on shutdown like Vk_Context::allocate_buffer
+static Vk_Allocated_Buffer create_temporary_buffer(Vk_Context* ctx, VkDeviceSize size, VkBufferUsageFlags usage, VkDeviceSize alignment)
+{
+	VkBufferCreateInfo buffer_info{ VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+	buffer_info.size = size;
+	buffer_info.usage = usage;
+	ctx->set_concurrent_sharing(&buffer_info);
+
+	VmaAllocationCreateInfo alloc_info = {};
+	alloc_info.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+
+	Vk_Allocated_Buffer buffer;
+	VK_CHECK(vmaCreateBufferWithAlignment(ctx->allocator, &buffer_info, &alloc_info, alignment, &buffer.buffer, &buffer.allocation, nullptr));
+	return buffer;
+}
+
+static void submit_and_wait(Vk_Context* ctx, VkCommandBuffer cmd)
+{
+	vkEndCommandBuffer(cmd);
+	VkSubmitInfo submit_info = vkinit::submit_info(1, &cmd);
+	VK_CHECK(vkQueueSubmit(ctx->graphics_queue, 1, &submit_info, VK_NULL_HANDLE));
+	VK_CHECK(vkQueueWaitIdle(ctx->graphics_queue));
+}
+
+static VkCommandBuffer begin_command_buffer(Vk_Context* ctx)
+{
+	VkCommandBuffer cmd = ctx->allocate_command_buffer();
+	VkCommandBufferBeginInfo begin_info{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+	begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	vkBeginCommandBuffer(cmd, &begin_info);
+	return cmd;
+}
+
+void Blas_Builder::init(Vk_Context* ctx)
+{
+	this->ctx = ctx;
+	inputs.clear();
+	results.clear();
+}
+
+u32 Blas_Builder::add_triangles(const VkAccelerationStructureGeometryTrianglesDataKHR& triangles, u32 primitive_count, u32 primitive_offset,
+	VkGeometryFlagsKHR flags)
+{
+	Input input{};
+	input.geometry = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR };
+	input.geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+	input.geometry.geometry.triangles = triangles;
+	input.geometry.flags = flags;
+	input.range = vkinit::acceleration_structure_build_range_info_khr(primitive_count, primitive_offset);
+	inputs.push_back(input);
+	return (u32)inputs.size() - 1;
+}
+
+void Blas_Builder::build()
+{
+	assert(ctx);
+	u32 count = (u32)inputs.size();
+	results.assign(count, Blas_Build_Result{});
+	uncompacted_size = compacted_size = scratch_size = 0;
+	build_call_count = 0;
+	if (count == 0)
+		return;
+
+	const VkDeviceSize scratch_alignment = ctx->acceleration_structure_properties.minAccelerationStructureScratchOffsetAlignment;
+
+	// Size everything first, each structure gets an aligned range of one storage buffer
+	std::vector<VkAccelerationStructureBuildGeometryInfoKHR> build_infos(count);
+	std::vector<VkAccelerationStructureBuildSizesInfoKHR> sizes(count);
+	std::vector<VkDeviceSize> storage_offsets(count);
+	VkDeviceSize largest_scratch = 0;
+	for (u32 i = 0; i < count; ++i)
+	{
+		build_infos[i] = vkinit::acceleration_structure_build_geometry_info_khr(
+			VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR,
+			1, &inputs[i].geometry,
+			VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR, VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR);
+
+		sizes[i] = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR };
+		vkGetAccelerationStructureBuildSizesKHR(ctx->device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+			&build_infos[i], &inputs[i].range.primitiveCount, &sizes[i]);
+
+		storage_offsets[i] = uncompacted_size;
+		uncompacted_size = align_up(uncompacted_size + sizes[i].accelerationStructureSize, ACCELERATION_STRUCTURE_OFFSET_ALIGNMENT);
+		largest_scratch = std::max(largest_scratch, align_up(sizes[i].buildScratchSize, scratch_alignment));
+	}
+
+	// Builds are split into batches whose scratch fits the arena, batches reuse it one after another
+	VkDeviceSize total_scratch = 0;
+	for (u32 i = 0; i < count; ++i)
+		total_scratch += align_up(sizes[i].buildScratchSize, scratch_alignment);
+	scratch_size = std::min(total_scratch, std::max(scratch_budget, largest_scratch));
+
+	Vk_Allocated_Buffer uncompacted_storage = create_temporary_buffer(ctx, uncompacted_size,
+		VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, ACCELERATION_STRUCTURE_OFFSET_ALIGNMENT);
+	Vk_Allocated_Buffer scratch = create_temporary_buffer(ctx, scratch_size,
+		VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, scratch_alignment);
+	VkDeviceAddress scratch_address = ctx->get_buffer_device_address(scratch);
+
+	std::vector<VkAccelerationStructureKHR> uncompacted(count);
+	for (u32 i = 0; i < count; ++i)
+	{
+		VkAccelerationStructureCreateInfoKHR create_info = vkinit::acceleration_structure_create_info(
+			VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, sizes[i].accelerationStructureSize, uncompacted_storage.buffer, storage_offsets[i]);
+		VK_CHECK(vkCreateAccelerationStructureKHR(ctx->device, &create_info, nullptr, &uncompacted[i]));
+		build_infos[i].dstAccelerationStructure = uncompacted[i];
+	}
+
+	VkQueryPool query_pool;
+	VkQueryPoolCreateInfo query_info{ VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+	query_info.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+	query_info.queryCount = count;
+	VK_CHECK(vkCreateQueryPool(ctx->device, &query_info, nullptr, &query_pool));
+
+	VkCommandBuffer cmd = begin_command_buffer(ctx);
+	vkCmdResetQueryPool(cmd, query_pool, 0, count);
+
+	std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> ranges(count);
+	for (u32 i = 0; i < count; ++i)
+		ranges[i] = &inputs[i].range;
+
+	u32 batch_begin = 0;
+	while (batch_begin < count)
+	{
+		VkDeviceSize scratch_offset = 0;
+		u32 batch_end = batch_begin;
+		while (batch_end < count)
+		{
+			VkDeviceSize size = align_up(sizes[batch_end].buildScratchSize, scratch_alignment);
+			if (batch_end != batch_begin && scratch_offset + size > scratch_size)
+				break;
+			build_infos[batch_end].scratchData.deviceAddress = scratch_address + scratch_offset;
+			scratch_offset += size;
+			batch_end++;
+		}
+
+		if (batch_begin != 0)
+		{
+			// The previous batch has to be done with the scratch arena
+			vkinit::memory_barrier2(cmd,
+				VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+				VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+				VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR);
+		}
+
+		vkCmdBuildAccelerationStructuresKHR(cmd, batch_end - batch_begin, &build_infos[batch_begin], &ranges[batch_begin]);
+		build_call_count++;
+		batch_begin = batch_end;
+	}
+
+	vkinit::memory_barrier2(cmd,
+		VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR,
+		VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR);
+	vkCmdWriteAccelerationStructuresPropertiesKHR(cmd, count, uncompacted.data(),
+		VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, query_pool, 0);
+	submit_and_wait(ctx, cmd);
+	ctx->free_command_buffer(cmd);
+
+	std::vector<VkDeviceSize> compacted_sizes(count);
+	VK_CHECK(vkGetQueryPoolResults(ctx->device, query_pool, 0, count, count * sizeof(VkDeviceSize), compacted_sizes.data(),
+		sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+	vkDestroyQueryPool(ctx->device, query_pool, nullptr);
+
+	for (u32 i = 0; i < count; ++i)
+	{
+		storage_offsets[i] = compacted_size;
+		compacted_size = align_up(compacted_size + compacted_sizes[i], ACCELERATION_STRUCTURE_OFFSET_ALIGNMENT);
+	}
+
+	storage = ctx->allocate_buffer(compacted_size,
+		VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, 0, ACCELERATION_STRUCTURE_OFFSET_ALIGNMENT);
+
+	cmd = begin_command_buffer(ctx);
+	for (u32 i = 0; i < count; ++i)
+	{
+		VkAccelerationStructureCreateInfoKHR create_info = vkinit::acceleration_structure_create_info(
+			VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, compacted_sizes[i], storage.buffer, storage_offsets[i]);
+		VK_CHECK(vkCreateAccelerationStructureKHR(ctx->device, &create_info, nullptr, &results[i].acceleration_structure));
+		results[i].address = ctx->get_acceleration_structure_device_address(results[i].acceleration_structure);
+		results[i].size = compacted_sizes[i];
+
+		VkCopyAccelerationStructureInfoKHR copy_info{ VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR };
+		copy_info.src = uncompacted[i];
+		copy_info.dst = results[i].acceleration_structure;
+		copy_info.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+		vkCmdCopyAccelerationStructureKHR(cmd, &copy_info);
+	}
+	// Later submissions build TLASes on top of these or trace against them
+	vkinit::memory_barrier2(cmd,
+		VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR,
+		VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT);
+	submit_and_wait(ctx, cmd);
+	ctx->free_command_buffer(cmd);
+
+	for (u32 i = 0; i < count; ++i)
+		vkDestroyAccelerationStructureKHR(ctx->device, uncompacted[i], nullptr);
+	vmaDestroyBuffer(ctx->allocator, uncompacted_storage.buffer, uncompacted_storage.allocation);
+	vmaDestroyBuffer(ctx->allocator, scratch.buffer, scratch.allocation);
+
+	LOG_DEBUG("Built %u BLASes in %u build calls with %.2f MB of scratch. Memory: %.2f MB, %.2f MB compacted\n",
+		count, build_call_count, (double)scratch_size / (1024.0 * 1024.0),
+		(double)uncompacted_size / (1024.0 * 1024.0), (double)compacted_size / (1024.0 * 1024.0));
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "defines.h"
+#include "r_vulkan.h"
+#include <vector>
+
+struct Blas_Build_Result
+{
+	VkAccelerationStructureKHR acceleration_structure = VK_NULL_HANDLE;
+	VkDeviceAddress address = 0;
+	VkDeviceSize size = 0; // Compacted
+};
+
+/*
+	Builds bottom level acceleration structures in bulk. Every build is sized up front,
+	the builds share one scratch arena and go out in as few vkCmdBuildAccelerationStructuresKHR
+	calls as the scratch budget allows. The compacted sizes are then read back and the
+	structures are copied into one compacted storage buffer, the uncompacted ones are freed.
+	build submits to the graphics queue and waits, geometry has to be on the GPU by then.
+	The caller owns the results: storage is freed on shutdown, the structures are not.
+*/
+struct Blas_Builder
+{
+	struct Input
+	{
+		VkAccelerationStructureGeometryKHR geometry;
+		VkAccelerationStructureBuildRangeInfoKHR range;
+	};
+
+	Vk_Context* ctx = nullptr;
+	VkDeviceSize scratch_budget = 64 * 1024 * 1024; // Raised to the largest single build if needed
+	std::vector<Input> inputs;
+	std::vector<Blas_Build_Result> results; // Same order as inputs
+	Vk_Allocated_Buffer storage{};
+
+	// Stats of the last build
+	VkDeviceSize uncompacted_size = 0;
+	VkDeviceSize compacted_size = 0;
+	VkDeviceSize scratch_size = 0;
+	u32 build_call_count = 0;
+
+	void init(Vk_Context* ctx);
+	// Returns the index of the result
+	u32 add_triangles(const VkAccelerationStructureGeometryTrianglesDataKHR& triangles, u32 primitive_count, u32 primitive_offset,
+		VkGeometryFlagsKHR flags = VK_GEOMETRY_OPAQUE_BIT_KHR);
+	void build();
+};
@@ -0,0 +1,92 @@
+#include "blue_noise.h"
+#include "file_system.h"
+#include "jobs.h"
+#include "logging.h"
+#include "stb/stb_image.h"
+#include <string.h>
+#include <string>
+
+bool decode_blue_noise_pngs(const char* png_base, u32 layer_count, Blue_Noise_Data* out)
+{
+	std::vector<std::string> paths(layer_count);
+	std::vector<const char*> path_ptrs(layer_count);
+	for (u32 i = 0; i < layer_count; ++i)
+	{
+		paths[i] = std::string(png_base) + std::to_string(i) + ".png";
+		path_ptrs[i] = paths[i].c_str();
+	}
+
+	std::vector<File_View> views(layer_count);
+	map_files(layer_count, path_ptrs.data(), views.data());
+
+	bool success = true;
+	for (u32 i = 0; i < layer_count; ++i)
+		success = success && views[i].is_valid();
+
+	// Get the size from the first slice, all slices must match
+	int x = 0, y = 0, comp = 0;
+	if (success)
+		success = stbi_info_from_memory(views[0].data, (int)views[0].size, &x, &y, &comp) != 0;
+
+	if (success)
+	{
+		out->width = (u32)x;
+		out->height = (u32)y;
+		out->layer_count = layer_count;
+		const size_t layer_size = (size_t)x * y * 4;
+		out->texels.resize(layer_size * layer_count);
+
+		// The flip state is global and other loaders leave it set
+		stbi_set_flip_vertically_on_load(0);
+		std::atomic<u32> counter = 0;
+		std::atomic<bool> failed = false;
+		for (u32 i = 0; i < layer_count; ++i)
+		{
+			g_job_system->push([&, i]()
+				{
+					int w, h, c;
+					u8* data = stbi_load_from_memory(views[i].data, (int)views[i].size, &w, &h, &c, 4);
+					if (!data || w != x || h != y)
+						failed = true;
+					else
+						memcpy(out->texels.data() + layer_size * i, data, layer_size);
+					stbi_image_free(data);
+				}, &counter);
+		}
+		g_job_system->wait(&counter);
+		success = !failed;
+	}
+
+	if (!success)
+		LOG_DEBUG("Failed to decode blue noise %s*.png\n", png_base);
+
+	for (auto& v : views)
+		unmap_file(&v);
+
+	return success;
+}
+
+bool write_blue_noise(const char* filepath, const Blue_Noise_Data* data)
+{
+	FILE* f = fopen(resolve_path(filepath).c_str(), "wb");
+	if (!f)
+		return false;
+
+	Blue_Noise_Header header{ BLUE_NOISE_MAGIC, data->width, data->height, data->layer_count };
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(data->texels.data(), 1, data->texels.size(), f);
+	fclose(f);
+	return true;
+}
+
+const u8* get_blue_noise_texels(const File_View* view, Blue_Noise_Header* header)
+{
+	if (!view->is_valid() || view->size < sizeof(Blue_Noise_Header))
+		return nullptr;
+
+	memcpy(header, view->data, sizeof(Blue_Noise_Header));
+	bool valid = header->magic == BLUE_NOISE_MAGIC
+		&& view->size == sizeof(Blue_Noise_Header) + (size_t)header->width * header->height * 4 * header->layer_count;
+
+	return valid ? view->data + sizeof(Blue_Noise_Header) : nullptr;
+}
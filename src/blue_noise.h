@@ -0,0 +1,36 @@
+#pragma once
+#include "defines.h"
+#include <vector>
+
+/*
+	Spatiotemporal blue noise sets are shipped as one png per slice. They are baked offline 
+	(tools/bake_blue_noise) into a single raw RGBA8 blob with all slices stacked so they can be 
+	uploaded into a 2D array texture with a single copy:
+		Blue_Noise_Header
+		width * height * 4 bytes per layer, layer_count layers
+*/
+
+constexpr u32 BLUE_NOISE_MAGIC = 0x30564E42; // "BNV0"
+
+struct Blue_Noise_Header
+{
+	u32 magic;
+	u32 width;
+	u32 height;
+	u32 layer_count;
+};
+
+struct Blue_Noise_Data
+{
+	u32 width = 0;
+	u32 height = 0;
+	u32 layer_count = 0;
+	std::vector<u8> texels; // RGBA8, layers stacked
+};
+
+// Decodes <png_base><i>.png for i in [0, layer_count), in parallel on the job system
+bool decode_blue_noise_pngs(const char* png_base, u32 layer_count, Blue_Noise_Data* out);
+
+bool write_blue_noise(const char* filepath, const Blue_Noise_Data* data);
+// Validates a mapped baked file and returns a pointer to the texels in it, nullptr if invalid
+const u8* get_blue_noise_texels(const struct File_View* view, Blue_Noise_Header* header);
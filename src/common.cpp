@@ -1,19 +1,24 @@
 #include "common.h"
+#include "file_system.h"
+#include <string.h>
+#include <stdlib.h>
 
 uint32_t read_entire_file(const char* filepath, uint8_t** data)
 {
-	HANDLE h = CreateFileA(filepath, FILE_GENERIC_READ, 0, 0, OPEN_EXISTING, 0, 0);
-	DWORD file_size = GetFileSize(h, 0);
+	File_View view;
+	if (!map_file(filepath, &view))
+	{
+		*data = nullptr;
+		return 0;
+	}
 
-	uint8_t* buffer = (uint8_t*)malloc(file_size);
-	DWORD bytes_read;
-	bool success = ReadFile(h, buffer, file_size, &bytes_read, 0);
-	assert(success);
-	assert(bytes_read == (uint32_t)file_size);
+	uint8_t* buffer = (uint8_t*)malloc(view.size);
+	memcpy(buffer, view.data, view.size);
+	uint32_t size = (uint32_t)view.size;
+	unmap_file(&view);
 
 	*data = buffer;
-	CloseHandle(h);
-	return (uint32_t)bytes_read;
+	return size;
 }
 
 int count_set_bits(int n)
@@ -6,7 +6,8 @@
 
 /*
 	Read the entire file and allocates memory for it. Returns the number
-	of bytes read. 
+	of bytes read, or 0 if the file couldn't be opened. Prefer map_file 
+	(file_system.h) when the data doesn't need to outlive the call.
 */
 uint32_t read_entire_file(const char* filepath, uint8_t** data);
 
@@ -0,0 +1,172 @@
+#include "compression.h"
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+static constexpr size_t MIN_MATCH = 4;
+static constexpr size_t LAST_LITERALS = 5;	// Last 5 bytes are always literals
+static constexpr size_t MF_LIMIT = 12;		// Last match must start at least 12 bytes before the end
+static constexpr size_t MAX_OFFSET = 65535;
+static constexpr u32 HASH_BITS = 16;
+
+static inline u32 read_u32(const u8* p)
+{
+	u32 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline u32 hash_u32(u32 v)
+{
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static u8* write_length(u8* op, size_t length)
+{
+	while (length >= 255)
+	{
+		*op++ = 255;
+		length -= 255;
+	}
+	*op++ = (u8)length;
+	return op;
+}
+
+size_t lz4_compress_bound(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+size_t lz4_compress(const u8* src, size_t src_size, u8* dst, size_t dst_capacity)
+{
+	if (dst_capacity < lz4_compress_bound(src_size))
+		return 0;
+
+	u8* op = dst;
+	size_t anchor = 0;
+
+	if (src_size > MF_LIMIT)
+	{
+		// Positions are stored truncated to 32 bits, the distance wraps correctly as long as it fits MAX_OFFSET.
+		// Stale entries that alias to a nearby position are caught by the sequence check like any hash collision
+		std::vector<u32> table(1 << HASH_BITS, 0);
+		const size_t match_start_limit = src_size - MF_LIMIT;
+		const size_t match_end_limit = src_size - LAST_LITERALS;
+
+		size_t ip = 0;
+		while (ip <= match_start_limit)
+		{
+			u32 seq = read_u32(src + ip);
+			u32 h = hash_u32(seq);
+			size_t distance = (u32)ip - table[h];
+			table[h] = (u32)ip;
+
+			if (distance == 0 || distance > MAX_OFFSET || distance > ip || read_u32(src + ip - distance) != seq)
+			{
+				ip++;
+				continue;
+			}
+
+			size_t ref = ip - distance;
+			size_t match_length = MIN_MATCH;
+			while (ip + match_length < match_end_limit && src[ref + match_length] == src[ip + match_length])
+				match_length++;
+
+			size_t literal_length = ip - anchor;
+			size_t ml = match_length - MIN_MATCH;
+			u8* token = op++;
+			*token = (u8)((std::min<size_t>(literal_length, 15) << 4) | std::min<size_t>(ml, 15));
+			if (literal_length >= 15)
+				op = write_length(op, literal_length - 15);
+			memcpy(op, src + anchor, literal_length);
+			op += literal_length;
+
+			u16 offset = (u16)distance;
+			*op++ = (u8)(offset & 0xFF);
+			*op++ = (u8)(offset >> 8);
+			if (ml >= 15)
+				op = write_length(op, ml - 15);
+
+			ip += match_length;
+			anchor = ip;
+		}
+	}
+
+	// Last literals
+	size_t literal_length = src_size - anchor;
+	*op++ = (u8)(std::min<size_t>(literal_length, 15) << 4);
+	if (literal_length >= 15)
+		op = write_length(op, literal_length - 15);
+	memcpy(op, src + anchor, literal_length);
+	op += literal_length;
+
+	return (size_t)(op - dst);
+}
+
+bool lz4_decompress(const u8* src, size_t src_size, u8* dst, size_t dst_size)
+{
+	const u8* ip = src;
+	const u8* ip_end = src + src_size;
+	u8* op = dst;
+	u8* op_end = dst + dst_size;
+
+	while (ip < ip_end)
+	{
+		u8 token = *ip++;
+
+		size_t literal_length = token >> 4;
+		if (literal_length == 15)
+		{
+			u8 b;
+			do
+			{
+				if (ip >= ip_end) return false;
+				b = *ip++;
+				literal_length += b;
+			} while (b == 255);
+		}
+
+		if ((size_t)(ip_end - ip) < literal_length || (size_t)(op_end - op) < literal_length)
+			return false;
+		memcpy(op, ip, literal_length);
+		ip += literal_length;
+		op += literal_length;
+
+		// The last sequence has no match
+		if (ip == ip_end)
+			break;
+
+		if (ip_end - ip < 2) return false;
+		size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - dst))
+			return false;
+
+		size_t match_length = token & 15;
+		if (match_length == 15)
+		{
+			u8 b;
+			do
+			{
+				if (ip >= ip_end) return false;
+				b = *ip++;
+				match_length += b;
+			} while (b == 255);
+		}
+		match_length += MIN_MATCH;
+
+		if ((size_t)(op_end - op) < match_length)
+			return false;
+
+		// Matches can overlap the output, copy byte by byte in that case
+		const u8* match = op - offset;
+		if (offset >= match_length)
+			memcpy(op, match, match_length);
+		else
+			for (size_t i = 0; i < match_length; ++i)
+				op[i] = match[i];
+		op += match_length;
+	}
+
+	return op == op_end;
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include "defines.h"
+
+// LZ4 block format compression. Output is compatible with LZ4_decompress_safe, the compressor
+// is a simple greedy single hash table one, so ratio is a bit worse than liblz4 but decoding 
+// speed is the same.
+
+size_t lz4_compress_bound(size_t size);
+
+// Returns the compressed size, 0 if dst_capacity is too small
+size_t lz4_compress(const u8* src, size_t src_size, u8* dst, size_t dst_capacity);
+
+// Returns false if the input is malformed or doesn't decode to exactly dst_size bytes
+bool lz4_decompress(const u8* src, size_t src_size, u8* dst, size_t dst_size);
@@ -1,6 +1,34 @@
 #include "ecs.h"
 #include "g_math.h"
 
+glm::mat4 Transform_Component::get_matrix() const
+{
+	glm::mat4 rot = glm::toMat4(rotation);
+	glm::mat4 trans = glm::translate(glm::mat4(1.0), pos);
+	glm::mat4 scale_matrix = glm::scale(glm::mat4(1.0), scale);
+	return trans * rot * scale_matrix;
+}
+
+bool Transform_Component::set_matrix(const glm::mat4& m)
+{
+	glm::vec3 axes[3] = { glm::vec3(m[0]), glm::vec3(m[1]), glm::vec3(m[2]) };
+	glm::vec3 s = glm::vec3(glm::length(axes[0]), glm::length(axes[1]), glm::length(axes[2]));
+	if (s.x == 0.0f || s.y == 0.0f || s.z == 0.0f || m[0][3] != 0.0f || m[1][3] != 0.0f || m[2][3] != 0.0f || m[3][3] != 1.0f)
+		return false;
+
+	glm::mat3 r = glm::mat3(axes[0] / s.x, axes[1] / s.y, axes[2] / s.z);
+	constexpr float epsilon = 1e-4f;
+	if (fabsf(glm::dot(r[0], r[1])) > epsilon || fabsf(glm::dot(r[0], r[2])) > epsilon || fabsf(glm::dot(r[1], r[2])) > epsilon
+		|| glm::determinant(r) < 0.0f)
+		return false;
+
+	rotation = glm::quat_cast(r);
+	pos = glm::vec3(m[3]);
+	scale = s;
+	dirty = true;
+	return true;
+}
+
 void Camera_Component::set_transform(Transform_Component* xform)
 {
 	origin = xform->pos;
@@ -34,7 +34,12 @@ struct Transform_Component
 {
 	glm::quat rotation = glm::quat_identity<float, glm::packed_highp>();
 	glm::vec3 pos = glm::vec3(0.f);
-	float scale = 1.0;
+	glm::vec3 scale = glm::vec3(1.f);
+	bool dirty = true; // Set by whatever moves the entity, cleared once the TLAS has the new transform
+
+	glm::mat4 get_matrix() const;
+	// False and unchanged if the matrix has shear or mirrors, i.e. isn't translation * rotation * scale
+	bool set_matrix(const glm::mat4& m);
 };
 
 struct Camera_Component
@@ -0,0 +1,213 @@
+#include "file_system.h"
+#include "logging.h"
+#include "jobs.h"
+#include "pack_file.h"
+#include <stdlib.h>
+#include <vector>
+
+#if !_WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static std::string data_root = []()
+{
+	const char* env = getenv("GIGARAY_ROOT");
+	return env ? std::string(env) : std::string();
+}();
+
+void set_data_root(const char* root)
+{
+	data_root = root ? root : "";
+}
+
+static bool is_absolute_path(const char* filepath)
+{
+	if (filepath[0] == '/' || filepath[0] == '\\')
+		return true;
+	// Drive letter
+	return filepath[0] != 0 && filepath[1] == ':';
+}
+
+std::string resolve_path(const char* filepath)
+{
+	if (data_root.empty() || is_absolute_path(filepath))
+		return filepath;
+
+	std::string path = data_root;
+	if (path.back() != '/' && path.back() != '\\')
+		path += '/';
+	path += filepath;
+	return path;
+}
+
+static std::vector<Pack_File> mounted_packs;
+
+bool mount_pack(const char* filepath)
+{
+	Pack_File pack;
+	if (!pack.open(filepath))
+		return false;
+
+	LOG_DEBUG("Mounted pack %s (%u entries)\n", filepath, pack.header->entry_count);
+	mounted_packs.push_back(pack);
+	return true;
+}
+
+void unmount_packs()
+{
+	for (auto& pack : mounted_packs)
+		pack.close();
+	mounted_packs.clear();
+}
+
+static bool map_from_packs(const char* filepath, File_View* view)
+{
+	for (const Pack_File& pack : mounted_packs)
+	{
+		const Pack_Entry* entry = pack.find(filepath);
+		if (!entry)
+			continue;
+
+		if (entry->flags & PACK_ENTRY_COMPRESSED)
+		{
+			u8* data = (u8*)malloc(entry->size);
+			if (!pack.read(entry, data))
+			{
+				LOG_DEBUG("Failed to decompress %s from pack\n", filepath);
+				free(data);
+				return false;
+			}
+			view->data = data;
+			view->source = FILE_VIEW_HEAP;
+		}
+		else
+		{
+			view->data = pack.get_stored_data(entry);
+			view->source = FILE_VIEW_PACK;
+		}
+		view->size = entry->size;
+		return true;
+	}
+	return false;
+}
+
+bool map_file(const char* filepath, File_View* view)
+{
+	*view = File_View{};
+	if (!mounted_packs.empty() && map_from_packs(filepath, view))
+		return true;
+
+	std::string path = resolve_path(filepath);
+
+#if _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+	if (!mapping)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!data)
+	{
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	view->data = (const u8*)data;
+	view->size = (size_t)file_size.QuadPart;
+	view->file = file;
+	view->mapping = mapping;
+#else
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // The mapping keeps its own reference to the file
+	if (data == MAP_FAILED)
+		return false;
+
+	view->data = (const u8*)data;
+	view->size = (size_t)st.st_size;
+#endif
+
+	return true;
+}
+
+void unmap_file(File_View* view)
+{
+	if (!view->data)
+		return;
+
+	if (view->source == FILE_VIEW_HEAP)
+		free((void*)view->data);
+	if (view->source != FILE_VIEW_MAPPED)
+	{
+		*view = File_View{};
+		return;
+	}
+
+#if _WIN32
+	UnmapViewOfFile(view->data);
+	CloseHandle(view->mapping);
+	CloseHandle(view->file);
+#else
+	munmap((void*)view->data, view->size);
+#endif
+
+	*view = File_View{};
+}
+
+static void prefetch_view(const File_View* view)
+{
+#if _WIN32
+	WIN32_MEMORY_RANGE_ENTRY range = { (void*)view->data, view->size };
+	PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+	madvise((void*)view->data, view->size, MADV_WILLNEED);
+#endif
+	// Touch every page so the read happens on this thread
+	volatile u8 sink = 0;
+	for (size_t i = 0; i < view->size; i += 4096)
+		sink += view->data[i];
+	(void)sink;
+}
+
+void map_files(u32 count, const char* const* filepaths, File_View* views)
+{
+	std::atomic<u32> counter = 0;
+	for (u32 i = 0; i < count; ++i)
+	{
+		g_job_system->push([=]()
+			{
+				if (map_file(filepaths[i], &views[i]))
+					prefetch_view(&views[i]);
+				else
+					LOG_DEBUG("Failed to map file %s\n", filepaths[i]);
+			}, &counter);
+	}
+	g_job_system->wait(&counter);
+}
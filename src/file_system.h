@@ -0,0 +1,46 @@
+#pragma once
+#include "defines.h"
+#include <string>
+
+/*
+	Read-only memory mapped view of a file. The data stays valid until unmap_file is called,
+	so things like SPIR-V and compressed images can be consumed straight from the mapping 
+	without copying them into a separate buffer first.
+*/
+enum File_View_Source
+{
+	FILE_VIEW_MAPPED = 0,	// Loose file mapped from disk
+	FILE_VIEW_PACK,			// Points into a mounted pack file
+	FILE_VIEW_HEAP,			// Decompressed from a pack file
+};
+
+struct File_View
+{
+	const u8* data = nullptr;
+	size_t size = 0;
+	File_View_Source source = FILE_VIEW_MAPPED;
+#if _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#endif
+
+	bool is_valid() const { return data != nullptr; }
+};
+
+// Relative paths are resolved against the data root. Defaults to the working directory, 
+// can be overridden with the GIGARAY_ROOT environment variable or set_data_root().
+void set_data_root(const char* root);
+std::string resolve_path(const char* filepath);
+
+// Mounted packs are searched before loose files. Not thread safe, mount everything at startup 
+// before loading anything. Views into a pack are invalidated when it's unmounted.
+bool mount_pack(const char* filepath);
+void unmount_packs();
+
+bool map_file(const char* filepath, File_View* view);
+void unmap_file(File_View* view);
+
+// Maps a batch of files in parallel on the job system and touches every page so the reads 
+// are issued concurrently instead of faulting one file at a time later on. Blocks until 
+// all files are mapped, views of missing files are left invalid.
+void map_files(u32 count, const char* const* filepaths, File_View* views);
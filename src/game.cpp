@@ -52,7 +52,21 @@ void Game_State::simulate(float dt)
 
 	auto cam = ecs->get_component<Camera_Component>(player_entity);
 	if (yaw_delta != 0.f || pitch_delta != 0.f || glm::dot(vel->velocity, vel->velocity) != 0.f)
+	{
 		cam->set_transform(xform);
+		xform->dirty = true;
+	}
+}
+
+void Game_State::animate(float dt)
+{
+	animation_time += dt;
+	for (size_t i = 0; i < moving_entities.size(); ++i)
+	{
+		auto xform = ecs->get_component<Transform_Component>(moving_entities[i]);
+		xform->pos.y = 2.0f + 0.25f * sinf(animation_time * 2.0f + (float)i * 0.1f);
+		xform->dirty = true;
+	}
 }
 
 void Game_State::handle_mouse_scroll(int delta)
@@ -13,7 +13,10 @@ struct Game_State
 	u32 player_entity;
 	Player_State player_state;
 	float fly_speed = 1.50f;
+	std::vector<u32> moving_entities; // Bob up and down, see animate
+	float animation_time = 0.f;
 
 	void simulate(float dt);
+	void animate(float dt);
 	void handle_mouse_scroll(int delta);
 };
\ No newline at end of file
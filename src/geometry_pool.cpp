@@ -0,0 +1,201 @@
+#include "geometry_pool.h"
+#include "vk_helpers.h"
+#include "logging.h"
+#include <string.h>
+#include <algorithm>
+
+void Free_List_Allocator::init(u32 capacity)
+{
+	this->capacity = capacity;
+	used = 0;
+	free_blocks.clear();
+	if (capacity)
+		free_blocks.push_back({ 0, capacity });
+}
+
+bool Free_List_Allocator::allocate(u32 size, u32* offset)
+{
+	if (size == 0)
+	{
+		*offset = 0;
+		return true;
+	}
+
+	for (size_t i = 0; i < free_blocks.size(); ++i)
+	{
+		Block& b = free_blocks[i];
+		if (b.size < size) continue;
+
+		*offset = b.offset;
+		b.offset += size;
+		b.size -= size;
+		if (b.size == 0)
+			free_blocks.erase(free_blocks.begin() + i);
+		used += size;
+		return true;
+	}
+	return false;
+}
+
+void Free_List_Allocator::free(u32 offset, u32 size)
+{
+	if (size == 0) return;
+	assert(offset + size <= capacity);
+
+	auto it = std::lower_bound(free_blocks.begin(), free_blocks.end(), offset, [](const Block& b, u32 value) { return b.offset < value; });
+	assert(it == free_blocks.end() || it->offset >= offset + size); // Double free
+	it = free_blocks.insert(it, { offset, size });
+
+	// Merge with the next block, then the previous one
+	auto next = it + 1;
+	if (next != free_blocks.end() && it->offset + it->size == next->offset)
+	{
+		it->size += next->size;
+		it = free_blocks.erase(next) - 1;
+	}
+	if (it != free_blocks.begin())
+	{
+		auto prev = it - 1;
+		if (prev->offset + prev->size == it->offset)
+		{
+			prev->size += it->size;
+			free_blocks.erase(it);
+		}
+	}
+	used -= size;
+}
+
+u32 Free_List_Allocator::get_largest_free_block()
+{
+	u32 largest = 0;
+	for (const Block& b : free_blocks)
+		largest = std::max(largest, b.size);
+	return largest;
+}
+
+void Geometry_Pool::init(Vk_Context* ctx, u32 vertex_stride, u32 vertex_capacity, u32 index_capacity)
+{
+	this->ctx = ctx;
+	this->vertex_stride = vertex_stride;
+
+	// Each buffer is bound as a single storage buffer
+	u64 max_range = std::min((u64)ctx->physical_device_properties.properties.limits.maxStorageBufferRange, (u64)UINT32_MAX);
+	if ((u64)vertex_capacity * vertex_stride > max_range)
+	{
+		LOG_DEBUG("Geometry pool: clamping vertex capacity %u to the storage buffer range\n", vertex_capacity);
+		vertex_capacity = (u32)(max_range / vertex_stride);
+	}
+	if ((u64)index_capacity * sizeof(u32) > max_range)
+	{
+		LOG_DEBUG("Geometry pool: clamping index capacity %u to the storage buffer range\n", index_capacity);
+		index_capacity = (u32)(max_range / sizeof(u32));
+	}
+	index_capacity -= index_capacity % 3;
+
+	VkBufferUsageFlags usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+		| VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR
+		| VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+		| VK_BUFFER_USAGE_TRANSFER_DST_BIT
+		| VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+
+	vertex_buffer = ctx->allocate_buffer(vertex_capacity * vertex_stride, usage | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, 0);
+	index_buffer = ctx->allocate_buffer(index_capacity * (u32)sizeof(u32), usage | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, 0);
+	vertex_buffer_address = ctx->get_buffer_device_address(vertex_buffer);
+	index_buffer_address = ctx->get_buffer_device_address(index_buffer);
+
+	vertex_allocator.init(vertex_capacity);
+	index_allocator.init(index_capacity / 3);
+}
+
+bool Geometry_Pool::allocate(u32 vertex_count, u32 index_count, Geometry_Allocation* out)
+{
+	assert(index_count % 3 == 0);
+
+	u32 vertex_offset, triangle_offset;
+	if (!vertex_allocator.allocate(vertex_count, &vertex_offset))
+		return false;
+	if (!index_allocator.allocate(index_count / 3, &triangle_offset))
+	{
+		vertex_allocator.free(vertex_offset, vertex_count);
+		return false;
+	}
+
+	out->vertex_offset = vertex_offset;
+	out->vertex_count = vertex_count;
+	out->index_offset = triangle_offset * 3;
+	out->index_count = index_count;
+	return true;
+}
+
+void Geometry_Pool::upload(const Geometry_Allocation& allocation, const void* vertices, const u32* indices)
+{
+	pending_uploads.push_back({ allocation, vertices, indices });
+}
+
+void Geometry_Pool::flush(VkCommandBuffer cmd)
+{
+	if (pending_uploads.empty()) return;
+
+	VkDeviceSize total_size = 0;
+	for (const Pending_Upload& p : pending_uploads)
+		total_size += (VkDeviceSize)p.allocation.vertex_count * vertex_stride + (VkDeviceSize)p.allocation.index_count * sizeof(u32);
+
+	VkBufferCreateInfo buffer_info{ VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+	buffer_info.size = total_size;
+	buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	VmaAllocationCreateInfo alloc_info{};
+	alloc_info.usage = VMA_MEMORY_USAGE_AUTO;
+	alloc_info.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+	Vk_Allocated_Buffer staging;
+	VmaAllocationInfo info;
+	VK_CHECK(vmaCreateBuffer(ctx->allocator, &buffer_info, &alloc_info, &staging.buffer, &staging.allocation, &info));
+	VmaAllocator allocator = ctx->allocator;
+	g_garbage_collector->push([=]()
+		{
+			vmaDestroyBuffer(allocator, staging.buffer, staging.allocation);
+		}, Garbage_Collector::FRAMES_IN_FLIGHT);
+
+	u8* mapped = (u8*)info.pMappedData;
+	VkDeviceSize offset = 0;
+	std::vector<VkBufferCopy> vertex_copies;
+	std::vector<VkBufferCopy> index_copies;
+	vertex_copies.reserve(pending_uploads.size());
+	index_copies.reserve(pending_uploads.size());
+	for (const Pending_Upload& p : pending_uploads)
+	{
+		VkDeviceSize vertex_size = (VkDeviceSize)p.allocation.vertex_count * vertex_stride;
+		if (vertex_size)
+		{
+			memcpy(mapped + offset, p.vertices, vertex_size);
+			vertex_copies.push_back({ offset, (VkDeviceSize)p.allocation.vertex_offset * vertex_stride, vertex_size });
+			offset += vertex_size;
+		}
+
+		VkDeviceSize index_size = (VkDeviceSize)p.allocation.index_count * sizeof(u32);
+		if (index_size)
+		{
+			memcpy(mapped + offset, p.indices, index_size);
+			index_copies.push_back({ offset, (VkDeviceSize)p.allocation.index_offset * sizeof(u32), index_size });
+			offset += index_size;
+		}
+	}
+	vmaFlushAllocation(ctx->allocator, staging.allocation, 0, VK_WHOLE_SIZE);
+
+	if (!vertex_copies.empty())
+		vkCmdCopyBuffer(cmd, staging.buffer, vertex_buffer.buffer, (u32)vertex_copies.size(), vertex_copies.data());
+	if (!index_copies.empty())
+		vkCmdCopyBuffer(cmd, staging.buffer, index_buffer.buffer, (u32)index_copies.size(), index_copies.data());
+
+	pending_uploads.clear();
+}
+
+VkDeviceAddress Geometry_Pool::get_vertex_address(const Geometry_Allocation& allocation)
+{
+	return vertex_buffer_address + (VkDeviceAddress)allocation.vertex_offset * vertex_stride;
+}
+
+VkDeviceAddress Geometry_Pool::get_index_address(const Geometry_Allocation& allocation)
+{
+	return index_buffer_address + (VkDeviceAddress)allocation.index_offset * sizeof(u32);
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include "defines.h"
+#include "r_vulkan.h"
+#include <vector>
+
+// First fit allocator over a range of elements, adjacent free blocks are merged when freed
+struct Free_List_Allocator
+{
+	struct Block
+	{
+		u32 offset;
+		u32 size;
+	};
+
+	std::vector<Block> free_blocks; // Sorted by offset
+	u32 capacity = 0;
+	u32 used = 0;
+
+	void init(u32 capacity);
+	bool allocate(u32 size, u32* offset);
+	void free(u32 offset, u32 size);
+	u32 get_largest_free_block();
+};
+
+struct Geometry_Allocation
+{
+	u32 vertex_offset = 0; // In vertices
+	u32 vertex_count = 0;
+	u32 index_offset = 0; // In indices, always a multiple of 3
+	u32 index_count = 0;
+};
+
+/*
+	All scene geometry lives in two large buffers, one for vertices and one for indices,
+	which are bound once in the bindless set instead of a buffer per mesh.
+	Indices stay relative to the allocation's first vertex, so draws pass vertex_offset
+	as the vertex offset and shaders add Primitive_Info::base_vertex.
+	Uploads are queued and written through a single staging buffer in flush.
+	Meshes are never unloaded yet, so allocations are not freed or compacted.
+*/
+struct Geometry_Pool
+{
+	struct Pending_Upload
+	{
+		Geometry_Allocation allocation;
+		const void* vertices;
+		const u32* indices;
+	};
+
+	Vk_Context* ctx = nullptr;
+	u32 vertex_stride = 0;
+	Vk_Allocated_Buffer vertex_buffer;
+	Vk_Allocated_Buffer index_buffer;
+	VkDeviceAddress vertex_buffer_address = 0;
+	VkDeviceAddress index_buffer_address = 0;
+	Free_List_Allocator vertex_allocator; // In vertices
+	Free_List_Allocator index_allocator; // In triangles, so index offsets line up with Index_Data in shaders
+	std::vector<Pending_Upload> pending_uploads;
+
+	void init(Vk_Context* ctx, u32 vertex_stride, u32 vertex_capacity, u32 index_capacity);
+	bool allocate(u32 vertex_count, u32 index_count, Geometry_Allocation* out);
+	// Data is copied in flush and has to stay alive until then
+	void upload(const Geometry_Allocation& allocation, const void* vertices, const u32* indices);
+	void flush(VkCommandBuffer cmd);
+
+	VkDeviceAddress get_vertex_address(const Geometry_Allocation& allocation);
+	VkDeviceAddress get_index_address(const Geometry_Allocation& allocation);
+};
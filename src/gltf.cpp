@@ -7,7 +7,11 @@
 #include "r_mesh.h"
 #include "resource_manager.h"
 #include "texture.h"
+#include "jobs.h"
+#include "ecs.h"
 #include <filesystem>
+#include <unordered_map>
+#include <cstring>
 
 Mesh2 load_gltf_from_file(const char* filepath, Vk_Context* ctx, Resource_Manager<Texture>* texture_manager, Resource_Manager<Material>* material_manager, bool swap_y_and_z)
 {
@@ -79,6 +83,10 @@ Mesh2 load_gltf_from_file(const char* filepath, Vk_Context* ctx, Resource_Manage
             new_mat.metallic_factor = data->materials[i].pbr_metallic_roughness.metallic_factor;
             new_mat.roughness_factor = data->materials[i].pbr_metallic_roughness.roughness_factor;
         }
+        {
+            float strength = data->materials[i].has_emissive_strength ? data->materials[i].emissive_strength.emissive_strength : 1.0f;
+            new_mat.emissive_factor = glm::make_vec3(data->materials[i].emissive_factor) * strength;
+        }
         std::string name = data->materials[i].name != nullptr ? data->materials[i].name : std::to_string(i);
         i32 material_id = material_manager->register_resource(new_mat, name);
         local_material_map[&data->materials[i]] = material_id;
@@ -181,38 +189,201 @@ Mesh2 load_gltf_from_file(const char* filepath, Vk_Context* ctx, Resource_Manage
     return ret;
 }
 
+static void create_mesh_from_vertex_group(const Vertex_Group& vg, i32 material_id, const glm::mat4& model, Mesh* mesh)
+{
+    Mesh_Primitive prim{};
+    prim.material_id = material_id;
+    prim.vertex_count = (u32)vg.indices.size();
+    prim.vertex_offset = 0;
+    mesh->primitives.push_back(prim);
+    mesh->indices = vg.indices;
+    //assert(vg.pos.size() == vg.normal.size()
+    //    && vg.pos.size() == vg.texcoord.size());
+    u32 vertex_count = (u32)vg.pos.size();
+    mesh->vertices.resize(vertex_count);
+    for (u32 j = 0; j < vertex_count; ++j)
+    {
+        Vertex new_vert{};
+        glm::vec4 transformed_pos = model * glm::vec4(vg.pos[j], 1.0f);
+        //new_vert.pos = vg.pos[j];
+        new_vert.pos = glm::vec3(transformed_pos);
+        new_vert.normal = vg.normal[j];
+        if (j < vg.texcoord.size())
+            new_vert.texcoord = vg.texcoord[j];
+        if (!vg.tangent.empty())
+            new_vert.tangent = vg.tangent[j];
+        else
+            new_vert.tangent = glm::vec4(1.f, 0.f, 0.f, 1.f);
+        mesh->vertices[j] = new_vert;
+        mesh->bbmax = glm::max(new_vert.pos, mesh->bbmax);
+        mesh->bbmin = glm::min(new_vert.pos, mesh->bbmin);
+    }
+}
+
+static void optimize_meshes(u32 mesh_count, Mesh* meshes)
+{
+    // glTF primitives come in whatever order the exporter wrote them
+    std::vector<Mesh_Optimization_Stats> stats(mesh_count);
+    std::atomic<u32> counter = 0;
+    for (u32 i = 0; i < mesh_count; ++i)
+        g_job_system->push([=, &stats]() { stats[i] = optimize_mesh(&meshes[i]); }, &counter);
+    g_job_system->wait(&counter);
+
+    Mesh_Optimization_Stats total{};
+    double misses_before = 0.0, misses_after = 0.0;
+    for (const Mesh_Optimization_Stats& s : stats)
+    {
+        total.vertex_count_before += s.vertex_count_before;
+        total.vertex_count_after += s.vertex_count_after;
+        total.index_count += s.index_count;
+        total.range_count += s.range_count;
+        total.ranges_fitting_16bit += s.ranges_fitting_16bit;
+        misses_before += s.acmr_before * (s.index_count / 3);
+        misses_after += s.acmr_after * (s.index_count / 3);
+    }
+    u32 triangle_count = std::max(total.index_count / 3, 1u);
+    LOG_DEBUG("Mesh optimization: %u -> %u vertices, ACMR %.3f -> %.3f, %u / %u index ranges fit 16-bit indices\n",
+        total.vertex_count_before, total.vertex_count_after, misses_before / triangle_count, misses_after / triangle_count,
+        total.ranges_fitting_16bit, total.range_count);
+}
+
 void create_from_mesh2(Mesh2* m, u32 mesh_count, Mesh* out_meshes)
 {
     assert(mesh_count == m->meshes.size());
     for (u32 i = 0; i < mesh_count; ++i)
+        create_mesh_from_vertex_group(m->meshes[i], m->materials[i], m->meshes[i].model, &out_meshes[i]);
+    optimize_meshes(mesh_count, out_meshes);
+}
+
+template<typename T>
+static u64 hash_bytes(u64 hash, const std::vector<T>& v)
+{
+    // FNV-1a, the size goes in too so the concatenation of the arrays is unambiguous
+    u64 size = v.size();
+    const u8* sizes = (const u8*)&size;
+    for (size_t i = 0; i < sizeof(size); ++i)
+    {
+        hash ^= sizes[i];
+        hash *= 1099511628211ull;
+    }
+    const u8* bytes = (const u8*)v.data();
+    for (size_t i = 0; i < v.size() * sizeof(T); ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static bool same_geometry(const Vertex_Group& a, const Vertex_Group& b)
+{
+    // Bytewise like the hash, -0.0 and 0.0 are different vertices to both
+    auto same = [](const auto& x, const auto& y)
+    {
+        return x.size() == y.size() && memcmp(x.data(), y.data(), x.size() * sizeof(x[0])) == 0;
+    };
+    return same(a.pos, b.pos) && same(a.normal, b.normal) && same(a.texcoord, b.texcoord)
+        && same(a.tangent, b.tangent) && same(a.indices, b.indices);
+}
+
+void create_instanced_meshes(Mesh2* m, std::vector<Mesh>* out_meshes, std::vector<Mesh_Instance>* out_instances)
+{
+    u32 group_count = (u32)m->meshes.size();
+    std::vector<u32> group_mesh(group_count); // Mesh index per vertex group
+    std::vector<glm::mat4> group_transform(group_count);
+    std::vector<u32> mesh_group; // First vertex group per mesh, the one it's created from
+    std::vector<glm::mat4> mesh_bake; // Transform baked into the mesh's vertices, identity unless it can't be an instance transform
+    std::unordered_multimap<u64, u32> meshes_by_hash;
+    u32 baked_count = 0;
+
     {
-        Mesh* mesh = &out_meshes[i];
-        Mesh_Primitive prim{};
-        prim.material_id = m->materials[i];
-        prim.vertex_count = (u32)m->meshes[i].indices.size();
-        prim.vertex_offset = 0;
-        mesh->primitives.push_back(prim);
-        mesh->indices = m->meshes[i].indices;
-        //assert(m->meshes[i].pos.size() == m->meshes[i].normal.size()
-        //    && m->meshes[i].pos.size() == m->meshes[i].texcoord.size());
-        u32 vertex_count = (u32)m->meshes[i].pos.size();
-        out_meshes[i].vertices.resize(vertex_count);
-        for (u32 j = 0; j < vertex_count; ++j)
+        // Hashing is the bulk of the work on big scenes, so it goes wide
+        std::vector<u64> hashes(group_count);
+        std::atomic<u32> counter = 0;
+        for (u32 i = 0; i < group_count; ++i)
         {
-            Vertex new_vert{};
-            glm::vec4 transformed_pos = m->meshes[i].model * glm::vec4(m->meshes[i].pos[j], 1.0f);
-            //new_vert.pos = m->meshes[i].pos[j];
-            new_vert.pos = glm::vec3(transformed_pos);
-            new_vert.normal = m->meshes[i].normal[j];
-            if (j < m->meshes[i].texcoord.size())
-                new_vert.texcoord = m->meshes[i].texcoord[j];
-            if (!m->meshes[i].tangent.empty())
-                new_vert.tangent = m->meshes[i].tangent[j];
-            else
-                new_vert.tangent = glm::vec4(1.f, 0.f, 0.f, 1.f);
-            out_meshes[i].vertices[j] = new_vert;
-            out_meshes[i].bbmax = glm::max(new_vert.pos, mesh->bbmax);
-            out_meshes[i].bbmin = glm::min(new_vert.pos, mesh->bbmin);
+            g_job_system->push([=, &hashes]()
+                {
+                    const Vertex_Group& vg = m->meshes[i];
+                    u64 hash = 14695981039346656037ull;
+                    hash = hash_bytes(hash, vg.pos);
+                    hash = hash_bytes(hash, vg.normal);
+                    hash = hash_bytes(hash, vg.texcoord);
+                    hash = hash_bytes(hash, vg.tangent);
+                    hash = hash_bytes(hash, vg.indices);
+                    hashes[i] = hash ^ (u64)(u32)m->materials[i];
+                }, &counter);
+        }
+        g_job_system->wait(&counter);
+
+        for (u32 i = 0; i < group_count; ++i)
+        {
+            const Vertex_Group& vg = m->meshes[i];
+            Transform_Component xform{};
+            if (!xform.set_matrix(vg.model))
+            {
+                // Shear or mirroring, instance transforms can't express it. The group gets a mesh of its own
+                group_mesh[i] = (u32)mesh_group.size();
+                group_transform[i] = glm::mat4(1.0f);
+                mesh_group.push_back(i);
+                mesh_bake.push_back(vg.model);
+                baked_count++;
+                continue;
+            }
+            group_transform[i] = vg.model;
+
+            u32 mesh_index = UINT32_MAX;
+            auto range = meshes_by_hash.equal_range(hashes[i]);
+            for (auto it = range.first; it != range.second; ++it)
+            {
+                u32 other = mesh_group[it->second];
+                if (m->materials[other] == m->materials[i] && same_geometry(m->meshes[other], vg))
+                {
+                    mesh_index = it->second;
+                    break;
+                }
+            }
+            if (mesh_index == UINT32_MAX)
+            {
+                mesh_index = (u32)mesh_group.size();
+                mesh_group.push_back(i);
+                mesh_bake.push_back(glm::mat4(1.0f));
+                meshes_by_hash.emplace(hashes[i], mesh_index);
+            }
+            group_mesh[i] = mesh_index;
         }
     }
+
+    u32 mesh_count = (u32)mesh_group.size();
+    out_meshes->clear();
+    out_meshes->resize(mesh_count);
+    for (u32 i = 0; i < mesh_count; ++i)
+    {
+        u32 group = mesh_group[i];
+        create_mesh_from_vertex_group(m->meshes[group], m->materials[group], mesh_bake[i], &(*out_meshes)[i]);
+    }
+
+    out_instances->clear();
+    out_instances->reserve(group_count);
+    u64 placed_vertex_count = 0, placed_index_count = 0;
+    for (u32 i = 0; i < group_count; ++i)
+    {
+        out_instances->push_back({ group_mesh[i], group_transform[i] });
+        placed_vertex_count += m->meshes[i].pos.size();
+        placed_index_count += m->meshes[i].indices.size();
+    }
+
+    u64 unique_vertex_count = 0, unique_index_count = 0;
+    for (u32 group : mesh_group)
+    {
+        unique_vertex_count += m->meshes[group].pos.size();
+        unique_index_count += m->meshes[group].indices.size();
+    }
+    // In the layouts the renderer keeps them in, before welding and LODs
+    auto to_mb = [](u64 vertices, u64 indices) { return (double)(vertices * sizeof(Packed_Vertex) + indices * sizeof(u32)) / (1024.0 * 1024.0); };
+    LOG_DEBUG("Instancing: %u primitives placed, %u unique meshes (%u with baked transforms). Geometry %.2f MB -> %.2f MB, %llu -> %llu triangles\n",
+        group_count, mesh_count, baked_count, to_mb(placed_vertex_count, placed_index_count), to_mb(unique_vertex_count, unique_index_count),
+        placed_index_count / 3, unique_index_count / 3);
+
+    optimize_meshes(mesh_count, out_meshes->data());
 }
@@ -29,4 +29,14 @@ struct Mesh2
 
 Mesh2 load_gltf_from_file(const char* filepath, Vk_Context* ctx, Resource_Manager<Texture>* texture_manager, Resource_Manager<Material>* material_manager, bool swap_y_and_z = false);
 
-void create_from_mesh2(Mesh2* m, u32 mesh_count, Mesh* out_meshes);
\ No newline at end of file
+void create_from_mesh2(Mesh2* m, u32 mesh_count, Mesh* out_meshes);
+
+struct Mesh_Instance
+{
+	u32 mesh_index;
+	glm::mat4 transform; // Always fits a Transform_Component
+};
+
+// Keeps one mesh per unique primitive geometry and material, in its own space, and places it with an instance per
+// glTF primitive. Primitives whose node transform has shear or mirroring get it baked into a mesh of their own
+void create_instanced_meshes(Mesh2* m, std::vector<Mesh>* out_meshes, std::vector<Mesh_Instance>* out_instances);
@@ -0,0 +1,86 @@
+#include "jobs.h"
+
+void Job_System::init(u32 thread_count)
+{
+	if (thread_count == 0)
+		thread_count = std::max(1u, std::thread::hardware_concurrency() - 1);
+
+	workers.reserve(thread_count);
+	for (u32 i = 0; i < thread_count; ++i)
+	{
+		workers.emplace_back([this]()
+			{
+				for (;;)
+				{
+					std::function<void()> job;
+					std::atomic<u32>* counter = nullptr;
+					{
+						std::unique_lock<std::mutex> lock(mutex);
+						job_available.wait(lock, [this]() { return quit || !queue.empty(); });
+						if (quit && queue.empty())
+							return;
+						job = std::move(queue.front().job);
+						counter = queue.front().counter;
+						queue.pop_front();
+					}
+
+					job();
+
+					{
+						std::lock_guard<std::mutex> lock(mutex);
+						--jobs_in_flight;
+						if (counter)
+							--(*counter);
+						if (jobs_in_flight == 0 || counter)
+							all_done.notify_all();
+					}
+				}
+			});
+	}
+}
+
+void Job_System::push(std::function<void()> job, std::atomic<u32>* counter)
+{
+	// No workers, just run it here
+	if (workers.empty())
+	{
+		job();
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (counter)
+			++(*counter);
+		queue.push_back({ std::move(job), counter });
+		jobs_in_flight++;
+	}
+	job_available.notify_one();
+}
+
+void Job_System::wait()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	all_done.wait(lock, [this]() { return jobs_in_flight == 0; });
+}
+
+void Job_System::wait(std::atomic<u32>* counter)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	all_done.wait(lock, [counter]() { return counter->load() == 0; });
+}
+
+void Job_System::shutdown()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	job_available.notify_all();
+	for (auto& w : workers)
+		w.join();
+	workers.clear();
+}
+
+static Job_System job_system;
+Job_System* g_job_system = &job_system;
@@ -0,0 +1,38 @@
+#pragma once
+#include "defines.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+// Simple fixed size thread pool. Jobs are executed in FIFO order, wait() blocks until every 
+// job pushed so far has finished. Jobs pushed with a counter can be waited on as a group.
+struct Job_System
+{
+	struct Job
+	{
+		std::function<void()> job;
+		std::atomic<u32>* counter;
+	};
+
+	std::vector<std::thread> workers;
+	std::deque<Job> queue;
+	std::mutex mutex;
+	std::condition_variable job_available;
+	std::condition_variable all_done;
+	u32 jobs_in_flight = 0;
+	bool quit = false;
+
+	void init(u32 thread_count = 0); // 0 = hardware concurrency - 1
+	void push(std::function<void()> job, std::atomic<u32>* counter = nullptr);
+	void wait();
+	void wait(std::atomic<u32>* counter);
+	void shutdown();
+
+	u32 get_thread_count() const { return (u32)workers.size(); }
+};
+
+extern Job_System* g_job_system;
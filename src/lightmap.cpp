@@ -1,5 +1,6 @@
 #include "lightmap.h"
 #include "common.h"
+#include "file_system.h"
 #include "cgltf/cgltf.h"
 #include "stb/stb_image.h"
 #include "vk_helpers.h"
@@ -9,6 +10,7 @@
 #include "logging.h"
 #include "shaders.h"
 #include "sampling.h"
+#include "blas_builder.h"
 
 constexpr u32 MAX_BINDLESS_RESOURCES = 16384;
 
@@ -439,7 +441,14 @@ void Lightmap_Renderer::init_scene(const char* gltf_path)
             VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
             VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR);
 
-        // Create ray tracing acceleration structures
+        // Create ray tracing acceleration structures. The builder submits on its own, so upload the geometry first
+        vkEndCommandBuffer(cmd);
+        VkSubmitInfo upload_submit_info = vkinit::submit_info(1, &cmd);
+        vkQueueSubmit(ctx->graphics_queue, 1, &upload_submit_info, 0);
+        vkQueueWaitIdle(ctx->graphics_queue);
+
+        Blas_Builder blas_builder;
+        blas_builder.init(ctx);
         for (auto& m : meshes)
         {
             for (auto& p : m.primitives)
@@ -452,51 +461,17 @@ void Lightmap_Renderer::init_scene(const char* gltf_path)
                     ctx->get_buffer_device_address(p.index_buffer),
                     p.vertex_count - 1
                 );
-
-                VkAccelerationStructureGeometryKHR geometry = vkinit::acceleration_structure_geometry_khr(triangles, VK_GEOMETRY_OPAQUE_BIT_KHR);
-                VkAccelerationStructureBuildRangeInfoKHR range_info = vkinit::acceleration_structure_build_range_info_khr(p.index_count / 3, 0);
-                VkAccelerationStructureBuildGeometryInfoKHR build_info = vkinit::acceleration_structure_build_geometry_info_khr(
-                    VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR,
-                    1, &geometry,
-                    VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR, VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR
-                );
-
-                VkAccelerationStructureBuildSizesInfoKHR size_info{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR };
-                vkGetAccelerationStructureBuildSizesKHR(ctx->device,
-                    VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &build_info, &range_info.primitiveCount, &size_info);
-
-                Vk_Allocated_Buffer buffer_blas = ctx->allocate_buffer((uint32_t)size_info.accelerationStructureSize,
-                    VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-                    VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, 0);
-
-                Vk_Allocated_Buffer scratch = ctx->allocate_buffer((uint32_t)size_info.buildScratchSize,
-                    VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-                    VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, 0,
-                    ctx->acceleration_structure_properties.minAccelerationStructureScratchOffsetAlignment);
-
-                VkAccelerationStructureCreateInfoKHR create_info = vkinit::acceleration_structure_create_info(
-                    build_info.type, size_info.accelerationStructureSize, buffer_blas.buffer, 0);
-                VK_CHECK(vkCreateAccelerationStructureKHR(ctx->device, &create_info, nullptr, &p.blas));
-
-                build_info.dstAccelerationStructure = p.blas;
-                build_info.scratchData.deviceAddress = ctx->get_buffer_device_address(scratch);
-
-                VkAccelerationStructureBuildRangeInfoKHR* p_range_info = &range_info;
-                vkCmdBuildAccelerationStructuresKHR(
-                    cmd,
-                    1,
-                    &build_info,
-                    &p_range_info
-                );
+                blas_builder.add_triangles(triangles, p.index_count / 3, 0);
             }
         }
+        blas_builder.build();
 
-        vkinit::memory_barrier2(cmd,
-            VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR, 
-            VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
-            VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 
-            VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR
-        );
+        u32 blas_index = 0;
+        for (auto& m : meshes)
+            for (auto& p : m.primitives)
+                p.blas = blas_builder.results[blas_index++].acceleration_structure;
+
+        vkBeginCommandBuffer(cmd, &cmd_info);
 
         {
             // Create top level acceleration structure 
@@ -532,8 +507,8 @@ void Lightmap_Renderer::init_scene(const char* gltf_path)
                 16
             );
 
-            instance_buf.update_staging_buffer(ctx->allocator, 0, instances.data(), required_size);
-            instance_buf.upload(cmd, 0);
+            ctx->upload_ring.upload(&instance_buf, instances.data(), required_size);
+            ctx->upload_ring.flush(cmd);
 
             vkinit::memory_barrier(cmd,
                 VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
@@ -806,8 +781,9 @@ void Lightmap_Renderer::render()
     cam_data.inverse_view = glm::inverse(cam_data.view);
     cam_data.viewproj = cam_data.proj * cam_data.view;
 
-    camera_data.update_staging_buffer(ctx->allocator, current_frame_index, &cam_data, sizeof(cam_data));
-    camera_data.upload(cmd, current_frame_index);
+    ctx->upload_ring.begin_frame(current_frame_index);
+    ctx->upload_ring.upload(&camera_data, &cam_data, sizeof(cam_data));
+    ctx->upload_ring.flush(cmd);
 
     vkinit::memory_barrier2(cmd, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_ACCESS_2_SHADER_READ_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT);
     
@@ -1137,8 +1113,15 @@ static void load_textures(Vk_Context* ctx, const char* basepath, cgltf_image* im
         stbi_set_flip_vertically_on_load(0);
         int x, y, comp;
         std::string path = std::string(basepath) + std::string(fp);
-        stbi_uc* data = stbi_load(path.c_str(), &x, &y, &comp, required_n_comps);
+        File_View view;
+        if (!map_file(path.c_str(), &view))
+        {
+            LOG_DEBUG("Failed to open texture %s\n", path.c_str());
+            abort();
+        }
+        stbi_uc* data = stbi_load_from_memory(view.data, (int)view.size, &x, &y, &comp, required_n_comps);
         assert(data);
+        unmap_file(&view);
 
         u32 required_size = (x * y * required_n_comps) * sizeof(u8);
         Vk_Allocated_Image img = ctx->allocate_image(
@@ -27,21 +27,33 @@
 #include "imgui/imgui_impl_sdl2.h"
 #include "imgui/imgui_impl_vulkan.h"
 #include "settings.h"
+#include "jobs.h"
+#include "file_system.h"
+#include "logging.h"
 
 constexpr int WINDOW_WIDTH = 1280;
 constexpr int WINDOW_HEIGHT = 720;
 
 int main(int argc, char** argv)
 {
-	if (argc != 2)
+	if (argc != 2 && argc != 3)
 	{
-		printf("Usage: %s <scene.glb>\n", argv[0]);
+		printf("Usage: %s <scene.glb> [moving instance count]\n", argv[0]);
 		return EXIT_FAILURE;
 	}
 
 	std::string scene_file = argv[1];
+	// Stress test for the per frame TLAS and instance table updates
+	u32 moving_instance_count = argc == 3 ? (u32)atoi(argv[2]) : 0;
 
 	Timer timer;
+	g_job_system->init();
+	{
+		// Optional, built with tools/packer. Anything not in the pack is loaded from loose files
+		double start = timer.get_current_time();
+		if (mount_pack("assets.pak"))
+			LOG_DEBUG("Opened assets.pak in %.3f ms\n", (timer.get_current_time() - start) * 1000.0);
+	}
 	Platform platform;
 	platform.init_window(WINDOW_WIDTH, WINDOW_HEIGHT, "GigaRay");
 	Vk_Context ctx(&platform);
@@ -53,12 +65,25 @@ int main(int argc, char** argv)
 	//Mesh2 gltf = load_gltf_from_file("data/cube/Cube.gltf", &ctx, &texture_manager, &material_manager);
 	Mesh2 gltf = load_gltf_from_file(scene_file.c_str(), &ctx, &texture_manager, &material_manager);
 	//Mesh2 gltf = load_gltf_from_file("data/cornellbox/scene.gltf", &ctx, &texture_manager, &material_manager, true);
-	std::vector<Mesh> meshes(gltf.meshes.size());
-	create_from_mesh2(&gltf, (u32)gltf.meshes.size(), meshes.data());
-	Mesh combined_mesh{};
+	std::vector<Mesh> meshes;
+	std::vector<Mesh_Instance> instances;
+	if (g_settings.instanced_import)
+	{
+		create_instanced_meshes(&gltf, &meshes, &instances);
+	}
+	else
+	{
+		// Every primitive baked into one mesh in world space
+		std::vector<Mesh> parts(gltf.meshes.size());
+		create_from_mesh2(&gltf, (u32)gltf.meshes.size(), parts.data());
+		meshes.resize(1);
+		merge_meshes((u32)parts.size(), parts.data(), &meshes[0]);
+		instances.push_back({ 0, glm::mat4(1.0f) });
+	}
+	generate_mesh_lods((u32)meshes.size(), meshes.data());
+	build_mesh_meshlets((u32)meshes.size(), meshes.data());
 	//Mesh test_mesh = create_box();
 	Mesh test_mesh = create_sphere(16);
-	merge_meshes((u32)meshes.size(), meshes.data(), &combined_mesh);
 	//std::vector<Mesh> meshes;
 	Material test_mat;
 	//test_mat.base_color_factor = glm::vec4(0.95, 0.93, 0.88, 1.0);
@@ -83,21 +108,34 @@ int main(int argc, char** argv)
 	Game_State game_state;
 	game_state.ecs = &ecs;
 
-#if 0
-	for (size_t i = 0; i < meshes.size(); ++i)
 	{
-		i32 mesh_id = mesh_manager.register_resource(meshes[i], std::to_string(i));
-		Static_Mesh_Component meshcomp = { &mesh_manager, mesh_id };
-		ecs.add_entity(Transform_Component(), meshcomp);
+		std::vector<i32> mesh_ids(meshes.size());
+		for (size_t i = 0; i < meshes.size(); ++i)
+			mesh_ids[i] = mesh_manager.register_resource(meshes[i], "scene_mesh_" + std::to_string(i));
+		for (const Mesh_Instance& instance : instances)
+		{
+			Transform_Component xform{};
+			[[maybe_unused]] bool decomposed = xform.set_matrix(instance.transform);
+			assert(decomposed);
+			Static_Mesh_Component meshcomp = { &mesh_manager, mesh_ids[instance.mesh_index] };
+			ecs.add_entity(xform, meshcomp);
+		}
 	}
-#else
+	if (moving_instance_count != 0)
 	{
-		i32 mesh_id = mesh_manager.register_resource(combined_mesh, "combined");
-		//i32 mesh_id = mesh_manager.register_resource(test_mesh, "combined");
+		// A grid of small spheres above the scene, Game_State::animate moves all of them every frame
+		i32 mesh_id = mesh_manager.register_resource(test_mesh, "moving_instance");
 		Static_Mesh_Component meshcomp = { &mesh_manager, mesh_id };
-		ecs.add_entity(Transform_Component(), meshcomp);
+		u32 grid_size = (u32)ceilf(sqrtf((float)moving_instance_count));
+		for (u32 i = 0; i < moving_instance_count; ++i)
+		{
+			Transform_Component xform{};
+			xform.pos = glm::vec3(((float)(i % grid_size) - 0.5f * grid_size) * 0.5f, 2.0f, ((float)(i / grid_size) - 0.5f * grid_size) * 0.5f);
+			xform.scale = glm::vec3(0.01f);
+			game_state.moving_entities.push_back(ecs.add_entity(xform, meshcomp));
+		}
+		LOG_DEBUG("Spawned %u moving instances\n", moving_instance_count);
 	}
-#endif
 	//ecs.add_entity(Transform_Component(), m, r);
 	//ecs.add_entity(c, m, r);
 	{
@@ -180,6 +218,7 @@ int main(int argc, char** argv)
 		
 		if (!camera_locked)
 			game_state.simulate(dt);
+		game_state.animate(dt);
 
 		renderer.do_frame(&ecs, dt);
 
@@ -189,6 +228,8 @@ here:
 	vkDeviceWaitIdle(ctx.device);
 	renderer.cleanup();
 	g_garbage_collector->shutdown();
+	g_job_system->shutdown();
+	unmount_packs();
 
 	return 0;
 }
\ No newline at end of file
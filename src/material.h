@@ -10,4 +10,5 @@ struct Material
 	glm::vec4 base_color_factor = glm::vec4(1.0f);
 	float metallic_factor = 0.0f;
 	float roughness_factor = 0.5f;
+	glm::vec3 emissive_factor = glm::vec3(0.0f); // Emitted radiance, the light table is built from these
 };
\ No newline at end of file
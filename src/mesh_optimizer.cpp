@@ -0,0 +1,695 @@
+#include "mesh_optimizer.h"
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+static u32 hash_bytes(const u8* data, u32 size)
+{
+	// FNV-1a
+	u32 hash = 2166136261u;
+	for (u32 i = 0; i < size; ++i)
+	{
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+u32 generate_vertex_remap(u32* remap, const u32* indices, u32 index_count, const void* vertices, u32 vertex_count, u32 vertex_stride)
+{
+	const u8* vertex_data = (const u8*)vertices;
+	for (u32 i = 0; i < vertex_count; ++i)
+		remap[i] = REMAP_UNUSED;
+
+	// Open addressing, the table stores the first vertex seen with each value
+	u32 table_size = 1;
+	while (table_size < vertex_count + vertex_count / 4)
+		table_size *= 2;
+	std::vector<u32> table(table_size, REMAP_UNUSED);
+	u32 mask = table_size - 1;
+
+	u32 unique_count = 0;
+	u32 count = indices ? index_count : vertex_count;
+	for (u32 i = 0; i < count; ++i)
+	{
+		u32 v = indices ? indices[i] : i;
+		assert(v < vertex_count);
+		if (remap[v] != REMAP_UNUSED)
+			continue;
+
+		const u8* data = vertex_data + (size_t)v * vertex_stride;
+		u32 slot = hash_bytes(data, vertex_stride) & mask;
+		for (u32 probe = 1;; ++probe)
+		{
+			u32 existing = table[slot];
+			if (existing == REMAP_UNUSED)
+			{
+				table[slot] = v;
+				remap[v] = unique_count++;
+				break;
+			}
+			if (memcmp(vertex_data + (size_t)existing * vertex_stride, data, vertex_stride) == 0)
+			{
+				remap[v] = remap[existing];
+				break;
+			}
+			slot = (slot + probe) & mask;
+		}
+	}
+	return unique_count;
+}
+
+void remap_vertex_buffer(void* dst, const void* vertices, u32 vertex_count, u32 vertex_stride, const u32* remap)
+{
+	assert(dst != vertices);
+	for (u32 i = 0; i < vertex_count; ++i)
+	{
+		if (remap[i] != REMAP_UNUSED)
+			memcpy((u8*)dst + (size_t)remap[i] * vertex_stride, (const u8*)vertices + (size_t)i * vertex_stride, vertex_stride);
+	}
+}
+
+void remap_index_buffer(u32* dst, const u32* indices, u32 index_count, const u32* remap)
+{
+	for (u32 i = 0; i < index_count; ++i)
+	{
+		assert(remap[indices[i]] != REMAP_UNUSED);
+		dst[i] = remap[indices[i]];
+	}
+}
+
+void optimize_vertex_cache(u32* dst, const u32* indices, u32 index_count, u32 cache_size)
+{
+	assert(index_count % 3 == 0);
+	assert(dst != indices);
+	if (index_count == 0)
+		return;
+
+	// Work on the range of vertices the indices actually use so per primitive calls stay cheap
+	u32 min_index = *std::min_element(indices, indices + index_count);
+	u32 max_index = *std::max_element(indices, indices + index_count);
+	u32 vertex_count = max_index - min_index + 1;
+	u32 triangle_count = index_count / 3;
+
+	// Vertex -> triangle adjacency
+	std::vector<u32> live_triangles(vertex_count, 0);
+	for (u32 i = 0; i < index_count; ++i)
+		live_triangles[indices[i] - min_index]++;
+	std::vector<u32> adjacency_offsets(vertex_count + 1, 0);
+	for (u32 i = 0; i < vertex_count; ++i)
+		adjacency_offsets[i + 1] = adjacency_offsets[i] + live_triangles[i];
+	std::vector<u32> adjacency(index_count);
+	{
+		std::vector<u32> fill = adjacency_offsets;
+		for (u32 i = 0; i < index_count; ++i)
+			adjacency[fill[indices[i] - min_index]++] = i / 3;
+	}
+
+	std::vector<u32> cache_time(vertex_count, 0);
+	std::vector<bool> emitted(triangle_count, false);
+	std::vector<u32> dead_end;
+	std::vector<u32> candidates;
+	dead_end.reserve(index_count);
+	candidates.reserve(64);
+
+	u32 time = cache_size + 1;
+	u32 cursor = 0;
+	u32 output_count = 0;
+	i64 fanning_vertex = indices[0] - min_index;
+	while (fanning_vertex >= 0)
+	{
+		u32 f = (u32)fanning_vertex;
+		candidates.clear();
+
+		// Emit every triangle still around the fanning vertex
+		for (u32 a = adjacency_offsets[f]; a < adjacency_offsets[f + 1]; ++a)
+		{
+			u32 t = adjacency[a];
+			if (emitted[t])
+				continue;
+			for (u32 k = 0; k < 3; ++k)
+			{
+				u32 index = indices[t * 3 + k];
+				u32 v = index - min_index;
+				dst[output_count++] = index;
+				dead_end.push_back(v);
+				candidates.push_back(v);
+				live_triangles[v]--;
+				if (time - cache_time[v] > cache_size)
+					cache_time[v] = time++;
+			}
+			emitted[t] = true;
+		}
+
+		// Next fanning vertex: the candidate that is still in the cache after its remaining triangles
+		// are emitted and has been there the longest
+		fanning_vertex = -1;
+		i64 best_priority = -1;
+		for (u32 v : candidates)
+		{
+			if (live_triangles[v] == 0)
+				continue;
+			i64 priority = 0;
+			if (time - cache_time[v] + 2 * live_triangles[v] <= cache_size)
+				priority = time - cache_time[v];
+			if (priority > best_priority)
+			{
+				best_priority = priority;
+				fanning_vertex = v;
+			}
+		}
+
+		// Dead end, go back to recently used vertices and then to the input order
+		while (fanning_vertex < 0 && !dead_end.empty())
+		{
+			u32 v = dead_end.back();
+			dead_end.pop_back();
+			if (live_triangles[v] > 0)
+				fanning_vertex = v;
+		}
+		while (fanning_vertex < 0 && cursor < vertex_count)
+		{
+			if (live_triangles[cursor] > 0)
+				fanning_vertex = cursor;
+			cursor++;
+		}
+	}
+	assert(output_count == index_count);
+}
+
+u32 optimize_vertex_fetch_remap(u32* remap, const u32* indices, u32 index_count, u32 vertex_count)
+{
+	for (u32 i = 0; i < vertex_count; ++i)
+		remap[i] = REMAP_UNUSED;
+
+	u32 next = 0;
+	for (u32 i = 0; i < index_count; ++i)
+	{
+		u32 v = indices[i];
+		assert(v < vertex_count);
+		if (remap[v] == REMAP_UNUSED)
+			remap[v] = next++;
+	}
+	return next;
+}
+
+float compute_acmr(const u32* indices, u32 index_count, u32 vertex_count, u32 cache_size)
+{
+	if (index_count == 0)
+		return 0.0f;
+
+	// FIFO: a vertex is still cached if fewer than cache_size misses happened since it was loaded
+	std::vector<u32> cache_time(vertex_count, 0);
+	u32 time = cache_size + 1;
+	u32 misses = 0;
+	for (u32 i = 0; i < index_count; ++i)
+	{
+		u32 v = indices[i];
+		if (time - cache_time[v] > cache_size)
+		{
+			cache_time[v] = time++;
+			misses++;
+		}
+	}
+	return (float)misses / (float)(index_count / 3);
+}
+
+bool fits_16bit_indices(const u32* indices, u32 index_count)
+{
+	if (index_count == 0)
+		return true;
+	u32 min_index = *std::min_element(indices, indices + index_count);
+	u32 max_index = *std::max_element(indices, indices + index_count);
+	return max_index - min_index <= 0xFFFF;
+}
+
+Mesh_Optimization_Stats optimize_indexed_mesh(void* vertices, u32 vertex_count, u32 vertex_stride, u32* indices, u32 index_count,
+	const Index_Range* ranges, u32 range_count, u32 cache_size)
+{
+	Mesh_Optimization_Stats stats{};
+	stats.vertex_count_before = vertex_count;
+	stats.vertex_count_after = vertex_count;
+	stats.index_count = index_count;
+	if (index_count == 0)
+		return stats;
+	stats.acmr_before = compute_acmr(indices, index_count, vertex_count, cache_size);
+
+	std::vector<u32> remap(vertex_count);
+	u32 unique_count = generate_vertex_remap(remap.data(), indices, index_count, vertices, vertex_count, vertex_stride);
+	std::vector<u8> welded((size_t)unique_count * vertex_stride);
+	remap_vertex_buffer(welded.data(), vertices, vertex_count, vertex_stride, remap.data());
+	remap_index_buffer(indices, indices, index_count, remap.data());
+
+	Index_Range everything = { 0, index_count };
+	if (range_count == 0)
+	{
+		ranges = &everything;
+		range_count = 1;
+	}
+	stats.range_count = range_count;
+	std::vector<u32> reordered(indices, indices + index_count);
+	for (u32 i = 0; i < range_count; ++i)
+	{
+		assert(ranges[i].offset + ranges[i].count <= index_count);
+		optimize_vertex_cache(reordered.data() + ranges[i].offset, indices + ranges[i].offset, ranges[i].count, cache_size);
+		if (fits_16bit_indices(reordered.data() + ranges[i].offset, ranges[i].count))
+			stats.ranges_fitting_16bit++;
+	}
+
+	u32 used_count = optimize_vertex_fetch_remap(remap.data(), reordered.data(), index_count, unique_count);
+	remap_vertex_buffer(vertices, welded.data(), unique_count, vertex_stride, remap.data());
+	remap_index_buffer(indices, reordered.data(), index_count, remap.data());
+
+	stats.vertex_count_after = used_count;
+	stats.acmr_after = compute_acmr(indices, index_count, used_count, cache_size);
+	return stats;
+}
+
+struct Quadric
+{
+	// Symmetric 4x4 matrix, upper triangle
+	double a00, a01, a02, a03;
+	double a11, a12, a13;
+	double a22, a23;
+	double a33;
+
+	void add(const Quadric& q)
+	{
+		a00 += q.a00; a01 += q.a01; a02 += q.a02; a03 += q.a03;
+		a11 += q.a11; a12 += q.a12; a13 += q.a13;
+		a22 += q.a22; a23 += q.a23;
+		a33 += q.a33;
+	}
+
+	double evaluate(const glm::vec3& p) const
+	{
+		double x = p.x, y = p.y, z = p.z;
+		double r = a00 * x * x + 2.0 * a01 * x * y + 2.0 * a02 * x * z + 2.0 * a03 * x
+			+ a11 * y * y + 2.0 * a12 * y * z + 2.0 * a13 * y
+			+ a22 * z * z + 2.0 * a23 * z
+			+ a33;
+		return r > 0.0 ? r : 0.0;
+	}
+};
+
+static Quadric plane_quadric(const glm::vec3& n, float d)
+{
+	Quadric q;
+	q.a00 = n.x * n.x; q.a01 = n.x * n.y; q.a02 = n.x * n.z; q.a03 = n.x * d;
+	q.a11 = n.y * n.y; q.a12 = n.y * n.z; q.a13 = n.y * d;
+	q.a22 = n.z * n.z; q.a23 = n.z * d;
+	q.a33 = (double)d * d;
+	return q;
+}
+
+static inline u64 edge_key(u32 a, u32 b)
+{
+	return ((u64)a << 32) | b;
+}
+
+// Open addressing set of directed edges, used to find edges without a twin (open borders)
+struct Edge_Set
+{
+	std::vector<u64> slots;
+	u64 mask;
+
+	static constexpr u64 EMPTY = ~0ull;
+
+	Edge_Set(size_t count)
+	{
+		size_t size = 1;
+		while (size < count * 2)
+			size *= 2;
+		slots.assign(size, EMPTY);
+		mask = size - 1;
+	}
+
+	size_t find_slot(u64 key) const
+	{
+		size_t slot = (size_t)((key * 0x9E3779B97F4A7C15ull) >> 20) & mask;
+		for (size_t probe = 1; slots[slot] != EMPTY && slots[slot] != key; ++probe)
+			slot = (slot + probe) & mask;
+		return slot;
+	}
+	void insert(u64 key) { slots[find_slot(key)] = key; }
+	bool contains(u64 key) const { return slots[find_slot(key)] == key; }
+};
+
+u32 simplify_mesh(u32* dst, const u32* indices, u32 index_count, const void* vertices, u32 vertex_stride,
+	u32 target_index_count, float target_error, float* result_error)
+{
+	assert(index_count % 3 == 0);
+	if (result_error)
+		*result_error = 0.0f;
+	if (index_count == 0)
+		return 0;
+
+	// Local vertex range, like optimize_vertex_cache
+	u32 min_index = *std::min_element(indices, indices + index_count);
+	u32 max_index = *std::max_element(indices, indices + index_count);
+	u32 vertex_count = max_index - min_index + 1;
+
+	std::vector<glm::vec3> positions(vertex_count);
+	glm::vec3 bbmin = glm::vec3(INFINITY);
+	glm::vec3 bbmax = glm::vec3(-INFINITY);
+	for (u32 i = 0; i < vertex_count; ++i)
+	{
+		memcpy(&positions[i], (const u8*)vertices + (size_t)(min_index + i) * vertex_stride, sizeof(glm::vec3));
+		bbmin = glm::min(bbmin, positions[i]);
+		bbmax = glm::max(bbmax, positions[i]);
+	}
+	// Work in a unit box so errors are relative to the mesh size
+	float extent = std::max(std::max(bbmax.x - bbmin.x, bbmax.y - bbmin.y), bbmax.z - bbmin.z);
+	float scale = extent > 0.0f ? 1.0f / extent : 1.0f;
+	for (glm::vec3& p : positions)
+		p = (p - bbmin) * scale;
+
+	std::vector<u32> result(index_count);
+	for (u32 i = 0; i < index_count; ++i)
+		result[i] = indices[i] - min_index;
+
+	// Seams: vertices sharing a position with another vertex. They keep their position and can't be
+	// collapse targets either, the triangles moving onto them would pick up one side's attributes
+	std::vector<u8> seam(vertex_count, 0);
+	{
+		std::vector<u32> position_remap(vertex_count);
+		u32 unique = generate_vertex_remap(position_remap.data(), nullptr, 0, positions.data(), vertex_count, sizeof(glm::vec3));
+		std::vector<u32> users(unique, 0);
+		std::vector<u8> referenced(vertex_count, 0);
+		for (u32 i = 0; i < index_count; ++i)
+			referenced[result[i]] = 1;
+		for (u32 v = 0; v < vertex_count; ++v)
+			users[position_remap[v]] += referenced[v];
+		for (u32 v = 0; v < vertex_count; ++v)
+			seam[v] = users[position_remap[v]] > 1;
+	}
+
+	// Open borders: directed edges without the opposite edge
+	std::vector<u8> locked = seam;
+	{
+		Edge_Set edges(index_count);
+		for (u32 i = 0; i < index_count; i += 3)
+			for (u32 k = 0; k < 3; ++k)
+				edges.insert(edge_key(result[i + k], result[i + (k + 1) % 3]));
+		for (u32 i = 0; i < index_count; i += 3)
+		{
+			for (u32 k = 0; k < 3; ++k)
+			{
+				u32 a = result[i + k];
+				u32 b = result[i + (k + 1) % 3];
+				if (!edges.contains(edge_key(b, a)))
+					locked[a] = locked[b] = 1;
+			}
+		}
+	}
+
+	std::vector<Quadric> quadrics(vertex_count, Quadric{});
+	for (u32 i = 0; i < index_count; i += 3)
+	{
+		const glm::vec3& p0 = positions[result[i + 0]];
+		glm::vec3 n = glm::cross(positions[result[i + 1]] - p0, positions[result[i + 2]] - p0);
+		float length = glm::length(n);
+		if (length == 0.0f)
+			continue;
+		n /= length;
+		Quadric q = plane_quadric(n, -glm::dot(n, p0));
+		for (u32 k = 0; k < 3; ++k)
+			quadrics[result[i + k]].add(q);
+	}
+
+	struct Collapse
+	{
+		u32 from;
+		u32 to;
+		float cost;
+	};
+
+	double max_cost = (double)target_error * target_error;
+	double worst_cost = 0.0;
+	u32 result_count = index_count;
+	std::vector<u32> remap(vertex_count);
+	std::vector<u8> touched(vertex_count);
+	std::vector<Collapse> collapses;
+	std::vector<u32> adjacency_offsets(vertex_count + 1);
+	std::vector<u32> adjacency;
+	while (result_count > target_index_count)
+	{
+		u32 triangle_count = result_count / 3;
+
+		// Vertex -> triangle adjacency of the current mesh
+		std::fill(adjacency_offsets.begin(), adjacency_offsets.end(), 0);
+		for (u32 i = 0; i < result_count; ++i)
+			adjacency_offsets[result[i] + 1]++;
+		for (u32 v = 0; v < vertex_count; ++v)
+			adjacency_offsets[v + 1] += adjacency_offsets[v];
+		adjacency.resize(result_count);
+		{
+			std::vector<u32> fill(adjacency_offsets.begin(), adjacency_offsets.end() - 1);
+			for (u32 i = 0; i < result_count; ++i)
+				adjacency[fill[result[i]]++] = i / 3;
+		}
+
+		collapses.clear();
+		for (u32 i = 0; i < result_count; i += 3)
+		{
+			for (u32 k = 0; k < 3; ++k)
+			{
+				u32 a = result[i + k];
+				u32 b = result[i + (k + 1) % 3];
+				// Both directions, every interior edge shows up twice so this covers a->b and b->a
+				if (!locked[a] && !seam[b])
+				{
+					Quadric q = quadrics[a];
+					q.add(quadrics[b]);
+					collapses.push_back({ a, b, (float)q.evaluate(positions[b]) });
+				}
+			}
+		}
+		std::sort(collapses.begin(), collapses.end(), [](const Collapse& x, const Collapse& y) { return x.cost < y.cost; });
+
+		// Every collapse removes about two triangles. Vertices around a collapse can't take part in
+		// another one in the same pass, which keeps the flip checks valid
+		u32 wanted = std::max((triangle_count - target_index_count / 3) / 2, 1u);
+		u32 collapse_count = 0;
+		for (u32 v = 0; v < vertex_count; ++v)
+			remap[v] = v;
+		std::fill(touched.begin(), touched.end(), 0);
+		for (const Collapse& c : collapses)
+		{
+			if (c.cost > max_cost || collapse_count >= wanted)
+				break;
+			if (touched[c.from] || touched[c.to])
+				continue;
+
+			// Moving `from` onto `to` must not flip any of the triangles that survive
+			bool flips = false;
+			for (u32 a = adjacency_offsets[c.from]; a < adjacency_offsets[c.from + 1] && !flips; ++a)
+			{
+				const u32* tri = &result[adjacency[a] * 3];
+				if (tri[0] == c.to || tri[1] == c.to || tri[2] == c.to)
+					continue;
+				glm::vec3 p[3], q[3];
+				for (u32 k = 0; k < 3; ++k)
+				{
+					p[k] = positions[tri[k]];
+					q[k] = tri[k] == c.from ? positions[c.to] : p[k];
+				}
+				glm::vec3 n0 = glm::cross(p[1] - p[0], p[2] - p[0]);
+				glm::vec3 n1 = glm::cross(q[1] - q[0], q[2] - q[0]);
+				flips = glm::dot(n0, n1) <= 0.0f;
+			}
+			if (flips)
+				continue;
+
+			remap[c.from] = c.to;
+			quadrics[c.to].add(quadrics[c.from]);
+			worst_cost = std::max(worst_cost, (double)c.cost);
+			collapse_count++;
+			for (u32 a = adjacency_offsets[c.from]; a < adjacency_offsets[c.from + 1]; ++a)
+				for (u32 k = 0; k < 3; ++k)
+					touched[result[adjacency[a] * 3 + k]] = 1;
+		}
+		if (collapse_count == 0)
+			break;
+
+		// Apply and drop the triangles that collapsed
+		u32 write = 0;
+		for (u32 i = 0; i < result_count; i += 3)
+		{
+			u32 a = remap[result[i + 0]];
+			u32 b = remap[result[i + 1]];
+			u32 c = remap[result[i + 2]];
+			if (a == b || b == c || a == c)
+				continue;
+			result[write++] = a;
+			result[write++] = b;
+			result[write++] = c;
+		}
+		result_count = write;
+	}
+
+	for (u32 i = 0; i < result_count; ++i)
+		dst[i] = result[i] + min_index;
+	if (result_error)
+		*result_error = (float)sqrt(worst_cost);
+	return result_count;
+}
+
+u32 build_meshlets(u32* dst, Index_Range* meshlets, const u32* indices, u32 index_count, const void* vertices, u32 vertex_stride,
+	u32 max_triangles)
+{
+	assert(index_count % 3 == 0);
+	assert(dst != indices);
+	assert(max_triangles > 0);
+	if (index_count == 0)
+		return 0;
+
+	u32 min_index = *std::min_element(indices, indices + index_count);
+	u32 max_index = *std::max_element(indices, indices + index_count);
+	u32 vertex_count = max_index - min_index + 1;
+	u32 triangle_count = index_count / 3;
+
+	// Vertex -> triangle adjacency, same as optimize_vertex_cache
+	std::vector<u32> adjacency_offsets(vertex_count + 1, 0);
+	for (u32 i = 0; i < index_count; ++i)
+		adjacency_offsets[indices[i] - min_index + 1]++;
+	for (u32 i = 0; i < vertex_count; ++i)
+		adjacency_offsets[i + 1] += adjacency_offsets[i];
+	std::vector<u32> adjacency(index_count);
+	{
+		std::vector<u32> fill(adjacency_offsets.begin(), adjacency_offsets.end() - 1);
+		for (u32 i = 0; i < index_count; ++i)
+			adjacency[fill[indices[i] - min_index]++] = i / 3;
+	}
+
+	std::vector<glm::vec3> centroids(triangle_count);
+	for (u32 t = 0; t < triangle_count; ++t)
+	{
+		glm::vec3 sum = glm::vec3(0.0f);
+		for (u32 k = 0; k < 3; ++k)
+		{
+			glm::vec3 p;
+			memcpy(&p, (const u8*)vertices + (size_t)indices[t * 3 + k] * vertex_stride, sizeof(p));
+			sum += p;
+		}
+		centroids[t] = sum / 3.0f;
+	}
+
+	// Greedy growth: start from the first triangle left in input order (which is vertex cache order after
+	// optimize_vertex_cache) and keep adding the neighbour that brings the fewest new vertices, ties going
+	// to the one closest to the cluster's centroid. Keeps clusters compact so their bounds stay tight
+	std::vector<bool> emitted(triangle_count, false);
+	std::vector<u32> vertex_cluster(vertex_count, ~0u);
+	std::vector<u32> candidates;
+	u32 meshlet_count = 0;
+	u32 output_count = 0;
+	u32 cursor = 0;
+	while (output_count < index_count)
+	{
+		while (emitted[cursor])
+			cursor++;
+
+		Index_Range meshlet = { output_count, 0 };
+		glm::vec3 centroid_sum = glm::vec3(0.0f);
+		candidates.clear();
+		u32 next = cursor;
+		while (next != ~0u)
+		{
+			u32 t = next;
+			emitted[t] = true;
+			centroid_sum += centroids[t];
+			for (u32 k = 0; k < 3; ++k)
+			{
+				u32 v = indices[t * 3 + k] - min_index;
+				dst[output_count++] = indices[t * 3 + k];
+				vertex_cluster[v] = meshlet_count;
+				for (u32 a = adjacency_offsets[v]; a < adjacency_offsets[v + 1]; ++a)
+					if (!emitted[adjacency[a]])
+						candidates.push_back(adjacency[a]);
+			}
+			meshlet.count += 3;
+			if (meshlet.count == max_triangles * 3)
+				break;
+
+			glm::vec3 centroid = centroid_sum / (float)(meshlet.count / 3);
+			next = ~0u;
+			u32 best_new_vertices = 4;
+			float best_distance = INFINITY;
+			size_t live = 0;
+			for (size_t c = 0; c < candidates.size(); ++c)
+			{
+				u32 candidate = candidates[c];
+				if (emitted[candidate])
+					continue;
+				candidates[live++] = candidate;
+				u32 new_vertices = 0;
+				for (u32 k = 0; k < 3; ++k)
+					new_vertices += vertex_cluster[indices[candidate * 3 + k] - min_index] != meshlet_count;
+				float distance = glm::dot(centroids[candidate] - centroid, centroids[candidate] - centroid);
+				if (new_vertices < best_new_vertices || (new_vertices == best_new_vertices && distance < best_distance))
+				{
+					best_new_vertices = new_vertices;
+					best_distance = distance;
+					next = candidate;
+				}
+			}
+			candidates.resize(live);
+		}
+		meshlets[meshlet_count++] = meshlet;
+	}
+	return meshlet_count;
+}
+
+Meshlet_Bounds compute_meshlet_bounds(const u32* indices, u32 index_count, const void* vertices, u32 vertex_stride)
+{
+	assert(index_count % 3 == 0);
+	Meshlet_Bounds bounds{};
+	if (index_count == 0)
+		return bounds;
+
+	auto position = [&](u32 index)
+	{
+		glm::vec3 p;
+		memcpy(&p, (const u8*)vertices + (size_t)index * vertex_stride, sizeof(p));
+		return p;
+	};
+
+	glm::vec3 bbmin = glm::vec3(INFINITY);
+	glm::vec3 bbmax = glm::vec3(-INFINITY);
+	for (u32 i = 0; i < index_count; ++i)
+	{
+		bbmin = glm::min(bbmin, position(indices[i]));
+		bbmax = glm::max(bbmax, position(indices[i]));
+	}
+	glm::vec3 center = (bbmin + bbmax) * 0.5f;
+	float radius = 0.0f;
+	for (u32 i = 0; i < index_count; ++i)
+		radius = std::max(radius, glm::length(position(indices[i]) - center));
+	bounds.center = center;
+	bounds.radius = radius;
+
+	// Normal cone: average of the face normals, opening up to the one furthest from it
+	std::vector<glm::vec3> normals;
+	normals.reserve(index_count / 3);
+	glm::vec3 axis = glm::vec3(0.0f);
+	for (u32 i = 0; i < index_count; i += 3)
+	{
+		glm::vec3 a = position(indices[i + 0]);
+		glm::vec3 n = glm::cross(position(indices[i + 1]) - a, position(indices[i + 2]) - a);
+		float length = glm::length(n);
+		if (length == 0.0f)
+			continue; // Degenerate triangles are never rasterized
+		normals.push_back(n / length);
+		axis += n / length;
+	}
+	float axis_length = glm::length(axis);
+	bounds.cone_axis = axis_length > 0.0f ? axis / axis_length : glm::vec3(0.0f, 0.0f, 1.0f);
+	float min_dot = 1.0f;
+	for (const glm::vec3& n : normals)
+		min_dot = std::min(min_dot, glm::dot(n, bounds.cone_axis));
+
+	// A cone wider than ~85 degrees is backfacing from too few places to be worth testing
+	bounds.cone_cutoff = normals.empty() || min_dot <= 0.1f ? 1.0f : sqrtf(1.0f - min_dot * min_dot);
+	return bounds;
+}
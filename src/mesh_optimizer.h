@@ -0,0 +1,104 @@
+#pragma once
+#include "defines.h"
+
+/*
+	Index and vertex buffer optimizations run on import. Nothing here knows about Mesh
+	or Vertex, vertices are compared as raw bytes so the same code works for any layout
+	(optimize_mesh in r_mesh.h wraps this for Mesh, tools/mesh_opt runs it offline).
+
+	optimize_indexed_mesh runs the whole pipeline: weld (generate_vertex_remap + remap_*),
+	optimize_vertex_cache on every index range, then optimize_vertex_fetch_remap + remap_*
+	so vertices end up in the order the reordered indices first use them.
+*/
+
+constexpr u32 DEFAULT_VERTEX_CACHE_SIZE = 16;
+constexpr u32 REMAP_UNUSED = ~0u;
+
+struct Index_Range
+{
+	u32 offset;
+	u32 count;
+};
+
+struct Mesh_Optimization_Stats
+{
+	u32 vertex_count_before;
+	u32 vertex_count_after;
+	u32 index_count;
+	float acmr_before;
+	float acmr_after;
+	u32 range_count;
+	u32 ranges_fitting_16bit; // Index ranges that could use 16-bit indices
+};
+
+/*
+	Optimizes vertices and indices in place. Triangles only move within their range so the
+	ranges (draws) stay valid, a single range covering everything is used if range_count is 0.
+	The vertex count shrinks to stats.vertex_count_after, the caller resizes its array.
+*/
+Mesh_Optimization_Stats optimize_indexed_mesh(void* vertices, u32 vertex_count, u32 vertex_stride, u32* indices, u32 index_count,
+	const Index_Range* ranges, u32 range_count, u32 cache_size = DEFAULT_VERTEX_CACHE_SIZE);
+
+/*
+	Welds bitwise identical vertices. Writes the new index of every vertex to remap
+	(REMAP_UNUSED for vertices no index refers to) and returns the unique vertex count.
+	Pass indices = nullptr to weld an unindexed vertex list.
+*/
+u32 generate_vertex_remap(u32* remap, const u32* indices, u32 index_count, const void* vertices, u32 vertex_count, u32 vertex_stride);
+// dst has room for the unique vertex count, must not alias vertices
+void remap_vertex_buffer(void* dst, const void* vertices, u32 vertex_count, u32 vertex_stride, const u32* remap);
+// dst can be the same as indices
+void remap_index_buffer(u32* dst, const u32* indices, u32 index_count, const u32* remap);
+
+/*
+	Reorders triangles for the post transform vertex cache with Tipsify
+	(Sander et al. 2007, "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw").
+	Linear in the triangle count, indices are only reordered, never changed. dst must not alias indices.
+*/
+void optimize_vertex_cache(u32* dst, const u32* indices, u32 index_count, u32 cache_size = DEFAULT_VERTEX_CACHE_SIZE);
+
+// Remap that puts vertices in the order the index buffer first references them, returns the used vertex count
+u32 optimize_vertex_fetch_remap(u32* remap, const u32* indices, u32 index_count, u32 vertex_count);
+
+// Average cache miss ratio (transformed vertices per triangle) of a FIFO cache, 3.0 is the worst and ~0.5 the best
+float compute_acmr(const u32* indices, u32 index_count, u32 vertex_count, u32 cache_size = DEFAULT_VERTEX_CACHE_SIZE);
+
+// Whether an index range could be stored as 16-bit indices relative to its smallest index
+bool fits_16bit_indices(const u32* indices, u32 index_count);
+
+/*
+	Quadric error edge collapse (Garland & Heckbert 1997). Vertices collapse onto existing neighbours,
+	so the output only references vertices of the input and the vertex buffer is shared between LODs.
+	Vertices on open borders and attribute seams (same position, different vertex) are kept.
+	Positions are the first 3 floats of every vertex. Errors are relative to the largest extent of
+	the bounding box of the referenced vertices, simplification stops at target_index_count or once
+	the next collapse would exceed target_error. Returns the index count written to dst, which needs
+	room for index_count indices.
+*/
+u32 simplify_mesh(u32* dst, const u32* indices, u32 index_count, const void* vertices, u32 vertex_stride,
+	u32 target_index_count, float target_error, float* result_error = nullptr);
+
+constexpr u32 MESHLET_MAX_TRIANGLES = 64;
+
+struct Meshlet_Bounds
+{
+	glm::vec3 center;
+	float radius;
+	glm::vec3 cone_axis;
+	float cone_cutoff; // 1 if the cone is too wide to ever cull, see compute_meshlet_bounds
+};
+
+/*
+	Splits an index range into meshlets (clusters) of up to max_triangles connected, spatially close
+	triangles. The triangles are reordered so every meshlet is a contiguous range of dst, the ranges
+	are written to meshlets (relative to dst) and their count is returned. meshlets needs room for
+	index_count / 3 entries, dst must not alias indices.
+*/
+u32 build_meshlets(u32* dst, Index_Range* meshlets, const u32* indices, u32 index_count, const void* vertices, u32 vertex_stride,
+	u32 max_triangles = MESHLET_MAX_TRIANGLES);
+
+/*
+	Bounding sphere and normal cone of a meshlet. All of its triangles face away from the camera if
+	dot(center - camera_pos, cone_axis) >= cone_cutoff * length(center - camera_pos) + radius.
+*/
+Meshlet_Bounds compute_meshlet_bounds(const u32* indices, u32 index_count, const void* vertices, u32 vertex_stride);
@@ -1,102 +1,708 @@
 #include "obj.h"
 #include "common.h"
-#include <iostream>
 #include "r_mesh.h"
+#include "file_system.h"
+#include "jobs.h"
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <algorithm>
+#include <filesystem>
 
-Mesh load_obj_from_file(const char* filepath)
-{
-    std::string inputfile = filepath;
-    tinyobj::ObjReaderConfig reader_config;
-    reader_config.mtl_search_path = "D:\\Projects\\GigaRayV0\\data"; // Path to material files
-
-    tinyobj::ObjReader reader;
-
-    if (!reader.ParseFromFile(inputfile, reader_config)) {
-        if (!reader.Error().empty()) {
-            std::cerr << "TinyObjReader: " << reader.Error();
-        }
-        exit(1);
-    }
-
-    if (!reader.Warning().empty()) {
-        std::cout << "TinyObjReader: " << reader.Warning();
-    }
-
-    std::vector<Vertex> vertices;
-    std::vector<uint32_t> indices;
-
-    glm::vec3 min = glm::vec3(INFINITY);
-    glm::vec3 max = glm::vec3(-INFINITY);
-
-    auto& attrib = reader.GetAttrib();
-    auto& shapes = reader.GetShapes();
-    auto& materials = reader.GetMaterials();
-
-    for (size_t v = 0; v < attrib.vertices.size() / 3; ++v)
-    {
-        float x = attrib.vertices[3 * v + 0];
-        float y = attrib.vertices[3 * v + 1];
-        float z = attrib.vertices[3 * v + 2];
-        glm::vec3 new_vert = glm::vec3(x, y, z);
-        min = glm::min(min, new_vert);
-        max = glm::max(max, new_vert);
-        //float nx = attrib.normals[3 * v + 0];
-        //float ny = attrib.normals[3 * v + 1];
-        //float nz = attrib.normals[3 * v + 2];
-        //float tx = attrib.texcoords[2 * v + 0];
-        //float ty = attrib.texcoords[2 * v + 1];
-        //vertices.push_back({ new_vert /*glm::vec3(nx, ny, nz), glm::vec2(tx, ty)*/});
-    }
-
-    uint32_t idx_ = 0;
-    // Loop over shapes
-    for (size_t s = 0; s < shapes.size(); s++) {
-        // Loop over faces(polygon)
-        size_t index_offset = 0;
-        for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
-            size_t fv = size_t(shapes[s].mesh.num_face_vertices[f]);
-            assert(fv == 3);
-            // Loop over vertices in the face.
-            for (size_t v = 0; v < fv; v++) {
-                // access to vertex
-                tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-                tinyobj::real_t vx = attrib.vertices[3 * size_t(idx.vertex_index) + 0];
-                tinyobj::real_t vy = attrib.vertices[3 * size_t(idx.vertex_index) + 1];
-                tinyobj::real_t vz = attrib.vertices[3 * size_t(idx.vertex_index) + 2];
-                //indices.push_back(idx.vertex_index);
-                indices.push_back(idx_++);
-
-                Vertex new_vert;
-                new_vert.pos = glm::vec3(vx, vy, vz);
-                // Check if `normal_index` is zero or positive. negative = no normal data
-                if (idx.normal_index >= 0) {
-                    tinyobj::real_t nx = attrib.normals[3 * size_t(idx.normal_index) + 0];
-                    tinyobj::real_t ny = attrib.normals[3 * size_t(idx.normal_index) + 1];
-                    tinyobj::real_t nz = attrib.normals[3 * size_t(idx.normal_index) + 2];
-                    new_vert.normal = glm::vec3(nx, ny, nz);
-                }
-
-                // Check if `texcoord_index` is zero or positive. negative = no texcoord data
-                if (idx.texcoord_index >= 0) {
-                    tinyobj::real_t tx = attrib.texcoords[2 * size_t(idx.texcoord_index) + 0];
-                    tinyobj::real_t ty = attrib.texcoords[2 * size_t(idx.texcoord_index) + 1];
-                    new_vert.texcoord = glm::vec2(tx, ty);
-                }
-                vertices.push_back(new_vert);
-                // Optional: vertex colors
-                // tinyobj::real_t red   = attrib.colors[3*size_t(idx.vertex_index)+0];
-                // tinyobj::real_t green = attrib.colors[3*size_t(idx.vertex_index)+1];
-                // tinyobj::real_t blue  = attrib.colors[3*size_t(idx.vertex_index)+2];
-            }
-            index_offset += fv;
-
-            // per-face material
-            (void)shapes[s].mesh.material_ids[f];
-        }
-    }
-    Mesh ret;
-    ret.vertices = std::move(vertices);
-    ret.indices = std::move(indices);
-
-    return ret;
+// Chunks are at least this big so small files don't get split into a job per line
+static constexpr size_t MIN_CHUNK_SIZE = 1 << 20;
+static constexpr u32 CHUNKS_PER_THREAD = 4;
+
+// Negative (relative) OBJ indices can refer to vertices of earlier chunks, they're stored biased
+// with this flag and resolved once the attribute counts of all chunks are known
+static constexpr u32 RELATIVE_INDEX_FLAG = 0x80000000u;
+static constexpr i64 RELATIVE_INDEX_BIAS = 0x40000000;
+static constexpr u32 NO_INDEX = ~0u;
+static constexpr u32 NO_MATERIAL = ~0u;
+
+struct Obj_Corner
+{
+	u32 v, vt, vn;
+};
+
+struct Obj_Chunk
+{
+	const char* begin;
+	const char* end;
+
+	// Pass 1, parsing
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> normals;
+	std::vector<glm::vec2> texcoords;
+	std::vector<Obj_Corner> corners; // 3 per triangle, polygons are fan triangulated
+	std::vector<std::pair<u32, std::string>> material_switches; // First triangle, usemtl name
+	std::vector<std::string> material_libraries; // mtllib
+	u32 line_count = 0;
+	u32 error_line = 0;
+	std::string error;
+
+	// Pass 2, indexing. Vertices and indices per material, indices are local to the chunk
+	u32 first_position = 0;
+	u32 first_texcoord = 0;
+	u32 first_normal = 0;
+	u32 start_material = NO_MATERIAL;
+	std::vector<u32> switch_materials; // Material id of each entry in material_switches
+	bool missing_normals = false; // Some corner has no vn
+	std::vector<std::vector<Vertex>> vertices;
+	std::vector<std::vector<u32>> indices;
+	glm::vec3 bbmin = glm::vec3(INFINITY);
+	glm::vec3 bbmax = glm::vec3(-INFINITY);
+};
+
+static inline bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static inline const char* skip_whitespace(const char* p, const char* end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+		++p;
+	return p;
+}
+
+static double pow10_int(i32 exponent)
+{
+	// Exact powers of ten that fit in a double, larger exponents go through pow
+	static const double table[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+	if (exponent >= 0 && exponent <= 22)
+		return table[exponent];
+	return pow(10.0, (double)exponent);
+}
+
+// Decimal float with optional exponent, no locale or allocation like strtof. Not correctly
+// rounded in every case, but well within float precision
+static bool parse_float(const char** cursor, const char* end, float* out)
+{
+	const char* p = *cursor;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+
+	u64 mantissa = 0;
+	i32 exponent = 0;
+	u32 significant_digits = 0;
+	bool any_digits = false;
+	for (; p < end && is_digit(*p); ++p)
+	{
+		any_digits = true;
+		if (significant_digits < 18)
+		{
+			mantissa = mantissa * 10 + (*p - '0');
+			significant_digits += mantissa != 0;
+		}
+		else
+		{
+			exponent++;
+		}
+	}
+	if (p < end && *p == '.')
+	{
+		for (++p; p < end && is_digit(*p); ++p)
+		{
+			any_digits = true;
+			if (significant_digits < 18)
+			{
+				mantissa = mantissa * 10 + (*p - '0');
+				significant_digits += mantissa != 0;
+				exponent--;
+			}
+		}
+	}
+	if (!any_digits)
+		return false;
+
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		++p;
+		bool negative_exponent = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			negative_exponent = *p++ == '-';
+		if (p >= end || !is_digit(*p))
+			return false;
+		i32 e = 0;
+		for (; p < end && is_digit(*p); ++p)
+			e = std::min(e * 10 + (*p - '0'), 10000);
+		exponent += negative_exponent ? -e : e;
+	}
+
+	double value = (double)mantissa;
+	value = exponent < 0 ? value / pow10_int(-exponent) : value * pow10_int(exponent);
+	*out = (float)(negative ? -value : value);
+	*cursor = p;
+	return true;
+}
+
+static bool parse_floats(const char** cursor, const char* end, float* out, u32 required, u32 optional)
+{
+	for (u32 i = 0; i < required + optional; ++i)
+	{
+		const char* p = skip_whitespace(*cursor, end);
+		if (!parse_float(&p, end, &out[i]))
+			return i >= required;
+		*cursor = p;
+	}
+	return true;
+}
+
+// OBJ index to a 0 based index, see RELATIVE_INDEX_FLAG for negative ones
+static bool parse_index(const char** cursor, const char* end, u32 count_so_far, u32* out)
+{
+	const char* p = *cursor;
+	bool negative = p < end && *p == '-';
+	if (negative)
+		++p;
+	if (p >= end || !is_digit(*p))
+		return false;
+
+	i64 value = 0;
+	for (; p < end && is_digit(*p); ++p)
+	{
+		value = value * 10 + (*p - '0');
+		if (value > RELATIVE_INDEX_BIAS)
+			return false;
+	}
+	if (value == 0)
+		return false;
+
+	*out = negative
+		? RELATIVE_INDEX_FLAG | (u32)((i64)count_so_far - value + RELATIVE_INDEX_BIAS)
+		: (u32)(value - 1);
+	*cursor = p;
+	return true;
+}
+
+static void set_chunk_error(Obj_Chunk* chunk, const char* message)
+{
+	if (chunk->error.empty())
+	{
+		chunk->error = message;
+		chunk->error_line = chunk->line_count;
+	}
+}
+
+// Trimmed rest of the line after a keyword
+static std::string parse_name(const char* p, const char* line_end)
+{
+	const char* name = skip_whitespace(p, line_end);
+	const char* name_end = line_end;
+	while (name_end > name && (name_end[-1] == ' ' || name_end[-1] == '\t' || name_end[-1] == '\r'))
+		--name_end;
+	return std::string(name, name_end);
+}
+
+static inline bool is_keyword(const char* p, const char* line_end, const char* keyword)
+{
+	size_t length = strlen(keyword);
+	return (size_t)(line_end - p) > length && strncmp(p, keyword, length) == 0 && (p[length] == ' ' || p[length] == '\t');
+}
+
+static void parse_chunk(Obj_Chunk* chunk)
+{
+	std::vector<Obj_Corner> polygon;
+	const char* end = chunk->end;
+	const char* line = chunk->begin;
+	while (line < end && chunk->error.empty())
+	{
+		const char* line_end = (const char*)memchr(line, '\n', end - line);
+		if (!line_end)
+			line_end = end;
+		chunk->line_count++;
+		const char* next_line = line_end + 1;
+
+		// Comments can also trail a statement
+		const char* comment = (const char*)memchr(line, '#', line_end - line);
+		if (comment)
+			line_end = comment;
+
+		const char* p = skip_whitespace(line, line_end);
+		if (p + 1 < line_end && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+		{
+			glm::vec3 v;
+			p += 1;
+			// Vertex colors after the position are ignored
+			if (!parse_floats(&p, line_end, &v.x, 3, 0))
+				set_chunk_error(chunk, "Invalid vertex position");
+			chunk->positions.push_back(v);
+		}
+		else if (p + 2 < line_end && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t'))
+		{
+			glm::vec3 n;
+			p += 2;
+			if (!parse_floats(&p, line_end, &n.x, 3, 0))
+				set_chunk_error(chunk, "Invalid vertex normal");
+			chunk->normals.push_back(n);
+		}
+		else if (p + 2 < line_end && p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t'))
+		{
+			float t[3] = {};
+			p += 2;
+			if (!parse_floats(&p, line_end, t, 1, 2))
+				set_chunk_error(chunk, "Invalid texture coordinate");
+			chunk->texcoords.push_back(glm::vec2(t[0], t[1]));
+		}
+		else if (p + 1 < line_end && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+		{
+			polygon.clear();
+			p = skip_whitespace(p + 1, line_end);
+			while (p < line_end)
+			{
+				Obj_Corner c = { NO_INDEX, NO_INDEX, NO_INDEX };
+				bool valid = parse_index(&p, line_end, (u32)chunk->positions.size(), &c.v);
+				if (valid && p < line_end && *p == '/')
+				{
+					++p;
+					if (p < line_end && *p != '/')
+						valid = parse_index(&p, line_end, (u32)chunk->texcoords.size(), &c.vt);
+					if (valid && p < line_end && *p == '/')
+					{
+						++p;
+						valid = parse_index(&p, line_end, (u32)chunk->normals.size(), &c.vn);
+					}
+				}
+				if (!valid || (p < line_end && *p != ' ' && *p != '\t' && *p != '\r'))
+				{
+					set_chunk_error(chunk, "Invalid face index");
+					break;
+				}
+				polygon.push_back(c);
+				p = skip_whitespace(p, line_end);
+			}
+			if (polygon.size() < 3 && chunk->error.empty())
+				set_chunk_error(chunk, "Face with fewer than 3 vertices");
+			for (size_t i = 2; i < polygon.size(); ++i)
+			{
+				chunk->corners.push_back(polygon[0]);
+				chunk->corners.push_back(polygon[i - 1]);
+				chunk->corners.push_back(polygon[i]);
+			}
+		}
+		else if (is_keyword(p, line_end, "usemtl"))
+		{
+			chunk->material_switches.push_back({ (u32)(chunk->corners.size() / 3), parse_name(p + 6, line_end) });
+		}
+		else if (is_keyword(p, line_end, "mtllib"))
+		{
+			chunk->material_libraries.push_back(parse_name(p + 6, line_end));
+		}
+		// Groups, smoothing groups and lines/points are skipped
+
+		line = next_line;
+	}
+}
+
+// Keyword followed by count floats
+static bool parse_statement(const char* p, const char* line_end, const char* keyword, float* out, u32 count)
+{
+	if (!is_keyword(p, line_end, keyword))
+		return false;
+	p += strlen(keyword);
+	return parse_floats(&p, line_end, out, count, 0);
+}
+
+/*
+	Reads the materials of an MTL library into the ones named so far, by name. Kd and d become the base
+	color, Ke the emission, Ns is mapped to a roughness unless the PBR extension's Pr/Pm are given.
+	map_Kd is only recorded. Relative library paths are looked up next to the OBJ, then in data.
+*/
+static void load_mtl_library(const char* obj_filepath, const std::string& library, std::vector<Obj_Material>* materials)
+{
+	std::filesystem::path path = std::filesystem::path(obj_filepath).parent_path() / library;
+	File_View view;
+	if (!map_file(path.string().c_str(), &view) && !map_file(("data/" + library).c_str(), &view))
+	{
+		LOG_DEBUG("%s: Failed to open material library %s\n", obj_filepath, library.c_str());
+		return;
+	}
+
+	const char* end = (const char*)view.data + view.size;
+	Obj_Material* current = nullptr;
+	bool has_roughness = false;
+	for (const char* line = (const char*)view.data; line < end;)
+	{
+		const char* line_end = (const char*)memchr(line, '\n', end - line);
+		if (!line_end)
+			line_end = end;
+		const char* next_line = line_end + 1;
+		const char* comment = (const char*)memchr(line, '#', line_end - line);
+		if (comment)
+			line_end = comment;
+
+		const char* p = skip_whitespace(line, line_end);
+		float f[3];
+		if (is_keyword(p, line_end, "newmtl"))
+		{
+			std::string name = parse_name(p + 6, line_end);
+			current = nullptr;
+			for (Obj_Material& m : *materials)
+			{
+				if (m.name == name)
+					current = &m;
+			}
+			has_roughness = false;
+		}
+		else if (!current)
+		{
+			// Materials the OBJ doesn't use, or statements before the first newmtl
+		}
+		else if (parse_statement(p, line_end, "Kd", f, 3))
+			current->material.base_color_factor = glm::vec4(f[0], f[1], f[2], current->material.base_color_factor.a);
+		else if (parse_statement(p, line_end, "Ke", f, 3))
+			current->material.emissive_factor = glm::vec3(f[0], f[1], f[2]);
+		else if (parse_statement(p, line_end, "d", f, 1))
+			current->material.base_color_factor.a = f[0];
+		else if (parse_statement(p, line_end, "Pm", f, 1))
+			current->material.metallic_factor = f[0];
+		else if (parse_statement(p, line_end, "Pr", f, 1))
+		{
+			current->material.roughness_factor = f[0];
+			has_roughness = true;
+		}
+		else if (parse_statement(p, line_end, "Ns", f, 1))
+		{
+			// Blinn-Phong exponent to GGX roughness
+			if (!has_roughness)
+				current->material.roughness_factor = sqrtf(2.0f / (std::max(f[0], 0.0f) + 2.0f));
+		}
+		else if (is_keyword(p, line_end, "map_Kd"))
+			current->base_color_texture = (std::filesystem::path(library).parent_path() / parse_name(p + 6, line_end)).string();
+
+		line = next_line;
+	}
+	unmap_file(&view);
+}
+
+static bool resolve_index(u32 index, u32 chunk_first, u32 total, u32* out)
+{
+	i64 resolved = (index & RELATIVE_INDEX_FLAG)
+		? (i64)chunk_first + (i64)(index & ~RELATIVE_INDEX_FLAG) - RELATIVE_INDEX_BIAS
+		: (i64)index;
+	if (resolved < 0 || resolved >= (i64)total)
+		return false;
+	*out = (u32)resolved;
+	return true;
+}
+
+// Turns the chunk's corners into absolute attribute indices
+static void resolve_chunk(Obj_Chunk* chunk, u32 position_count, u32 texcoord_count, u32 normal_count)
+{
+	for (Obj_Corner& c : chunk->corners)
+	{
+		bool valid = resolve_index(c.v, chunk->first_position, position_count, &c.v);
+		if (c.vt != NO_INDEX)
+			valid = valid && resolve_index(c.vt, chunk->first_texcoord, texcoord_count, &c.vt);
+		if (c.vn != NO_INDEX)
+			valid = valid && resolve_index(c.vn, chunk->first_normal, normal_count, &c.vn);
+		else
+			chunk->missing_normals = true;
+		if (!valid)
+		{
+			chunk->error = "Face index out of range";
+			return;
+		}
+	}
+}
+
+/*
+	Builds indexed vertices for a chunk, deduplicating corners with the same (material, v, vt, vn).
+	Vertices without a normal in the file take smooth_normals of their position, which are summed
+	over the whole file so chunk and material boundaries don't show up as seams.
+	Corners shared across chunk boundaries are duplicated here, optimize_mesh welds them afterwards.
+*/
+static void index_chunk(Obj_Chunk* chunk, u32 material_count, const std::vector<glm::vec3>& positions,
+	const std::vector<glm::vec2>& texcoords, const std::vector<glm::vec3>& normals, const std::vector<glm::vec3>& smooth_normals)
+{
+	struct Key
+	{
+		u32 material, v, vt, vn;
+		u32 index;
+	};
+
+	u32 triangle_count = (u32)(chunk->corners.size() / 3);
+	chunk->vertices.resize(material_count);
+	chunk->indices.resize(material_count);
+
+	u32 table_size = 1;
+	while (table_size < chunk->corners.size() * 2)
+		table_size *= 2;
+	u32 mask = table_size - 1;
+	std::vector<u32> table(table_size, NO_INDEX);
+	std::vector<Key> keys;
+	keys.reserve(chunk->corners.size() / 2);
+
+	u32 material = chunk->start_material;
+	size_t next_switch = 0;
+	for (u32 t = 0; t < triangle_count; ++t)
+	{
+		while (next_switch < chunk->material_switches.size() && chunk->material_switches[next_switch].first <= t)
+			material = chunk->switch_materials[next_switch++];
+		assert(material != NO_MATERIAL);
+
+		std::vector<Vertex>& vertices = chunk->vertices[material];
+		for (u32 k = 0; k < 3; ++k)
+		{
+			const Obj_Corner& c = chunk->corners[t * 3 + k];
+			u32 hash = (c.v * 73856093u) ^ (c.vt * 19349663u) ^ (c.vn * 83492791u) ^ (material * 2654435761u);
+			u32 slot = hash & mask;
+			u32 index = NO_INDEX;
+			for (u32 probe = 1; table[slot] != NO_INDEX; ++probe)
+			{
+				const Key& key = keys[table[slot]];
+				if (key.material == material && key.v == c.v && key.vt == c.vt && key.vn == c.vn)
+				{
+					index = key.index;
+					break;
+				}
+				slot = (slot + probe) & mask;
+			}
+			if (index == NO_INDEX)
+			{
+				index = (u32)vertices.size();
+				table[slot] = (u32)keys.size();
+				keys.push_back({ material, c.v, c.vt, c.vn, index });
+
+				Vertex v{};
+				v.pos = positions[c.v];
+				v.normal = c.vn != NO_INDEX ? normals[c.vn] : smooth_normals[c.v];
+				v.texcoord = c.vt != NO_INDEX ? texcoords[c.vt] : glm::vec2(0.0f);
+				v.tangent = glm::vec4(1.0f, 0.0f, 0.0f, 1.0f);
+				vertices.push_back(v);
+				chunk->bbmin = glm::min(chunk->bbmin, v.pos);
+				chunk->bbmax = glm::max(chunk->bbmax, v.pos);
+			}
+			chunk->indices[material].push_back(index);
+		}
+	}
+}
+
+bool load_obj_from_file(const char* filepath, Mesh* out, std::vector<Obj_Material>* materials, std::string* error)
+{
+	auto fail = [&](const std::string& message)
+	{
+		LOG_DEBUG("%s\n", message.c_str());
+		if (error)
+			*error = message;
+		return false;
+	};
+
+	File_View view;
+	if (!map_file(filepath, &view))
+		return fail(std::string("Failed to open ") + filepath);
+
+	// Split at line boundaries
+	const char* data = (const char*)view.data;
+	const char* data_end = data + view.size;
+	size_t chunk_size = std::max(MIN_CHUNK_SIZE, view.size / ((g_job_system->get_thread_count() + 1) * CHUNKS_PER_THREAD));
+	std::vector<Obj_Chunk> chunks;
+	for (const char* p = data; p < data_end;)
+	{
+		const char* chunk_end = p + std::min(chunk_size, (size_t)(data_end - p));
+		const char* newline = chunk_end < data_end ? (const char*)memchr(chunk_end, '\n', data_end - chunk_end) : nullptr;
+		chunk_end = newline ? newline + 1 : data_end;
+		Obj_Chunk& chunk = chunks.emplace_back();
+		chunk.begin = p;
+		chunk.end = chunk_end;
+		p = chunk_end;
+	}
+
+	std::atomic<u32> counter = 0;
+	for (Obj_Chunk& chunk : chunks)
+	{
+		Obj_Chunk* c = &chunk;
+		g_job_system->push([c]() { parse_chunk(c); }, &counter);
+	}
+	g_job_system->wait(&counter);
+
+	// Attribute offsets, materials and the first error in file order
+	u32 line = 0;
+	u32 position_count = 0, texcoord_count = 0, normal_count = 0;
+	u32 material = NO_MATERIAL;
+	std::vector<std::string> names;
+	std::map<std::string, u32> name_to_material;
+	std::vector<std::string> libraries;
+	for (Obj_Chunk& chunk : chunks)
+	{
+		if (!chunk.error.empty())
+		{
+			unmap_file(&view);
+			return fail(std::string(filepath) + ":" + std::to_string(line + chunk.error_line) + ": " + chunk.error);
+		}
+		line += chunk.line_count;
+		chunk.first_position = position_count;
+		chunk.first_texcoord = texcoord_count;
+		chunk.first_normal = normal_count;
+		position_count += (u32)chunk.positions.size();
+		texcoord_count += (u32)chunk.texcoords.size();
+		normal_count += (u32)chunk.normals.size();
+		for (std::string& library : chunk.material_libraries)
+		{
+			if (std::find(libraries.begin(), libraries.end(), library) == libraries.end())
+				libraries.push_back(std::move(library));
+		}
+
+		// Faces before the first usemtl get a default material with an empty name
+		bool faces_before_switch = !chunk.corners.empty()
+			&& (chunk.material_switches.empty() || chunk.material_switches[0].first > 0);
+		if (material == NO_MATERIAL && faces_before_switch)
+		{
+			material = (u32)names.size();
+			names.push_back("");
+			name_to_material[""] = material;
+		}
+		chunk.start_material = material;
+		for (const auto& [first_triangle, name] : chunk.material_switches)
+		{
+			auto it = name_to_material.find(name);
+			if (it == name_to_material.end())
+			{
+				it = name_to_material.emplace(name, (u32)names.size()).first;
+				names.push_back(name);
+			}
+			material = it->second;
+			chunk.switch_materials.push_back(material);
+		}
+	}
+
+	std::vector<glm::vec3> positions(position_count);
+	std::vector<glm::vec2> texcoords(texcoord_count);
+	std::vector<glm::vec3> normals(normal_count);
+	for (Obj_Chunk& chunk : chunks)
+	{
+		Obj_Chunk* c = &chunk;
+		g_job_system->push([=, &positions, &texcoords, &normals]()
+			{
+				std::copy(c->positions.begin(), c->positions.end(), positions.begin() + c->first_position);
+				std::copy(c->texcoords.begin(), c->texcoords.end(), texcoords.begin() + c->first_texcoord);
+				std::copy(c->normals.begin(), c->normals.end(), normals.begin() + c->first_normal);
+				c->positions = {};
+				c->texcoords = {};
+				c->normals = {};
+			}, &counter);
+	}
+	g_job_system->wait(&counter);
+	// Nothing points into the file past this point
+	unmap_file(&view);
+
+	for (Obj_Chunk& chunk : chunks)
+	{
+		Obj_Chunk* c = &chunk;
+		g_job_system->push([=]() { resolve_chunk(c, position_count, texcoord_count, normal_count); }, &counter);
+	}
+	g_job_system->wait(&counter);
+	bool missing_normals = false;
+	for (const Obj_Chunk& chunk : chunks)
+	{
+		if (!chunk.error.empty())
+			return fail(std::string(filepath) + ": " + chunk.error);
+		missing_normals = missing_normals || chunk.missing_normals;
+	}
+
+	// Area weighted sum of the face normals around each position, for corners without vn.
+	// Serial, faces of any chunk can share a position
+	std::vector<glm::vec3> smooth_normals;
+	if (missing_normals)
+	{
+		smooth_normals.resize(position_count, glm::vec3(0.0f));
+		for (const Obj_Chunk& chunk : chunks)
+		{
+			if (!chunk.missing_normals)
+				continue;
+			for (size_t i = 0; i < chunk.corners.size(); i += 3)
+			{
+				const Obj_Corner* c = &chunk.corners[i];
+				glm::vec3 face_normal = glm::cross(positions[c[1].v] - positions[c[0].v], positions[c[2].v] - positions[c[0].v]);
+				for (u32 k = 0; k < 3; ++k)
+				{
+					if (c[k].vn == NO_INDEX)
+						smooth_normals[c[k].v] += face_normal;
+				}
+			}
+		}
+		for (glm::vec3& n : smooth_normals)
+			n = glm::dot(n, n) > 0.0f ? glm::normalize(n) : glm::vec3(0.0f, 1.0f, 0.0f);
+	}
+
+	u32 material_count = (u32)names.size();
+	for (Obj_Chunk& chunk : chunks)
+	{
+		Obj_Chunk* c = &chunk;
+		g_job_system->push([=, &positions, &texcoords, &normals, &smooth_normals]()
+			{
+				index_chunk(c, material_count, positions, texcoords, normals, smooth_normals);
+				c->corners = {};
+			}, &counter);
+	}
+	g_job_system->wait(&counter);
+
+	// Concatenate the chunks into one primitive per material
+	struct Copy_Range
+	{
+		u32 first_vertex;
+		u32 first_index;
+	};
+	std::vector<Copy_Range> copy_ranges(chunks.size() * material_count);
+	Mesh mesh;
+	u32 vertex_count = 0, index_count = 0;
+	for (u32 m = 0; m < material_count; ++m)
+	{
+		Mesh_Primitive prim{};
+		prim.vertex_offset = index_count;
+		prim.material_id = m;
+		prim.model = glm::mat4(1.0f);
+		for (size_t i = 0; i < chunks.size(); ++i)
+		{
+			copy_ranges[i * material_count + m] = { vertex_count, index_count };
+			vertex_count += (u32)chunks[i].vertices[m].size();
+			index_count += (u32)chunks[i].indices[m].size();
+		}
+		prim.vertex_count = index_count - prim.vertex_offset;
+		if (prim.vertex_count != 0)
+			mesh.primitives.push_back(prim);
+	}
+	mesh.vertices.resize(vertex_count);
+	mesh.indices.resize(index_count);
+	for (size_t i = 0; i < chunks.size(); ++i)
+	{
+		Obj_Chunk* c = &chunks[i];
+		const Copy_Range* ranges = &copy_ranges[i * material_count];
+		Mesh* m = &mesh;
+		g_job_system->push([=]()
+			{
+				for (u32 mat = 0; mat < material_count; ++mat)
+				{
+					std::copy(c->vertices[mat].begin(), c->vertices[mat].end(), m->vertices.begin() + ranges[mat].first_vertex);
+					for (size_t j = 0; j < c->indices[mat].size(); ++j)
+						m->indices[ranges[mat].first_index + j] = ranges[mat].first_vertex + c->indices[mat][j];
+				}
+			}, &counter);
+		mesh.bbmin = glm::min(mesh.bbmin, c->bbmin);
+		mesh.bbmax = glm::max(mesh.bbmax, c->bbmax);
+	}
+	g_job_system->wait(&counter);
+	chunks.clear();
+
+	// Welds the duplicates at chunk boundaries and reorders for the vertex cache
+	Mesh_Optimization_Stats stats = optimize_mesh(&mesh);
+	LOG_DEBUG("%s: %u triangles, %u materials, %u -> %u vertices, ACMR %.3f -> %.3f\n", filepath, index_count / 3, material_count,
+		stats.vertex_count_before, stats.vertex_count_after, stats.acmr_before, stats.acmr_after);
+	generate_mesh_lods(&mesh);
+	build_mesh_meshlets(&mesh);
+
+	if (materials)
+	{
+		materials->clear();
+		for (std::string& name : names)
+			materials->push_back({ std::move(name) });
+		for (const std::string& library : libraries)
+			load_mtl_library(filepath, library, materials);
+	}
+	*out = std::move(mesh);
+	return true;
 }
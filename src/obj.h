@@ -1,7 +1,27 @@
 #pragma once
-
-#include "tiny_obj_loader.h"
+#include "defines.h"
+#include "material.h"
+#include <string>
+#include <vector>
 
 struct Mesh;
 
-Mesh load_obj_from_file(const char* filepath);
\ No newline at end of file
+struct Obj_Material
+{
+	std::string name; // usemtl name, empty for faces before the first usemtl
+	std::string base_color_texture; // map_Kd relative to the library, not loaded
+	Material material;
+};
+
+/*
+	Loads an OBJ file into an indexed mesh with one primitive per material (usemtl).
+	The file is memory mapped and split into chunks at line boundaries, which are parsed
+	and deduplicated in parallel on the job system, so multi-GB files never get copied
+	into one big string or expanded to a vertex per face corner.
+
+	Mesh_Primitive::material_id is an index into materials, read from the mtllib libraries.
+	Materials missing from them keep the defaults. The caller maps those to registered
+	materials. Returns false and fills in error (if given) on failure, out is left
+	untouched in that case.
+*/
+bool load_obj_from_file(const char* filepath, Mesh* out, std::vector<Obj_Material>* materials = nullptr, std::string* error = nullptr);
@@ -0,0 +1,207 @@
+#include "pack_file.h"
+#include "compression.h"
+#include "logging.h"
+#include <string.h>
+#include <algorithm>
+
+// Only compress if it saves at least this much, otherwise the entry can be used in place
+static constexpr double MIN_COMPRESSION_RATIO = 0.9;
+
+u64 hash_pack_path(const char* path)
+{
+	// FNV-1a
+	u64 hash = 14695981039346656037ull;
+	for (const char* c = path; *c; ++c)
+	{
+		hash ^= (u8)*c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+std::string normalize_pack_path(const char* path)
+{
+	std::string ret = path;
+	std::replace(ret.begin(), ret.end(), '\\', '/');
+	while (ret.compare(0, 2, "./") == 0)
+		ret.erase(0, 2);
+	return ret;
+}
+
+bool Pack_File::open(const char* filepath)
+{
+	if (!map_file(filepath, &view))
+		return false;
+
+	header = (const Pack_Header*)view.data;
+	u64 size = view.size;
+	// Written as subtractions so corrupt offsets can't overflow past the checks
+	bool valid = size >= sizeof(Pack_Header)
+		&& header->magic == PACK_MAGIC
+		&& header->version == PACK_VERSION
+		&& header->toc_offset <= size
+		&& header->entry_count <= (size - header->toc_offset) / sizeof(Pack_Entry)
+		&& header->string_table_offset <= size;
+	if (valid)
+	{
+		entries = (const Pack_Entry*)(view.data + header->toc_offset);
+		string_table = (const char*)(view.data + header->string_table_offset);
+		u64 string_table_size = size - header->string_table_offset;
+		for (u32 i = 0; i < header->entry_count && valid; ++i)
+		{
+			const Pack_Entry& e = entries[i];
+			bool compressed = (e.flags & PACK_ENTRY_COMPRESSED) != 0;
+			valid = e.offset <= size
+				&& e.stored_size <= size - e.offset
+				&& (compressed || e.size <= e.stored_size)
+				&& e.path_offset < string_table_size
+				&& memchr(string_table + e.path_offset, '\0', string_table_size - e.path_offset) != nullptr;
+		}
+	}
+	if (!valid)
+	{
+		LOG_DEBUG("Invalid pack file %s\n", filepath);
+		close();
+		return false;
+	}
+	return true;
+}
+
+void Pack_File::close()
+{
+	unmap_file(&view);
+	header = nullptr;
+	entries = nullptr;
+	string_table = nullptr;
+}
+
+const Pack_Entry* Pack_File::find(const char* path) const
+{
+	if (!header)
+		return nullptr;
+
+	std::string normalized = normalize_pack_path(path);
+	u64 hash = hash_pack_path(normalized.c_str());
+
+	const Pack_Entry* end = entries + header->entry_count;
+	const Pack_Entry* it = std::lower_bound(entries, end, hash, 
+		[](const Pack_Entry& e, u64 h) { return e.path_hash < h; });
+
+	// Check the path too in case of hash collisions
+	for (; it != end && it->path_hash == hash; ++it)
+	{
+		if (strcmp(get_path(it), normalized.c_str()) == 0)
+			return it;
+	}
+	return nullptr;
+}
+
+bool Pack_File::read(const Pack_Entry* entry, u8* dst) const
+{
+	const u8* src = get_stored_data(entry);
+	if (entry->flags & PACK_ENTRY_COMPRESSED)
+		return lz4_decompress(src, entry->stored_size, dst, entry->size);
+
+	memcpy(dst, src, entry->size);
+	return true;
+}
+
+static void write_padding(FILE* f, u64* offset, u32 alignment)
+{
+	static const u8 zeros[256] = {};
+	u64 aligned = (*offset + alignment - 1) / alignment * alignment;
+	while (*offset < aligned)
+	{
+		u64 n = std::min<u64>(aligned - *offset, sizeof(zeros));
+		fwrite(zeros, 1, n, f);
+		*offset += n;
+	}
+}
+
+bool build_pack(const char* output_path, const std::vector<std::string>& files, u32 alignment, Pack_Build_Stats* stats)
+{
+	assert(alignment != 0);
+	FILE* f = fopen(output_path, "wb");
+	if (!f)
+	{
+		LOG_DEBUG("Failed to open %s for writing\n", output_path);
+		return false;
+	}
+
+	Pack_Build_Stats s{};
+	std::vector<Pack_Entry> entries;
+	std::string string_table;
+
+	Pack_Header header{};
+	header.magic = PACK_MAGIC;
+	header.version = PACK_VERSION;
+	header.alignment = alignment;
+	fwrite(&header, sizeof(header), 1, f);
+	u64 offset = sizeof(header);
+
+	std::vector<u8> compressed;
+	for (const std::string& file : files)
+	{
+		File_View view;
+		if (!map_file(file.c_str(), &view))
+		{
+			LOG_DEBUG("Skipping %s, failed to open\n", file.c_str());
+			continue;
+		}
+
+		std::string path = normalize_pack_path(file.c_str());
+
+		Pack_Entry entry{};
+		entry.path_hash = hash_pack_path(path.c_str());
+		entry.size = view.size;
+		entry.path_offset = (u32)string_table.size();
+		string_table += path;
+		string_table += '\0';
+
+		compressed.resize(lz4_compress_bound(view.size));
+		size_t compressed_size = lz4_compress(view.data, view.size, compressed.data(), compressed.size());
+
+		write_padding(f, &offset, alignment);
+		entry.offset = offset;
+		if (compressed_size != 0 && (double)compressed_size < (double)view.size * MIN_COMPRESSION_RATIO)
+		{
+			entry.flags |= PACK_ENTRY_COMPRESSED;
+			entry.stored_size = compressed_size;
+			fwrite(compressed.data(), 1, compressed_size, f);
+			s.compressed_count++;
+		}
+		else
+		{
+			entry.stored_size = view.size;
+			fwrite(view.data, 1, view.size, f);
+		}
+		offset += entry.stored_size;
+
+		s.file_count++;
+		s.total_size += entry.size;
+		s.stored_size += entry.stored_size;
+
+		entries.push_back(entry);
+		unmap_file(&view);
+	}
+
+	std::sort(entries.begin(), entries.end(), [](const Pack_Entry& a, const Pack_Entry& b) { return a.path_hash < b.path_hash; });
+
+	write_padding(f, &offset, alignof(Pack_Entry));
+	header.entry_count = (u32)entries.size();
+	header.toc_offset = offset;
+	fwrite(entries.data(), sizeof(Pack_Entry), entries.size(), f);
+	offset += entries.size() * sizeof(Pack_Entry);
+
+	header.string_table_offset = offset;
+	fwrite(string_table.data(), 1, string_table.size(), f);
+
+	fseek(f, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, f);
+	fclose(f);
+
+	if (stats)
+		*stats = s;
+
+	return true;
+}
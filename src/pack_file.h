@@ -0,0 +1,80 @@
+#pragma once
+#include "defines.h"
+#include "file_system.h"
+#include <string>
+#include <vector>
+
+/*
+	Pack file layout:
+		Pack_Header
+		entry data, each entry starts at a multiple of Pack_Header::alignment
+		Pack_Entry[entry_count], sorted by path_hash
+		string table of null terminated entry paths
+
+	Paths are stored relative to the data root with forward slashes, e.g. "shaders/spirv/blur.comp.spv".
+	Entries are either stored as is, so they can be used straight from the mapped pack, or LZ4 
+	compressed if that saves enough space.
+*/
+
+constexpr u32 PACK_MAGIC = 0x4B415047; // "GPAK"
+constexpr u32 PACK_VERSION = 1;
+constexpr u32 PACK_DEFAULT_ALIGNMENT = 4096;
+
+enum Pack_Entry_Flags
+{
+	PACK_ENTRY_COMPRESSED = 1 << 0,
+};
+
+struct Pack_Header
+{
+	u32 magic;
+	u32 version;
+	u32 entry_count;
+	u32 alignment;
+	u64 toc_offset;
+	u64 string_table_offset;
+};
+
+struct Pack_Entry
+{
+	u64 path_hash;
+	u64 offset;
+	u64 stored_size;	// Size in the pack
+	u64 size;			// Uncompressed size
+	u32 path_offset;	// Into the string table
+	u32 flags;
+};
+
+u64 hash_pack_path(const char* path);
+std::string normalize_pack_path(const char* path);
+
+struct Pack_File
+{
+	File_View view;
+	const Pack_Header* header = nullptr;
+	const Pack_Entry* entries = nullptr;
+	const char* string_table = nullptr;
+
+	bool open(const char* filepath);
+	void close();
+
+	const Pack_Entry* find(const char* path) const;
+	const char* get_path(const Pack_Entry* entry) const { return string_table + entry->path_offset; }
+
+	// Points straight into the mapping, only valid for uncompressed entries
+	const u8* get_stored_data(const Pack_Entry* entry) const { return view.data + entry->offset; }
+
+	// Decompresses if needed, dst must hold entry->size bytes
+	bool read(const Pack_Entry* entry, u8* dst) const;
+};
+
+struct Pack_Build_Stats
+{
+	u32 file_count;
+	u32 compressed_count;
+	u64 total_size;
+	u64 stored_size;
+};
+
+// Packs the given files, paths are stored as given (relative to the data root)
+bool build_pack(const char* output_path, const std::vector<std::string>& files, u32 alignment = PACK_DEFAULT_ALIGNMENT, Pack_Build_Stats* stats = nullptr);
@@ -1,6 +1,8 @@
 #include "r_mesh.h"
 #include "ecs.h"
 #include "resource_manager.h"
+#include "jobs.h"
+#include "logging.h"
 
 void merge_meshes(u32 num_meshes, Mesh* meshes, Mesh* out)
 {
@@ -14,11 +16,24 @@ void merge_meshes(u32 num_meshes, Mesh* meshes, Mesh* out)
 		out->vertices.insert(out->vertices.end(), meshes[i].vertices.begin(), meshes[i].vertices.end());
 		for (u32 j = 0; j < index_count; ++j)
 			out->indices.push_back(start_index + meshes[i].indices[j]);
-		Mesh_Primitive prim{};
-		prim.vertex_offset = index_offset;
-		prim.vertex_count = index_count;
 		assert(meshes[i].primitives.size() == 1);
+		// The index buffer also holds the LODs, the primitive only covers LOD 0
+		Mesh_Primitive prim{};
+		prim.vertex_offset = meshes[i].primitives[0].vertex_offset + index_offset;
+		prim.vertex_count = meshes[i].primitives[0].vertex_count;
 		prim.material_id = meshes[i].primitives[0].material_id;
+		prim.bounding_sphere = meshes[i].primitives[0].bounding_sphere;
+		for (Mesh_Lod lod : meshes[i].primitives[0].lods)
+		{
+			lod.vertex_offset += index_offset;
+			prim.lods.push_back(lod);
+		}
+		for (Meshlet meshlet : meshes[i].meshlets)
+		{
+			meshlet.first_index += index_offset;
+			meshlet.primitive_index = (u32)out->primitives.size();
+			out->meshlets.push_back(meshlet);
+		}
 		out->primitives.push_back(prim);
 		out->bbmax = glm::max(out->bbmax, meshes[i].bbmax);
 		out->bbmin = glm::min(out->bbmin, meshes[i].bbmin);
@@ -250,7 +265,215 @@ uint32_t Mesh::get_vertex_count()
 
 uint32_t Mesh::get_vertex_size()
 {
-	return (uint32_t)(sizeof(vertices[0]));
+	return geometry.index_count != 0 ? (uint32_t)sizeof(Packed_Vertex) : (uint32_t)sizeof(vertices[0]);
+}
+
+Mesh_Optimization_Stats optimize_mesh(Mesh* mesh, u32 cache_size)
+{
+	std::vector<Index_Range> ranges;
+	for (const Mesh_Primitive& prim : mesh->primitives)
+		ranges.push_back({ prim.vertex_offset, prim.vertex_count });
+
+	Mesh_Optimization_Stats stats = optimize_indexed_mesh(mesh->vertices.data(), (u32)mesh->vertices.size(), sizeof(Vertex),
+		mesh->indices.data(), (u32)mesh->indices.size(), ranges.data(), (u32)ranges.size(), cache_size);
+	mesh->vertices.resize(stats.vertex_count_after);
+	return stats;
+}
+
+// Each LOD aims for half the triangles of the previous one and is dropped if it can't get below this
+static constexpr float LOD_REDUCTION = 0.5f;
+static constexpr float MIN_LOD_REDUCTION = 0.85f;
+static constexpr u32 MIN_LOD_TRIANGLES = 32;
+// Relative to the primitive's extent, past this the shape falls apart and more LODs aren't worth it
+static constexpr float MAX_LOD_ERROR = 0.05f;
+
+void generate_mesh_lods(Mesh* mesh, u32 max_lods)
+{
+	generate_mesh_lods(1, mesh, max_lods);
+}
+
+void generate_mesh_lods(u32 mesh_count, Mesh* meshes, u32 max_lods)
+{
+	struct Primitive_Lods
+	{
+		Mesh* mesh;
+		Mesh_Primitive* prim;
+		std::vector<std::vector<u32>> indices;
+		std::vector<float> errors;
+	};
+
+	// One job per primitive of every mesh, instanced scenes are mostly single primitive meshes
+	std::vector<Primitive_Lods> results;
+	for (u32 m = 0; m < mesh_count; ++m)
+		for (Mesh_Primitive& prim : meshes[m].primitives)
+			results.push_back({ &meshes[m], &prim });
+
+	std::atomic<u32> counter = 0;
+	for (Primitive_Lods& r : results)
+	{
+		Mesh* mesh = r.mesh;
+		Mesh_Primitive* prim = r.prim;
+		Primitive_Lods* result = &r;
+		g_job_system->push([=]()
+			{
+				const u32* source = mesh->indices.data() + prim->vertex_offset;
+				u32 index_count = prim->vertex_count;
+
+				glm::vec3 bbmin = glm::vec3(INFINITY);
+				glm::vec3 bbmax = glm::vec3(-INFINITY);
+				for (u32 i = 0; i < index_count; ++i)
+				{
+					bbmin = glm::min(bbmin, mesh->vertices[source[i]].pos);
+					bbmax = glm::max(bbmax, mesh->vertices[source[i]].pos);
+				}
+				if (index_count == 0)
+					return;
+				glm::vec3 center = (bbmin + bbmax) * 0.5f;
+				float radius = 0.0f;
+				for (u32 i = 0; i < index_count; ++i)
+					radius = std::max(radius, glm::length(mesh->vertices[source[i]].pos - center));
+				prim->bounding_sphere = glm::vec4(center, radius);
+				glm::vec3 size = bbmax - bbmin;
+				float extent = std::max(std::max(size.x, size.y), size.z);
+
+				// Every level is simplified from the previous one, so errors add up
+				std::vector<u32> current(source, source + index_count);
+				float error = 0.0f;
+				for (u32 level = 0; level < max_lods; ++level)
+				{
+					u32 target = (u32)(current.size() / 3 * LOD_REDUCTION) * 3;
+					if (target < MIN_LOD_TRIANGLES * 3)
+						break;
+
+					std::vector<u32> simplified(current.size());
+					float level_error = 0.0f;
+					u32 count = simplify_mesh(simplified.data(), current.data(), (u32)current.size(), mesh->vertices.data(), sizeof(Vertex),
+						target, MAX_LOD_ERROR, &level_error);
+					if (count > current.size() * MIN_LOD_REDUCTION)
+						break;
+
+					simplified.resize(count);
+					current = simplified;
+					optimize_vertex_cache(simplified.data(), current.data(), count);
+					error += level_error * extent;
+					result->indices.push_back(std::move(simplified));
+					result->errors.push_back(error);
+				}
+			}, &counter);
+	}
+	g_job_system->wait(&counter);
+
+	u32 lod_triangles[MAX_MESH_LODS + 1] = {};
+	for (Primitive_Lods& r : results)
+	{
+		Mesh* mesh = r.mesh;
+		Mesh_Primitive& prim = *r.prim;
+		prim.lods.clear();
+		lod_triangles[0] += prim.vertex_count / 3;
+		for (size_t l = 0; l < r.indices.size(); ++l)
+		{
+			Mesh_Lod lod;
+			lod.vertex_offset = (u32)mesh->indices.size();
+			lod.vertex_count = (u32)r.indices[l].size();
+			lod.error = r.errors[l];
+			mesh->indices.insert(mesh->indices.end(), r.indices[l].begin(), r.indices[l].end());
+			prim.lods.push_back(lod);
+			lod_triangles[std::min((u32)l + 1, MAX_MESH_LODS)] += lod.vertex_count / 3;
+		}
+	}
+	std::string counts;
+	for (u32 l = 0; l <= max_lods && l <= MAX_MESH_LODS; ++l)
+		counts += (l ? " / " : "") + std::to_string(lod_triangles[l]);
+	LOG_DEBUG("Mesh LOD triangles: %s\n", counts.c_str());
+}
+
+void build_mesh_meshlets(Mesh* mesh)
+{
+	build_mesh_meshlets(1, mesh);
+}
+
+void build_mesh_meshlets(u32 mesh_count, Mesh* meshes)
+{
+	// Every LOD of every primitive is clustered on its own, the triangles stay within their range
+	struct Meshlet_Job
+	{
+		Mesh* mesh;
+		u32 primitive;
+		u32 lod;
+		std::vector<Meshlet> meshlets;
+	};
+	std::vector<Meshlet_Job> jobs;
+	u32 primitive_count = 0;
+	for (u32 m = 0; m < mesh_count; ++m)
+	{
+		Mesh* mesh = &meshes[m];
+		for (u32 p = 0; p < (u32)mesh->primitives.size(); ++p)
+			for (u32 l = 0; l <= (u32)mesh->primitives[p].lods.size(); ++l)
+				jobs.push_back({ mesh, p, l });
+		primitive_count += (u32)mesh->primitives.size();
+	}
+
+	std::atomic<u32> counter = 0;
+	for (Meshlet_Job& job : jobs)
+	{
+		Meshlet_Job* j = &job;
+		g_job_system->push([=]()
+			{
+				Mesh* mesh = j->mesh;
+				Mesh_Lod range = get_primitive_lod(mesh->primitives[j->primitive], j->lod);
+				u32* indices = mesh->indices.data() + range.vertex_offset;
+				std::vector<u32> source(indices, indices + range.vertex_count);
+				std::vector<Index_Range> ranges(range.vertex_count / 3);
+				u32 count = build_meshlets(indices, ranges.data(), source.data(), range.vertex_count, mesh->vertices.data(), sizeof(Vertex));
+
+				j->meshlets.resize(count);
+				for (u32 i = 0; i < count; ++i)
+				{
+					Meshlet_Bounds bounds = compute_meshlet_bounds(indices + ranges[i].offset, ranges[i].count, mesh->vertices.data(), sizeof(Vertex));
+					Meshlet& m = j->meshlets[i];
+					m.bounding_sphere = glm::vec4(bounds.center, bounds.radius);
+					m.cone = glm::vec4(bounds.cone_axis, bounds.cone_cutoff);
+					m.first_index = range.vertex_offset + ranges[i].offset;
+					m.index_count = ranges[i].count;
+					m.primitive_index = j->primitive;
+					m.lod = j->lod;
+				}
+			}, &counter);
+	}
+	g_job_system->wait(&counter);
+
+	u32 meshlet_count = 0;
+	for (u32 m = 0; m < mesh_count; ++m)
+		meshes[m].meshlets.clear();
+	for (const Meshlet_Job& job : jobs)
+	{
+		job.mesh->meshlets.insert(job.mesh->meshlets.end(), job.meshlets.begin(), job.meshlets.end());
+		meshlet_count += (u32)job.meshlets.size();
+	}
+	LOG_DEBUG("Meshlets: %u for %u primitives\n", meshlet_count, primitive_count);
+}
+
+Mesh_Lod get_primitive_lod(const Mesh_Primitive& prim, u32 lod)
+{
+	if (lod == 0 || prim.lods.empty())
+		return { prim.vertex_offset, prim.vertex_count, 0.0f };
+	return prim.lods[std::min(lod, (u32)prim.lods.size()) - 1];
+}
+
+Packed_Vertex pack_vertex(const Vertex& v)
+{
+	Packed_Vertex p;
+	p.pos = v.pos;
+	p.normal = pack_normal(v.normal);
+	p.tangent = pack_tangent(v.tangent);
+	p.texcoord = glm::packHalf2x16(v.texcoord);
+	return p;
+}
+
+void pack_vertices(u32 count, const Vertex* vertices, Packed_Vertex* out)
+{
+	for (u32 i = 0; i < count; ++i)
+		out[i] = pack_vertex(vertices[i]);
 }
 
 uint32_t Mesh::get_primitive_count()
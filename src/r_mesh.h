@@ -1,6 +1,9 @@
 #pragma once
 #include "defines.h"
 #include "r_vulkan.h"
+#include "geometry_pool.h"
+#include "mesh_optimizer.h"
+#include "../shared/shared.h"
 
 struct Vertex
 {
@@ -29,6 +32,16 @@ struct Acceleration_Structure
 	VkDeviceAddress tlas_instances_address;
 };
 
+constexpr u32 MAX_MESH_LODS = 4; // Not counting the full detail primitive
+
+// Simplified version of a primitive, indexes the same vertices
+struct Mesh_Lod
+{
+	u32 vertex_offset; // First index in Mesh::indices, like Mesh_Primitive
+	u32 vertex_count; // Index count
+	float error; // Geometric error in mesh units
+};
+
 struct Mesh_Primitive
 {
 	u32 vertex_offset;
@@ -36,6 +49,8 @@ struct Mesh_Primitive
 	u32 material_id;
 	std::optional<Acceleration_Structure> acceleration_structure;
 	glm::mat4 model;
+	std::vector<Mesh_Lod> lods; // Progressively coarser, lods[0] is LOD 1
+	glm::vec4 bounding_sphere = glm::vec4(0.0f); // xyz center, w radius. Filled in by generate_mesh_lods
 };
 
 struct Mesh
@@ -43,20 +58,25 @@ struct Mesh
 	std::vector<Vertex> vertices;
 	std::vector<uint32_t> indices;
 	std::vector<Mesh_Primitive> primitives;
+	std::vector<Meshlet> meshlets; // For every LOD of every primitive, see build_mesh_meshlets
 	glm::vec3 bbmin = glm::vec3(INFINITY);
 	glm::vec3 bbmax = glm::vec3(-INFINITY);
 	
+	// Own buffers, only for meshes outside the renderer's geometry pool (e.g. debug meshes)
 	Vk_Allocated_Buffer vertex_buffer;
 	Vk_Allocated_Buffer index_buffer;
+	// Address of the first vertex / index, either in the own buffers or in the geometry pool
 	VkDeviceAddress vertex_buffer_address;
 	VkDeviceAddress index_buffer_address;
-	
-	GPU_Buffer instance_data_buffer;
+
+	Geometry_Allocation geometry; // index_count is 0 until the mesh is in the geometry pool
+	u32 first_primitive = 0; // Index of primitives[0] in the renderer's primitive info buffer
+	u32 first_meshlet = 0; // Index of meshlets[0] in the renderer's meshlet buffer
 
 	uint32_t get_vertex_buffer_size();
 	uint32_t get_index_buffer_size();
 	uint32_t get_vertex_count();
-	uint32_t get_vertex_size();
+	uint32_t get_vertex_size(); // Stride of the buffer the mesh lives in, Packed_Vertex once it's in the geometry pool
 	uint32_t get_primitive_count();
 
 	void get_acceleration_structure_build_info(
@@ -73,6 +93,18 @@ struct Geometry
 };
 
 void merge_meshes(u32 num_meshes, Mesh* meshes, Mesh* out);
+// Welds duplicate vertices, reorders each primitive's triangles for the vertex cache and the vertices for fetch locality
+Mesh_Optimization_Stats optimize_mesh(Mesh* mesh, u32 cache_size = DEFAULT_VERTEX_CACHE_SIZE);
+// Appends up to max_lods simplified index ranges per primitive to mesh->indices, run after optimize_mesh
+void generate_mesh_lods(Mesh* mesh, u32 max_lods = MAX_MESH_LODS);
+void generate_mesh_lods(u32 mesh_count, Mesh* meshes, u32 max_lods = MAX_MESH_LODS);
+// Reorders the triangles of every primitive and LOD into meshlets and fills in mesh->meshlets, run after generate_mesh_lods
+void build_mesh_meshlets(Mesh* mesh);
+void build_mesh_meshlets(u32 mesh_count, Mesh* meshes);
+// LOD 0 is the primitive itself, levels past the last LOD clamp to it
+Mesh_Lod get_primitive_lod(const Mesh_Primitive& prim, u32 lod);
+Packed_Vertex pack_vertex(const Vertex& v);
+void pack_vertices(u32 count, const Vertex* vertices, Packed_Vertex* out);
 
 struct ECS;
 
@@ -1,5 +1,6 @@
 #include "r_vulkan.h"
 #include "common.h"
+#include "file_system.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb/stb_image.h"
 #include "vk_helpers.h"
@@ -7,8 +8,11 @@
 #include "imgui/imgui.h"
 #include "imgui/imgui_impl_sdl2.h"
 #include "imgui/imgui_impl_vulkan.h"
+#include <string>
+#include <algorithm>
 
 #define VSYNC 1
+#define PIPELINE_CACHE_PATH "pipeline_cache.bin"
 //#define VALIDATION_VERBOSE
 
 static VKAPI_ATTR VkBool32 VKAPI_CALL debug_callback(
@@ -34,8 +38,10 @@ Vk_Context::Vk_Context(Platform* platform)
 
 	create_instance(&platform->window);
 	find_physical_device();
+	create_pipeline_cache(PIPELINE_CACHE_PATH);
 	create_command_pool();
 	init_mem_allocator();
+	upload_ring.init(this, UPLOAD_RING_FRAME_SIZE);
 	create_swapchain(platform);
 	create_sync_objects();
 }
@@ -256,21 +262,24 @@ void Vk_Context::find_physical_device()
 	int i = 0;
 	for (const auto& fam : fam_props)
 	{
-		if (fam.queueFlags & VK_QUEUE_GRAPHICS_BIT)
+		if ((fam.queueFlags & VK_QUEUE_GRAPHICS_BIT) && queue_indices.graphics_idx == -1)
 			queue_indices.graphics_idx = i;
-		if (fam.queueFlags & VK_QUEUE_COMPUTE_BIT)
+		// A family without graphics runs the renderer's async compute work. It writes timestamps there too
+		if ((fam.queueFlags & VK_QUEUE_COMPUTE_BIT) && !(fam.queueFlags & VK_QUEUE_GRAPHICS_BIT) && fam.timestampValidBits != 0
+			&& queue_indices.compute_idx == -1)
 			queue_indices.compute_idx = i;
-		if (fam.queueFlags & VK_QUEUE_TRANSFER_BIT)
+		if ((fam.queueFlags & VK_QUEUE_TRANSFER_BIT) && queue_indices.transfer_idx == -1)
 			queue_indices.transfer_idx = i;
-
-		if (queue_indices.compute_idx != -1 && queue_indices.graphics_idx != -1 && queue_indices.transfer_idx != -1)
-			break;
 		++i;
 	}
+	if (queue_indices.compute_idx == -1)
+		queue_indices.compute_idx = queue_indices.graphics_idx;
 
 	graphics_idx = queue_indices.graphics_idx;
 	compute_idx = queue_indices.compute_idx;
 	transfer_idx = queue_indices.transfer_idx;
+	shared_queue_families[0] = (u32)graphics_idx;
+	shared_queue_families[1] = (u32)compute_idx;
 
 	constexpr u32 queue_count = 2; // 1 primary, 1 async;
 	std::array<float, 2> queue_prio = { 1.f, 1.f };
@@ -278,13 +287,17 @@ void Vk_Context::find_physical_device()
 	queue_info.queueCount = (u32)queue_prio.size();
 	queue_info.pQueuePriorities = queue_prio.data();
 
+	std::array<VkDeviceQueueCreateInfo, 2> queue_infos = { queue_info, queue_info };
+	queue_infos[1].queueFamilyIndex = queue_indices.compute_idx;
+	queue_infos[1].queueCount = 1;
+
 	VkDeviceCreateInfo device_create_info{ VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO };
 	device_create_info.enabledExtensionCount = (uint32_t)preferred_extensions.size();
 	device_create_info.ppEnabledExtensionNames = preferred_extensions.data();
 	device_create_info.pEnabledFeatures = nullptr;
 	device_create_info.pNext = &features2;
-	device_create_info.queueCreateInfoCount = 1;
-	device_create_info.pQueueCreateInfos = &queue_info;
+	device_create_info.queueCreateInfoCount = has_async_compute() ? 2 : 1;
+	device_create_info.pQueueCreateInfos = queue_infos.data();
 	VK_CHECK(vkCreateDevice(physical_device, &device_create_info, nullptr, &dev));
 	g_garbage_collector->push([dev]()
 		{
@@ -300,6 +313,74 @@ void Vk_Context::find_physical_device()
 
 	vkGetDeviceQueue(device, graphics_idx, 0, &graphics_queue);
 	vkGetDeviceQueue(device, graphics_idx, 1, &async_upload.upload_queue);
+	if (has_async_compute())
+		vkGetDeviceQueue(device, compute_idx, 0, &compute_queue);
+	LOG_DEBUG("Async compute: %s\n", has_async_compute() ? "dedicated compute family" : "not available");
+}
+
+void Vk_Context::create_pipeline_cache(const char* filepath)
+{
+	std::vector<u8> blob;
+	File_View view;
+	if (map_file(filepath, &view))
+	{
+		blob.assign(view.data, view.data + view.size);
+		unmap_file(&view);
+	}
+
+	// The driver should reject incompatible data on its own, but not all of them do. The blob
+	// is keyed by vendor, device and pipeline cache UUID, which changes with driver updates
+	if (!blob.empty())
+	{
+		const VkPhysicalDeviceProperties& props = physical_device_properties.properties;
+		VkPipelineCacheHeaderVersionOne header{};
+		bool valid = blob.size() >= sizeof(header);
+		if (valid)
+		{
+			memcpy(&header, blob.data(), sizeof(header));
+			valid = header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+				&& header.vendorID == props.vendorID
+				&& header.deviceID == props.deviceID
+				&& memcmp(header.pipelineCacheUUID, props.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+		}
+		if (!valid)
+		{
+			LOG_DEBUG("Pipeline cache %s doesn't match the current driver, discarding\n", filepath);
+			blob.clear();
+		}
+	}
+
+	VkPipelineCacheCreateInfo cinfo{ VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+	cinfo.initialDataSize = blob.size();
+	cinfo.pInitialData = blob.empty() ? nullptr : blob.data();
+	VK_CHECK(vkCreatePipelineCache(device, &cinfo, nullptr, &pipeline_cache));
+	pipeline_cache_warm = !blob.empty();
+
+	LOG_DEBUG("Pipeline cache: %s (%zu bytes)\n", pipeline_cache_warm ? "warm" : "cold", blob.size());
+
+	std::string path = filepath;
+	g_garbage_collector->push([=]()
+		{
+			save_pipeline_cache(path.c_str());
+			vkDestroyPipelineCache(device, pipeline_cache, nullptr);
+		}, Garbage_Collector::SHUTDOWN);
+}
+
+void Vk_Context::save_pipeline_cache(const char* filepath)
+{
+	size_t size = 0;
+	VK_CHECK(vkGetPipelineCacheData(device, pipeline_cache, &size, nullptr));
+	std::vector<u8> blob(size);
+	VK_CHECK(vkGetPipelineCacheData(device, pipeline_cache, &size, blob.data()));
+
+	FILE* f = fopen(resolve_path(filepath).c_str(), "wb");
+	if (!f)
+	{
+		LOG_DEBUG("Failed to write pipeline cache %s\n", filepath);
+		return;
+	}
+	fwrite(blob.data(), 1, size, f);
+	fclose(f);
 }
 
 void Vk_Context::init_mem_allocator()
@@ -349,6 +430,40 @@ void Vk_Context::create_command_pool()
 	{
 		frame_objects[i].cmd = per_frame_cmd[i];
 	}
+
+	VK_CHECK(vkAllocateCommandBuffers(device, &cmd_alloc_info, per_frame_cmd.data()));
+	for (int i = 0; i < FRAMES_IN_FLIGHT; ++i)
+		frame_objects[i].present_cmd = per_frame_cmd[i];
+
+	auto create_pass_command_buffers = [&](u32 queue_family, VkCommandPool* pools, VkCommandBuffer* cmds)
+	{
+		VkCommandPoolCreateInfo pass_pool_info{ VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
+		pass_pool_info.queueFamilyIndex = queue_family;
+		pass_pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+		for (int i = 0; i < MAX_PASS_COMMAND_BUFFERS; ++i)
+		{
+			VK_CHECK(vkCreateCommandPool(device, &pass_pool_info, nullptr, &pools[i]));
+			VkCommandPool pool = pools[i];
+			g_garbage_collector->push([=]()
+				{
+					vkDestroyCommandPool(device, pool, nullptr);
+				},
+				Garbage_Collector::SHUTDOWN);
+
+			VkCommandBufferAllocateInfo pass_alloc_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+			pass_alloc_info.commandPool = pool;
+			pass_alloc_info.commandBufferCount = 1;
+			pass_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+			VK_CHECK(vkAllocateCommandBuffers(device, &pass_alloc_info, &cmds[i]));
+		}
+	};
+
+	for (int i = 0; i < FRAMES_IN_FLIGHT; ++i)
+	{
+		create_pass_command_buffers(graphics_idx, frame_objects[i].pass_command_pools, frame_objects[i].pass_cmds);
+		if (has_async_compute())
+			create_pass_command_buffers(compute_idx, frame_objects[i].compute_pass_command_pools, frame_objects[i].compute_pass_cmds);
+	}
 }
 
 static VkSurfaceFormatKHR get_surface_format(const std::vector<VkSurfaceFormatKHR>& formats)
@@ -485,6 +600,14 @@ void Vk_Context::create_sync_objects()
 	}
 
 
+	graphics_timeline_sem = create_semaphore(true);
+	compute_timeline_sem = create_semaphore(true);
+	g_garbage_collector->push([=]()
+		{
+			vkDestroySemaphore(device, graphics_timeline_sem, nullptr);
+			vkDestroySemaphore(device, compute_timeline_sem, nullptr);
+		}, Garbage_Collector::SHUTDOWN);
+
 	async_upload.timeline_sem = create_semaphore(true);
 	async_upload.timeline_semaphore_value = 0;
 	g_garbage_collector->push([=]()
@@ -493,11 +616,12 @@ void Vk_Context::create_sync_objects()
 		}, Garbage_Collector::SHUTDOWN);
 }
 
-Vk_Allocated_Buffer Vk_Context::allocate_buffer(uint32_t size, VkBufferUsageFlags usage, VmaMemoryUsage memory_usage, VmaAllocationCreateFlags flags, u64 alignment)
+Vk_Allocated_Buffer Vk_Context::allocate_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VmaMemoryUsage memory_usage, VmaAllocationCreateFlags flags, u64 alignment)
 {
 	VkBufferCreateInfo buffer_info{ VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
 	buffer_info.size = size;
 	buffer_info.usage = usage;
+	set_concurrent_sharing(&buffer_info);
 
 	VmaAllocationCreateInfo alloc_info = {};
 	alloc_info.usage = memory_usage;
@@ -514,7 +638,7 @@ Vk_Allocated_Buffer Vk_Context::allocate_buffer(uint32_t size, VkBufferUsageFlag
 	return buffer;
 }
 
-Vk_Allocated_Image Vk_Context::allocate_image(VkExtent3D extent, VkFormat format, VkImageUsageFlags usage, VkImageAspectFlags aspect, VkImageTiling tiling, int mip_levels, VkImageCreateFlags flags, int layers)
+Vk_Allocated_Image Vk_Context::allocate_image(VkExtent3D extent, VkFormat format, VkImageUsageFlags usage, VkImageAspectFlags aspect, VkImageTiling tiling, int mip_levels, VkImageCreateFlags flags, int layers, bool exclusive)
 {
 	VkImageCreateInfo cinfo{ VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
 	cinfo.arrayLayers = layers;
@@ -527,6 +651,8 @@ Vk_Allocated_Image Vk_Context::allocate_image(VkExtent3D extent, VkFormat format
 	cinfo.usage = usage;
 	cinfo.tiling = tiling;
 	cinfo.flags = flags;
+	if (!exclusive)
+		set_concurrent_sharing(&cinfo);
 
 	VmaAllocationCreateInfo allocinfo{};
 	allocinfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
@@ -537,11 +663,13 @@ Vk_Allocated_Image Vk_Context::allocate_image(VkExtent3D extent, VkFormat format
 	VkImageViewCreateInfo view_info{ VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO };
 	view_info.format = cinfo.format;
 	view_info.image = img.image;
-	view_info.viewType = extent.depth == 1 ? VK_IMAGE_VIEW_TYPE_2D : VK_IMAGE_VIEW_TYPE_3D;
+	// Cubemaps create their own views
+	bool array_view = layers > 1 && !(flags & VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT);
+	view_info.viewType = extent.depth == 1 ? (array_view ? VK_IMAGE_VIEW_TYPE_2D_ARRAY : VK_IMAGE_VIEW_TYPE_2D) : VK_IMAGE_VIEW_TYPE_3D;
 	view_info.subresourceRange.baseMipLevel = 0;
 	view_info.subresourceRange.levelCount = mip_levels;
 	view_info.subresourceRange.baseArrayLayer = 0;
-	view_info.subresourceRange.layerCount = 1;
+	view_info.subresourceRange.layerCount = array_view ? layers : 1;
 	view_info.subresourceRange.aspectMask = aspect;
 	VK_CHECK(vkCreateImageView(device, &view_info, nullptr, &img.image_view));
 
@@ -556,11 +684,11 @@ Vk_Allocated_Image Vk_Context::allocate_image(VkExtent3D extent, VkFormat format
 
 Vk_Allocated_Buffer Vk_Context::create_buffer(VkCommandBuffer cmd, size_t size, void* data, VkBufferUsageFlags usage)
 {
-	Vk_Allocated_Buffer buf = allocate_buffer((u32)size, usage,
+	Vk_Allocated_Buffer buf = allocate_buffer(size, usage,
 		VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, 0);
 
 	Vk_Allocated_Buffer tmp_staging_buffer = allocate_buffer(
-		(u32)size,
+		size,
 		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
 		VMA_MEMORY_USAGE_AUTO, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT, 0);
 
@@ -588,21 +716,18 @@ VkDeviceAddress Vk_Context::get_buffer_device_address(const Vk_Allocated_Buffer&
 
 VkShaderModule Vk_Context::create_shader_module_from_file(const char* filepath)
 {
-	// FIXME: This should go through some kind of filesystem
-	uint8_t* data;
-	uint32_t bytes_read = read_entire_file(filepath, &data);
-	assert(bytes_read != 0);
-	const size_t spirv_size = bytes_read;
-	const uint32_t* spirv_data = (uint32_t*)data;
+	File_View view;
+	bool success = map_file(filepath, &view);
+	assert(success);
 
 	VkShaderModuleCreateInfo create_info{ VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
-	create_info.codeSize = spirv_size;
-	create_info.pCode = spirv_data;
+	create_info.codeSize = view.size;
+	create_info.pCode = (const uint32_t*)view.data;
 
 	VkShaderModule sm;
 	VK_CHECK(vkCreateShaderModule(device, &create_info, nullptr, &sm));
 
-	free(data);
+	unmap_file(&view);
 
 	return sm;
 }
@@ -720,8 +845,6 @@ GPU_Buffer Vk_Context::create_gpu_buffer(u32 size, VkBufferUsageFlags usage_flag
 
 	buffer.size = (size_t)size;
 	buffer.gpu_buffer = allocate_buffer(size, usage_flags | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_AUTO, 0, alignment);
-	for (int i = 0; i < FRAMES_IN_FLIGHT; ++i)
-		buffer.staging_buffer[i] = allocate_buffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_AUTO, VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT, alignment);
 
 	return buffer;
 }
@@ -818,7 +941,7 @@ Vk_Pipeline Vk_Context::create_compute_pipeline(const char* shaderpath, VkDescri
 	cinfo.stage = shader_stage_cinfo;
 
 	VkPipeline pipeline;
-	vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &cinfo, nullptr, &pipeline);
+	vkCreateComputePipelines(device, pipeline_cache, 1, &cinfo, nullptr, &pipeline);
 
 	Vk_Pipeline pp{};
 	pp.desc_sets = { set_layout };
@@ -879,9 +1002,14 @@ VkDescriptorSetLayout Vk_Context::create_layout_from_spirv(u8* bytecode, u32 siz
 Vk_Allocated_Image Vk_Context::load_texture_hdri(const char* filepath, VkImageUsageFlags usage)
 {
 	constexpr int required_n_comps = 4;
+	File_View view;
+	bool mapped_file = map_file(filepath, &view);
+	assert(mapped_file);
+
 	stbi_set_flip_vertically_on_load(1);
 	int x, y, comp;
-	float* data = stbi_loadf(filepath, &x, &y, &comp, required_n_comps);
+	float* data = stbi_loadf_from_memory(view.data, (int)view.size, &x, &y, &comp, required_n_comps);
+	unmap_file(&view);
 
 	u32 required_size = (x * y * required_n_comps) * sizeof(float);
 	Vk_Allocated_Image img = allocate_image(
@@ -1034,7 +1162,7 @@ Raytracing_Pipeline Vk_Context::create_raytracing_pipeline(
 	VK_CHECK(vkCreateRayTracingPipelinesKHR(
 		device,
 		VK_NULL_HANDLE,
-		VK_NULL_HANDLE,
+		pipeline_cache,
 		1, &rtpci,
 		nullptr,
 		&rt_pipeline));
@@ -1183,7 +1311,7 @@ Vk_Pipeline Vk_Context::create_raster_pipeline(VkShaderModule vertex_shader, VkS
 	pipeline_create_info.pDynamicState = &dynamic_state;
 	pipeline_create_info.layout = layout;
 
-	vkCreateGraphicsPipelines(device, 0, 1, &pipeline_create_info, nullptr, &pp.pipeline);
+	vkCreateGraphicsPipelines(device, pipeline_cache, 1, &pipeline_create_info, nullptr, &pp.pipeline);
 
 	return pp;
 }
@@ -1351,13 +1479,86 @@ Vk_Pipeline Vk_Context::create_raster_pipeline(const char* vertex_shader, const
 	return pipeline;
 }
 
+Vk_Allocated_Image Vk_Context::create_texture_array(VkExtent2D extent, u32 layer_count, VkFormat format, const u8* data, size_t data_size)
+{
+	Vk_Allocated_Image img = allocate_image(
+		{ extent.width, extent.height, 1 },
+		format,
+		VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+		VK_IMAGE_ASPECT_COLOR_BIT,
+		VK_IMAGE_TILING_OPTIMAL,
+		1, 0, (int)layer_count
+	);
+
+	Vk_Allocated_Buffer staging_buffer = allocate_buffer(
+		(u32)data_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_AUTO, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+
+	void* mapped;
+	vmaMapMemory(allocator, staging_buffer.allocation, &mapped);
+	memcpy(mapped, data, data_size);
+	vmaUnmapMemory(allocator, staging_buffer.allocation);
+
+	VkCommandBuffer cmd = allocate_command_buffer();
+	VkCommandBufferBeginInfo begin_info{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+	begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	vkBeginCommandBuffer(cmd, &begin_info);
+
+	VkImageMemoryBarrier barrier{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+	barrier.image = img.image;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, layer_count };
+	barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+	// Layers are tightly packed one after another so one region covers all of them
+	VkBufferImageCopy region{};
+	region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, layer_count };
+	region.imageExtent = { extent.width, extent.height, 1 };
+	vkCmdCopyBufferToImage(cmd, staging_buffer.buffer, img.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+		0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+	vkEndCommandBuffer(cmd);
+
+	VkSubmitInfo submit{ VK_STRUCTURE_TYPE_SUBMIT_INFO };
+	submit.commandBufferCount = 1;
+	submit.pCommandBuffers = &cmd;
+	vkQueueSubmit(graphics_queue, 1, &submit, 0);
+	vkQueueWaitIdle(graphics_queue);
+
+	free_command_buffer(cmd);
+
+	return img;
+}
+
 Vk_Allocated_Image Vk_Context::load_texture(const char* filepath, bool flip_y, bool generate_mipmaps)
+{
+	File_View view;
+	bool mapped_file = map_file(filepath, &view);
+	assert(mapped_file);
+
+	Vk_Allocated_Image img = load_texture_from_memory(view.data, view.size, flip_y, generate_mipmaps);
+	unmap_file(&view);
+	return img;
+}
+
+Vk_Allocated_Image Vk_Context::load_texture_from_memory(const u8* file_data, size_t file_size, bool flip_y, bool generate_mipmaps)
 {
 	constexpr int required_n_comps = 4;
 
 	stbi_set_flip_vertically_on_load((int)flip_y);
 	int x, y, comp;
-	u8* data = stbi_load(filepath, &x, &y, &comp, required_n_comps);
+	u8* data = stbi_load_from_memory(file_data, (int)file_size, &x, &y, &comp, required_n_comps);
 	assert(data);
 
 	u32 mip_levels = 1;
@@ -1538,27 +1739,148 @@ static bool check_extensions(const std::vector<const char*>& device_exts, const
 	return true;
 }
 
-void GPU_Buffer::upload(VkCommandBuffer cmd, u32 frame_index)
+void Upload_Ring::init(Vk_Context* ctx, VkDeviceSize size_per_frame)
 {
-	VkBufferCopy copy_region{};
-	copy_region.srcOffset = 0; // Optional
-	copy_region.dstOffset = 0; // Optional
-	copy_region.size = size;
+	this->ctx = ctx;
+	frame_size = size_per_frame;
+	buffer = ctx->allocate_buffer(frame_size * FRAMES_IN_FLIGHT, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_AUTO,
+		VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT);
+
+	VmaAllocationInfo info;
+	vmaGetAllocationInfo(ctx->allocator, buffer.allocation, &info);
+	mapped = (u8*)info.pMappedData;
+	assert(mapped);
+}
 
-	vkCmdCopyBuffer(cmd, staging_buffer[frame_index].buffer, gpu_buffer.buffer, 1, &copy_region);
+void Upload_Ring::begin_frame(u32 frame_index)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	assert(pending_copies.empty());
+	this->frame_index = frame_index;
+	head = 0;
+	allocation_count = 0;
 }
 
-void GPU_Buffer::update_staging_buffer(VmaAllocator allocator, u32 frame_index, void* data, size_t data_size, size_t offset)
+void* Upload_Ring::allocate(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize* offset)
 {
-	void* mapped;
-	vmaMapMemory(allocator, staging_buffer[frame_index].allocation, &mapped);
-	u8* dst = (u8*)mapped;
-	memcpy(dst + offset, data, data_size);
-	vmaUnmapMemory(allocator, staging_buffer[frame_index].allocation);
+	std::lock_guard<std::mutex> lock(mutex);
+	VkDeviceSize start = alignment > 1 ? (head + alignment - 1) / alignment * alignment : head;
+	if (start + size > frame_size)
+		return nullptr;
+
+	head = start + size;
+	allocation_count++;
+	*offset = frame_index * frame_size + start;
+	return mapped + *offset;
+}
+
+void Upload_Ring::upload(VkBuffer dst, VkDeviceSize dst_offset, const void* data, VkDeviceSize size)
+{
+	// vkCmdCopyBuffer has no alignment requirements, 16 keeps the memcpy destinations aligned
+	VkDeviceSize src_offset;
+	void* dst_ptr = allocate(size, 16, &src_offset);
+	VkBuffer src = buffer.buffer;
+	VmaAllocation src_allocation = buffer.allocation;
+	if (!dst_ptr)
+	{
+		VkBufferCreateInfo buffer_info{ VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+		buffer_info.size = size;
+		buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+		VmaAllocationCreateInfo alloc_info{};
+		alloc_info.usage = VMA_MEMORY_USAGE_AUTO;
+		alloc_info.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+		Vk_Allocated_Buffer overflow;
+		VmaAllocationInfo info;
+		VK_CHECK(vmaCreateBuffer(ctx->allocator, &buffer_info, &alloc_info, &overflow.buffer, &overflow.allocation, &info));
+		VmaAllocator allocator = ctx->allocator;
+		g_garbage_collector->push([=]()
+			{
+				vmaDestroyBuffer(allocator, overflow.buffer, overflow.allocation);
+			}, Garbage_Collector::FRAMES_IN_FLIGHT);
+
+		LOG_DEBUG("Upload ring overflow: %llu bytes requested, %llu / %llu used\n", 
+			(unsigned long long)size, (unsigned long long)head, (unsigned long long)frame_size);
+		src = overflow.buffer;
+		src_allocation = overflow.allocation;
+		src_offset = 0;
+		dst_ptr = info.pMappedData;
+		std::lock_guard<std::mutex> lock(mutex);
+		stats.overflow_count++;
+	}
+
+	memcpy(dst_ptr, data, size);
+	vmaFlushAllocation(ctx->allocator, src_allocation, src_offset, size); // No-op on coherent memory
+
+	Copy copy;
+	copy.src = src;
+	copy.dst = dst;
+	copy.region.srcOffset = src_offset;
+	copy.region.dstOffset = dst_offset;
+	copy.region.size = size;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	pending_copies.push_back(copy);
+}
+
+void Upload_Ring::upload(GPU_Buffer* dst, const void* data, size_t size, size_t dst_offset)
+{
+	assert(dst_offset + size <= dst->size);
+	upload(dst->gpu_buffer.buffer, (VkDeviceSize)dst_offset, data, (VkDeviceSize)size);
+}
+
+void Upload_Ring::flush(VkCommandBuffer cmd)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// Group by destination. Vulkan doesn't order overlapping regions, not even across copy commands
+	// without a barrier, so a buffer range may only be written once per flush
+	std::sort(pending_copies.begin(), pending_copies.end(), [](const Copy& a, const Copy& b)
+		{
+			if (a.dst != b.dst) return a.dst < b.dst;
+			return a.region.dstOffset < b.region.dstOffset;
+		});
+	for (size_t i = 1; i < pending_copies.size(); ++i)
+	{
+		const Copy& prev = pending_copies[i - 1];
+		assert(prev.dst != pending_copies[i].dst || prev.region.dstOffset + prev.region.size <= pending_copies[i].region.dstOffset);
+	}
+
+	std::vector<VkBufferCopy> regions;
+	u32 copy_command_count = 0;
+	u32 copy_region_count = 0;
+	for (size_t i = 0; i < pending_copies.size();)
+	{
+		VkBuffer src = pending_copies[i].src;
+		VkBuffer dst = pending_copies[i].dst;
+		regions.clear();
+		for (; i < pending_copies.size() && pending_copies[i].src == src && pending_copies[i].dst == dst; ++i)
+		{
+			// Merge copies that are contiguous in both buffers, e.g. consecutive fields of one struct
+			const VkBufferCopy& r = pending_copies[i].region;
+			if (!regions.empty() &&
+				regions.back().srcOffset + regions.back().size == r.srcOffset &&
+				regions.back().dstOffset + regions.back().size == r.dstOffset)
+				regions.back().size += r.size;
+			else
+				regions.push_back(r);
+		}
+		vkCmdCopyBuffer(cmd, src, dst, (u32)regions.size(), regions.data());
+		copy_command_count++;
+		copy_region_count += (u32)regions.size();
+	}
+	pending_copies.clear();
+
+	stats.bytes_used = head;
+	stats.peak_bytes_used = std::max(stats.peak_bytes_used, head);
+	stats.allocation_count = allocation_count;
+	stats.copy_command_count = copy_command_count;
+	stats.copy_region_count = copy_region_count;
 }
 
 void Garbage_Collector::push(std::function<void()> func, DESTROY_TIME timing)
 {
+	std::lock_guard<std::mutex> lock(mutex);
 	if (timing == END_OF_FRAME)
 		end_of_frame_queue.push_back({ func, 0 });
 	else if (timing == FRAMES_IN_FLIGHT)
@@ -4,9 +4,11 @@
 #include "vma/include/vk_mem_alloc.h"
 #include "platform.h"
 #include "spirv-reflect/spirv_reflect.h"
+#include <mutex>
 
 
 constexpr int FRAMES_IN_FLIGHT = 2;
+constexpr int MAX_PASS_COMMAND_BUFFERS = 8; // Per frame and queue, see Per_Frame_Objects
 #ifdef _DEBUG
 constexpr bool USE_VALIDATION_LAYERS = true;
 #else
@@ -27,14 +29,64 @@ struct Vk_Allocated_Image
 	VmaAllocation allocation;
 };
 
+struct Vk_Context;
+
+// Device local buffer, updated through Upload_Ring
 struct GPU_Buffer
 {
 	Vk_Allocated_Buffer gpu_buffer;
-	std::array<Vk_Allocated_Buffer, FRAMES_IN_FLIGHT> staging_buffer;
 	size_t size;
+};
+
+constexpr VkDeviceSize UPLOAD_RING_FRAME_SIZE = 4 * 1024 * 1024;
+
+/*
+	Staging memory for per-frame uploads. A single persistently mapped buffer is split into 
+	one region per frame in flight and each region is a linear allocator that is reset in 
+	begin_frame, after the frame's fence has been waited on. Queued copies are recorded in 
+	flush, merged into one vkCmdCopyBuffer per destination buffer. A destination range may
+	only be uploaded once per flush, overlapping copies have no defined order.
+	Uploads that don't fit fall back to a temporary staging buffer and are counted as overflows.
+*/
+struct Upload_Ring
+{
+	struct Copy
+	{
+		VkBuffer src;
+		VkBuffer dst;
+		VkBufferCopy region;
+	};
 
-	void upload(VkCommandBuffer cmd, u32 frame_index);
-	void update_staging_buffer(VmaAllocator allocator, u32 frame_index, void* data, size_t data_size, size_t offset = 0);
+	struct Stats
+	{
+		VkDeviceSize bytes_used; // Previous flush
+		VkDeviceSize peak_bytes_used;
+		u32 allocation_count;
+		u32 copy_command_count;
+		u32 copy_region_count;
+		u32 overflow_count; // Total since init
+	};
+
+	Vk_Context* ctx = nullptr;
+	Vk_Allocated_Buffer buffer;
+	u8* mapped = nullptr;
+	VkDeviceSize frame_size = 0;
+	u32 frame_index = 0;
+	VkDeviceSize head = 0; // Relative to the current frame's region
+	u32 allocation_count = 0;
+	std::vector<Copy> pending_copies;
+	Stats stats{};
+	std::mutex mutex;
+
+	void init(Vk_Context* ctx, VkDeviceSize size_per_frame);
+	void begin_frame(u32 frame_index);
+	// Returns a pointer to size bytes of mapped memory and its offset in the ring buffer, nullptr if the frame's region is full
+	void* allocate(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize* offset);
+	// Copies data to staging memory and queues a copy to dst
+	void upload(VkBuffer dst, VkDeviceSize dst_offset, const void* data, VkDeviceSize size);
+	void upload(GPU_Buffer* dst, const void* data, size_t size, size_t dst_offset = 0);
+	// Records the queued copies, needs a transfer barrier before the destinations are read
+	void flush(VkCommandBuffer cmd);
 };
 
 struct Vk_Pipeline
@@ -92,6 +144,7 @@ struct Garbage_Collector
 	std::vector<Garbage> end_of_frame_queue;
 	std::vector<Garbage> frames_in_flight_queue;
 	std::vector<Garbage> on_shutdown_queue;
+	std::mutex mutex; // Pipelines etc. can be created from worker threads
 
 	void push(std::function<void()> func, DESTROY_TIME timing);
 	void collect();
@@ -121,6 +174,13 @@ struct Vk_Context
 	{
 		VkFence fence;
 		VkCommandBuffer cmd;
+		VkCommandBuffer present_cmd; // Graphics, presents the async compute output
+		// Passes are recorded in parallel, each into a command buffer with a pool of its own since pools are
+		// externally synchronized. The pools are reset as a whole once the frame's fence has been waited on
+		VkCommandPool pass_command_pools[MAX_PASS_COMMAND_BUFFERS];
+		VkCommandBuffer pass_cmds[MAX_PASS_COMMAND_BUFFERS];
+		VkCommandPool compute_pass_command_pools[MAX_PASS_COMMAND_BUFFERS]; // Async compute only
+		VkCommandBuffer compute_pass_cmds[MAX_PASS_COMMAND_BUFFERS];
 		VkSemaphore render_finished_sem;
 		VkSemaphore image_available_sem;
 	};
@@ -130,7 +190,8 @@ struct Vk_Context
 	VkPhysicalDevice physical_device;
 	VkDevice device;
 	VmaAllocator allocator;
-	int graphics_idx, compute_idx, transfer_idx;
+	int graphics_idx, compute_idx, transfer_idx; // compute_idx is a family without graphics if there is one
+	u32 shared_queue_families[2]; // Graphics and compute, for concurrent sharing
 	VkCommandPool command_pool;
 	VkCommandPool async_command_pool;
 	VkDescriptorPool descriptor_pool;
@@ -141,11 +202,18 @@ struct Vk_Context
 	uint32_t device_sbt_alignment; // Device shader binding table alignment requirement
 	uint32_t device_shader_group_handle_size;
 	VkQueue graphics_queue;
+	VkQueue compute_queue = VK_NULL_HANDLE; // Only with a dedicated compute family
+	// Work done on each queue, the renderer's async compute frame waits on these
+	VkSemaphore graphics_timeline_sem;
+	VkSemaphore compute_timeline_sem;
 	Async_Upload async_upload;
 	VkPhysicalDeviceProperties2 physical_device_properties;
 	VkPhysicalDeviceRayTracingPipelinePropertiesKHR raytracing_pipeline_properties;
 	VkPhysicalDeviceSubgroupProperties subgroup_properties;
 	VkPhysicalDeviceAccelerationStructurePropertiesKHR acceleration_structure_properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR };
+	Upload_Ring upload_ring;
+	VkPipelineCache pipeline_cache = VK_NULL_HANDLE;
+	bool pipeline_cache_warm = false; // True if the cache was loaded from disk and matched the driver
 
 	std::array<Per_Frame_Objects, FRAMES_IN_FLIGHT> frame_objects;
 
@@ -161,14 +229,29 @@ struct Vk_Context
 	void create_command_pool();
 	void create_swapchain(Platform* platform);
 	void create_sync_objects();
+	void create_pipeline_cache(const char* filepath);
+	void save_pipeline_cache(const char* filepath);
 	VkQueryPool create_query_pool();
 
-	Vk_Allocated_Buffer allocate_buffer(uint32_t size,
+	bool has_async_compute() const { return compute_idx != graphics_idx; }
+	// Buffers and images are shared by the graphics and async compute families unless created exclusive,
+	// exclusive ones need queue family ownership transfers between the two
+	template<typename Create_Info>
+	void set_concurrent_sharing(Create_Info* info)
+	{
+		if (!has_async_compute())
+			return;
+		info->sharingMode = VK_SHARING_MODE_CONCURRENT;
+		info->queueFamilyIndexCount = (u32)std::size(shared_queue_families);
+		info->pQueueFamilyIndices = shared_queue_families;
+	}
+
+	Vk_Allocated_Buffer allocate_buffer(VkDeviceSize size,
 		VkBufferUsageFlags usage, VmaMemoryUsage memory_usage, VmaAllocationCreateFlags flags, u64 alignment = 0);
 	Vk_Allocated_Image allocate_image(VkExtent3D extent, VkFormat format, 
 		VkImageUsageFlags usage, VkImageAspectFlags aspect = 
 		VK_IMAGE_ASPECT_COLOR_BIT, VkImageTiling tiling = VK_IMAGE_TILING_OPTIMAL, int mip_levels = 1, VkImageCreateFlags flags = 0,
-		int layers = 1
+		int layers = 1, bool exclusive = false
 	);
 	void free_image(Vk_Allocated_Image img);
 	void free_buffer(Vk_Allocated_Buffer buffer);
@@ -188,6 +271,8 @@ struct Vk_Context
 	VkDescriptorSetLayout create_layout_from_spirv(u8* bytecode, u32 size);
 	Vk_Allocated_Image load_texture_hdri(const char* filepath, VkImageUsageFlags usage = (VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT));
 	Vk_Allocated_Image load_texture(const char* filepath, bool flip_y = false, bool generate_mipmaps = false);
+	Vk_Allocated_Image load_texture_from_memory(const u8* file_data, size_t file_size, bool flip_y = false, bool generate_mipmaps = false); // Encoded image file, e.g. a mapped png
+	Vk_Allocated_Image create_texture_array(VkExtent2D extent, u32 layer_count, VkFormat format, const u8* data, size_t data_size); // Layers tightly packed in data
 	Vk_Allocated_Image load_texture_async(const char* filepath, u64* timeline_semaphore_value);
 	Cubemap create_cubemap(u32 size, VkFormat format);
 	VkDescriptorSetLayout create_descriptor_set_layout(u32 num_shaders, struct Shader* shaders);
@@ -0,0 +1,1067 @@
+#include "reblur_cpu.h"
+#include "jobs.h"
+#include "logging.h"
+#include <stdio.h>
+#include <string>
+#include <atomic>
+#include <algorithm>
+
+// Straight ports of the GLSL helpers in math.glsl, misc.glsl and blur_common.glsl. Keep them in sync
+
+static constexpr float REBLUR_PI = 3.14159265359f;
+static constexpr float MAX_ACCUM_FRAME_NUM = 32.0f;
+static constexpr i32 ROWS_PER_JOB = 16;
+
+static const glm::vec3 poisson_samples[8] =
+{
+	glm::vec3(-1.00f, 0.00f, 1.0f),
+	glm::vec3(0.00f, 1.00f, 1.0f),
+	glm::vec3(1.00f, 0.00f, 1.0f),
+	glm::vec3(0.00f, -1.00f, 1.0f),
+	glm::vec3(-0.25f * 1.41421356f, 0.25f * 1.41421356f, 0.5f),
+	glm::vec3(0.25f * 1.41421356f, 0.25f * 1.41421356f, 0.5f),
+	glm::vec3(0.25f * 1.41421356f, -0.25f * 1.41421356f, 0.5f),
+	glm::vec3(-0.25f * 1.41421356f, -0.25f * 1.41421356f, 0.5f),
+};
+
+struct Bilinear
+{
+	glm::vec2 origin;
+	glm::vec2 weights;
+};
+
+template <typename F>
+static void parallel_rows(i32 height, const F& f)
+{
+	std::atomic<u32> counter = 0;
+	for (i32 y0 = 0; y0 < height; y0 += ROWS_PER_JOB)
+	{
+		i32 y1 = std::min(y0 + ROWS_PER_JOB, height);
+		g_job_system->push([&f, y0, y1]()
+			{
+				for (i32 y = y0; y < y1; ++y)
+					f(y);
+			}, &counter);
+	}
+	g_job_system->wait(&counter);
+}
+
+static float van_der_corput_base_2(u32 i)
+{
+	u32 bits = i;
+	bits = (bits << 16u) | (bits >> 16u);
+	bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+	bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+	bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+	bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+	return float(bits) * 2.3283064365386963e-10f;
+}
+
+static glm::uvec4 pcg4d(glm::uvec4 v)
+{
+	v = v * 1664525u + 1013904223u;
+	v += glm::uvec4(v.y, v.z, v.x, v.y) * glm::uvec4(v.w, v.x, v.y, v.z);
+	v = v ^ (v >> 16u);
+	v += glm::uvec4(v.y, v.z, v.x, v.y) * glm::uvec4(v.w, v.x, v.y, v.z);
+	return v;
+}
+
+static glm::vec3 decode_unit_vector(glm::vec2 p)
+{
+	p = p * 2.0f - 1.0f;
+	glm::vec3 n = glm::vec3(p.x, p.y, 1.0f - fabsf(p.x) - fabsf(p.y));
+	float t = glm::clamp(-n.z, 0.0f, 1.0f);
+	n.x -= t * (n.x >= 0.0f ? 1.0f : -1.0f);
+	n.y -= t * (n.y >= 0.0f ? 1.0f : -1.0f);
+	return glm::normalize(n);
+}
+
+static glm::mat3 create_tangent_space(glm::vec3 n)
+{
+	if (n.z < -0.9999999f)
+		return glm::mat3(glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(-1.0f, 0.0f, 0.0f), n);
+
+	float a = 1.0f / (1.0f + n.z);
+	float b = -n.x * n.y * a;
+	glm::vec3 b1 = glm::vec3(1.0f - n.x * n.x * a, b, -n.x);
+	glm::vec3 b2 = glm::vec3(b, 1.0f - n.y * n.y * a, -n.y);
+	return glm::mat3(b1, b2, n);
+}
+
+static glm::vec3 get_view_pos(glm::vec3 uv_depth, const glm::mat4& proj)
+{
+	float aspect = proj[1][1] / proj[0][0];
+	float tan_half_fov_y = 1.0f / proj[1][1];
+
+	glm::vec3 res;
+	res.z = proj[3][2] / uv_depth.z;
+	res.x = res.z * tan_half_fov_y * uv_depth.x * aspect;
+	res.y = res.z * tan_half_fov_y * uv_depth.y;
+	res.z = -res.z;
+	return res;
+}
+
+static float get_hit_distance_normalization(glm::vec4 hit_distance_params, float view_z, float roughness)
+{
+	return (hit_distance_params.x + hit_distance_params.y * fabsf(view_z)) * glm::mix(1.0f, hit_distance_params.z, exp2f(hit_distance_params.w * roughness * roughness));
+}
+
+static float get_specular_dominant_factor(float NoV, float roughness)
+{
+	float a = 0.298475f * logf(39.4115f - 39.0029f * roughness);
+	float f = powf(glm::clamp(1.0f - NoV, 0.0f, 1.0f), 10.8649f) * (1.0f - a) + a;
+	return glm::clamp(f, 0.0f, 1.0f);
+}
+
+static Bilinear get_bilinear_filter(glm::vec2 uv, glm::vec2 tex_size)
+{
+	Bilinear result;
+	result.origin = glm::floor(uv * tex_size - 0.5f);
+	result.weights = glm::fract(uv * tex_size - 0.5f);
+	return result;
+}
+
+static glm::vec4 get_bilinear_weights(const Bilinear& bilinear)
+{
+	return glm::vec4(
+		(1.0f - bilinear.weights.x) * (1.0f - bilinear.weights.y), bilinear.weights.x * (1.0f - bilinear.weights.y),
+		(1.0f - bilinear.weights.x) * bilinear.weights.y, bilinear.weights.x * bilinear.weights.y);
+}
+
+static glm::vec4 bicubic_filter(const Cpu_Image& tex, glm::vec2 uv)
+{
+	glm::vec2 size = glm::vec2(tex.width, tex.height);
+	glm::vec2 inv_size = 1.0f / size;
+	glm::vec2 pos = size * uv;
+	glm::vec2 center_pos = glm::floor(pos - 0.5f) + 0.5f;
+	glm::vec2 f = pos - center_pos;
+	glm::vec2 f2 = f * f;
+	glm::vec2 f3 = f * f2;
+
+	float c = 0.5f;
+	glm::vec2 w0 = -c * f3 + 2.0f * c * f2 - c * f;
+	glm::vec2 w1 = (2.0f - c) * f3 - (3.0f - c) * f2 + 1.0f;
+	glm::vec2 w2 = -(2.0f - c) * f3 + (3.0f - 2.0f * c) * f2 + c * f;
+	glm::vec2 w3 = c * f3 - c * f2;
+
+	glm::vec2 w12 = w1 + w2;
+	glm::vec2 tc12 = inv_size * (center_pos + w2 / w12);
+	glm::vec4 center_color = tex.sample(tc12);
+
+	glm::vec2 tc0 = inv_size * (center_pos - 1.0f);
+	glm::vec2 tc3 = inv_size * (center_pos + 2.0f);
+	glm::vec4 color = tex.sample(glm::vec2(tc12.x, tc0.y)) * (w12.x * w0.y) +
+		tex.sample(glm::vec2(tc0.x, tc12.y)) * (w0.x * w12.y) +
+		center_color * (w12.x * w12.y) +
+		tex.sample(glm::vec2(tc3.x, tc12.y)) * (w3.x * w12.y) +
+		tex.sample(glm::vec2(tc12.x, tc3.y)) * (w12.x * w3.y);
+
+	float total_w = (w12.x * w0.y) + (w0.x * w12.y) + (w12.x * w12.y) + (w3.x * w12.y) + (w12.x * w3.y);
+	return color / total_w;
+}
+
+static glm::vec3 linear_to_YCoCg(glm::vec3 rgb)
+{
+	float Co = rgb.r - rgb.b;
+	float t = rgb.b + Co * 0.5f;
+	float Cg = rgb.g - t;
+	float Y = t + Cg * 0.5f;
+	return glm::vec3(Y, Co, Cg);
+}
+
+static glm::vec3 YCoCg_to_linear(glm::vec3 ycocg)
+{
+	float t = ycocg.x - ycocg.z * 0.5f;
+	float g = ycocg.z + t;
+	float b = t - ycocg.y * 0.5f;
+	float r = b + ycocg.y;
+	return glm::max(glm::vec3(0.0f), glm::vec3(r, g, b));
+}
+
+static glm::vec4 clamp_negative_to_zero(glm::vec4 color, bool ycocg_color_space)
+{
+	if (!ycocg_color_space)
+		return glm::max(glm::vec4(0.0f), color);
+
+	glm::vec3 rgb = YCoCg_to_linear(glm::vec3(color));
+	color = glm::max(glm::vec4(0.0f), glm::vec4(rgb, color.w));
+	return glm::vec4(linear_to_YCoCg(glm::vec3(color)), color.w);
+}
+
+static float get_gaussian_weight(float r)
+{
+	return expf(-0.66f * r * r);
+}
+
+static glm::vec2 get_geometry_weight_params(float plane_dist_sensitivity, float frustum_size, glm::vec3 X, glm::vec3 N, float inv_accum_speed)
+{
+	float relaxation = glm::mix(1.0f, 0.25f, inv_accum_speed);
+	float a = relaxation / (plane_dist_sensitivity * frustum_size);
+	float b = -glm::dot(X, N) * a;
+	return glm::vec2(a, b);
+}
+
+static float get_specular_lobe_half_angle(float linear_roughness, float percent_of_volume)
+{
+	float m = linear_roughness * linear_roughness;
+	return atanf(m * percent_of_volume / (1.0f - percent_of_volume));
+}
+
+static float get_normal_weight_params(float inv_accum_speed, float lobe_fraction, float roughness)
+{
+	float angle = get_specular_lobe_half_angle(roughness, 0.75f);
+	angle *= glm::mix(lobe_fraction, 1.0f, inv_accum_speed);
+	return 1.0f / glm::max(angle, 0.01f);
+}
+
+static glm::vec2 get_hit_distance_weight_params(float hit_dist, float inv_accum_speed)
+{
+	float norm = glm::mix(0.001f, 1.0f, inv_accum_speed);
+	float a = 1.0f / norm;
+	float b = hit_dist * a;
+	return glm::vec2(a, -b);
+}
+
+static glm::mat3 get_kernel_basis(glm::vec3 V, glm::vec3 N, float roughness)
+{
+	glm::mat3 tbn = create_tangent_space(N);
+	glm::vec3 T = tbn[0];
+	glm::vec3 B = tbn[1];
+
+	float NoV = fabsf(glm::dot(N, V));
+	float f = get_specular_dominant_factor(NoV, roughness);
+	glm::vec3 R = glm::reflect(-V, N);
+	glm::vec3 D = glm::normalize(glm::mix(N, R, f));
+	float NoD = fabsf(glm::dot(N, D));
+
+	if (NoD < 0.999f && roughness != 1.0f)
+	{
+		glm::vec3 Dreflected = glm::reflect(-D, N);
+		T = glm::normalize(glm::cross(N, Dreflected));
+		B = glm::cross(Dreflected, T);
+
+		float acos01sq = glm::clamp(1.0f - NoV, 0.0f, 1.0f);
+		float skew_factor = glm::mix(1.0f, roughness, sqrtf(acos01sq));
+		T *= skew_factor;
+	}
+
+	return glm::mat3(T, B, N);
+}
+
+static glm::vec2 get_screen_uv(const glm::mat4& world_to_clip, glm::vec3 X)
+{
+	glm::vec4 clip = world_to_clip * glm::vec4(X, 1.0f);
+	clip /= clip.w;
+	clip.y = -clip.y;
+	return glm::vec2(clip) * 0.5f + 0.5f;
+}
+
+static bool is_in_screen(glm::ivec2 q, glm::ivec2 size)
+{
+	return q.x >= 0 && q.y >= 0 && q.x < size.x && q.y < size.y;
+}
+
+static bool is_in_unit_square(glm::vec2 uv)
+{
+	return uv == glm::clamp(uv, 0.0f, 1.0f);
+}
+
+void Cpu_Image::resize(i32 w, i32 h)
+{
+	width = w;
+	height = h;
+	texels.assign((size_t)w * h, glm::vec4(0.0f));
+}
+
+glm::vec4 Cpu_Image::load(glm::ivec2 p) const
+{
+	if (p.x < 0 || p.y < 0 || p.x >= width || p.y >= height)
+		return glm::vec4(0.0f);
+	return texels[(size_t)p.y * width + p.x];
+}
+
+glm::vec4 Cpu_Image::sample(glm::vec2 uv) const
+{
+	glm::vec2 pos = uv * glm::vec2(width, height) - 0.5f;
+	glm::vec2 origin = glm::floor(pos);
+	glm::vec2 f = pos - origin;
+	glm::ivec2 p0 = glm::clamp(glm::ivec2(origin), glm::ivec2(0), glm::ivec2(width - 1, height - 1));
+	glm::ivec2 p1 = glm::clamp(glm::ivec2(origin) + 1, glm::ivec2(0), glm::ivec2(width - 1, height - 1));
+
+	glm::vec4 s00 = texels[(size_t)p0.y * width + p0.x];
+	glm::vec4 s10 = texels[(size_t)p0.y * width + p1.x];
+	glm::vec4 s01 = texels[(size_t)p1.y * width + p0.x];
+	glm::vec4 s11 = texels[(size_t)p1.y * width + p1.x];
+	return glm::mix(glm::mix(s00, s10, f.x), glm::mix(s01, s11, f.x), f.y);
+}
+
+glm::mat4 Cpu_Image::gather(glm::vec2 uv) const
+{
+	glm::ivec2 origin = glm::ivec2(glm::floor(uv * glm::vec2(width, height) - 0.5f));
+	glm::ivec2 max_p = glm::ivec2(width - 1, height - 1);
+	glm::mat4 result;
+	result[0] = load(glm::clamp(origin, glm::ivec2(0), max_p));
+	result[1] = load(glm::clamp(origin + glm::ivec2(1, 0), glm::ivec2(0), max_p));
+	result[2] = load(glm::clamp(origin + glm::ivec2(0, 1), glm::ivec2(0), max_p));
+	result[3] = load(glm::clamp(origin + glm::ivec2(1, 1), glm::ivec2(0), max_p));
+	return result;
+}
+
+// blur.comp
+struct Blur_Params
+{
+	int pass; // *_BLUR_CONSTANT_ID
+	int channel; // BLUR_CHANNEL_*
+	glm::mat2 rotation;
+	float depth_scale;
+	float blur_radius;
+	float blur_radius_scale;
+};
+
+static glm::vec2 get_sample_pos(const Global_Constants_Data& gc, glm::ivec2 size, glm::vec3 center, float blur_radius, glm::vec3 offset,
+	glm::vec3 T, glm::vec3 B, const glm::mat4& viewproj, const glm::mat2& rotation)
+{
+	T *= blur_radius;
+	B *= blur_radius;
+
+	glm::vec2 o = glm::vec2(offset);
+	if (gc.use_quadratic_distribution == 1)
+		o *= offset.z;
+
+	o = rotation * o;
+	glm::vec3 sample_pos_world = center + T * o.x + B * o.y;
+	return get_screen_uv(viewproj, sample_pos_world) * glm::vec2(size);
+}
+
+static void blur_pixel(const Reblur_Frame& frame, const Blur_Params& params, const Cpu_Image& input, const Cpu_Image& history_length,
+	Cpu_Image* output, glm::ivec2 p)
+{
+	const Global_Constants_Data& gc = frame.constants;
+	const Reblur_Gbuffer& gbuffer = *frame.current;
+	glm::ivec2 size = glm::ivec2(input.width, input.height);
+
+	glm::vec4 center = input.load(p);
+	if (params.blur_radius == 0.0f || params.blur_radius_scale == 0.0f)
+	{
+		output->store(p, center);
+		return;
+	}
+
+	glm::vec2 accum_frames = glm::vec2(history_length.load(p)) * 255.0f;
+	float accumulated_frames = params.channel == BLUR_CHANNEL_DIFFUSE ? accum_frames.x : accum_frames.y;
+
+	glm::vec3 p0 = glm::vec3(gbuffer.world_position.load(p));
+	glm::vec3 V = glm::normalize(glm::vec3(frame.camera.inverse_view[3]) - p0);
+	glm::vec4 n0r0 = gbuffer.normal_roughness.load(p);
+	glm::vec3 N = decode_unit_vector(glm::vec2(n0r0));
+	float d0 = gbuffer.depth.load(p).x;
+
+	float roughness = params.channel == BLUR_CHANNEL_SPECULAR ? n0r0.z * n0r0.z : 1.0f;
+
+	if (d0 == 0.0f)
+	{
+		output->store(p, center);
+		return;
+	}
+
+	bool pre_blur = params.pass == PRE_BLUR_CONSTANT_ID;
+	float inv_accum_speed = pre_blur ? 1.0f : 1.0f / accumulated_frames;
+
+	float Z = params.depth_scale / d0;
+	float hit_dist_normalization = get_hit_distance_normalization(gc.hit_dist_params, Z, roughness);
+	float frustum_size = gc.min_rect_dim_mul_unproject * fabsf(Z);
+	float hit_t = center.w * hit_dist_normalization;
+	float hit_dist_factor = glm::clamp(hit_t / frustum_size, 0.0f, 1.0f);
+	float hit_t0 = center.w;
+	float blur_radius = params.blur_radius;
+	if (pre_blur)
+	{
+		if (gc.hit_distance_scaling == 1)
+			blur_radius *= hit_dist_factor;
+	}
+	else
+	{
+		hit_dist_factor = glm::mix(hit_dist_factor, 1.0f, glm::smoothstep(20.0f, 4.0f, accumulated_frames));
+		if (gc.hit_distance_scaling == 1)
+			blur_radius *= hit_dist_factor;
+
+		if (gc.frame_num_scaling == 1)
+		{
+			float frame_count_scale = glm::smoothstep(20.0f, 4.0f, accumulated_frames);
+			blur_radius *= (1.0f + 2.0f * frame_count_scale) / 3.0f;
+		}
+
+		blur_radius += 1.0f; // Avoid underblurring
+		blur_radius *= params.blur_radius_scale;
+	}
+
+	glm::mat3 tbn = get_kernel_basis(V, N, roughness);
+	float world_radius = blur_radius * gc.unproject * Z;
+
+	float normal_weight_params = get_normal_weight_params(inv_accum_speed, gc.lobe_percentage, roughness);
+
+	glm::vec3 Xv = glm::vec3(frame.camera.view * glm::vec4(p0, 1.0f));
+	glm::vec3 Nv = glm::mat3(frame.camera.view) * N;
+	glm::vec2 geometry_weight_params = get_geometry_weight_params(gc.plane_distance_sensitivity, frustum_size, Xv, Nv, inv_accum_speed);
+	glm::vec2 hit_distance_weight_params = get_hit_distance_weight_params(hit_t0, inv_accum_speed);
+
+	float sum = 1.0f;
+	glm::vec4 diff = center;
+
+	glm::mat2 rotation = glm::mat2(1.0f);
+	if (gc.blur_kernel_rotation_mode == 2)
+	{
+		glm::uvec4 seed = pcg4d(glm::uvec4((u32)p.x, (u32)p.y, gc.frame_number, 1337u));
+		float theta = float(seed.x) * 2.3283064365386963e-10f * 2.0f * REBLUR_PI;
+		rotation = glm::mat2(cosf(theta), sinf(theta), -sinf(theta), cosf(theta));
+	}
+	else if (gc.blur_kernel_rotation_mode == 1)
+	{
+		rotation = params.rotation;
+	}
+
+	for (const glm::vec3& offset : poisson_samples)
+	{
+		glm::vec2 sample_pos;
+		if (pre_blur)
+			sample_pos = glm::vec2(p) + 0.5f + rotation * glm::vec2(offset) * blur_radius;
+		else
+			sample_pos = get_sample_pos(gc, size, p0, world_radius, offset, tbn[0], tbn[1], frame.camera.viewproj, rotation);
+
+		glm::ivec2 q = glm::ivec2(sample_pos);
+		if (!is_in_screen(q, size))
+			continue;
+
+		glm::vec4 s = input.load(q);
+		glm::vec3 pos = glm::vec3(gbuffer.world_position.load(q));
+		glm::vec3 Ns = decode_unit_vector(glm::vec2(gbuffer.normal_roughness.load(q)));
+
+		float w = gc.use_gaussian_weight == 1 ? get_gaussian_weight(offset.z) : 1.0f;
+
+		glm::vec3 Xvs = glm::vec3(frame.camera.view * glm::vec4(pos, 1.0f));
+		float ndotx = glm::dot(Xvs, Nv);
+		float plane_dist_w = fabsf(ndotx * geometry_weight_params.x + geometry_weight_params.y);
+		plane_dist_w = glm::smoothstep(1.0f, 0.0f, plane_dist_w);
+
+		float cosa = glm::clamp(glm::dot(Ns, N), 0.0f, 1.0f);
+		float w_n = glm::smoothstep(1.0f, 0.0f, acosf(cosa) * normal_weight_params);
+
+		float w_hit_dist = expf(-3.0f * fabsf(s.w * hit_distance_weight_params.x + hit_distance_weight_params.y));
+		w_hit_dist = glm::mix(0.1f, 1.0f, w_hit_dist);
+
+		if (gc.use_geometry_weight == 1)
+			w *= plane_dist_w;
+		if (gc.use_normal_weight == 1)
+			w *= w_n;
+		if (gc.use_hit_distance_weight == 1)
+			w *= w_hit_dist;
+
+		sum += w;
+		diff += s * w;
+	}
+
+	output->store(p, diff / sum);
+}
+
+// temporal_accumulation.comp
+static float compute_parallax(glm::vec3 X, glm::vec3 Xprev, glm::vec3 camera_delta)
+{
+	glm::vec3 V = glm::normalize(X);
+	glm::vec3 Vprev = glm::normalize(Xprev - camera_delta);
+	float cosa = glm::clamp(glm::dot(V, Vprev), 0.0f, 1.0f);
+	float parallax = sqrtf(1.0f - cosa * cosa) / glm::max(cosa, 1e-6f);
+	return parallax * 60.0f;
+}
+
+static float get_spec_accum_speed(const Global_Constants_Data& gc, float amax, float roughness, float NoV, float parallax)
+{
+	float acos01sq = 1.0f - NoV;
+
+	float a = powf(glm::clamp(acos01sq, 0.0f, 1.0f), gc.spec_accum_curve);
+	float b = 1.1f + roughness * roughness;
+	float parallax_sensitivity = (b + a) / (b - a);
+	float power_scale = 1.0f + parallax * parallax_sensitivity;
+	float f = 1.0f - exp2f(-200.0f * roughness * roughness);
+	f *= powf(roughness, gc.spec_accum_base_power * power_scale);
+	float A = MAX_ACCUM_FRAME_NUM * f;
+
+	return glm::min(A, amax);
+}
+
+static glm::vec3 get_x_virtual(glm::vec3 X, glm::vec3 V, float NoV, float roughness, float hit_dist)
+{
+	float f = get_specular_dominant_factor(NoV, roughness);
+	return X - V * hit_dist * f;
+}
+
+static float get_normal_weight(float roughness, glm::vec3 N, glm::vec3 Nprev)
+{
+	float w_params = get_normal_weight_params(1.0f, 0.5f, roughness);
+	float angle = acosf(glm::clamp(glm::dot(N, Nprev), -1.0f, 1.0f));
+	return glm::clamp(1.0f - angle * w_params, 0.0f, 1.0f);
+}
+
+struct Temporal_Accumulation_Images
+{
+	const Cpu_Image* input[Reblur_Cpu::CHANNEL_COUNT];
+	const Cpu_Image* history[Reblur_Cpu::CHANNEL_COUNT];
+	const Cpu_Image* previous_history_length;
+	const Reblur_Gbuffer* previous;
+	Cpu_Image* output[Reblur_Cpu::CHANNEL_COUNT];
+	Cpu_Image* history_length;
+	u8* occlusion_data;
+};
+
+static void temporal_accumulation_pixel(const Reblur_Frame& frame, const Temporal_Accumulation_Images& images, glm::ivec2 p)
+{
+	const Global_Constants_Data& gc = frame.constants;
+	const Camera_Data& camera = frame.camera;
+	const Camera_Data& previous_camera = frame.previous_camera;
+	const Reblur_Gbuffer& gbuffer = *frame.current;
+	glm::ivec2 size = glm::ivec2(gbuffer.depth.width, gbuffer.depth.height);
+	size_t index = (size_t)p.y * size.x + p.x;
+
+	glm::vec4 radiance = images.input[Reblur_Cpu::DIFFUSE]->load(p);
+	glm::vec4 specular_radiance = images.input[Reblur_Cpu::SPECULAR]->load(p);
+	float spec_hit_dist = specular_radiance.w;
+
+	images.occlusion_data[index] = 0;
+	if (gc.temporal_accumulation == 0)
+	{
+		images.output[Reblur_Cpu::DIFFUSE]->store(p, radiance);
+		images.output[Reblur_Cpu::SPECULAR]->store(p, specular_radiance);
+		images.history_length->store(p, glm::vec4(1.0f / 255.0f));
+		return;
+	}
+
+	glm::vec4 curr_normal_roughness = gbuffer.normal_roughness.load(p);
+	float roughness = curr_normal_roughness.z * curr_normal_roughness.z;
+	glm::vec3 curr_normal = decode_unit_vector(glm::vec2(curr_normal_roughness));
+	float curr_depth = gbuffer.depth.load(p).x;
+
+	if (curr_depth == 0.0f)
+	{
+		images.output[Reblur_Cpu::DIFFUSE]->store(p, glm::vec4(0.0f));
+		images.output[Reblur_Cpu::SPECULAR]->store(p, glm::vec4(0.0f));
+		images.history_length->store(p, glm::vec4(1.0f / 255.0f));
+		return;
+	}
+
+	glm::vec2 ndc = (glm::vec2(p) + 0.5f) / glm::vec2(size);
+	ndc.y = 1.0f - ndc.y;
+	ndc = ndc * 2.0f - 1.0f;
+
+	glm::vec3 camera_pos = glm::vec3(camera.inverse_view[3]);
+	glm::vec3 Xv = get_view_pos(glm::vec3(ndc, curr_depth), camera.proj);
+	float hit_distance_scale = get_hit_distance_normalization(gc.hit_dist_params, Xv.z, roughness);
+	glm::vec3 X = glm::vec3(camera.inverse_view * glm::vec4(Xv, 1.0f));
+	glm::vec3 V = glm::normalize(camera_pos - X);
+
+	glm::vec2 X_clip_uv = (glm::vec2(p) + 0.5f) / glm::vec2(size) + glm::vec2(gbuffer.motion_vectors.load(p));
+	Bilinear bilinear = get_bilinear_filter(X_clip_uv, glm::vec2(size));
+	glm::vec4 bilinear_weights = get_bilinear_weights(bilinear);
+
+	float frustum_size = gc.min_rect_dim_mul_unproject * fabsf(Xv.z);
+	float inv_dist_to_point = 1.0f / frustum_size;
+	const float occlusion_threshold = 0.005f;
+
+	glm::vec3 X_prev = X; // Exact for static geometry, like the shader
+	glm::vec3 X_prev_cam_rel = X_prev - camera_pos;
+	glm::vec3 Xv_prev = glm::vec3(previous_camera.view * glm::vec4(X_prev, 1.0f));
+
+	float threshold = is_in_unit_square(X_clip_uv) ? occlusion_threshold : -1.0f;
+
+	float NoXprev = fabsf(glm::dot(X_prev_cam_rel, curr_normal)) * inv_dist_to_point;
+	float Zprev = fabsf(Xv_prev.z);
+	float NoVprev = NoXprev / Zprev;
+
+	// 4x4 previous depths around the footprint, like the four textureGathers in the shader
+	glm::vec4 prev_zs[4];
+	const glm::vec2 gather_offsets[4] = { glm::vec2(0.0f, 0.0f), glm::vec2(2.0f, 0.0f), glm::vec2(0.0f, 2.0f), glm::vec2(2.0f, 2.0f) };
+	for (int i = 0; i < 4; ++i)
+	{
+		glm::mat4 depths = images.previous->depth.gather((bilinear.origin + gather_offsets[i]) / glm::vec2(size));
+		prev_zs[i] = camera.proj[3][2] / glm::vec4(depths[0].x, depths[1].x, depths[2].x, depths[3].x);
+	}
+
+	glm::vec3 plane_dist00 = glm::abs(NoVprev * glm::vec3(prev_zs[0].y, prev_zs[0].z, prev_zs[0].w) - NoXprev);
+	glm::vec3 plane_dist10 = glm::abs(NoVprev * glm::vec3(prev_zs[1].x, prev_zs[1].z, prev_zs[1].w) - NoXprev);
+	glm::vec3 plane_dist01 = glm::abs(NoVprev * glm::vec3(prev_zs[2].x, prev_zs[2].y, prev_zs[2].w) - NoXprev);
+	glm::vec3 plane_dist11 = glm::abs(NoVprev * glm::vec3(prev_zs[3].x, prev_zs[3].y, prev_zs[3].z) - NoXprev);
+
+	glm::vec3 valid00 = glm::step(plane_dist00, glm::vec3(threshold));
+	glm::vec3 valid10 = glm::step(plane_dist10, glm::vec3(threshold));
+	glm::vec3 valid01 = glm::step(plane_dist01, glm::vec3(threshold));
+	glm::vec3 valid11 = glm::step(plane_dist11, glm::vec3(threshold));
+
+	float valid_count = glm::dot(valid00, glm::vec3(1.0f)) + glm::dot(valid10, glm::vec3(1.0f)) + glm::dot(valid01, glm::vec3(1.0f)) + glm::dot(valid11, glm::vec3(1.0f));
+	bool allow_bicubic = valid_count == 12.0f && gc.temporal_filtering_mode == 1;
+
+	glm::vec4 valids = glm::vec4(valid00.z, valid10.y, valid01.y, valid11.x);
+	glm::vec4 occlusion_weights = bilinear_weights * valids;
+	float w_sum = glm::dot(occlusion_weights, glm::vec4(1.0f));
+
+	// The shader's bicubic history path is disabled, the history is always the occlusion weighted bilinear
+	glm::vec4 prev_color = glm::vec4(0.0f);
+	glm::vec4 prev_specular = glm::vec4(0.0f);
+	glm::vec2 history_length = glm::vec2(0.0f);
+	const glm::ivec2 footprint[4] = { glm::ivec2(0, 0), glm::ivec2(1, 0), glm::ivec2(0, 1), glm::ivec2(1, 1) };
+	for (int i = 0; i < 4; ++i)
+	{
+		glm::ivec2 q = glm::ivec2(bilinear.origin) + footprint[i];
+		prev_color += images.history[Reblur_Cpu::DIFFUSE]->load(q) * occlusion_weights[i];
+		prev_specular += images.history[Reblur_Cpu::SPECULAR]->load(q) * occlusion_weights[i];
+		history_length += glm::vec2(images.previous_history_length->load(q)) * 255.0f * occlusion_weights[i];
+	}
+	if (w_sum < 0.001f)
+	{
+		prev_color = glm::vec4(0.0f);
+		prev_specular = glm::vec4(0.0f);
+		history_length = glm::vec2(0.0f);
+	}
+	else
+	{
+		prev_color /= w_sum;
+		prev_specular /= w_sum;
+		history_length /= w_sum;
+	}
+
+	NoVprev = fabsf(glm::dot(glm::normalize(glm::vec3(previous_camera.inverse_view[3]) - X), curr_normal));
+	float NoV = fabsf(glm::dot(glm::normalize(-X_prev_cam_rel), curr_normal));
+	float size_quality = (NoVprev + 1e-3f) / (NoV + 1e-3f); // Fix stretching only, shrinking is OK
+	size_quality *= size_quality;
+	size_quality = glm::mix(0.1f, 1.0f, saturate(size_quality));
+	float footprint_quality = sqrtf(glm::clamp(w_sum, 0.0f, 1.0f));
+	footprint_quality *= size_quality;
+
+	glm::vec2 accum_speed = glm::min(history_length, glm::vec2(32.0f));
+	accum_speed *= glm::mix(glm::vec2(footprint_quality), glm::vec2(1.0f), 1.0f / (accum_speed + 1.0f));
+
+	glm::vec3 Xc = X - camera_pos;
+	glm::vec3 camera_delta = glm::vec3(previous_camera.inverse_view[3]) - camera_pos;
+	float parallax = compute_parallax(Xc, Xc, camera_delta);
+	float A = accum_speed.y;
+	accum_speed.y = get_spec_accum_speed(gc, accum_speed.y, roughness, NoV, parallax);
+	float Asurf = accum_speed.y;
+
+	accum_speed += 1.0f;
+
+	spec_hit_dist *= hit_distance_scale;
+
+	glm::vec4 current_surf = glm::mix(prev_specular, specular_radiance, 1.0f / accum_speed.y);
+
+	glm::vec3 Xvirt = get_x_virtual(X, V, NoV, roughness, spec_hit_dist);
+	glm::vec2 uv_prev_virt = get_screen_uv(previous_camera.viewproj, Xvirt);
+	glm::vec4 history_virt = images.history[Reblur_Cpu::SPECULAR]->sample(uv_prev_virt);
+
+	float is_in_screen_virtual = is_in_unit_square(uv_prev_virt) ? 1.0f : 0.0f;
+	float confidence = is_in_screen_virtual;
+
+	Bilinear bilinear_virt = get_bilinear_filter(uv_prev_virt, glm::vec2(size));
+	glm::vec4 virt_weights = get_bilinear_weights(bilinear_virt);
+	glm::vec4 prev_normal_roughness = glm::vec4(0.0f);
+	for (int i = 0; i < 4; ++i)
+		prev_normal_roughness += images.previous->normal_roughness.load(glm::ivec2(bilinear_virt.origin) + footprint[i]) * virt_weights[i];
+	glm::vec3 N_prev_virt = decode_unit_vector(glm::vec2(prev_normal_roughness));
+
+	confidence *= get_normal_weight(roughness, curr_normal, N_prev_virt);
+	float hit_dist_delta = fabsf(current_surf.w - history_virt.w);
+	float threshold_min = 0.02f * glm::smoothstep(0.2f, 0.01f, parallax);
+	float threshold_max = glm::mix(0.01f, 0.25f, roughness * roughness) + threshold_min;
+	confidence *= glm::smoothstep(threshold_max, threshold_min, hit_dist_delta);
+
+	float amount = get_specular_dominant_factor(NoV, roughness);
+	amount *= is_in_screen_virtual;
+
+	float Avirt = get_spec_accum_speed(gc, A, roughness, NoV, 0.0f);
+	float Amin = glm::min(Avirt, 3.0f * sqrtf(roughness));
+	float a = glm::mix(1.0f / (1.0f + Amin), 1.0f / (1.0f + Avirt), confidence);
+	Avirt = 1.0f / a - 1.0f;
+
+	glm::vec4 current_virt = glm::mix(history_virt, specular_radiance, 1.0f / (1.0f + Avirt));
+	glm::vec4 current_result = glm::mix(current_surf, current_virt, amount);
+	a = glm::mix(1.0f / (1.0f + Asurf), 1.0f / (1.0f + Avirt), amount);
+	float Acurr = 1.0f / a;
+
+	glm::vec2 alpha = 1.0f / accum_speed;
+	radiance = glm::mix(prev_color, radiance, alpha.x);
+
+	u32 packed_occlusion_data = u32(allow_bicubic) | (u32(valids[0]) << 1) | (u32(valids[1]) << 2) | (u32(valids[2]) << 3) | (u32(valids[3]) << 4);
+
+	images.history_length->store(p, glm::vec4(accum_speed.x / 255.0f, Acurr / 255.0f, 0.0f, 0.0f));
+	images.output[Reblur_Cpu::DIFFUSE]->store(p, radiance);
+	images.output[Reblur_Cpu::SPECULAR]->store(p, current_result);
+	images.occlusion_data[index] = (u8)packed_occlusion_data;
+}
+
+// history_fix_alternative.comp
+static void history_fix_pixel(const Reblur_Frame& frame, bool is_specular, const Cpu_Image& input, const Cpu_Image& history_length,
+	Cpu_Image* output, glm::ivec2 p)
+{
+	const Global_Constants_Data& gc = frame.constants;
+	const Reblur_Gbuffer& gbuffer = *frame.current;
+	glm::ivec2 size = glm::ivec2(input.width, input.height);
+
+	glm::vec2 accum_frames = glm::vec2(history_length.load(p)) * 255.0f;
+	float accumulated_frames = is_specular ? accum_frames.y : accum_frames.x;
+	float norm_hist_len = glm::clamp((accumulated_frames - 1.0f) / 4.0f, 0.0f, 1.0f);
+
+	glm::vec4 diff = input.load(p);
+	if (norm_hist_len == 1.0f || gc.history_fix == 0)
+	{
+		output->store(p, diff);
+		return;
+	}
+
+	float w_sum = 1.0f;
+
+	glm::vec3 n_r = glm::vec3(gbuffer.normal_roughness.load(p));
+	glm::vec3 N = decode_unit_vector(glm::vec2(n_r));
+	glm::vec3 Nv = glm::mat3(frame.camera.view) * N;
+	float D = gbuffer.depth.load(p).x;
+	float Z = frame.camera.proj[3][2] / D;
+
+	glm::vec3 X = glm::vec3(gbuffer.world_position.load(p));
+	glm::vec3 Xv = glm::vec3(frame.camera.view * glm::vec4(X, 1.0f));
+
+	float frustum_size = gc.min_rect_dim_mul_unproject * fabsf(Z);
+	float roughness = is_specular ? n_r.z * n_r.z : 1.0f;
+
+	float normal_weight_params = get_normal_weight_params(1.0f, 1.0f, roughness);
+	float inv_accum_speed = 1.0f / accumulated_frames;
+	glm::vec2 geometry_weight_params = get_geometry_weight_params(gc.plane_distance_sensitivity, frustum_size, Xv, Nv, inv_accum_speed);
+
+	float stride = frame.history_fix_stride / (1.0f + accumulated_frames);
+
+	const int RADIUS = 2;
+	for (int yy = -RADIUS; yy <= RADIUS; ++yy)
+	{
+		for (int xx = -RADIUS; xx <= RADIUS; ++xx)
+		{
+			if (xx == 0 && yy == 0)
+				continue;
+
+			glm::ivec2 q = p + glm::ivec2(xx, yy) * int(stride);
+			if (!is_in_screen(q, size))
+				continue;
+
+			glm::vec4 s = input.load(q);
+
+			glm::vec3 Xs = glm::vec3(gbuffer.world_position.load(q));
+			glm::vec3 Xvs = glm::vec3(frame.camera.view * glm::vec4(Xs, 1.0f));
+			glm::vec3 Ns = decode_unit_vector(glm::vec2(gbuffer.normal_roughness.load(q)));
+			float NoX = glm::dot(Xvs, Nv);
+			float plane_dist_w = glm::smoothstep(1.0f, 0.0f, fabsf(NoX * geometry_weight_params.x + geometry_weight_params.y));
+
+			float cosa = glm::clamp(glm::dot(Ns, N), 0.0f, 1.0f);
+			float w_n = glm::smoothstep(1.0f, 0.0f, acosf(cosa) * normal_weight_params);
+
+			float w = 1.0f;
+			if (gc.use_geometry_weight == 1)
+				w *= plane_dist_w;
+			if (gc.use_normal_weight == 1)
+				w *= w_n;
+
+			diff += w * s;
+			w_sum += w;
+		}
+	}
+
+	output->store(p, diff / w_sum);
+}
+
+// temporal_stabilization.comp
+static void temporal_stabilization_pixel(const Reblur_Frame& frame, const Cpu_Image& input, const Cpu_Image& history, const Cpu_Image& history_length,
+	const u8* occlusion_data, Cpu_Image* output, glm::ivec2 p)
+{
+	const Global_Constants_Data& gc = frame.constants;
+	glm::ivec2 size = glm::ivec2(input.width, input.height);
+
+	glm::vec4 radiance = input.load(p);
+
+	glm::vec3 m1 = glm::vec3(radiance);
+	glm::vec3 m2 = m1 * m1;
+	float w_mu = 1.0f;
+
+	const int RADIUS = 3;
+	for (int yy = -RADIUS; yy <= RADIUS; ++yy)
+	{
+		for (int xx = -RADIUS; xx <= RADIUS; ++xx)
+		{
+			glm::ivec2 q = p + glm::ivec2(xx, yy);
+			if ((xx == 0 && yy == 0) || !is_in_screen(q, size))
+				continue;
+
+			glm::vec3 s = glm::vec3(input.load(q));
+			m1 += s;
+			m2 += s * s;
+			w_mu += 1.0f;
+		}
+	}
+
+	// The GPU runs the diffuse history length for both channels
+	float accumulated_frames = history_length.load(p).x * 255.0f;
+
+	m1 /= w_mu;
+	m2 /= w_mu;
+	glm::vec3 sigma = glm::sqrt(m2 - m1 * m1);
+	float gamma = 2.0f + 6.0f * (1.0f / accumulated_frames);
+	glm::vec3 minc = m1 - gamma * sigma;
+	glm::vec3 maxc = m1 + gamma * sigma;
+
+	u32 occlusion = occlusion_data[(size_t)p.y * size.x + p.x];
+	bool allow_bicubic = (occlusion & 1) != 0;
+
+	glm::vec2 uv = (glm::vec2(p) + 0.5f) / glm::vec2(size) + glm::vec2(frame.current->motion_vectors.load(p));
+
+	Bilinear bilinear = get_bilinear_filter(uv, glm::vec2(size));
+	glm::vec4 bilinear_weights = get_bilinear_weights(bilinear);
+
+	glm::vec4 occlusions = glm::vec4((occlusion >> 1) & 1, (occlusion >> 2) & 1, (occlusion >> 3) & 1, (occlusion >> 4) & 1);
+	glm::vec4 occlusion_weights = occlusions * bilinear_weights;
+	float footprint_quality = glm::dot(bilinear_weights, occlusions);
+	float w_sum = glm::dot(occlusion_weights, glm::vec4(1.0f));
+
+	if (!is_in_unit_square(uv))
+		footprint_quality = 0.0f;
+
+	glm::vec4 prev_radiance = glm::vec4(0.0f);
+	if (allow_bicubic)
+	{
+		prev_radiance = bicubic_filter(history, uv);
+		prev_radiance = clamp_negative_to_zero(prev_radiance, gc.use_ycocg_color_space != 0);
+	}
+	else
+	{
+		const glm::ivec2 footprint[4] = { glm::ivec2(0, 0), glm::ivec2(1, 0), glm::ivec2(0, 1), glm::ivec2(1, 1) };
+		for (int i = 0; i < 4; ++i)
+			prev_radiance += history.load(glm::ivec2(bilinear.origin) + footprint[i]) * occlusion_weights[i];
+		prev_radiance = w_sum < 0.001f ? glm::vec4(0.0f) : prev_radiance / w_sum;
+	}
+
+	prev_radiance = glm::vec4(glm::clamp(glm::vec3(prev_radiance), minc, maxc), prev_radiance.w);
+
+	float prev_accum_frames = accumulated_frames - 1.0f; // Accumulated frames is always >= 1
+	float history_weight = (prev_accum_frames / (1.0f + prev_accum_frames)) * gc.stabilization_strength * footprint_quality;
+	output->store(p, glm::mix(radiance, prev_radiance, history_weight));
+}
+
+void Reblur_Cpu::init(i32 w, i32 h)
+{
+	width = w;
+	height = h;
+	for (int c = 0; c < CHANNEL_COUNT; ++c)
+	{
+		pre_blurred[c].resize(w, h);
+		accumulated[c].resize(w, h);
+		history_fixed[c].resize(w, h);
+		blurred[c].resize(w, h);
+		post_blurred[c].resize(w, h);
+		stabilized[c].resize(w, h);
+	}
+	history_length.resize(w, h);
+	occlusion_data.assign((size_t)w * h, 0);
+	reset();
+}
+
+void Reblur_Cpu::reset()
+{
+	for (int c = 0; c < CHANNEL_COUNT; ++c)
+	{
+		previous_post_blurred[c].resize(width, height);
+		previous_stabilized[c].resize(width, height);
+	}
+	previous_history_length.resize(width, height);
+}
+
+void Reblur_Cpu::denoise(const Reblur_Frame& frame)
+{
+	assert(frame.current && frame.noisy_diffuse && frame.noisy_specular);
+	assert(frame.current->depth.width == width && frame.current->depth.height == height);
+	assert(frame.noisy_diffuse->width == width && frame.noisy_specular->width == width);
+
+	const Global_Constants_Data& gc = frame.constants;
+	const Reblur_Gbuffer* previous = frame.previous ? frame.previous : frame.current;
+
+	// Same per frame kernel rotation as the renderer
+	float angle = 0.5f * REBLUR_PI * van_der_corput_base_2((frame.frame_number + 17) % 64);
+	glm::mat2 rotation = glm::mat2(cosf(angle), sinf(angle), -sinf(angle), cosf(angle));
+	float depth_scale = frame.camera.proj[3][2];
+
+	auto for_each_pixel = [&](auto&& pixel)
+	{
+		parallel_rows(height, [&](i32 y)
+			{
+				for (i32 x = 0; x < width; ++x)
+					pixel(glm::ivec2(x, y));
+			});
+	};
+
+	// Pre-blur. The renderer runs the diffuse pipeline for both channels
+	{
+		Blur_Params params = { PRE_BLUR_CONSTANT_ID, BLUR_CHANNEL_DIFFUSE, rotation, depth_scale, gc.prepass_blur_radius, 1.0f };
+		for_each_pixel([&](glm::ivec2 p)
+			{
+				blur_pixel(frame, params, *frame.noisy_diffuse, previous_history_length, &pre_blurred[DIFFUSE], p);
+				blur_pixel(frame, params, *frame.noisy_specular, previous_history_length, &pre_blurred[SPECULAR], p);
+			});
+	}
+
+	{
+		Temporal_Accumulation_Images images;
+		for (int c = 0; c < CHANNEL_COUNT; ++c)
+		{
+			images.input[c] = &pre_blurred[c];
+			images.history[c] = &previous_post_blurred[c];
+			images.output[c] = &accumulated[c];
+		}
+		images.previous_history_length = &previous_history_length;
+		images.previous = previous;
+		images.history_length = &history_length;
+		images.occlusion_data = occlusion_data.data();
+		for_each_pixel([&](glm::ivec2 p) { temporal_accumulation_pixel(frame, images, p); });
+	}
+
+	for_each_pixel([&](glm::ivec2 p)
+		{
+			history_fix_pixel(frame, false, accumulated[DIFFUSE], history_length, &history_fixed[DIFFUSE], p);
+			history_fix_pixel(frame, true, accumulated[SPECULAR], history_length, &history_fixed[SPECULAR], p);
+		});
+
+	{
+		Blur_Params diffuse_params = { BLUR_CONSTANT_ID, BLUR_CHANNEL_DIFFUSE, rotation, depth_scale, gc.blur_radius, 1.0f };
+		Blur_Params specular_params = diffuse_params;
+		specular_params.channel = BLUR_CHANNEL_SPECULAR;
+		for_each_pixel([&](glm::ivec2 p)
+			{
+				blur_pixel(frame, diffuse_params, history_fixed[DIFFUSE], history_length, &blurred[DIFFUSE], p);
+				blur_pixel(frame, specular_params, history_fixed[SPECULAR], history_length, &blurred[SPECULAR], p);
+			});
+	}
+
+	{
+		Blur_Params diffuse_params = { POST_BLUR_CONSTANT_ID, BLUR_CHANNEL_DIFFUSE, rotation, depth_scale, gc.blur_radius, gc.post_blur_radius_scale };
+		Blur_Params specular_params = diffuse_params;
+		specular_params.channel = BLUR_CHANNEL_SPECULAR;
+		for_each_pixel([&](glm::ivec2 p)
+			{
+				blur_pixel(frame, diffuse_params, blurred[DIFFUSE], history_length, &post_blurred[DIFFUSE], p);
+				blur_pixel(frame, specular_params, blurred[SPECULAR], history_length, &post_blurred[SPECULAR], p);
+			});
+	}
+
+	for_each_pixel([&](glm::ivec2 p)
+		{
+			for (int c = 0; c < CHANNEL_COUNT; ++c)
+				temporal_stabilization_pixel(frame, post_blurred[c], previous_stabilized[c], history_length, occlusion_data.data(), &stabilized[c], p);
+		});
+
+	for (int c = 0; c < CHANNEL_COUNT; ++c)
+	{
+		previous_post_blurred[c].texels = post_blurred[c].texels;
+		previous_stabilized[c].texels = stabilized[c].texels;
+	}
+	previous_history_length.texels = history_length.texels;
+}
+
+// Little endian PFM, rows bottom to top. Alpha is dropped
+static bool write_pfm(const std::string& path, const Cpu_Image& image)
+{
+	FILE* f = fopen(path.c_str(), "wb");
+	if (!f)
+	{
+		LOG_DEBUG("Failed to open %s for writing\n", path.c_str());
+		return false;
+	}
+
+	fprintf(f, "PF\n%d %d\n-1.0\n", image.width, image.height);
+	std::vector<float> row((size_t)image.width * 3);
+	for (i32 y = image.height - 1; y >= 0; --y)
+	{
+		for (i32 x = 0; x < image.width; ++x)
+		{
+			const glm::vec4& t = image.texels[(size_t)y * image.width + x];
+			row[x * 3 + 0] = t.x;
+			row[x * 3 + 1] = t.y;
+			row[x * 3 + 2] = t.z;
+		}
+		fwrite(row.data(), sizeof(float), row.size(), f);
+	}
+	fclose(f);
+	return true;
+}
+
+bool save_cpu_image(const char* path, const Cpu_Image& image)
+{
+	FILE* f = fopen(path, "wb");
+	if (!f)
+	{
+		LOG_DEBUG("Failed to open %s for writing\n", path);
+		return false;
+	}
+
+	i32 size[2] = { image.width, image.height };
+	bool success = fwrite(size, sizeof(size), 1, f) == 1
+		&& fwrite(image.texels.data(), sizeof(glm::vec4), image.texels.size(), f) == image.texels.size();
+	fclose(f);
+	if (!success)
+		LOG_DEBUG("Failed to write %s\n", path);
+	return success;
+}
+
+bool load_cpu_image(const char* path, Cpu_Image* image)
+{
+	FILE* f = fopen(path, "rb");
+	if (!f)
+	{
+		LOG_DEBUG("Failed to open %s\n", path);
+		return false;
+	}
+
+	i32 size[2] = {};
+	bool success = fread(size, sizeof(size), 1, f) == 1 && size[0] > 0 && size[1] > 0 && size[0] <= 16384 && size[1] <= 16384;
+	if (success)
+	{
+		image->resize(size[0], size[1]);
+		success = fread(image->texels.data(), sizeof(glm::vec4), image->texels.size(), f) == image->texels.size();
+	}
+	fclose(f);
+	if (!success)
+		LOG_DEBUG("Invalid image %s\n", path);
+	return success;
+}
+
+std::vector<std::pair<std::string, const Cpu_Image*>> Reblur_Cpu::get_pass_outputs() const
+{
+	static const char* channel_names[CHANNEL_COUNT] = { "diffuse", "specular" };
+	struct
+	{
+		const char* name;
+		const Cpu_Image* images;
+	} passes[] =
+	{
+		{ "pre_blur", pre_blurred },
+		{ "temporal_accumulation", accumulated },
+		{ "history_fix", history_fixed },
+		{ "blur", blurred },
+		{ "post_blur", post_blurred },
+		{ "temporal_stabilization", stabilized },
+	};
+
+	std::vector<std::pair<std::string, const Cpu_Image*>> outputs;
+	for (const auto& pass : passes)
+	{
+		for (int c = 0; c < CHANNEL_COUNT; ++c)
+			outputs.push_back({ std::string(pass.name) + "_" + channel_names[c], &pass.images[c] });
+	}
+	outputs.push_back({ "history_length", &history_length });
+	return outputs;
+}
+
+bool Reblur_Cpu::save_pass_outputs(const char* directory) const
+{
+	bool success = true;
+	for (const auto& [name, image] : get_pass_outputs())
+		success &= write_pfm(std::string(directory) + "/" + name + ".pfm", *image);
+	return success;
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include "defines.h"
+#include "../shared/shared.h"
+#include <vector>
+#include <string>
+#include <utility>
+
+/*
+	CPU port of the ReBLUR chain the hybrid renderer runs on the GPU, for offline renders and as a reference
+	for the shaders. The passes follow renderer.cpp pass for pass with the same Global_Constants_Data controls:
+		pre-blur -> temporal accumulation -> history fix (the alternative one) -> blur -> post-blur -> temporal stabilization
+	Every pass keeps its output so a frame can be dumped as per pass golden images. Rows are split over the
+	job system, so denoise must not be called from inside a job.
+*/
+
+// Row major float4 image. Out of bounds loads return zero like robust image loads do
+struct Cpu_Image
+{
+	i32 width = 0;
+	i32 height = 0;
+	std::vector<glm::vec4> texels;
+
+	void resize(i32 w, i32 h);
+	glm::vec4 load(glm::ivec2 p) const;
+	void store(glm::ivec2 p, const glm::vec4& v) { texels[(size_t)p.y * width + p.x] = v; }
+	// Bilinear with clamp to edge addressing, uv in [0, 1]
+	glm::vec4 sample(glm::vec2 uv) const;
+	// Four texels of the bilinear footprint at uv, in 00, 10, 01, 11 order
+	glm::mat4 gather(glm::vec2 uv) const;
+};
+
+// Raw image files, width and height as i32 and then the texels. Unlike PFM they keep alpha, so they hold captured
+// inputs and golden outputs (see tools/reblur_check.cpp)
+bool save_cpu_image(const char* path, const Cpu_Image& image);
+bool load_cpu_image(const char* path, Cpu_Image* image);
+
+// G-buffer of one frame, laid out like the render targets. Depth is reverse Z in x
+struct Reblur_Gbuffer
+{
+	Cpu_Image normal_roughness; // Octahedral normal in xy, linear roughness in z
+	Cpu_Image world_position;
+	Cpu_Image motion_vectors; // Screen UV offset to the previous frame in xy, like MOTION_VECTORS
+	Cpu_Image depth;
+};
+
+struct Reblur_Frame
+{
+	const Reblur_Gbuffer* current = nullptr;
+	const Reblur_Gbuffer* previous = nullptr; // Same as current on the first frame
+	const Cpu_Image* noisy_diffuse = nullptr; // Radiance and normalized hit distance
+	const Cpu_Image* noisy_specular = nullptr;
+	Camera_Data camera;
+	Camera_Data previous_camera;
+	Global_Constants_Data constants;
+	float history_fix_stride = 14.0f; // Not part of the constants on the GPU either
+	u32 frame_number = 0;
+};
+
+struct Reblur_Cpu
+{
+	enum Channel { DIFFUSE = 0, SPECULAR, CHANNEL_COUNT };
+
+	i32 width = 0;
+	i32 height = 0;
+
+	// Outputs of the last denoise, per channel
+	Cpu_Image pre_blurred[CHANNEL_COUNT];
+	Cpu_Image accumulated[CHANNEL_COUNT];
+	Cpu_Image history_fixed[CHANNEL_COUNT];
+	Cpu_Image blurred[CHANNEL_COUNT];
+	Cpu_Image post_blurred[CHANNEL_COUNT]; // Also the history of the next temporal accumulation
+	Cpu_Image stabilized[CHANNEL_COUNT]; // Final output
+	Cpu_Image history_length; // Accumulated frames / 255, diffuse in x and specular in y
+	std::vector<u8> occlusion_data; // Same bits as INTERNAL_OCCLUSION_DATA
+
+	void init(i32 w, i32 h);
+	// Drops the history, the next frame starts accumulating from scratch
+	void reset();
+	void denoise(const Reblur_Frame& frame);
+	// Every pass output of the last denoise in chain order, named like "blur_diffuse"
+	std::vector<std::pair<std::string, const Cpu_Image*>> get_pass_outputs() const;
+	// Writes every pass output of the last frame as <directory>/<pass>_<channel>.pfm
+	bool save_pass_outputs(const char* directory) const;
+
+private:
+	Cpu_Image previous_post_blurred[CHANNEL_COUNT];
+	Cpu_Image previous_stabilized[CHANNEL_COUNT];
+	Cpu_Image previous_history_length;
+};
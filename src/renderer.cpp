@@ -11,6 +11,12 @@
 #include "imgui/imgui_impl_vulkan.h"
 
 #include "settings.h"
+#include "jobs.h"
+#include "file_system.h"
+#include "blue_noise.h"
+#include "blas_builder.h"
+#include "sampling.h"
+#include <unordered_map>
 
 using namespace vkinit;
 
@@ -18,15 +24,61 @@ static constexpr int BINDLESS_TEXTURE_BINDING = 0;
 static constexpr int BINDLESS_VERTEX_BINDING = 1;
 static constexpr int BINDLESS_INDEX_BINDING = 2;
 static constexpr int BINDLESS_UNIFORM_BINDING = 3;
-static constexpr int BINDLESS_INSTANCE_DATA_BINDING = 4;
-static constexpr int MAX_MATERIAL_COUNT = 256;
+static constexpr int BINDLESS_PRIMITIVE_INFO_BINDING = 4;
+static constexpr int BINDLESS_INSTANCE_TABLE_BINDING = 5;
+static constexpr int BINDLESS_EMISSIVE_TRIANGLE_BINDING = 6;
+static constexpr u32 INITIAL_MATERIAL_CAPACITY = 256; // Doubles whenever more materials are registered
 
 static void vk_begin_command_buffer(VkCommandBuffer cmd);
 
+// Tiled or untiled variant of a blur pipeline, same bindings either way
+static Pipelines blur_pipeline(Pipelines index)
+{
+	return g_settings.tiled_blur ? Pipelines(index + PRE_BLUR_TILED - PRE_BLUR) : index;
+}
+
+// Matches indirect_trace_size in indirect_resolution.glsl
+static glm::ivec2 get_indirect_trace_size(glm::ivec2 size, u32 mode)
+{
+	if (mode == INDIRECT_RESOLUTION_HALF)
+		return (size + 1) / 2;
+	if (mode == INDIRECT_RESOLUTION_CHECKERBOARD)
+		return glm::ivec2((size.x + 1) / 2, size.y);
+	return size;
+}
+
+// The reservoirs are per pixel, so ReSTIR only runs with full resolution rays
+static bool restir_enabled()
+{
+	return g_settings.restir && g_settings.indirect_resolution == INDIRECT_RESOLUTION_FULL;
+}
+
 constexpr VkFormat NORMAL_ROUGHNESS_FORMAT = VK_FORMAT_A2B10G10R10_UNORM_PACK32;
 constexpr VkFormat BASECOLOR_METALNESS_FORMAT = VK_FORMAT_R8G8B8A8_UNORM;
-
-constexpr u32 MAX_INDIRECT_DRAWS = 1'000'000;
+// Screen UV offset to where the pixel was last frame, written by the G-buffer pass
+constexpr VkFormat MOTION_VECTORS_FORMAT = VK_FORMAT_R16G16_SFLOAT;
+
+// Timestamp queries, 0 and 1 are the whole frame
+static constexpr u32 GBUFFER_BEGIN_TIMESTAMP = 2;
+static constexpr u32 GBUFFER_END_TIMESTAMP = 3;
+static constexpr u32 TLAS_BEGIN_TIMESTAMP = 4;
+static constexpr u32 TLAS_END_TIMESTAMP = 5;
+static constexpr u32 INDIRECT_BEGIN_TIMESTAMP = 6;
+static constexpr u32 INDIRECT_END_TIMESTAMP = 7;
+static constexpr u32 DENOISER_END_TIMESTAMP = 8;
+static constexpr u32 PRE_BLUR_END_TIMESTAMP = 9;
+static constexpr u32 BLUR_BEGIN_TIMESTAMP = 10;
+static constexpr u32 BLUR_END_TIMESTAMP = 11;
+static constexpr u32 POST_BLUR_END_TIMESTAMP = 12;
+static constexpr u32 RADIANCE_CACHE_BEGIN_TIMESTAMP = 13;
+static constexpr u32 RADIANCE_CACHE_END_TIMESTAMP = 14;
+static constexpr u32 RESTIR_BEGIN_TIMESTAMP = 15;
+static constexpr u32 RESTIR_END_TIMESTAMP = 16;
+static constexpr u32 RESTIR_STATS_COUNT = 5; // u32s in restir_spatial.comp's stats
+// Written by the rasterizer and handed to the compute queue with async compute
+static const Render_Targets GBUFFER_TARGETS[] = { RASTER_COLOR, DEPTH, NORMAL_ROUGHNESS, BASECOLOR_METALNESS, WORLD_POSITION, MOTION_VECTORS };
+static constexpr float CAMERA_Z_NEAR = 0.1f;
+constexpr u64 GEOMETRY_POOL_HEADROOM = 1'000'000; // Extra vertices (and triangles) on top of the loaded meshes
 constexpr int MAX_BINDLESS_RESOURCES = 16536;
 constexpr int TAA_SAMPLE_COUNT = 8;
 
@@ -175,10 +227,12 @@ void Renderer::create_bindless_descriptor_set_layout()
 
 	VkDescriptorSetLayoutBinding bindless_bindings[] = {
 	vkinit::descriptor_set_layout_binding(0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, MAX_BINDLESS_RESOURCES, flags),
-	vkinit::descriptor_set_layout_binding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, MAX_BINDLESS_RESOURCES, flags),
-	vkinit::descriptor_set_layout_binding(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, MAX_BINDLESS_RESOURCES, flags),
+	vkinit::descriptor_set_layout_binding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flags), // Geometry pool vertices
+	vkinit::descriptor_set_layout_binding(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flags), // Geometry pool indices
 	vkinit::descriptor_set_layout_binding(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flags),
-	vkinit::descriptor_set_layout_binding(4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, MAX_BINDLESS_RESOURCES, flags),
+	vkinit::descriptor_set_layout_binding(4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flags), // Primitive infos
+	vkinit::descriptor_set_layout_binding(5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flags), // Instance table
+	vkinit::descriptor_set_layout_binding(6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flags), // Emissive triangles
 	};
 
 	VkDescriptorSetLayoutCreateInfo layout_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
@@ -190,7 +244,7 @@ void Renderer::create_bindless_descriptor_set_layout()
 		VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT 
 		| VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT;
 
-	VkDescriptorBindingFlags flags2[5] = { bindless_flags, bindless_flags, bindless_flags, 0, bindless_flags };
+	VkDescriptorBindingFlags flags2[7] = { bindless_flags, bindless_flags, bindless_flags, 0, bindless_flags, bindless_flags, bindless_flags };
 
 	VkDescriptorSetLayoutBindingFlagsCreateInfoEXT extended_info{ VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT, nullptr };
 	extended_info.bindingCount = (u32)std::size(bindless_bindings);
@@ -470,103 +524,139 @@ void Renderer::initialize()
 
 	create_lookup_textures();
 
-	std::string blue_noise_tex_base = "data/bluenoise/stbn_unitvec3_cosine_2Dx1D_128x128x64_";
-	for (int i = 0; i < BLUE_NOISE_TEXTURE_COUNT; ++i)
-	{
-		std::string path = blue_noise_tex_base + std::to_string(i) + ".png";
-		blue_noise[i] = context->load_texture(path.c_str());
-	}
-
-	std::string blue_noise_tex_base2 = "data/bluenoise/stbn_scalar_2Dx1Dx1D_128x128x64x1_";
-	for (int i = 0; i < BLUE_NOISE_TEXTURE_COUNT; ++i)
-	{
-		std::string path = blue_noise_tex_base2 + std::to_string(i) + ".png";
-		blue_noise_scalar[i] = context->load_texture(path.c_str());
-	}
-
-	std::string blue_noise_tex_base3 = "data/bluenoise/stbn_vec2_2Dx1D_128x128x64_";
-	for (int i = 0; i < BLUE_NOISE_TEXTURE_COUNT; ++i)
 	{
-		std::string path = blue_noise_tex_base3 + std::to_string(i) + ".png";
-		blue_noise_vec2[i] = context->load_texture(path.c_str());
+		double start = timer->get_current_time();
+		blue_noise = load_blue_noise("stbn_unitvec3_cosine_2Dx1D_128x128x64");
+		blue_noise_scalar = load_blue_noise("stbn_scalar_2Dx1Dx1D_128x128x64x1");
+		blue_noise_vec2 = load_blue_noise("stbn_vec2_2Dx1D_128x128x64");
+		LOG_DEBUG("Loaded blue noise in %.2f ms\n", (timer->get_current_time() - start) * 1000.0);
 	}
 
-	pipelines[PATH_TRACER_PIPELINE] = vk_create_rt_pipeline();
+	// Pipelines are independent of each other, create them on the job system. Pipeline creation
+	// hits the driver compiler so this is by far the most expensive part of startup on a cold cache
+	double pipeline_start_time = timer->get_current_time();
+	g_job_system->push([=]() { pipelines[PATH_TRACER_PIPELINE] = vk_create_rt_pipeline(); });
 	//primary_ray_pipeline = create_gbuffer_rt_pipeline();
 	{
 		Raster_Options opt;
-		opt.color_attachment_count = 4;
+		opt.color_attachment_count = 5;
 		opt.color_formats[0] = VK_FORMAT_R32G32B32A32_SFLOAT;
 		opt.color_formats[1] = NORMAL_ROUGHNESS_FORMAT;
 		opt.color_formats[2] = BASECOLOR_METALNESS_FORMAT;
 		opt.color_formats[3] = VK_FORMAT_R32G32B32A32_SFLOAT;
+		opt.color_formats[4] = MOTION_VECTORS_FORMAT;
 		//opt.cull_mode = VK_CULL_MODE_NONE;
-		pipelines[RASTER_PIPELINE] = create_raster_graphics_pipeline("shaders/spirv/basic.vert.spv", "shaders/spirv/basic.frag.spv", true, opt);
+		g_job_system->push([=]() { pipelines[RASTER_PIPELINE] = create_raster_graphics_pipeline("shaders/spirv/basic.vert.spv", "shaders/spirv/basic.frag.spv", true, opt); });
 
 		opt.depth_write_enable = VK_FALSE;
-		pipelines[SKYBOX_PIPELINE] = create_raster_graphics_pipeline("shaders/spirv/skybox.vert.spv", "shaders/spirv/skybox.frag.spv", false, opt);
+		g_job_system->push([=]() { pipelines[SKYBOX_PIPELINE] = create_raster_graphics_pipeline("shaders/spirv/skybox.vert.spv", "shaders/spirv/skybox.frag.spv", false, opt); });
 	}
-	pipelines[CUBEMAP_PIPELINE] = create_raster_graphics_pipeline("shaders/spirv/cube_test.vert.spv", "shaders/spirv/cube_test.frag.spv", true);
+	g_job_system->push([=]() { pipelines[CUBEMAP_PIPELINE] = create_raster_graphics_pipeline("shaders/spirv/cube_test.vert.spv", "shaders/spirv/cube_test.frag.spv", true); });
 
 	Raster_Options opt;
 	opt.color_formats[0] = VK_FORMAT_R16G16B16A16_SFLOAT;
 	//pipelines[GENERATE_CUBEMAP_PIPELINE] = create_raster_graphics_pipeline("shaders/spirv/fullscreen_quad.vert.spv", "shaders/spirv/equirectangular_to_cubemap.frag.spv", false, opt);
-	pipelines[GENERATE_CUBEMAP_PIPELINE2] = create_raster_graphics_pipeline("shaders/spirv/generate_cubemap.vert.spv", "shaders/spirv/equirectangular_to_cubemap.frag.spv", false, opt);
-	pipelines[INDIRECT_DIFFUSE_PIPELINE] = context->create_compute_pipeline("shaders/spirv/indirect_diffuse.comp.spv", bindless_set_layout);
-	pipelines[INDIRECT_SPECULAR_PIPELINE] = context->create_compute_pipeline("shaders/spirv/indirect_specular.comp.spv", bindless_set_layout);
+	g_job_system->push([=]() { pipelines[GENERATE_CUBEMAP_PIPELINE2] = create_raster_graphics_pipeline("shaders/spirv/generate_cubemap.vert.spv", "shaders/spirv/equirectangular_to_cubemap.frag.spv", false, opt); });
 
-	cubemap = context->create_cubemap(512, VK_FORMAT_R16G16B16A16_SFLOAT);
+	auto create_compute_pipeline = [=](Pipelines index, const char* path, VkDescriptorSetLayout bindless_layout = VK_NULL_HANDLE)
+	{
+		g_job_system->push([=]() { pipelines[index] = context->create_compute_pipeline(path, bindless_layout); });
+	};
+
+	create_compute_pipeline(INDIRECT_DIFFUSE_PIPELINE, "shaders/spirv/indirect_diffuse.comp.spv", bindless_set_layout);
+	create_compute_pipeline(INDIRECT_SPECULAR_PIPELINE, "shaders/spirv/indirect_specular.comp.spv", bindless_set_layout);
+	create_compute_pipeline(COMPOSITION_PIPELINE, "shaders/spirv/composition.comp.spv");
+	create_compute_pipeline(TEMPORAL_ACCUMULATION, "shaders/spirv/temporal_accumulation.comp.spv");
+	create_compute_pipeline(HISTORY_FIX_MIP_GEN, "shaders/spirv/history_fix_mip_gen.comp.spv");
+	create_compute_pipeline(HISTORY_FIX, "shaders/spirv/history_fix.comp.spv");
+	create_compute_pipeline(HISTORY_FIX_ALTERNATIVE, "shaders/spirv/history_fix_alternative.comp.spv");
+	create_compute_pipeline(TONEMAP_AND_TAA, "shaders/spirv/tonemap_and_taa.comp.spv");
+	create_compute_pipeline(TEMPORAL_STABILIZATION, "shaders/spirv/temporal_stabilization.comp.spv");
+	create_compute_pipeline(CULL_MESHLETS, "shaders/spirv/cull_meshlets.comp.spv");
+	create_compute_pipeline(DEPTH_PYRAMID, "shaders/spirv/depth_pyramid.comp.spv");
+	create_compute_pipeline(UPSAMPLE_INDIRECT, "shaders/spirv/upsample_indirect.comp.spv");
+	create_compute_pipeline(INDIRECT_ERROR, "shaders/spirv/indirect_error.comp.spv");
+	create_compute_pipeline(RADIANCE_CACHE_UPDATE, "shaders/spirv/radiance_cache_update.comp.spv", bindless_set_layout);
+	create_compute_pipeline(RADIANCE_CACHE_RESOLVE, "shaders/spirv/radiance_cache_resolve.comp.spv");
+	create_compute_pipeline(RESTIR_TEMPORAL, "shaders/spirv/restir_temporal.comp.spv", bindless_set_layout);
+	create_compute_pipeline(RESTIR_SPATIAL, "shaders/spirv/restir_spatial.comp.spv", bindless_set_layout);
+
+	// Each job needs its own copy of the specialization data
+	auto create_blur_pipeline = [=](Pipelines index, int blur_type, int channel, bool tiled)
+	{
+		g_job_system->push([=]()
+			{
+				VkSpecializationMapEntry map_entries[] = {
+					{0, 0, sizeof(int)},
+					{1, sizeof(int), sizeof(int)},
+					{2, 2 * sizeof(int), sizeof(VkBool32)}
+				};
+				int spec_data[] = { blur_type, channel, tiled ? VK_TRUE : VK_FALSE };
+				VkSpecializationInfo spec_info = {};
+				spec_info.dataSize = sizeof(spec_data);
+				spec_info.mapEntryCount = (u32)std::size(map_entries);
+				spec_info.pData = &spec_data;
+				spec_info.pMapEntries = map_entries;
+				pipelines[index] = context->create_compute_pipeline("shaders/spirv/blur.comp.spv", VK_NULL_HANDLE, &spec_info);
+			});
+	};
 
-	u32 indirect_buffer_size = MAX_INDIRECT_DRAWS * sizeof(VkDrawIndexedIndirectCommand);
-	indirect_draw_buffer = context->create_gpu_buffer(indirect_buffer_size, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	for (bool tiled : { false, true })
+	{
+		int offset = tiled ? PRE_BLUR_TILED - PRE_BLUR : 0;
+		create_blur_pipeline(Pipelines(PRE_BLUR + offset), PRE_BLUR_CONSTANT_ID, BLUR_CHANNEL_DIFFUSE, tiled);
+		create_blur_pipeline(Pipelines(PRE_BLUR_SPEC + offset), PRE_BLUR_CONSTANT_ID, BLUR_CHANNEL_SPECULAR, tiled);
+		create_blur_pipeline(Pipelines(BLUR + offset), BLUR_CONSTANT_ID, BLUR_CHANNEL_DIFFUSE, tiled);
+		create_blur_pipeline(Pipelines(BLUR_SPEC + offset), BLUR_CONSTANT_ID, BLUR_CHANNEL_SPECULAR, tiled);
+		create_blur_pipeline(Pipelines(POST_BLUR + offset), POST_BLUR_CONSTANT_ID, BLUR_CHANNEL_DIFFUSE, tiled);
+		create_blur_pipeline(Pipelines(POST_BLUR_SPEC + offset), POST_BLUR_CONSTANT_ID, BLUR_CHANNEL_SPECULAR, tiled);
+	}
+
+	cubemap = context->create_cubemap(512, VK_FORMAT_R16G16B16A16_SFLOAT);
 
 	transition_swapchain_images(get_current_frame_command_buffer());
 	create_render_targets(get_current_frame_command_buffer());
 
+	g_job_system->wait();
+	LOG_DEBUG("Created pipelines in %.2f ms on %u threads (%s pipeline cache)\n",
+		(timer->get_current_time() - pipeline_start_time) * 1000.0, g_job_system->get_thread_count(),
+		context->pipeline_cache_warm ? "warm" : "cold");
+	
+	create_samplers();
+
+	for (int i = 0; i < FRAMES_IN_FLIGHT; ++i)
+	{
+		global_constants_buffers[i] = context->allocate_buffer(sizeof(Global_Constants_Data), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_AUTO, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+		vmaMapMemory(context->allocator, global_constants_buffers[i].allocation, (void**)&global_constants_mapped[i]);
+	}
+	global_constants_buffer = global_constants_buffers[current_frame_index];
+	global_constants_data = global_constants_mapped[current_frame_index];
 
-	pipelines[COMPOSITION_PIPELINE] = context->create_compute_pipeline("shaders/spirv/composition.comp.spv");
-	pipelines[TEMPORAL_ACCUMULATION] = context->create_compute_pipeline("shaders/spirv/temporal_accumulation.comp.spv");
-	pipelines[HISTORY_FIX_MIP_GEN] = context->create_compute_pipeline("shaders/spirv/history_fix_mip_gen.comp.spv");
-	pipelines[HISTORY_FIX] = context->create_compute_pipeline("shaders/spirv/history_fix.comp.spv");
-	pipelines[HISTORY_FIX_ALTERNATIVE] = context->create_compute_pipeline("shaders/spirv/history_fix_alternative.comp.spv");
-	pipelines[TONEMAP_AND_TAA] = context->create_compute_pipeline("shaders/spirv/tonemap_and_taa.comp.spv");
+	draw_count_readback = context->allocate_buffer(FRAMES_IN_FLIGHT * sizeof(u32), VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_AUTO, VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT);
+	vmaMapMemory(context->allocator, draw_count_readback.allocation, (void**)&draw_count_readback_data);
+	memset(draw_count_readback_data, 0, FRAMES_IN_FLIGHT * sizeof(u32));
 
-	VkSpecializationMapEntry map_entries[] = {
-		{0, 0, sizeof(int)},
-		{1, sizeof(int), sizeof(int)}
-	};
-	VkSpecializationInfo spec_info = {};
-	int spec_data[] = { PRE_BLUR_CONSTANT_ID, BLUR_CHANNEL_DIFFUSE };
-	spec_info.dataSize = sizeof(spec_data);
-	spec_info.mapEntryCount = (u32)std::size(map_entries);
-	spec_info.pData = &spec_data;
-	spec_info.pMapEntries = map_entries;
-	pipelines[PRE_BLUR] = context->create_compute_pipeline("shaders/spirv/blur.comp.spv", VK_NULL_HANDLE, &spec_info);
-
-	spec_data[1] = BLUR_CHANNEL_SPECULAR;
-	pipelines[PRE_BLUR_SPEC] = context->create_compute_pipeline("shaders/spirv/blur.comp.spv", VK_NULL_HANDLE, &spec_info);
-	
-	spec_data[0] = BLUR_CONSTANT_ID;
-	spec_data[1] = BLUR_CHANNEL_DIFFUSE;
-	pipelines[BLUR] = context->create_compute_pipeline("shaders/spirv/blur.comp.spv", VK_NULL_HANDLE, &spec_info);
-	
-	spec_data[1] = BLUR_CHANNEL_SPECULAR;
-	pipelines[BLUR_SPEC] = context->create_compute_pipeline("shaders/spirv/blur.comp.spv", VK_NULL_HANDLE, &spec_info);
-	
-	spec_data[0] = POST_BLUR_CONSTANT_ID;
-	spec_data[1] = BLUR_CHANNEL_DIFFUSE;
-	pipelines[POST_BLUR] = context->create_compute_pipeline("shaders/spirv/blur.comp.spv", VK_NULL_HANDLE, &spec_info);
+	indirect_error_buffer = context->create_gpu_buffer(3 * sizeof(u32), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+	indirect_error_readback = context->allocate_buffer(FRAMES_IN_FLIGHT * 3 * sizeof(u32), VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_AUTO, VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT);
+	vmaMapMemory(context->allocator, indirect_error_readback.allocation, (void**)&indirect_error_readback_data);
+	memset(indirect_error_readback_data, 0, FRAMES_IN_FLIGHT * 3 * sizeof(u32));
 
-	spec_data[1] = BLUR_CHANNEL_SPECULAR;
-	pipelines[POST_BLUR_SPEC] = context->create_compute_pipeline("shaders/spirv/blur.comp.spv", VK_NULL_HANDLE, &spec_info);
-	
-	pipelines[TEMPORAL_STABILIZATION] = context->create_compute_pipeline("shaders/spirv/temporal_stabilization.comp.spv");
-	
-	create_samplers();
+	// Cleared by trace_indirect before the first use
+	radiance_cache_keys = context->create_gpu_buffer(RADIANCE_CACHE_SIZE * sizeof(u32), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+	radiance_cache_cells = context->create_gpu_buffer(RADIANCE_CACHE_SIZE * sizeof(Radiance_Cache_Cell), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
 
-	// TODO: Create separate buffer for each in flight frame when we remove vkDeviceWaitIdle / vkQueueWaitIdle from the main loop
-	global_constants_buffer = context->allocate_buffer(sizeof(Global_Constants_Data), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_AUTO, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
-	vmaMapMemory(context->allocator, global_constants_buffer.allocation, (void**)&global_constants_data);
+	{
+		// Also cleared by trace_indirect before the first use
+		i32 w, h;
+		platform->get_window_size(&w, &h);
+		u32 reservoir_count = 2 * (u32)w * (u32)h;
+		restir_di_reservoirs = context->create_gpu_buffer(reservoir_count * (u32)sizeof(Packed_DI_Reservoir), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+		restir_gi_reservoirs = context->create_gpu_buffer(reservoir_count * (u32)sizeof(Packed_GI_Reservoir), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+	}
+	restir_stats_buffer = context->create_gpu_buffer(RESTIR_STATS_COUNT * sizeof(u32), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+	restir_stats_readback = context->allocate_buffer(FRAMES_IN_FLIGHT * RESTIR_STATS_COUNT * sizeof(u32), VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_AUTO, VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT);
+	vmaMapMemory(context->allocator, restir_stats_readback.allocation, (void**)&restir_stats_readback_data);
+	memset(restir_stats_readback_data, 0, FRAMES_IN_FLIGHT * RESTIR_STATS_COUNT * sizeof(u32));
 
 	for (int i = 0; i < FRAMES_IN_FLIGHT; ++i)
 		query_pools[i] = context->create_query_pool();
@@ -627,10 +717,80 @@ void Renderer::vk_command_buffer_single_submit(VkCommandBuffer cmd)
 
 void Renderer::do_frame(ECS* ecs, float dt)
 {
+	select_queue_mode();
+	wait_for_frame();
 	pre_frame();
 	begin_frame();
 	draw(ecs, dt);
-	end_frame();
+	end_frame(dt);
+}
+
+// Timeline values of an async compute frame, each queue signals two per frame in submission order:
+//	graphics: G-buffer of the frame = value, present of the previous frame = value + 1
+//	compute: indirect tracing = value, denoising and composition = value + 1
+static u64 async_timeline_value(u64 frame)
+{
+	return 2 * (frame + 1);
+}
+
+void Renderer::select_queue_mode()
+{
+	// Probe visualization rasterizes on top of the composited image, which the async path produces on the compute queue
+	bool async = context->has_async_compute() && g_settings.async_compute
+		&& g_settings.rendering_mode == Rendering_Mode::HYBRID_RENDERER && !g_settings.visualize_probes;
+	if (async == async_compute_active)
+		return;
+
+	vkDeviceWaitIdle(context->device);
+	if (async)
+	{
+		// The first frame's wait for the previous one's compute work is satisfied right away
+		u64 value = async_timeline_value(frame_counter) - 1;
+		VkSemaphore timelines[] = { context->graphics_timeline_sem, context->compute_timeline_sem };
+		for (VkSemaphore timeline : timelines)
+		{
+			VkSemaphoreSignalInfo signal_info{ VK_STRUCTURE_TYPE_SEMAPHORE_SIGNAL_INFO };
+			signal_info.semaphore = timeline;
+			signal_info.value = value;
+			VK_CHECK(vkSignalSemaphore(context->device, &signal_info));
+		}
+	}
+	else if (present_pending)
+	{
+		// The last async frame is dropped, its fence still has to be signaled for the next wait on it
+		u32 previous_frame_index = (current_frame_index + FRAMES_IN_FLIGHT - 1) % FRAMES_IN_FLIGHT;
+		VK_CHECK(vkQueueSubmit(context->graphics_queue, 0, nullptr, context->frame_objects[previous_frame_index].fence));
+		present_pending = false;
+	}
+
+	// G-buffer layers owned by the other queue family read back undefined for a frame
+	async_compute_active = async;
+	needs_history_clear = true;
+	LOG_DEBUG("Async compute %s\n", async ? "enabled" : "disabled");
+}
+
+void Renderer::wait_for_frame()
+{
+	cpu_frame_begin = timer->get_current_time();
+
+	Vk_Context::Per_Frame_Objects& frame = context->frame_objects[current_frame_index];
+	vkWaitForFences(context->device, 1, &frame.fence, VK_TRUE, UINT64_MAX);
+	vkResetFences(context->device, 1, &frame.fence);
+
+	// The GPU is done with the last frame that used these
+	for (int i = 0; i < MAX_PASS_COMMAND_BUFFERS; ++i)
+	{
+		vkResetCommandPool(context->device, frame.pass_command_pools[i], 0);
+		if (context->has_async_compute())
+			vkResetCommandPool(context->device, frame.compute_pass_command_pools[i], 0);
+	}
+	pass_cmds_used = 0;
+	compute_pass_cmds_used = 0;
+	frame_cmds.clear();
+
+	gpu_camera_data = gpu_camera_buffers[current_frame_index];
+	global_constants_buffer = global_constants_buffers[current_frame_index];
+	global_constants_data = global_constants_mapped[current_frame_index];
 }
 
 // Loads the meshes from the scene and creates the acceleration structures
@@ -650,7 +810,6 @@ void Renderer::init_scene(ECS* ecs)
 		size_t resource_count = (u32)texture_manager->resources.size();
 		std::vector<VkWriteDescriptorSet> writes(resource_count);
 		std::vector<VkDescriptorImageInfo> img_infos(resource_count);
-		std::vector<VkDescriptorBufferInfo> buf_infos;
 		for (size_t i = 0; i < resource_count; ++i)
 		{
 			VkWriteDescriptorSet& w = writes[i];
@@ -668,40 +827,9 @@ void Renderer::init_scene(ECS* ecs)
 			w.pImageInfo = &img;
 		}
 		
-		{
-			// Update material descriptions
-			size_t material_count = (u32)material_manager->resources.size();
-			scene.material_buffer = context->allocate_buffer(sizeof(Material) * MAX_MATERIAL_COUNT,
-				VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
-				VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
-
-			void* mapped;
-			vmaMapMemory(context->allocator, scene.material_buffer.allocation, &mapped);
-			Material* writeaddr = (Material*)mapped;
-			for (size_t i = 0; i < material_count; ++i)
-			{
-				writeaddr[i] = material_manager->resources[i].resource;
-				//assert(material_manager->resources[i].resource.base_color != -1);
-			}
-			vmaUnmapMemory(context->allocator, scene.material_buffer.allocation);
-
-			VkDescriptorBufferInfo buf_info{};
-			buf_info.buffer = scene.material_buffer.buffer;
-			buf_info.offset = 0;
-			buf_info.range = VK_WHOLE_SIZE;
-			buf_infos.push_back(buf_info);
-
-			VkWriteDescriptorSet buf_write{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
-			buf_write.descriptorCount = 1;
-			buf_write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-			buf_write.dstArrayElement = 0;
-			buf_write.dstBinding = BINDLESS_UNIFORM_BINDING;
-			buf_write.dstSet = bindless_descriptor_set;
-			buf_write.pBufferInfo = &buf_infos.back();
-			writes.push_back(buf_write);
-		}
 		vkUpdateDescriptorSets(context->device, (u32)writes.size(), writes.data(), 0, nullptr);
 	}
+	update_material_buffer();
 
 	// Find first active camera
 	for (auto [cam] : ecs->filter<Camera_Component>())
@@ -718,129 +846,176 @@ void Renderer::init_scene(ECS* ecs)
 		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
 		VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
 		VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);*/
-	gpu_camera_data = context->create_gpu_buffer(
-		aligned_size * 2 * FRAMES_IN_FLIGHT,
-		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-		VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE);
+	for (int i = 0; i < FRAMES_IN_FLIGHT; ++i)
+	{
+		gpu_camera_buffers[i] = context->create_gpu_buffer(
+			aligned_size * 2,
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+			VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE);
+	}
+	gpu_camera_data = gpu_camera_buffers[current_frame_index];
 	VkCommandBuffer cmd = get_current_frame_command_buffer();
 	vk_begin_command_buffer(cmd);
 
 	// Prefilter envmap
 	prefiltered_envmap = prefilter_envmap(cmd, environment_map);
 
-	glm::vec3 scene_bbmin = glm::vec3(INFINITY);
-	glm::vec3 scene_bbmax = glm::vec3(-INFINITY);
-	// Create vertex / index buffers
+	// Size the geometry pool for everything that's loaded plus some room for streaming in more
+	u64 total_vertex_count = 0;
+	u64 total_index_count = 0;
+	for (const Resource<Mesh>& res : mesh_manager->resources)
+	{
+		total_vertex_count += res.resource.vertices.size();
+		total_index_count += res.resource.indices.size();
+	}
+	geometry_pool.init(context, sizeof(Packed_Vertex),
+		(u32)std::min(total_vertex_count + GEOMETRY_POOL_HEADROOM, (u64)UINT32_MAX),
+		(u32)std::min(total_index_count + GEOMETRY_POOL_HEADROOM * 3, (u64)UINT32_MAX));
+
+	// Upload geometry and fill in the primitive infos and draws for all meshes
+	std::vector<Primitive_Info> primitive_infos;
+	std::vector<Meshlet> meshlets;
+	// Vertices are packed on the worker threads, the packed copies have to live until the pool is flushed
+	std::vector<std::vector<Packed_Vertex>> packed_vertices;
+	std::atomic<u32> pack_counter = 0;
+	u64 packed_vertex_count = 0;
 	for (auto [mesh] : ecs->filter<Static_Mesh_Component>())
 	{
 		Mesh* m = mesh->manager->get_resource_with_id(mesh->mesh_id);
-		if (m->vertex_buffer.buffer != VK_NULL_HANDLE && m->index_buffer.buffer != VK_NULL_HANDLE)
+		if (m->geometry.index_count != 0)
 			continue;
+		// Meshes that didn't go through the importers, the raster pass only draws meshlets
+		if (m->meshlets.empty())
+			build_mesh_meshlets(m);
 
-		scene_bbmin = glm::min(m->bbmin, scene_bbmin);
-		scene_bbmax = glm::max(m->bbmax, scene_bbmax);
-		create_vertex_buffer(m, cmd, context);
-		create_index_buffer(m, cmd, context);
-		
-		u32 prim_count = (u32)m->primitives.size();
-		m->instance_data_buffer = context->create_gpu_buffer((u32)(m->primitives.size() * sizeof(Primitive_Info)), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
-		std::vector<Primitive_Info> primitive_infos(prim_count);
-		std::vector<VkDrawIndexedIndirectCommand> indirect_draw_commands(prim_count);
-		for (u32 i = 0; i < prim_count; ++i)
-		{
-			u32 mesh_id = mesh->mesh_id;
-			u32 index = ((m->primitives[i].material_id & 0x3FF) << 14) | (mesh_id & 0x3FFF);
-
-			indirect_draw_commands[i].indexCount = m->primitives[i].vertex_count;
-			indirect_draw_commands[i].instanceCount = 1;
-			indirect_draw_commands[i].firstIndex = m->primitives[i].vertex_offset;
-			indirect_draw_commands[i].vertexOffset = 0;
-			indirect_draw_commands[i].firstInstance = index;
+		std::vector<Packed_Vertex>& packed = packed_vertices.emplace_back(m->vertices.size());
+		Packed_Vertex* packed_data = packed.data();
+		g_job_system->push([=]() { pack_vertices((u32)m->vertices.size(), m->vertices.data(), packed_data); }, &pack_counter);
+		packed_vertex_count += m->vertices.size();
 
-			primitive_infos[i].material_index = m->primitives[i].material_id;
-			primitive_infos[i].vertex_count = m->primitives[i].vertex_count;
-			primitive_infos[i].vertex_offset = m->primitives[i].vertex_offset;
+		// The pool is sized for every loaded mesh, running out means init clamped it to the storage buffer range
+		if (!geometry_pool.allocate((u32)m->vertices.size(), (u32)m->indices.size(), &m->geometry))
+		{
+			LOG_DEBUG("Geometry pool out of space for %zu vertices, %zu indices (%u / %u vertices, %u / %u indices used)\n",
+				m->vertices.size(), m->indices.size(), geometry_pool.vertex_allocator.used, geometry_pool.vertex_allocator.capacity,
+				geometry_pool.index_allocator.used * 3, geometry_pool.index_allocator.capacity * 3);
+			abort();
+		}
+		geometry_pool.upload(m->geometry, packed_data, m->indices.data());
+		m->vertex_buffer_address = geometry_pool.get_vertex_address(m->geometry);
+		m->index_buffer_address = geometry_pool.get_index_address(m->geometry);
+		m->first_primitive = (u32)primitive_infos.size();
+		m->first_meshlet = (u32)meshlets.size();
+		scene_meshes.push_back(m);
+
+		for (const Meshlet& meshlet : m->meshlets)
+		{
+			Meshlet gpu_meshlet = meshlet;
+			gpu_meshlet.first_index += m->geometry.index_offset;
+			gpu_meshlet.primitive_index += m->first_primitive; // Shaders look up the primitive info with it, draws take the instance from the placed meshlet
+			meshlets.push_back(gpu_meshlet);
 		}
-		indirect_draw_buffer.update_staging_buffer(context->allocator, current_frame_index, indirect_draw_commands.data(), indirect_draw_commands.size() * sizeof(indirect_draw_commands[0]));
-		indirect_draw_buffer.upload(cmd, current_frame_index);
 
-		m->instance_data_buffer.update_staging_buffer(context->allocator, current_frame_index, primitive_infos.data(), primitive_infos.size() * sizeof(primitive_infos[0]));
-		m->instance_data_buffer.upload(cmd, current_frame_index);
+		for (const Mesh_Primitive& prim : m->primitives)
+		{
+			// Hit shaders fetch the triangles of the LOD the BLAS was built from
+			Mesh_Lod rt_lod = get_primitive_lod(prim, (u32)std::max(g_settings.ray_tracing_lod, 0));
+			Primitive_Info info{};
+			info.material_index = prim.material_id;
+			info.vertex_count = rt_lod.vertex_count;
+			info.vertex_offset = m->geometry.index_offset + rt_lod.vertex_offset;
+			info.base_vertex = m->geometry.vertex_offset;
+			primitive_infos.push_back(info);
+			scene_primitives.push_back(&prim);
+		}
 	}
+	g_job_system->wait(&pack_counter);
+	geometry_pool.flush(cmd);
+	packed_vertices.clear();
+	LOG_DEBUG("Geometry pool: %u / %u vertices, %u / %u indices, %u primitives\n", 
+		geometry_pool.vertex_allocator.used, geometry_pool.vertex_allocator.capacity,
+		geometry_pool.index_allocator.used * 3, geometry_pool.index_allocator.capacity * 3, (u32)primitive_infos.size());
+	LOG_DEBUG("Scene vertices: %.2f MB packed, %.2f MB unpacked. Vertex fetch per hit: %u bytes, was %u\n",
+		(double)(packed_vertex_count * sizeof(Packed_Vertex)) / (1024.0 * 1024.0),
+		(double)(packed_vertex_count * sizeof(Vertex)) / (1024.0 * 1024.0),
+		(u32)(3 * sizeof(Packed_Vertex)), (u32)(3 * sizeof(Vertex)));
+
+	primitive_count = (u32)primitive_infos.size();
+	meshlet_count = (u32)meshlets.size();
+	primitive_info_buffer = context->create_gpu_buffer((u32)(std::max(primitive_count, 1u) * sizeof(Primitive_Info)), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	meshlet_buffer = context->create_gpu_buffer((u32)(std::max(meshlet_count, 1u) * sizeof(Meshlet)), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	draw_count_buffer = context->create_gpu_buffer(sizeof(u32), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+	primitive_lod_meshlet_counts.assign(primitive_count * (MAX_MESH_LODS + 1), 0);
+	for (const Meshlet& meshlet : meshlets)
+		primitive_lod_meshlet_counts[meshlet.primitive_index * (MAX_MESH_LODS + 1) + meshlet.lod]++;
+	if (primitive_count != 0)
+		context->upload_ring.upload(&primitive_info_buffer, primitive_infos.data(), primitive_infos.size() * sizeof(primitive_infos[0]));
+	if (meshlet_count != 0)
+		context->upload_ring.upload(&meshlet_buffer, meshlets.data(), meshlets.size() * sizeof(meshlets[0]));
+	LOG_DEBUG("Scene meshlets: %u, %.2f MB\n", meshlet_count, (double)(meshlets.size() * sizeof(Meshlet)) / (1024.0 * 1024.0));
+
+	glm::vec3 scene_bbmin, scene_bbmax;
+	create_instance_table(ecs, &scene_bbmin, &scene_bbmax);
+	create_emissive_light_table();
+	// At most one draw per meshlet instance, culling writes them on the GPU
+	indirect_draw_buffer = context->create_gpu_buffer((u32)(std::max(meshlet_instance_count, 1u) * sizeof(VkDrawIndexedIndirectCommand)), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	context->upload_ring.flush(cmd);
 
 	memory_barrier(cmd,
 		VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
 		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR);
 
-	for (auto [mesh] : ecs->filter<Static_Mesh_Component>())
+	// The BLAS builder submits its own work and reads back compacted sizes, so the geometry has to be uploaded first
+	vkEndCommandBuffer(cmd);
+	vk_command_buffer_single_submit(cmd);
+	vkQueueWaitIdle(context->graphics_queue);
+
+	double blas_start = timer->get_current_time();
+	build_bottom_level_acceleration_structures();
+	blas_build_time = timer->get_current_time() - blas_start;
+	u64 rt_triangle_count = 0, full_triangle_count = 0;
+	for (Mesh* m : scene_meshes)
 	{
-		Mesh* m = mesh->manager->get_resource_with_id(mesh->mesh_id);
-		create_bottom_level_acceleration_structure(m);
-		build_bottom_level_acceleration_structure(m, cmd);
+		for (const Mesh_Primitive& prim : m->primitives)
+		{
+			rt_triangle_count += get_primitive_lod(prim, (u32)std::max(g_settings.ray_tracing_lod, 0)).vertex_count / 3;
+			full_triangle_count += prim.vertex_count / 3;
+		}
 	}
-	memory_barrier(cmd,
-		VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
-		VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR,
-		VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
-		VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR);
+	LOG_DEBUG("BLAS: LOD %d, %llu triangles, %.2f MB compacted, %.2f MB before compaction, built in %.2f ms. Full detail: %llu triangles, %.2f MB uncompacted\n",
+		g_settings.ray_tracing_lod, rt_triangle_count, (double)blas_memory / (1024.0 * 1024.0), (double)blas_memory_uncompacted / (1024.0 * 1024.0),
+		blas_build_time * 1000.0, full_triangle_count, (double)blas_memory_full_detail / (1024.0 * 1024.0));
+
+	vk_begin_command_buffer(cmd);
 	create_top_level_acceleration_structure(ecs, cmd);
 
 	vkEndCommandBuffer(cmd);
 	vk_command_buffer_single_submit(cmd);
 
 	{
-		// Update vertex / index buffers
-		size_t mesh_count = mesh_manager->resources.size();
-		constexpr u32 buffer_count_per_mesh = 3;
-		std::vector<VkWriteDescriptorSet> writes(mesh_count * buffer_count_per_mesh);
-		std::vector<VkDescriptorBufferInfo> buf_infos(mesh_count * buffer_count_per_mesh);
-		for (size_t i = 0; i < mesh_count; ++i)
-		{
-			Mesh* m = &mesh_manager->resources[i].resource;
-
-			VkDescriptorBufferInfo buffer_info[buffer_count_per_mesh];
-			buffer_info[0].buffer = m->vertex_buffer.buffer;
-			buffer_info[0].offset = 0;
-			buffer_info[0].range = VK_WHOLE_SIZE;
-			buffer_info[1].buffer = m->index_buffer.buffer;
-			buffer_info[1].offset = 0;
-			buffer_info[1].range = VK_WHOLE_SIZE;
-			buffer_info[2].buffer = m->instance_data_buffer.gpu_buffer.buffer;
-			buffer_info[2].offset = 0;
-			buffer_info[2].range = VK_WHOLE_SIZE;
-
-			VkWriteDescriptorSet vwrite{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
-			VkWriteDescriptorSet iwrite{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
-			VkWriteDescriptorSet instance_write{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
-			vwrite.descriptorCount = 1;
-			vwrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-			vwrite.dstArrayElement = (u32)i;
-			vwrite.dstBinding = BINDLESS_VERTEX_BINDING;
-			vwrite.dstSet = bindless_descriptor_set;
-			buf_infos[i * buffer_count_per_mesh] = buffer_info[0];
-			vwrite.pBufferInfo = &buf_infos[i * buffer_count_per_mesh];
-
-			iwrite.descriptorCount = 1;
-			iwrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-			iwrite.dstArrayElement = (u32)i;
-			iwrite.dstBinding = BINDLESS_INDEX_BINDING;
-			iwrite.dstSet = bindless_descriptor_set;
-			buf_infos[i * buffer_count_per_mesh + 1] = buffer_info[1];
-			iwrite.pBufferInfo = &buf_infos[i * buffer_count_per_mesh + 1];
-
-			instance_write.descriptorCount = 1;
-			instance_write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-			instance_write.dstArrayElement = (u32)i;
-			instance_write.dstBinding = BINDLESS_INSTANCE_DATA_BINDING;
-			instance_write.dstSet = bindless_descriptor_set;
-			buf_infos[i * buffer_count_per_mesh + 2] = buffer_info[2];
-			instance_write.pBufferInfo = &buf_infos[i * buffer_count_per_mesh + 2];
-
-			writes[i * buffer_count_per_mesh + 0] = vwrite;
-			writes[i * buffer_count_per_mesh + 1] = iwrite;
-			writes[i * buffer_count_per_mesh + 2] = instance_write;
+		// The whole scene's geometry, primitive infos, instances and emissive triangles are one buffer each
+		VkDescriptorBufferInfo buffer_info[] = {
+			vkinit::descriptor_buffer_info(geometry_pool.vertex_buffer.buffer),
+			vkinit::descriptor_buffer_info(geometry_pool.index_buffer.buffer),
+			vkinit::descriptor_buffer_info(primitive_info_buffer.gpu_buffer.buffer),
+			vkinit::descriptor_buffer_info(instance_table_buffer.gpu_buffer.buffer),
+			vkinit::descriptor_buffer_info(emissive_triangle_buffer.gpu_buffer.buffer),
+		};
+		u32 bindings[] = { BINDLESS_VERTEX_BINDING, BINDLESS_INDEX_BINDING, BINDLESS_PRIMITIVE_INFO_BINDING, BINDLESS_INSTANCE_TABLE_BINDING,
+			BINDLESS_EMISSIVE_TRIANGLE_BINDING };
+
+		VkWriteDescriptorSet writes[std::size(bindings)];
+		for (size_t i = 0; i < std::size(bindings); ++i)
+		{
+			writes[i] = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+			writes[i].descriptorCount = 1;
+			writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			writes[i].dstArrayElement = 0;
+			writes[i].dstBinding = bindings[i];
+			writes[i].dstSet = bindless_descriptor_set;
+			writes[i].pBufferInfo = &buffer_info[i];
 		}
-		vkUpdateDescriptorSets(context->device, (u32)writes.size(), writes.data(), 0, nullptr);
+		vkUpdateDescriptorSets(context->device, (u32)std::size(writes), writes, 0, nullptr);
 	}
 
 	{
@@ -862,6 +1037,68 @@ void Renderer::init_scene(ECS* ecs)
 	}
 }
 
+void Renderer::update_material_buffer()
+{
+	u32 material_count = (u32)material_manager->resources.size();
+	if (material_capacity != 0 && material_count == uploaded_material_count)
+		return;
+
+	if (material_count > material_capacity)
+	{
+		u32 capacity = std::max(material_capacity, INITIAL_MATERIAL_CAPACITY);
+		while (capacity < material_count)
+			capacity *= 2;
+
+		// Frames in flight read the old buffer through the descriptor, which can't change under them. Growing is rare
+		if (material_capacity != 0)
+		{
+			vkDeviceWaitIdle(context->device);
+			vmaDestroyBuffer(context->allocator, scene.material_buffer.buffer, scene.material_buffer.allocation);
+		}
+		else
+		{
+			// Not allocate_buffer, the buffers it replaces are destroyed right away. This destroys whichever is current
+			g_garbage_collector->push([this]()
+				{
+					vmaDestroyBuffer(context->allocator, scene.material_buffer.buffer, scene.material_buffer.allocation);
+				}, Garbage_Collector::SHUTDOWN);
+		}
+
+		VkBufferCreateInfo buffer_info{ VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+		buffer_info.size = capacity * sizeof(Material);
+		buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+		context->set_concurrent_sharing(&buffer_info);
+		VmaAllocationCreateInfo alloc_info{};
+		alloc_info.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+		alloc_info.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT;
+		VK_CHECK(vmaCreateBuffer(context->allocator, &buffer_info, &alloc_info, &scene.material_buffer.buffer, &scene.material_buffer.allocation, nullptr));
+		material_capacity = capacity;
+		uploaded_material_count = 0;
+
+		VkDescriptorBufferInfo buf_info = vkinit::descriptor_buffer_info(scene.material_buffer.buffer);
+		VkWriteDescriptorSet buf_write{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+		buf_write.descriptorCount = 1;
+		buf_write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		buf_write.dstArrayElement = 0;
+		buf_write.dstBinding = BINDLESS_UNIFORM_BINDING;
+		buf_write.dstSet = bindless_descriptor_set;
+		buf_write.pBufferInfo = &buf_info;
+		vkUpdateDescriptorSets(context->device, 1, &buf_write, 0, nullptr);
+		LOG_DEBUG("Material buffer: %u materials, room for %u\n", material_count, capacity);
+	}
+
+	// Only the new materials are written, nothing in flight reads them yet
+	void* mapped;
+	vmaMapMemory(context->allocator, scene.material_buffer.allocation, &mapped);
+	Material* writeaddr = (Material*)mapped;
+	for (u32 i = uploaded_material_count; i < material_count; ++i)
+		writeaddr[i] = material_manager->resources[i].resource;
+	vmaUnmapMemory(context->allocator, scene.material_buffer.allocation);
+	vmaFlushAllocation(context->allocator, scene.material_buffer.allocation,
+		uploaded_material_count * sizeof(Material), (material_count - uploaded_material_count) * sizeof(Material));
+	uploaded_material_count = material_count;
+}
+
 void full_barrier(VkCommandBuffer cmd)
 {
 	VkMemoryBarrier2 barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER_2 };
@@ -881,6 +1118,7 @@ void full_barrier(VkCommandBuffer cmd)
 void Renderer::pre_frame()
 {
 	g_garbage_collector->collect();
+	update_material_buffer();
 
 
 	scene.previous_frame_camera = scene.current_frame_camera;
@@ -890,17 +1128,20 @@ void Renderer::pre_frame()
 		frames_accumulated = 0;
 		scene.active_camera->dirty = false;
 	}
+	// Restart the accumulation, so both settings are compared after the same number of frames
+	if (g_settings.emissive_light_sampling != emissive_sampling_accumulated)
+	{
+		frames_accumulated = 0;
+		emissive_sampling_accumulated = g_settings.emissive_light_sampling;
+	}
 
 	scene.current_frame_camera.view = scene.active_camera->get_view_matrix();
-	scene.current_frame_camera.proj = scene.active_camera->get_projection_matrix(aspect_ratio, 0.1f, 1000.f);
+	scene.current_frame_camera.proj = scene.active_camera->get_projection_matrix(aspect_ratio, CAMERA_Z_NEAR, 1000.f);
 	scene.current_frame_camera.viewproj = scene.current_frame_camera.proj * scene.current_frame_camera.view;
 	scene.current_frame_camera.inverse_proj = glm::inverse(scene.current_frame_camera.proj);
 	scene.current_frame_camera.inverse_view = glm::inverse(scene.current_frame_camera.view);
 	scene.current_frame_camera.frame_index = glm::uvec4((u32)frame_counter);
 
-	gpu_camera_data.update_staging_buffer(context->allocator, current_frame_index, &scene.current_frame_camera, sizeof(Camera_Data));
-	gpu_camera_data.update_staging_buffer(context->allocator, current_frame_index, &scene.previous_frame_camera, sizeof(Camera_Data), sizeof(Camera_Data));
-
 	float unproject_y = 1.0f / tan(glm::radians(scene.active_camera->fov * 0.5f));
 	float unproject = 1.0f / (0.5f * (float)window_height * unproject_y);
 	glm::vec3 sun_direction = math::polar_to_unit_vec(glm::radians(g_settings.sun_azimuth), glm::radians(g_settings.sun_zenith));
@@ -947,54 +1188,147 @@ void Renderer::pre_frame()
 	global_constants_data->use_roughness_override = (u32)g_settings.use_roughness_override;
 	global_constants_data->indirect_diffuse = (u32)g_settings.indirect_diffuse;
 	global_constants_data->indirect_specular = (u32)g_settings.indirect_specular;
+	global_constants_data->radiance_cache = (u32)g_settings.radiance_cache;
+	global_constants_data->radiance_cache_cell_scale = g_settings.radiance_cache_cell_scale;
+	global_constants_data->emissive_sampling = (u32)g_settings.emissive_light_sampling;
+	global_constants_data->emissive_triangle_count = emissive_triangle_count;
+	global_constants_data->emissive_total_power = emissive_total_power;
+	global_constants_data->restir = (u32)restir_enabled();
+}
+
+void Renderer::select_lods()
+{
+	if (instance_table.empty())
+		return;
+
+	// Pixels per unit of error at distance 1
+	float pixel_scale = 0.5f * (float)window_height / tan(glm::radians(scene.active_camera->fov * 0.5f));
+	glm::vec3 camera_pos = scene.active_camera->origin;
+	raster_triangle_count = 0;
+	u32 lod_meshlet_count = 0;
+
+	for (size_t i = 0; i < instance_table.size(); ++i)
+	{
+		const Instance_Data& instance = instance_table[i];
+		const Mesh_Primitive& prim = *scene_primitives[instance.primitive_index];
+
+		// Coarsest LOD whose error stays under the threshold when projected at the nearest point of the bounding sphere.
+		// Errors and the sphere are in mesh units, they grow with the instance's largest scale axis
+		u32 lod = 0;
+		if (g_settings.raster_lods)
+		{
+			glm::mat3 m = glm::mat3(instance.transform);
+			float scale = sqrtf(std::max(std::max(glm::dot(m[0], m[0]), glm::dot(m[1], m[1])), glm::dot(m[2], m[2])));
+			glm::vec3 center = glm::vec3(instance.transform * glm::vec4(glm::vec3(prim.bounding_sphere), 1.0f));
+			float distance = std::max(glm::length(center - camera_pos) - prim.bounding_sphere.w * scale, 1e-4f);
+			while (lod < prim.lods.size() && prim.lods[lod].error * scale * pixel_scale / distance <= g_settings.lod_pixel_error)
+				lod++;
+		}
+		instance_lods[i] = lod;
+		raster_triangle_count += get_primitive_lod(prim, lod).vertex_count / 3;
+		lod_meshlet_count += primitive_lod_meshlet_counts[instance.primitive_index * (MAX_MESH_LODS + 1) + lod];
+	}
+	lod_meshlet_counts[current_frame_index] = lod_meshlet_count;
+
+	size_t size = instance_lods.size() * sizeof(u32);
+	context->upload_ring.upload(&instance_lod_buffer, instance_lods.data(), size, current_frame_index * size);
 }
 
 void Renderer::begin_frame()
 {
-	cpu_frame_begin = timer->get_current_time();
+	// Async frames acquire the swapchain image when they are presented, at the end of the next frame
+	if (!async_compute_active)
+	{
+		vkAcquireNextImageKHR(context->device, context->swapchain,
+			UINT64_MAX, context->frame_objects[current_frame_index].image_available_sem,
+			VK_NULL_HANDLE, &swapchain_image_index);
+	}
+
+	// The GPU is done with this frame's staging memory
+	context->upload_ring.begin_frame(current_frame_index);
+	context->upload_ring.upload(&gpu_camera_data, &scene.current_frame_camera, sizeof(Camera_Data));
+	context->upload_ring.upload(&gpu_camera_data, &scene.previous_frame_camera, sizeof(Camera_Data), sizeof(Camera_Data));
 
-	vkWaitForFences(context->device, 1, &context->frame_objects[current_frame_index].fence, VK_TRUE, UINT64_MAX);
-	double after_fence = timer->get_current_time();
-	//printf("fence wait time: %f\n", after_fence - cpu_frame_begin);
-	vkResetFences(context->device, 1, &context->frame_objects[current_frame_index].fence);
-	vkAcquireNextImageKHR(context->device, context->swapchain,
-		UINT64_MAX, context->frame_objects[current_frame_index].image_available_sem,
-		VK_NULL_HANDLE, &swapchain_image_index);
+	// Culling results of the last frame that used this frame's resources
+	vmaInvalidateAllocation(context->allocator, draw_count_readback.allocation, current_frame_index * sizeof(u32), sizeof(u32));
+	visible_meshlet_count = draw_count_readback_data[current_frame_index];
+	tested_meshlet_count = lod_meshlet_counts[current_frame_index];
+	if (g_settings.indirect_error_metric && indirect_reference_valid)
+	{
+		// Sums in 1/256 fixed point, see indirect_error.comp
+		vmaInvalidateAllocation(context->allocator, indirect_error_readback.allocation, current_frame_index * 3 * sizeof(u32), 3 * sizeof(u32));
+		float scale = 1.0f / (256.0f * (float)window_width * (float)window_height);
+		indirect_diffuse_error = (float)indirect_error_readback_data[current_frame_index * 3] * scale;
+		indirect_specular_error = (float)indirect_error_readback_data[current_frame_index * 3 + 1] * scale;
+		indirect_noisy_diffuse_error = (float)indirect_error_readback_data[current_frame_index * 3 + 2] * scale;
+	}
+	if (restir_enabled())
+	{
+		// Sample count sums of the final reservoirs, see restir_spatial.comp
+		vmaInvalidateAllocation(context->allocator, restir_stats_readback.allocation, current_frame_index * RESTIR_STATS_COUNT * sizeof(u32), RESTIR_STATS_COUNT * sizeof(u32));
+		const u32* stats = restir_stats_readback_data + current_frame_index * RESTIR_STATS_COUNT;
+		double pixels = (double)std::max(stats[4], 1u);
+		restir_direct_spp = (float)((double)(stats[0] | (u64)stats[1] << 32) / pixels);
+		restir_indirect_spp = (float)((double)(stats[2] | (u64)stats[3] << 32) / pixels);
+	}
+	select_lods();
 
 	VkCommandBuffer cmd = get_current_frame_command_buffer();
-	VkImage next_image = context->swapchain_images[swapchain_image_index];
 
 
 	// Time from two frames ago
-	u64 query_results[2];
+	// The G-buffer and indirect timestamps are only written in the hybrid mode and the TLAS ones when something moved,
+	// unavailable ones are left at 0
+	u64 query_results[17] = {};
 	vkGetQueryPoolResults(context->device, query_pools[current_frame_index], 0, (u32)std::size(query_results), sizeof(query_results), query_results, sizeof(query_results[0]), VK_QUERY_RESULT_64_BIT);
-	double frame_gpu_begin = double(query_results[0]) * context->physical_device_properties.properties.limits.timestampPeriod;
-	double frame_gpu_end = double(query_results[1]) * context->physical_device_properties.properties.limits.timestampPeriod;
+	double timestamp_period = context->physical_device_properties.properties.limits.timestampPeriod;
+	double frame_gpu_begin = double(query_results[0]) * timestamp_period;
+	double frame_gpu_end = double(query_results[1]) * timestamp_period;
 
 	current_frame_gpu_time = frame_gpu_end - frame_gpu_begin;
+	gbuffer_gpu_time = double(query_results[GBUFFER_END_TIMESTAMP] - query_results[GBUFFER_BEGIN_TIMESTAMP]) * timestamp_period;
+	tlas_update_gpu_time = double(query_results[TLAS_END_TIMESTAMP] - query_results[TLAS_BEGIN_TIMESTAMP]) * timestamp_period;
+	indirect_gpu_time = double(query_results[INDIRECT_END_TIMESTAMP] - query_results[INDIRECT_BEGIN_TIMESTAMP]) * timestamp_period;
+	denoiser_gpu_time = double(query_results[DENOISER_END_TIMESTAMP] - query_results[INDIRECT_END_TIMESTAMP]) * timestamp_period;
+	pre_blur_gpu_time = double(query_results[PRE_BLUR_END_TIMESTAMP] - query_results[INDIRECT_END_TIMESTAMP]) * timestamp_period;
+	blur_gpu_time = double(query_results[BLUR_END_TIMESTAMP] - query_results[BLUR_BEGIN_TIMESTAMP]) * timestamp_period;
+	post_blur_gpu_time = double(query_results[POST_BLUR_END_TIMESTAMP] - query_results[BLUR_END_TIMESTAMP]) * timestamp_period;
+	radiance_cache_gpu_time = g_settings.radiance_cache ? double(query_results[RADIANCE_CACHE_END_TIMESTAMP] - query_results[RADIANCE_CACHE_BEGIN_TIMESTAMP]) * timestamp_period : 0.0;
+	restir_gpu_time = restir_enabled() ? double(query_results[RESTIR_END_TIMESTAMP] - query_results[RESTIR_BEGIN_TIMESTAMP]) * timestamp_period : 0.0;
+	if (!g_settings.restir && g_settings.indirect_resolution == INDIRECT_RESOLUTION_FULL && query_results[INDIRECT_END_TIMESTAMP] != 0)
+		indirect_gpu_time_without_restir = indirect_gpu_time;
 	vkResetCommandBuffer(cmd, 0);
 	vk_begin_command_buffer(cmd);
 
 	vkCmdResetQueryPool(cmd, query_pools[current_frame_index], 0, 128);
 	vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pools[current_frame_index], 0);
 
-	// Update camera data
-	gpu_camera_data.upload(cmd, current_frame_index);
+	// Camera data and anything else queued for this frame
+	context->upload_ring.flush(cmd);
 	
 	vkinit::memory_barrier2(
 		cmd,
 		VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_ACCESS_2_SHADER_READ_BIT,
 		VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR
 	);
+	vkinit::memory_barrier2(
+		cmd,
+		VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_ACCESS_2_SHADER_READ_BIT,
+		VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT
+	);
+
+	if (async_compute_active)
+		return;
 
-	vk_transition_layout(cmd, next_image,
+	vk_transition_layout(cmd, context->swapchain_images[swapchain_image_index],
 		VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
 		VK_ACCESS_HOST_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
 		VK_PIPELINE_STAGE_HOST_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT
 	);
 	
+	// Overwritten completely, the async path may also have left it released to the graphics queue
 	vk_transition_layout(cmd, final_output.image,
-		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL,
+		VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
 		VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_SHADER_WRITE_BIT,
 		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
 	);
@@ -1057,10 +1391,8 @@ void Renderer::trace_primary_rays()
 	// Trace rays
 }
 
-void Renderer::end_frame()
+void Renderer::blit_to_swapchain(VkCommandBuffer cmd)
 {
-	VkCommandBuffer cmd = get_current_frame_command_buffer();
-
 	VkImageBlit region{};
 	VkImageSubresourceLayers src_layer{};
 	src_layer.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -1078,10 +1410,11 @@ void Renderer::end_frame()
 	dst_layer.mipLevel = 0;
 	dst_layer.layerCount = 1;
 	region.dstSubresource = dst_layer;
+	// Written by compute and by the UI overlay's color attachment
 	vk_transition_layout(cmd, final_output.image,
 		VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-		VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
-		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT
+		VK_ACCESS_MEMORY_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+		VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT
 	);
 	VkImage next_image = context->swapchain_images[swapchain_image_index];
 	vkCmdBlitImage(cmd, 
@@ -1092,38 +1425,146 @@ void Renderer::end_frame()
 		VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT,
 		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT
 	);
-	
-	vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pools[current_frame_index], 1);
+}
 
-	VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+void Renderer::end_frame(float dt)
+{
+	if (async_compute_active)
+	{
+		if (present_pending)
+		{
+			// Present the previous frame, the compute queue has finished it or is about to
+			u32 frame_index = (current_frame_index + FRAMES_IN_FLIGHT - 1) % FRAMES_IN_FLIGHT;
+			Vk_Context::Per_Frame_Objects& frame = context->frame_objects[frame_index];
+			u64 timeline_value = async_timeline_value(frame_counter);
+
+			vkAcquireNextImageKHR(context->device, context->swapchain,
+				UINT64_MAX, frame.image_available_sem, VK_NULL_HANDLE, &swapchain_image_index);
+
+			VkCommandBuffer cmd = frame.present_cmd;
+			vkResetCommandBuffer(cmd, 0);
+			vk_begin_command_buffer(cmd);
+
+			VkImageMemoryBarrier2 acquire = vkinit::image_ownership_barrier2(final_output.image,
+				context->compute_idx, context->graphics_idx, true);
+			VkDependencyInfo deps{ VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
+			deps.imageMemoryBarrierCount = 1;
+			deps.pImageMemoryBarriers = &acquire;
+			vkCmdPipelineBarrier2(cmd, &deps);
+
+			vk_transition_layout(cmd, context->swapchain_images[swapchain_image_index],
+				VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				VK_ACCESS_HOST_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+				VK_PIPELINE_STAGE_HOST_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT
+			);
+
+			ui_overlay.update_and_render(cmd, dt);
+			blit_to_swapchain(cmd);
+			vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pools[frame_index], 1);
+			vkEndCommandBuffer(cmd);
+
+			VkCommandBufferSubmitInfo cmd_info = vkinit::command_buffer_submit_info(cmd);
+			VkSemaphoreSubmitInfo waits[] = {
+				vkinit::semaphore_submit_info(context->compute_timeline_sem, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, timeline_value - 1),
+				vkinit::semaphore_submit_info(frame.image_available_sem, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT),
+			};
+			VkSemaphoreSubmitInfo signals[] = {
+				vkinit::semaphore_submit_info(context->graphics_timeline_sem, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, timeline_value + 1),
+				vkinit::semaphore_submit_info(frame.render_finished_sem, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT),
+			};
+			VkSubmitInfo2 submit = vkinit::submit_info2(1, &cmd_info, (u32)std::size(waits), waits, (u32)std::size(signals), signals);
+			VK_CHECK(vkQueueSubmit2(context->graphics_queue, 1, &submit, frame.fence));
+
+			VkPresentInfoKHR present_info{ VK_STRUCTURE_TYPE_PRESENT_INFO_KHR };
+			present_info.swapchainCount = 1;
+			present_info.pSwapchains = &context->swapchain;
+			present_info.pImageIndices = &swapchain_image_index;
+			present_info.waitSemaphoreCount = 1;
+			present_info.pWaitSemaphores = &frame.render_finished_sem;
+			vkQueuePresentKHR(context->graphics_queue, &present_info);
+		}
+		present_pending = true;
 
-	VkSubmitInfo submit{ VK_STRUCTURE_TYPE_SUBMIT_INFO };
-	submit.commandBufferCount = 1;
-	submit.pCommandBuffers = &cmd;
-	submit.signalSemaphoreCount = 1;
-	submit.waitSemaphoreCount = 1;
-	submit.pWaitDstStageMask = &wait_stage;
-	submit.pWaitSemaphores = &context->frame_objects[current_frame_index].image_available_sem;
-	submit.pSignalSemaphores = &context->frame_objects[current_frame_index].render_finished_sem;
+		cpu_frame_end = timer->get_current_time();
+	}
+	else
+	{
+		// Left open by draw after the UI overlay
+		VkCommandBuffer cmd = frame_cmds.back();
+		blit_to_swapchain(cmd);
+		vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pools[current_frame_index], 1);
+
+		VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+
+		VkSubmitInfo submit{ VK_STRUCTURE_TYPE_SUBMIT_INFO };
+		submit.commandBufferCount = (u32)frame_cmds.size();
+		submit.pCommandBuffers = frame_cmds.data();
+		submit.signalSemaphoreCount = 1;
+		submit.waitSemaphoreCount = 1;
+		submit.pWaitDstStageMask = &wait_stage;
+		submit.pWaitSemaphores = &context->frame_objects[current_frame_index].image_available_sem;
+		submit.pSignalSemaphores = &context->frame_objects[current_frame_index].render_finished_sem;
 
-	vkEndCommandBuffer(cmd);
+		vkEndCommandBuffer(cmd);
 
-	vkQueueSubmit(context->graphics_queue, 1, &submit, context->frame_objects[current_frame_index].fence);
+		vkQueueSubmit(context->graphics_queue, 1, &submit, context->frame_objects[current_frame_index].fence);
 
-	VkPresentInfoKHR present_info{ VK_STRUCTURE_TYPE_PRESENT_INFO_KHR };
-	present_info.swapchainCount = 1;
-	present_info.pSwapchains = &context->swapchain;
-	present_info.pImageIndices = &swapchain_image_index;
-	present_info.waitSemaphoreCount = 1;
-	present_info.pWaitSemaphores = &context->frame_objects[current_frame_index].render_finished_sem;
-	vkQueuePresentKHR(context->graphics_queue, &present_info);
+		VkPresentInfoKHR present_info{ VK_STRUCTURE_TYPE_PRESENT_INFO_KHR };
+		present_info.swapchainCount = 1;
+		present_info.pSwapchains = &context->swapchain;
+		present_info.pImageIndices = &swapchain_image_index;
+		present_info.waitSemaphoreCount = 1;
+		present_info.pWaitSemaphores = &context->frame_objects[current_frame_index].render_finished_sem;
+		vkQueuePresentKHR(context->graphics_queue, &present_info);
 
-	cpu_frame_end = timer->get_current_time();
+		cpu_frame_end = timer->get_current_time();
 
-	vkDeviceWaitIdle(context->device); // Synchronization debugging
+		vkDeviceWaitIdle(context->device); // Synchronization debugging
+	}
 
-	char title[256];
-	sprintf(title, "cpu time: %.2f ms, gpu time: %.2f ms, mode: %s", (cpu_frame_end - cpu_frame_begin) * 1000.0, current_frame_gpu_time * 1e-6, g_settings.rendering_mode == Rendering_Mode::REFERENCE_PATH_TRACER ? "path tracer" : "hybrid");
+	char title[768];
+	int title_length;
+	if (g_settings.rendering_mode == Rendering_Mode::HYBRID_RENDERER)
+	{
+		float culled = tested_meshlet_count ? 100.0f * (1.0f - (float)visible_meshlet_count / (float)tested_meshlet_count) : 0.0f;
+		title_length = sprintf(title, "cpu time: %.2f ms, gpu time: %.2f ms, gbuffer: %.2f ms, mode: hybrid, raster triangles: %u, meshlets: %u / %u (%.1f%% culled)",
+			(cpu_frame_end - cpu_frame_begin) * 1000.0, current_frame_gpu_time * 1e-6, gbuffer_gpu_time * 1e-6,
+			raster_triangle_count, visible_meshlet_count, tested_meshlet_count, culled);
+		static const char* resolution_names[] = { "full", "half", "checkerboard" };
+		title_length += sprintf(title + title_length, ", indirect (%s): %.2f ms, denoiser: %.2f ms",
+			resolution_names[g_settings.indirect_resolution], indirect_gpu_time * 1e-6, denoiser_gpu_time * 1e-6);
+		title_length += sprintf(title + title_length, ", %s blur: pre %.2f ms, main %.2f ms, post %.2f ms",
+			g_settings.tiled_blur ? "tiled" : "untiled", pre_blur_gpu_time * 1e-6, blur_gpu_time * 1e-6, post_blur_gpu_time * 1e-6);
+		if (g_settings.radiance_cache)
+			title_length += sprintf(title + title_length, ", radiance cache: %.2f ms", radiance_cache_gpu_time * 1e-6);
+		if (restir_enabled())
+		{
+			// The candidates are traced in indirect_diffuse.comp, only the total against a frame without ReSTIR covers them
+			if (indirect_gpu_time_without_restir > 0.0)
+				title_length += sprintf(title + title_length, ", ReSTIR: +%.2f ms indirect (passes %.2f ms)",
+					(indirect_gpu_time - indirect_gpu_time_without_restir) * 1e-6, restir_gpu_time * 1e-6);
+			else
+				title_length += sprintf(title + title_length, ", ReSTIR passes: %.2f ms", restir_gpu_time * 1e-6);
+			title_length += sprintf(title + title_length, ", effective spp: direct %.1f, indirect %.1f", restir_direct_spp, restir_indirect_spp);
+		}
+		if (g_settings.indirect_error_metric && indirect_reference_valid)
+		{
+			title_length += sprintf(title + title_length, ", error vs reference: diffuse %.5f (noisy %.5f), specular %.5f",
+				indirect_diffuse_error, indirect_noisy_diffuse_error, indirect_specular_error);
+		}
+	}
+	else
+	{
+		title_length = sprintf(title, "cpu time: %.2f ms, gpu time: %.2f ms, mode: path tracer, frames: %u, emitter sampling: %s",
+			(cpu_frame_end - cpu_frame_begin) * 1000.0, current_frame_gpu_time * 1e-6, frames_accumulated, g_settings.emissive_light_sampling ? "on" : "off");
+	}
+	if (tlas_last_update != Tlas_Update::NONE)
+	{
+		// The GPU time is from two frames ago, close enough while things keep moving
+		sprintf(title + title_length, ", tlas %s: %u / %u instances, %.3f ms cpu, %.3f ms gpu",
+			tlas_last_update == Tlas_Update::REFIT ? "refit" : "rebuild", tlas_dirty_instance_count, (u32)tlas_instances.size(),
+			tlas_update_cpu_time * 1000.0, tlas_update_gpu_time * 1e-6);
+	}
 	SDL_SetWindowTitle(platform->window.window, title);
 
 	frame_counter++;
@@ -1136,12 +1577,92 @@ void Renderer::draw(ECS* ecs, float dt)
 {
 	VkCommandBuffer cmd = get_current_frame_command_buffer();
 
-	probe_system.bake(cmd, &cubemap, samplers[BILINEAR_SAMPLER_CLAMP]);
+	// Anything touching the TLAS or the upload ring stays on this thread, ahead of the passes recorded in parallel
+	update_top_level_acceleration_structure(ecs, cmd);
+	vkEndCommandBuffer(cmd);
 
-	if(g_settings.rendering_mode == Rendering_Mode::REFERENCE_PATH_TRACER)
-		trace_rays(cmd);
+	if (async_compute_active)
+	{
+		// The graphics queue rasterizes the G-buffer and hands it over to the compute queue, which traces and denoises
+		// the indirect lighting and composites. Tracing waits for the G-buffer and the next G-buffer waits for tracing,
+		// since both touch the TLAS and temporal accumulation reads the previous layer. Denoising and composition
+		// overlap the next frame's G-buffer
+		u64 timeline_value = async_timeline_value(frame_counter);
+
+		VkCommandBuffer pass_cmds[5];
+		record_passes({
+			{ [=](VkCommandBuffer c) { rasterize(c, ecs); transfer_gbuffer_ownership(c, false); } },
+			{ [=](VkCommandBuffer c) { transfer_gbuffer_ownership(c, true); probe_system.bake(c, &cubemap, samplers[BILINEAR_SAMPLER_CLAMP]); }, true },
+			{ [=](VkCommandBuffer c) { trace_indirect(c); }, true },
+			{ [=](VkCommandBuffer c) { denoise_indirect(c); }, true },
+			{ [=](VkCommandBuffer c)
+				{
+					// Overwritten completely, the previous frame's present already read it
+					vk_transition_layout(c, final_output.image,
+						VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
+						0, VK_ACCESS_SHADER_WRITE_BIT,
+						VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+					);
+					composite_and_tonemap(c);
+
+					VkImageMemoryBarrier2 release = vkinit::image_ownership_barrier2(final_output.image,
+						context->compute_idx, context->graphics_idx, false);
+					VkDependencyInfo deps{ VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
+					deps.imageMemoryBarrierCount = 1;
+					deps.pImageMemoryBarriers = &release;
+					vkCmdPipelineBarrier2(c, &deps);
+				}, true },
+		}, pass_cmds);
+
+		{
+			VkCommandBufferSubmitInfo cmd_infos[] = { vkinit::command_buffer_submit_info(cmd), vkinit::command_buffer_submit_info(pass_cmds[0]) };
+			VkSemaphoreSubmitInfo wait = vkinit::semaphore_submit_info(context->compute_timeline_sem, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, timeline_value - 2);
+			VkSemaphoreSubmitInfo signal = vkinit::semaphore_submit_info(context->graphics_timeline_sem, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, timeline_value);
+			VkSubmitInfo2 submit = vkinit::submit_info2((u32)std::size(cmd_infos), cmd_infos, 1, &wait, 1, &signal);
+			VK_CHECK(vkQueueSubmit2(context->graphics_queue, 1, &submit, VK_NULL_HANDLE));
+		}
+		{
+			VkCommandBufferSubmitInfo cmd_infos[] = { vkinit::command_buffer_submit_info(pass_cmds[1]), vkinit::command_buffer_submit_info(pass_cmds[2]) };
+			VkSemaphoreSubmitInfo wait = vkinit::semaphore_submit_info(context->graphics_timeline_sem, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, timeline_value);
+			VkSemaphoreSubmitInfo signal = vkinit::semaphore_submit_info(context->compute_timeline_sem, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, timeline_value);
+			VkSubmitInfo2 submit = vkinit::submit_info2((u32)std::size(cmd_infos), cmd_infos, 1, &wait, 1, &signal);
+			VK_CHECK(vkQueueSubmit2(context->compute_queue, 1, &submit, VK_NULL_HANDLE));
+		}
+		{
+			// final_output is free once the previous frame is presented, which end_frame submits after this
+			VkCommandBufferSubmitInfo cmd_infos[] = { vkinit::command_buffer_submit_info(pass_cmds[3]), vkinit::command_buffer_submit_info(pass_cmds[4]) };
+			VkSemaphoreSubmitInfo wait = vkinit::semaphore_submit_info(context->graphics_timeline_sem, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, timeline_value + 1);
+			VkSemaphoreSubmitInfo signal = vkinit::semaphore_submit_info(context->compute_timeline_sem, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, timeline_value + 1);
+			VkSubmitInfo2 submit = vkinit::submit_info2((u32)std::size(cmd_infos), cmd_infos, present_pending ? 1 : 0, &wait, 1, &signal);
+			VK_CHECK(vkQueueSubmit2(context->compute_queue, 1, &submit, VK_NULL_HANDLE));
+		}
+
+		frames_accumulated++;
+		return;
+	}
+
+	frame_cmds.push_back(cmd);
+
+	VkCommandBuffer pass_cmds[5];
+	if (g_settings.rendering_mode == Rendering_Mode::REFERENCE_PATH_TRACER)
+	{
+		record_passes({
+			{ [=](VkCommandBuffer c) { probe_system.bake(c, &cubemap, samplers[BILINEAR_SAMPLER_CLAMP]); } },
+			{ [=](VkCommandBuffer c) { trace_rays(c); composite_and_tonemap(c); } },
+		}, pass_cmds);
+		frame_cmds.insert(frame_cmds.end(), pass_cmds, pass_cmds + 2);
+	}
 	else if (g_settings.rendering_mode == Rendering_Mode::HYBRID_RENDERER)
-		rasterize(cmd, ecs);
+	{
+		record_passes({
+			{ [=](VkCommandBuffer c) { probe_system.bake(c, &cubemap, samplers[BILINEAR_SAMPLER_CLAMP]); } },
+			{ [=](VkCommandBuffer c) { rasterize(c, ecs); } },
+			{ [=](VkCommandBuffer c) { trace_indirect(c); } },
+			{ [=](VkCommandBuffer c) { denoise_indirect(c); } },
+			{ [=](VkCommandBuffer c) { composite_and_tonemap(c); } },
+		}, pass_cmds);
+		frame_cmds.insert(frame_cmds.end(), pass_cmds, pass_cmds + 5);
+	}
 	/*else if (render_mode == SIDE_BY_SIDE)
 	{
 		trace_rays(cmd);
@@ -1149,7 +1670,10 @@ void Renderer::draw(ECS* ecs, float dt)
 		rasterize(cmd, ecs);
 	}*/
 
-	composite_and_tonemap(cmd);
+	// The overlay edits the settings the passes read, so it's recorded once they're done. end_frame adds the blit
+	cmd = next_pass_command_buffer(false);
+	vk_begin_command_buffer(cmd);
+	frame_cmds.push_back(cmd);
 
 	if (g_settings.visualize_probes)
 	{
@@ -1196,6 +1720,42 @@ void Renderer::draw(ECS* ecs, float dt)
 	frames_accumulated++;
 }
 
+VkCommandBuffer Renderer::next_pass_command_buffer(bool compute)
+{
+	Vk_Context::Per_Frame_Objects& frame = context->frame_objects[current_frame_index];
+	u32& used = compute ? compute_pass_cmds_used : pass_cmds_used;
+	assert(used < MAX_PASS_COMMAND_BUFFERS);
+	assert(!compute || context->has_async_compute());
+	return compute ? frame.compute_pass_cmds[used++] : frame.pass_cmds[used++];
+}
+
+static void record_pass(const Renderer::Pass_Recording& pass, VkCommandBuffer cmd)
+{
+	vk_begin_command_buffer(cmd);
+	pass.record(cmd);
+	vkEndCommandBuffer(cmd);
+}
+
+void Renderer::record_passes(std::initializer_list<Pass_Recording> passes, VkCommandBuffer* cmds)
+{
+	const Pass_Recording* first = passes.begin();
+	for (size_t i = 0; i < passes.size(); ++i)
+		cmds[i] = next_pass_command_buffer(first[i].compute);
+
+	std::atomic<u32> counter = 0;
+	for (size_t i = 1; i < passes.size(); ++i)
+	{
+		const Pass_Recording* pass = first + i;
+		VkCommandBuffer cmd = cmds[i];
+		g_job_system->push([pass, cmd]() { record_pass(*pass, cmd); }, &counter);
+	}
+
+	// This thread takes the first pass instead of just waiting
+	if (passes.size() != 0)
+		record_pass(*first, cmds[0]);
+	g_job_system->wait(&counter);
+}
+
 void Renderer::trace_rays(VkCommandBuffer cmd)
 {
 	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipelines[PATH_TRACER_PIPELINE].pipeline);
@@ -1271,7 +1831,7 @@ void Renderer::composite_and_tonemap(VkCommandBuffer cmd)
 
 		Descriptor_Info descriptor_info[] = {
 			Descriptor_Info(0, framebuffer.render_targets[PATH_TRACER_COLOR].images[0].image_view,  VK_IMAGE_LAYOUT_GENERAL),
-			Descriptor_Info(0, framebuffer.render_targets[RASTER_COLOR].images[0].image_view,  VK_IMAGE_LAYOUT_GENERAL),
+			Descriptor_Info(0, framebuffer.render_targets[RASTER_COLOR].images[current_frame_gbuffer_index].image_view,  VK_IMAGE_LAYOUT_GENERAL),
 			Descriptor_Info(0, framebuffer.render_targets[NORMAL_ROUGHNESS].images[current_frame_gbuffer_index].image_view,  VK_IMAGE_LAYOUT_GENERAL),
 			Descriptor_Info(0, framebuffer.render_targets[BASECOLOR_METALNESS].images[current_frame_gbuffer_index].image_view,  VK_IMAGE_LAYOUT_GENERAL),
 			Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], framebuffer.render_targets[DEPTH].images[current_frame_gbuffer_index].image_view,  VK_IMAGE_LAYOUT_GENERAL),
@@ -1338,8 +1898,7 @@ void Renderer::composite_and_tonemap(VkCommandBuffer cmd)
 			Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], framebuffer.render_targets[TAA_OUTPUT].images[previous_frame_gbuffer_index].image_view,  VK_IMAGE_LAYOUT_GENERAL),
 			Descriptor_Info(0, framebuffer.render_targets[TAA_OUTPUT].images[current_frame_gbuffer_index].image_view,  VK_IMAGE_LAYOUT_GENERAL),
 			Descriptor_Info(global_constants_buffer.buffer, 0, VK_WHOLE_SIZE),
-			Descriptor_Info(gpu_camera_data.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
-			Descriptor_Info(0, framebuffer.render_targets[WORLD_POSITION].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+			Descriptor_Info(0, framebuffer.render_targets[MOTION_VECTORS].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 		};
 
 		vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[TONEMAP_AND_TAA].update_template, pipelines[TONEMAP_AND_TAA].layout, 0, descriptor_info);
@@ -1365,32 +1924,136 @@ void Renderer::composite_and_tonemap(VkCommandBuffer cmd)
 	);
 }
 
-void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
+void Renderer::cull_meshlets(VkCommandBuffer cmd)
 {
+	// The previous frame's draws have to be done reading the buffers before they are rewritten
+	vkinit::memory_barrier2(cmd,
+		0, 0,
+		VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+	vkCmdFillBuffer(cmd, draw_count_buffer.gpu_buffer.buffer, 0, sizeof(u32), 0);
+	vkinit::memory_barrier2(cmd,
+		VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[CULL_MESHLETS].pipeline);
+	Descriptor_Info descriptor_info[] =
 	{
-		VkClearColorValue clr = {};
-		VkImageSubresourceRange range = {};
-		range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		range.baseArrayLayer = 0;
-		range.baseMipLevel = 0;
-		range.layerCount = 1;
-		range.levelCount = 1;
-		vkCmdClearColorImage(cmd, framebuffer.render_targets[DEBUG].images[current_frame_gbuffer_index].image, VK_IMAGE_LAYOUT_GENERAL, &clr, 1, &range);
-	}
+		Descriptor_Info(meshlet_buffer.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+		Descriptor_Info(primitive_info_buffer.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+		Descriptor_Info(instance_table_buffer.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+		Descriptor_Info(meshlet_instance_buffer.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+		Descriptor_Info(instance_lod_buffer.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+		Descriptor_Info(gpu_camera_data.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+		Descriptor_Info(samplers[POINT_SAMPLER], depth_pyramid.image.image_view, VK_IMAGE_LAYOUT_GENERAL),
+		Descriptor_Info(indirect_draw_buffer.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+		Descriptor_Info(draw_count_buffer.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+	};
+	vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[CULL_MESHLETS].update_template, pipelines[CULL_MESHLETS].layout, 0, descriptor_info);
 
-	if (needs_history_clear)
+	struct
 	{
-		VkClearColorValue clr = {};
-		VkImageSubresourceRange range = {};
-		range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		range.baseArrayLayer = 0;
-		range.baseMipLevel = 0;
-		range.layerCount = 1;
-		range.levelCount = 1;
+		glm::vec4 frustum_planes[5];
+		u32 meshlet_instance_count;
+		u32 lod_offset;
+		u32 flags;
+		float z_near;
+	} pc;
+
+	// Planes from the rows of the (unjittered) view projection, pointing inwards. The infinite
+	// reverse Z projection has no far plane and the near plane is z_clip <= w_clip
+	const glm::mat4& m = scene.current_frame_camera.viewproj;
+	glm::vec4 rows[4];
+	for (int i = 0; i < 4; ++i)
+		rows[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+	pc.frustum_planes[0] = rows[3] + rows[0];
+	pc.frustum_planes[1] = rows[3] - rows[0];
+	pc.frustum_planes[2] = rows[3] + rows[1];
+	pc.frustum_planes[3] = rows[3] - rows[1];
+	pc.frustum_planes[4] = rows[3] - rows[2];
+	for (glm::vec4& plane : pc.frustum_planes)
+		plane /= glm::length(glm::vec3(plane));
+
+	enum { CULL_FRUSTUM = 1, CULL_BACKFACE = 2, CULL_OCCLUSION = 4 }; // Same as cull_meshlets.comp
+	pc.meshlet_instance_count = meshlet_instance_count;
+	pc.lod_offset = current_frame_index * (u32)instance_table.size();
+	pc.flags = (g_settings.frustum_culling ? CULL_FRUSTUM : 0)
+		| (g_settings.backface_culling ? CULL_BACKFACE : 0)
+		| (g_settings.occlusion_culling && depth_pyramid.valid ? CULL_OCCLUSION : 0);
+	pc.z_near = CAMERA_Z_NEAR;
+	vkCmdPushConstants(cmd, pipelines[CULL_MESHLETS].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+	vkCmdDispatch(cmd, (meshlet_instance_count + 63) / 64, 1, 1);
+
+	vkinit::memory_barrier2(cmd,
+		VK_ACCESS_2_SHADER_WRITE_BIT, VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_TRANSFER_READ_BIT,
+		VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_TRANSFER_BIT);
+
+	VkBufferCopy region = { 0, current_frame_index * sizeof(u32), sizeof(u32) };
+	vkCmdCopyBuffer(cmd, draw_count_buffer.gpu_buffer.buffer, draw_count_readback.buffer, 1, &region);
+}
 
-		vkCmdClearColorImage(cmd, framebuffer.render_targets[DENOISER_HISTORY_LENGTH].images[previous_frame_gbuffer_index].image, VK_IMAGE_LAYOUT_GENERAL, &clr, 1, &range);
+void Renderer::build_depth_pyramid(VkCommandBuffer cmd)
+{
+	// Waits for the depth writes and for cull_meshlets to be done with the previous pyramid
+	vkinit::memory_barrier2(cmd,
+		VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_2_SHADER_READ_BIT, VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[DEPTH_PYRAMID].pipeline);
+	glm::ivec2 source_size = glm::ivec2(window_width, window_height);
+	for (u32 level = 0; level < depth_pyramid.mip_count; ++level)
+	{
+		VkImageView source = level == 0
+			? framebuffer.render_targets[DEPTH].images[current_frame_gbuffer_index].image_view
+			: depth_pyramid.mip_views[level - 1];
+		Descriptor_Info descriptor_info[] =
+		{
+			Descriptor_Info(samplers[POINT_SAMPLER], source, VK_IMAGE_LAYOUT_GENERAL),
+			Descriptor_Info(0, depth_pyramid.mip_views[level], VK_IMAGE_LAYOUT_GENERAL),
+		};
+		vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[DEPTH_PYRAMID].update_template, pipelines[DEPTH_PYRAMID].layout, 0, descriptor_info);
 
-		needs_history_clear = false;
+		struct
+		{
+			glm::ivec2 source_size;
+			glm::ivec2 destination_size;
+		} pc;
+		pc.source_size = source_size;
+		pc.destination_size = glm::ivec2(std::max(depth_pyramid.width >> level, 1u), std::max(depth_pyramid.height >> level, 1u));
+		vkCmdPushConstants(cmd, pipelines[DEPTH_PYRAMID].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+		vkCmdDispatch(cmd, (pc.destination_size.x + 7) / 8, (pc.destination_size.y + 7) / 8, 1);
+		source_size = pc.destination_size;
+
+		vkinit::memory_barrier2(cmd,
+			VK_ACCESS_2_SHADER_WRITE_BIT, VK_ACCESS_2_SHADER_READ_BIT,
+			VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+	}
+	depth_pyramid.valid = true;
+}
+
+void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
+{
+	{
+		// Every target of the layer is cleared on load. Discarding also takes the layer back from the compute queue
+		VkImageMemoryBarrier2 barriers[std::size(GBUFFER_TARGETS)];
+		for (size_t i = 0; i < std::size(GBUFFER_TARGETS); ++i)
+		{
+			bool depth = GBUFFER_TARGETS[i] == DEPTH;
+			VkImageMemoryBarrier2& barrier = barriers[i];
+			barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 };
+			barrier.image = framebuffer.render_targets[GBUFFER_TARGETS[i]].images[current_frame_gbuffer_index].image;
+			barrier.subresourceRange = vkinit::image_subresource_range(depth ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT);
+			barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+			barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+			barrier.srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+			barrier.dstStageMask = depth
+				? VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT
+				: VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
+			barrier.dstAccessMask = depth ? VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT : VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT;
+		}
+		VkDependencyInfo deps{ VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
+		deps.imageMemoryBarrierCount = (u32)std::size(barriers);
+		deps.pImageMemoryBarriers = barriers;
+		vkCmdPipelineBarrier2(cmd, &deps);
 	}
 
 	VkClearValue clear_value{};
@@ -1400,9 +2063,9 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 	depth_clear.depthStencil.depth = 0.f;
 
 
-	VkRenderingAttachmentInfo attachment_infos[4] = {};
+	VkRenderingAttachmentInfo attachment_infos[5] = {};
 	attachment_infos[0].sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
-	attachment_infos[0].imageView = framebuffer.render_targets[RASTER_COLOR].images[0].image_view;
+	attachment_infos[0].imageView = framebuffer.render_targets[RASTER_COLOR].images[current_frame_gbuffer_index].image_view;
 	attachment_infos[0].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
 	attachment_infos[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
 	attachment_infos[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
@@ -1430,12 +2093,23 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 	attachment_infos[3].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
 	attachment_infos[3].clearValue = { 0.0f, 0.0f, 0.0f, 0.0f };
 
+	// Sky keeps the cleared zero motion, nothing reprojects it
+	attachment_infos[4].sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+	attachment_infos[4].imageView = framebuffer.render_targets[MOTION_VECTORS].images[current_frame_gbuffer_index].image_view;
+	attachment_infos[4].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+	attachment_infos[4].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	attachment_infos[4].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	attachment_infos[4].clearValue = { 0.0f, 0.0f, 0.0f, 0.0f };
+
 	VkRenderingAttachmentInfo depth_attachment_info{ VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO };
 	depth_attachment_info.imageView = framebuffer.render_targets[DEPTH].images[current_frame_gbuffer_index].image_view;
 	depth_attachment_info.imageLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL;
 	depth_attachment_info.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
 	depth_attachment_info.clearValue = depth_clear;
 
+	vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, query_pools[current_frame_index], GBUFFER_BEGIN_TIMESTAMP);
+	cull_meshlets(cmd);
+
 	VkRect2D render_area = { {0, 0}, {(u32)window_width, (u32)window_height} };
 	VkRenderingInfo rendering_info{VK_STRUCTURE_TYPE_RENDERING_INFO};
 	rendering_info.renderArea = render_area;
@@ -1518,24 +2192,19 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines[RASTER_PIPELINE].layout, 1, 1, &bindless_descriptor_set, 0, nullptr);
 
 
-		for (auto [a] : ecs->filter<Static_Mesh_Component>())
-		{
-			Mesh* mesh = a->manager->get_resource_with_id(a->mesh_id);
-			i32 mat_id = mesh->primitives[0].material_id;
-			i32 mesh_id = a->mesh_id;
-
-			u32 index = ((mat_id & 0x3FF) << 14) | (mesh_id & 0x3FFF);
-
-			vkCmdBindIndexBuffer(cmd, mesh->index_buffer.buffer, 0, VK_INDEX_TYPE_UINT32);
-			//vkCmdDrawIndexed(cmd, (u32)mesh->indices.size(), 1, 0, 0, index);
-			vkCmdDrawIndexedIndirect(cmd, indirect_draw_buffer.gpu_buffer.buffer, 0, (u32)mesh->primitives.size(), sizeof(VkDrawIndexedIndirectCommand));
-		}
+		// All meshes share the geometry pool, so the whole scene is one indirect draw of the meshlets that survived culling
+		vkCmdBindIndexBuffer(cmd, geometry_pool.index_buffer.buffer, 0, VK_INDEX_TYPE_UINT32);
+		vkCmdDrawIndexedIndirectCount(cmd, indirect_draw_buffer.gpu_buffer.buffer, 0, draw_count_buffer.gpu_buffer.buffer, 0,
+			meshlet_instance_count, sizeof(VkDrawIndexedIndirectCommand));
 	}
 	//probe_system.debug_render(cmd);
 
 	//ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), cmd);
 
 	vkCmdEndRendering(cmd);
+	vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pools[current_frame_index], GBUFFER_END_TIMESTAMP);
+
+	build_depth_pyramid(cmd);
 
 
 	VkMemoryBarrier memory_barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
@@ -1549,12 +2218,179 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 		0, nullptr,
 		0, nullptr
 	);
+}
+
+void Renderer::transfer_gbuffer_ownership(VkCommandBuffer cmd, bool acquire)
+{
+	VkImageMemoryBarrier2 barriers[std::size(GBUFFER_TARGETS)];
+	for (size_t i = 0; i < std::size(GBUFFER_TARGETS); ++i)
+	{
+		barriers[i] = vkinit::image_ownership_barrier2(
+			framebuffer.render_targets[GBUFFER_TARGETS[i]].images[current_frame_gbuffer_index].image,
+			context->graphics_idx, context->compute_idx, acquire, VK_IMAGE_LAYOUT_GENERAL,
+			GBUFFER_TARGETS[i] == DEPTH ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT);
+	}
+
+	// The previous frame's denoising was submitted to the compute queue right before, its passes write what this
+	// frame's tracing reads and the other way around
+	VkMemoryBarrier2 memory_barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER_2 };
+	memory_barrier.srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+	memory_barrier.dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+	memory_barrier.srcAccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT;
+	memory_barrier.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT;
+
+	VkDependencyInfo deps{ VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
+	deps.memoryBarrierCount = acquire ? 1 : 0;
+	deps.pMemoryBarriers = &memory_barrier;
+	deps.imageMemoryBarrierCount = (u32)std::size(barriers);
+	deps.pImageMemoryBarriers = barriers;
+	vkCmdPipelineBarrier2(cmd, &deps);
+}
+
+void Renderer::trace_indirect(VkCommandBuffer cmd)
+{
+	{
+		VkClearColorValue clr = {};
+		VkImageSubresourceRange range = {};
+		range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		range.baseArrayLayer = 0;
+		range.baseMipLevel = 0;
+		range.layerCount = 1;
+		range.levelCount = 1;
+		vkCmdClearColorImage(cmd, framebuffer.render_targets[DEBUG].images[current_frame_gbuffer_index].image, VK_IMAGE_LAYOUT_GENERAL, &clr, 1, &range);
+	}
+
+	if (needs_history_clear)
+	{
+		VkClearColorValue clr = {};
+		VkImageSubresourceRange range = {};
+		range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		range.baseArrayLayer = 0;
+		range.baseMipLevel = 0;
+		range.layerCount = 1;
+		range.levelCount = 1;
+
+		vkCmdClearColorImage(cmd, framebuffer.render_targets[DENOISER_HISTORY_LENGTH].images[previous_frame_gbuffer_index].image, VK_IMAGE_LAYOUT_GENERAL, &clr, 1, &range);
+
+		needs_history_clear = false;
+	}
+
+	if (g_settings.radiance_cache && !radiance_cache_valid)
+	{
+		vkCmdFillBuffer(cmd, radiance_cache_keys.gpu_buffer.buffer, 0, VK_WHOLE_SIZE, 0);
+		vkCmdFillBuffer(cmd, radiance_cache_cells.gpu_buffer.buffer, 0, VK_WHOLE_SIZE, 0);
+	}
+	radiance_cache_valid = g_settings.radiance_cache;
+
+	bool restir = restir_enabled();
+	if (restir && !restir_valid)
+	{
+		vkCmdFillBuffer(cmd, restir_di_reservoirs.gpu_buffer.buffer, 0, VK_WHOLE_SIZE, 0);
+		vkCmdFillBuffer(cmd, restir_gi_reservoirs.gpu_buffer.buffer, 0, VK_WHOLE_SIZE, 0);
+	}
+	restir_valid = restir;
+	if (restir)
+		vkCmdFillBuffer(cmd, restir_stats_buffer.gpu_buffer.buffer, 0, RESTIR_STATS_COUNT * sizeof(u32), 0);
+
+	vkinit::memory_barrier2(cmd,
+		VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+
+	VkMemoryBarrier memory_barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	memory_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	memory_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+	// With reduced resolution rays the trace passes write INDIRECT_*_RAYS and upsample_indirect.comp fills the full
+	// resolution targets the denoiser reads. Only the tracing is reduced, ReBLUR always runs at full resolution:
+	// its reprojection, history fix mips and blurs read the full resolution G-buffer, and running it at reduced
+	// resolution would need downsampled guides and separate history targets
+	vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, query_pools[current_frame_index], INDIRECT_BEGIN_TIMESTAMP);
+	u32 resolution_mode = (u32)g_settings.indirect_resolution;
+	bool reduced_resolution = resolution_mode != INDIRECT_RESOLUTION_FULL;
+	glm::ivec2 trace_size = get_indirect_trace_size(glm::ivec2(window_width, window_height), resolution_mode);
+
+	if (g_settings.radiance_cache)
+	{
+		// Add a path per tile to the radiance cache, then resolve it for the diffuse rays to look up
+		vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, query_pools[current_frame_index], RADIANCE_CACHE_BEGIN_TIMESTAMP);
+
+		{
+			constexpr glm::uvec3 group_size = glm::uvec3(8, 8, 1);
+			glm::uvec3 size = glm::uvec3((window_width + RADIANCE_CACHE_UPDATE_TILE - 1) / RADIANCE_CACHE_UPDATE_TILE, (window_height + RADIANCE_CACHE_UPDATE_TILE - 1) / RADIANCE_CACHE_UPDATE_TILE, 1);
+			glm::uvec3 group_count = (size + (group_size - 1u)) & ~(group_size - 1u);
+			group_count /= group_size;
+
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[RADIANCE_CACHE_UPDATE].pipeline);
+
+			Descriptor_Info descriptor_info[] =
+			{
+				Descriptor_Info(0, framebuffer.render_targets[NORMAL_ROUGHNESS].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+				Descriptor_Info(0, framebuffer.render_targets[WORLD_POSITION].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+				Descriptor_Info(gpu_camera_data.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+				Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], framebuffer.render_targets[DEPTH].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+				Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], cubemap.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL),
+				Descriptor_Info(scene.tlas.value().acceleration_structure),
+				Descriptor_Info(global_constants_buffer.buffer, 0, VK_WHOLE_SIZE),
+				Descriptor_Info(radiance_cache_keys.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+				Descriptor_Info(radiance_cache_cells.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+			};
+
+			struct
+			{
+				glm::ivec2 size;
+				u32 frame_number;
+			} pc;
+
+			pc.size = glm::ivec2(window_width, window_height);
+			pc.frame_number = (u32)frame_counter;
+			vkCmdPushConstants(cmd, pipelines[RADIANCE_CACHE_UPDATE].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+
+			vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[RADIANCE_CACHE_UPDATE].layout, 1, 1, &bindless_descriptor_set, 0, nullptr);
+			vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[RADIANCE_CACHE_UPDATE].update_template, pipelines[RADIANCE_CACHE_UPDATE].layout, 0, descriptor_info);
+
+			vkCmdDispatch(cmd, group_count.x, group_count.y, 1);
+		}
+
+		vkinit::memory_barrier2(cmd,
+			VK_ACCESS_2_SHADER_WRITE_BIT, VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT,
+			VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+
+		{
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[RADIANCE_CACHE_RESOLVE].pipeline);
+
+			Descriptor_Info descriptor_info[] =
+			{
+				Descriptor_Info(radiance_cache_keys.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+				Descriptor_Info(radiance_cache_cells.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+			};
+
+			struct
+			{
+				u32 frame_number;
+				u32 max_samples;
+				u32 stale_frames;
+			} pc;
+
+			pc.frame_number = (u32)frame_counter;
+			pc.max_samples = (u32)g_settings.radiance_cache_max_samples;
+			pc.stale_frames = (u32)g_settings.radiance_cache_stale_frames;
+			vkCmdPushConstants(cmd, pipelines[RADIANCE_CACHE_RESOLVE].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+
+			vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[RADIANCE_CACHE_RESOLVE].update_template, pipelines[RADIANCE_CACHE_RESOLVE].layout, 0, descriptor_info);
+			vkCmdDispatch(cmd, RADIANCE_CACHE_SIZE / 64, 1, 1);
+		}
+
+		vkinit::memory_barrier2(cmd,
+			VK_ACCESS_2_SHADER_WRITE_BIT, VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT,
+			VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+		vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pools[current_frame_index], RADIANCE_CACHE_END_TIMESTAMP);
+	}
 
 	{
 		// Trace indirect diffuse rays
 
 		constexpr glm::uvec3 group_size = glm::uvec3(4, 8, 1);
-		glm::uvec3 size = glm::uvec3(window_width, window_height, 1);
+		glm::uvec3 size = glm::uvec3(trace_size.x, trace_size.y, 1);
 		glm::uvec3 group_count = (size + (group_size - 1u)) & ~(group_size - 1u);
 		group_count /= group_size;
 
@@ -1562,15 +2398,19 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 
 		Descriptor_Info descriptor_info[] =
 		{
-			Descriptor_Info(0, framebuffer.render_targets[INDIRECT_DIFFUSE].images[0].image_view, VK_IMAGE_LAYOUT_GENERAL),
+			Descriptor_Info(0, framebuffer.render_targets[reduced_resolution ? INDIRECT_DIFFUSE_RAYS : INDIRECT_DIFFUSE].images[0].image_view, VK_IMAGE_LAYOUT_GENERAL),
 			Descriptor_Info(0, framebuffer.render_targets[NORMAL_ROUGHNESS].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 			Descriptor_Info(gpu_camera_data.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
 			Descriptor_Info(samplers[BILINEAR_SAMPLER_WRAP], framebuffer.render_targets[BASECOLOR_METALNESS].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 			Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], framebuffer.render_targets[DEPTH].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 			Descriptor_Info(scene.tlas.value().acceleration_structure),
 			Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], cubemap.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL),
-			Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], blue_noise[g_settings.animate_noise ? frame_counter % BLUE_NOISE_TEXTURE_COUNT : 0].image_view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL),
+			Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], blue_noise.image_view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL),
 			Descriptor_Info(global_constants_buffer.buffer, 0, VK_WHOLE_SIZE),
+			Descriptor_Info(radiance_cache_keys.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+			Descriptor_Info(radiance_cache_cells.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+			Descriptor_Info(restir_di_reservoirs.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+			Descriptor_Info(restir_gi_reservoirs.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
 			//Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], blue_noise[0].image_view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL),
 
 		};
@@ -1580,11 +2420,17 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 			glm::ivec2 size;
 			u32 frame_number;
 			u32 frames_accumulated;
+			u32 blue_noise_layer;
+			u32 resolution_mode;
+			glm::ivec2 trace_size;
 		} pc;
 
 		pc.size = glm::ivec2(window_width, window_height);
 		pc.frame_number = (u32)frame_counter;
 		pc.frames_accumulated = frames_accumulated;
+		pc.blue_noise_layer = g_settings.animate_noise ? (u32)(frame_counter % BLUE_NOISE_TEXTURE_COUNT) : 0;
+		pc.resolution_mode = resolution_mode;
+		pc.trace_size = trace_size;
 		vkCmdPushConstants(cmd, pipelines[INDIRECT_DIFFUSE_PIPELINE].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
 
 		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[INDIRECT_DIFFUSE_PIPELINE].layout, 1, 1, &bindless_descriptor_set, 0, nullptr);
@@ -1596,7 +2442,7 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 	{
 		// Trace indirect specular rays
 		constexpr glm::uvec3 group_size = glm::uvec3(4, 8, 1);
-		glm::uvec3 size = glm::uvec3(window_width, window_height, 1);
+		glm::uvec3 size = glm::uvec3(trace_size.x, trace_size.y, 1);
 		glm::uvec3 group_count = (size + (group_size - 1u)) & ~(group_size - 1u);
 		group_count /= group_size;
 
@@ -1604,14 +2450,14 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 
 		Descriptor_Info descriptor_info[] =
 		{
-			Descriptor_Info(0, framebuffer.render_targets[INDIRECT_SPECULAR].images[0].image_view, VK_IMAGE_LAYOUT_GENERAL),
+			Descriptor_Info(0, framebuffer.render_targets[reduced_resolution ? INDIRECT_SPECULAR_RAYS : INDIRECT_SPECULAR].images[0].image_view, VK_IMAGE_LAYOUT_GENERAL),
 			Descriptor_Info(0, framebuffer.render_targets[NORMAL_ROUGHNESS].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 			Descriptor_Info(gpu_camera_data.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
 			Descriptor_Info(samplers[BILINEAR_SAMPLER_WRAP], framebuffer.render_targets[BASECOLOR_METALNESS].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 			Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], framebuffer.render_targets[DEPTH].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 			Descriptor_Info(scene.tlas.value().acceleration_structure),
 			Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], cubemap.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL),
-			Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], blue_noise_vec2[g_settings.animate_noise ? frame_counter % BLUE_NOISE_TEXTURE_COUNT : 0].image_view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL),
+			Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], blue_noise_vec2.image_view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL),
 			Descriptor_Info(global_constants_buffer.buffer, 0, VK_WHOLE_SIZE),
 			Descriptor_Info(0, framebuffer.render_targets[WORLD_POSITION].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 		};
@@ -1621,11 +2467,17 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 			glm::ivec2 size;
 			u32 frame_number;
 			u32 frames_accumulated;
+			u32 blue_noise_layer;
+			u32 resolution_mode;
+			glm::ivec2 trace_size;
 		} pc;
 
 		pc.size = glm::ivec2(window_width, window_height);
 		pc.frame_number = (u32)frame_counter;
 		pc.frames_accumulated = frames_accumulated;
+		pc.blue_noise_layer = g_settings.animate_noise ? (u32)(frame_counter % BLUE_NOISE_TEXTURE_COUNT) : 0;
+		pc.resolution_mode = resolution_mode;
+		pc.trace_size = trace_size;
 		vkCmdPushConstants(cmd, pipelines[INDIRECT_SPECULAR_PIPELINE].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
 
 		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[INDIRECT_SPECULAR_PIPELINE].layout, 1, 1, &bindless_descriptor_set, 0, nullptr);
@@ -1643,8 +2495,155 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 		0, nullptr
 	);
 
+	if (reduced_resolution)
+	{
+		// Depth and normal guided upsample to full resolution
+
+		constexpr glm::uvec3 group_size = glm::uvec3(8, 8, 1);
+		glm::uvec3 size = glm::uvec3(window_width, window_height, 1);
+		glm::uvec3 group_count = (size + (group_size - 1u)) & ~(group_size - 1u);
+		group_count /= group_size;
+
+		vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[UPSAMPLE_INDIRECT].pipeline);
+
+		Descriptor_Info descriptor_info[] =
+		{
+			Descriptor_Info(0, framebuffer.render_targets[INDIRECT_DIFFUSE_RAYS].images[0].image_view, VK_IMAGE_LAYOUT_GENERAL),
+			Descriptor_Info(0, framebuffer.render_targets[INDIRECT_SPECULAR_RAYS].images[0].image_view, VK_IMAGE_LAYOUT_GENERAL),
+			Descriptor_Info(0, framebuffer.render_targets[INDIRECT_DIFFUSE].images[0].image_view, VK_IMAGE_LAYOUT_GENERAL),
+			Descriptor_Info(0, framebuffer.render_targets[INDIRECT_SPECULAR].images[0].image_view, VK_IMAGE_LAYOUT_GENERAL),
+			Descriptor_Info(0, framebuffer.render_targets[NORMAL_ROUGHNESS].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+			Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], framebuffer.render_targets[DEPTH].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+		};
+
+		struct
+		{
+			glm::ivec2 size;
+			glm::ivec2 trace_size;
+			u32 resolution_mode;
+			u32 frame_number;
+			float depth_scale;
+		} pc;
+
+		pc.size = glm::ivec2(window_width, window_height);
+		pc.trace_size = trace_size;
+		pc.resolution_mode = resolution_mode;
+		pc.frame_number = (u32)frame_counter;
+		pc.depth_scale = scene.current_frame_camera.proj[3][2];
+		vkCmdPushConstants(cmd, pipelines[UPSAMPLE_INDIRECT].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+
+		vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[UPSAMPLE_INDIRECT].update_template, pipelines[UPSAMPLE_INDIRECT].layout, 0, descriptor_info);
+		vkCmdDispatch(cmd, group_count.x, group_count.y, 1);
+
+		vkCmdPipelineBarrier(cmd,
+			VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+			VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+			0,
+			1, &memory_barrier,
+			0, nullptr,
+			0, nullptr
+		);
+	}
+
+	if (restir)
+	{
+		// Resample the diffuse rays' reservoirs over time, then over neighbors, and shade INDIRECT_DIFFUSE from them
+		vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, query_pools[current_frame_index], RESTIR_BEGIN_TIMESTAMP);
+
+		constexpr glm::uvec3 group_size = glm::uvec3(8, 8, 1);
+		glm::uvec3 size = glm::uvec3(window_width, window_height, 1);
+		glm::uvec3 group_count = (size + (group_size - 1u)) & ~(group_size - 1u);
+		group_count /= group_size;
+
+		{
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[RESTIR_TEMPORAL].pipeline);
+
+			Descriptor_Info descriptor_info[] =
+			{
+				Descriptor_Info(0, framebuffer.render_targets[NORMAL_ROUGHNESS].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+				Descriptor_Info(0, framebuffer.render_targets[WORLD_POSITION].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+				Descriptor_Info(gpu_camera_data.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+				Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], framebuffer.render_targets[DEPTH].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+				Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], cubemap.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL),
+				Descriptor_Info(0, framebuffer.render_targets[MOTION_VECTORS].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+				Descriptor_Info(0, framebuffer.render_targets[NORMAL_ROUGHNESS].images[previous_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+				Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], framebuffer.render_targets[DEPTH].images[previous_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+				Descriptor_Info(global_constants_buffer.buffer, 0, VK_WHOLE_SIZE),
+				Descriptor_Info(restir_di_reservoirs.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+				Descriptor_Info(restir_gi_reservoirs.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+			};
+
+			struct
+			{
+				glm::ivec2 size;
+				u32 frame_number;
+				float max_history;
+			} pc;
+
+			pc.size = glm::ivec2(window_width, window_height);
+			pc.frame_number = (u32)frame_counter;
+			pc.max_history = (float)g_settings.restir_max_history;
+			vkCmdPushConstants(cmd, pipelines[RESTIR_TEMPORAL].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+
+			vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[RESTIR_TEMPORAL].layout, 1, 1, &bindless_descriptor_set, 0, nullptr);
+			vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[RESTIR_TEMPORAL].update_template, pipelines[RESTIR_TEMPORAL].layout, 0, descriptor_info);
+			vkCmdDispatch(cmd, group_count.x, group_count.y, 1);
+		}
+
+		vkinit::memory_barrier2(cmd,
+			VK_ACCESS_2_SHADER_WRITE_BIT, VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT,
+			VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+
+		{
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[RESTIR_SPATIAL].pipeline);
+
+			Descriptor_Info descriptor_info[] =
+			{
+				Descriptor_Info(0, framebuffer.render_targets[NORMAL_ROUGHNESS].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+				Descriptor_Info(0, framebuffer.render_targets[WORLD_POSITION].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+				Descriptor_Info(gpu_camera_data.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+				Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], framebuffer.render_targets[DEPTH].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+				Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], cubemap.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL),
+				Descriptor_Info(scene.tlas.value().acceleration_structure),
+				Descriptor_Info(0, framebuffer.render_targets[INDIRECT_DIFFUSE].images[0].image_view, VK_IMAGE_LAYOUT_GENERAL),
+				Descriptor_Info(global_constants_buffer.buffer, 0, VK_WHOLE_SIZE),
+				Descriptor_Info(restir_di_reservoirs.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+				Descriptor_Info(restir_gi_reservoirs.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+				Descriptor_Info(restir_stats_buffer.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+			};
+
+			struct
+			{
+				glm::ivec2 size;
+				u32 frame_number;
+				u32 spatial_samples;
+				float spatial_radius;
+			} pc;
+
+			pc.size = glm::ivec2(window_width, window_height);
+			pc.frame_number = (u32)frame_counter;
+			pc.spatial_samples = (u32)g_settings.restir_spatial_samples;
+			pc.spatial_radius = g_settings.restir_spatial_radius;
+			vkCmdPushConstants(cmd, pipelines[RESTIR_SPATIAL].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+
+			vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[RESTIR_SPATIAL].layout, 1, 1, &bindless_descriptor_set, 0, nullptr);
+			vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[RESTIR_SPATIAL].update_template, pipelines[RESTIR_SPATIAL].layout, 0, descriptor_info);
+			vkCmdDispatch(cmd, group_count.x, group_count.y, 1);
+		}
+
+		vkinit::memory_barrier2(cmd,
+			VK_ACCESS_2_SHADER_WRITE_BIT, VK_ACCESS_2_TRANSFER_READ_BIT | VK_ACCESS_2_SHADER_READ_BIT,
+			VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+
+		VkBufferCopy region = { 0, current_frame_index * RESTIR_STATS_COUNT * sizeof(u32), RESTIR_STATS_COUNT * sizeof(u32) };
+		vkCmdCopyBuffer(cmd, restir_stats_buffer.gpu_buffer.buffer, restir_stats_readback.buffer, 1, &region);
+		vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pools[current_frame_index], RESTIR_END_TIMESTAMP);
+	}
+	vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pools[current_frame_index], INDIRECT_END_TIMESTAMP);
+
 	{
-		// Denoise indirect diffuse and specular
+		// Denoise indirect diffuse and specular, up to temporal accumulation
+
 		{
 			// Pre-blur pass diffuse
 
@@ -1653,7 +2652,7 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 			glm::uvec3 group_count = (size + (group_size - 1u)) & ~(group_size - 1u);
 			group_count /= group_size;
 
-			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[PRE_BLUR].pipeline);
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[blur_pipeline(PRE_BLUR)].pipeline);
 
 			Descriptor_Info descriptor_info[] =
 			{
@@ -1694,9 +2693,9 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 			pc.depth_scale = scene.current_frame_camera.proj[3][2];
 			pc.blur_radius = g_settings.prepass_blur_radius;
 			pc.blur_radius_scale = 1.0;
-			vkCmdPushConstants(cmd, pipelines[PRE_BLUR].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+			vkCmdPushConstants(cmd, pipelines[blur_pipeline(PRE_BLUR)].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
 
-			vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[PRE_BLUR].update_template, pipelines[PRE_BLUR].layout, 0, descriptor_info);
+			vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[blur_pipeline(PRE_BLUR)].update_template, pipelines[blur_pipeline(PRE_BLUR)].layout, 0, descriptor_info);
 			vkCmdDispatch(cmd, group_count.x, group_count.y, 1);
 
 		}
@@ -1709,7 +2708,7 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 			glm::uvec3 group_count = (size + (group_size - 1u)) & ~(group_size - 1u);
 			group_count /= group_size;
 
-			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[PRE_BLUR].pipeline);
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[blur_pipeline(PRE_BLUR)].pipeline);
 
 			Descriptor_Info descriptor_info[] =
 			{
@@ -1743,13 +2742,15 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 			pc.depth_scale = scene.current_frame_camera.proj[3][2];
 			pc.blur_radius = g_settings.prepass_blur_radius;
 			pc.blur_radius_scale = 1.0;
-			vkCmdPushConstants(cmd, pipelines[PRE_BLUR].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+			vkCmdPushConstants(cmd, pipelines[blur_pipeline(PRE_BLUR)].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
 
-			vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[PRE_BLUR].update_template, pipelines[PRE_BLUR].layout, 0, descriptor_info);
+			vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[blur_pipeline(PRE_BLUR)].update_template, pipelines[blur_pipeline(PRE_BLUR)].layout, 0, descriptor_info);
 			vkCmdDispatch(cmd, group_count.x, group_count.y, 1);
 
 		}
 
+		vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pools[current_frame_index], PRE_BLUR_END_TIMESTAMP);
+
 		vkCmdPipelineBarrier(cmd,
 			VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
 			VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
@@ -1774,11 +2775,10 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 				Descriptor_Info(gpu_camera_data.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
 				Descriptor_Info(0, framebuffer.render_targets[NORMAL_ROUGHNESS].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 				Descriptor_Info(0, framebuffer.render_targets[BASECOLOR_METALNESS].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
-				Descriptor_Info(0, framebuffer.render_targets[WORLD_POSITION].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+				Descriptor_Info(0, framebuffer.render_targets[MOTION_VECTORS].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 				Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], framebuffer.render_targets[DEPTH].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 				Descriptor_Info(0, framebuffer.render_targets[NORMAL_ROUGHNESS].images[previous_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 				Descriptor_Info(0, framebuffer.render_targets[BASECOLOR_METALNESS].images[previous_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
-				Descriptor_Info(0, framebuffer.render_targets[WORLD_POSITION].images[previous_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 				Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], framebuffer.render_targets[DEPTH].images[previous_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 				//Descriptor_Info(0, framebuffer.render_targets[INDIRECT_DIFFUSE].images[0].image_view, VK_IMAGE_LAYOUT_GENERAL),
 				Descriptor_Info(0, framebuffer.render_targets[DENOISER_PING_PONG].images[PING].image_view, VK_IMAGE_LAYOUT_GENERAL),
@@ -1817,60 +2817,17 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 			0, nullptr,
 			0, nullptr
 		);
-		
-
-#if 0
-		{
-			// History fix mip generation
-
-			constexpr glm::uvec3 group_size = glm::uvec3(8, 8, 1);
-			glm::uvec3 size = glm::uvec3(window_width / 2, window_height / 2, 1);
-			glm::uvec3 group_count = (size + (group_size - 1u)) & ~(group_size - 1u);
-			group_count /= group_size;
-
-			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[HISTORY_FIX_MIP_GEN].pipeline);
-
-
-			Descriptor_Info descriptor_info[] =
-			{
-				//Descriptor_Info(0, framebuffer.render_targets[INDIRECT_DIFFUSE].images[0].image_view, VK_IMAGE_LAYOUT_GENERAL),
-				Descriptor_Info(0, framebuffer.render_targets[DENOISER_PING_PONG].images[PING].image_view, VK_IMAGE_LAYOUT_GENERAL),
-				Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], framebuffer.render_targets[DEPTH].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
-				Descriptor_Info(0, history_fix.radiance_mip_views[0], VK_IMAGE_LAYOUT_GENERAL),
-				Descriptor_Info(0, history_fix.radiance_mip_views[1], VK_IMAGE_LAYOUT_GENERAL),
-				Descriptor_Info(0, history_fix.radiance_mip_views[2], VK_IMAGE_LAYOUT_GENERAL),
-				Descriptor_Info(0, history_fix.radiance_mip_views[3], VK_IMAGE_LAYOUT_GENERAL),
-				Descriptor_Info(0, history_fix.radiance_mip_views[4], VK_IMAGE_LAYOUT_GENERAL),
-				Descriptor_Info(0, history_fix.view_z_mip_views[0], VK_IMAGE_LAYOUT_GENERAL),
-				Descriptor_Info(0, history_fix.view_z_mip_views[1], VK_IMAGE_LAYOUT_GENERAL),
-				Descriptor_Info(0, history_fix.view_z_mip_views[2], VK_IMAGE_LAYOUT_GENERAL),
-				Descriptor_Info(0, history_fix.view_z_mip_views[3], VK_IMAGE_LAYOUT_GENERAL),
-				Descriptor_Info(0, history_fix.view_z_mip_views[4], VK_IMAGE_LAYOUT_GENERAL),
-			};
-
-			struct
-			{
-				glm::ivec2 size;
-				float depth_scale;
-			} pc;
-
-			pc.size = glm::ivec2(size.x, size.y);
-			pc.depth_scale = scene.current_frame_camera.proj[3][2];
-			vkCmdPushConstants(cmd, pipelines[HISTORY_FIX_MIP_GEN].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+	}
+}
 
-			vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[HISTORY_FIX_MIP_GEN].update_template, pipelines[HISTORY_FIX_MIP_GEN].layout, 0, descriptor_info);
-			vkCmdDispatch(cmd, group_count.x, group_count.y, 1);
-		}
+void Renderer::denoise_indirect(VkCommandBuffer cmd)
+{
+	VkMemoryBarrier memory_barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	memory_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	memory_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
 
-		vkCmdPipelineBarrier(cmd,
-			VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
-			VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
-			0,
-			1, &memory_barrier,
-			0, nullptr,
-			0, nullptr
-		);
-#endif
+	{
+		// Denoise indirect diffuse and specular, from the history fix on
 
 		if (g_settings.use_alternative_history_fix)
 		{
@@ -1887,10 +2844,12 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 			{
 				glm::ivec2 size;
 				float stride;
+				u32 is_specular;
 			} pc;
 
 			pc.size = glm::ivec2(size.x, size.y);
 			pc.stride = g_settings.history_fix_stride;
+			pc.is_specular = 0;
 
 			vkCmdPushConstants(cmd, pipelines[HISTORY_FIX_ALTERNATIVE].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
 
@@ -1925,11 +2884,74 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 				};
 				vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[HISTORY_FIX_ALTERNATIVE].update_template, pipelines[HISTORY_FIX_ALTERNATIVE].layout, 0, descriptor_info);
 			}
+			// Specular history length and roughness
+			pc.is_specular = 1;
+			vkCmdPushConstants(cmd, pipelines[HISTORY_FIX_ALTERNATIVE].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
 
 			vkCmdDispatch(cmd, group_count.x, group_count.y, 1);
 		}
 		else
 		{
+			{
+				// History fix mip generation, every level in one dispatch
+
+				constexpr glm::uvec3 group_size = glm::uvec3(64, 64, 1); // Mip 0 texels per 16x16 group
+				glm::uvec3 size = glm::uvec3(window_width, window_height, 1);
+				glm::uvec3 group_count = (size + (group_size - 1u)) / group_size;
+
+				vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[HISTORY_FIX_MIP_GEN].pipeline);
+
+				Descriptor_Info descriptor_info[] =
+				{
+					Descriptor_Info(0, framebuffer.render_targets[DENOISER_PING_PONG].images[PING].image_view, VK_IMAGE_LAYOUT_GENERAL),
+					Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], framebuffer.render_targets[DEPTH].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+					Descriptor_Info(0, history_fix.radiance_mip_views[0], VK_IMAGE_LAYOUT_GENERAL),
+					Descriptor_Info(0, history_fix.radiance_mip_views[1], VK_IMAGE_LAYOUT_GENERAL),
+					Descriptor_Info(0, history_fix.radiance_mip_views[2], VK_IMAGE_LAYOUT_GENERAL),
+					Descriptor_Info(0, history_fix.radiance_mip_views[3], VK_IMAGE_LAYOUT_GENERAL),
+					Descriptor_Info(0, history_fix.radiance_mip_views[4], VK_IMAGE_LAYOUT_GENERAL),
+					Descriptor_Info(0, history_fix.radiance_mip_views[5], VK_IMAGE_LAYOUT_GENERAL),
+					Descriptor_Info(0, history_fix.radiance_mip_views[6], VK_IMAGE_LAYOUT_GENERAL),
+					Descriptor_Info(0, history_fix.radiance_mip_views[7], VK_IMAGE_LAYOUT_GENERAL),
+					Descriptor_Info(0, history_fix.view_z_mip_views[0], VK_IMAGE_LAYOUT_GENERAL),
+					Descriptor_Info(0, history_fix.view_z_mip_views[1], VK_IMAGE_LAYOUT_GENERAL),
+					Descriptor_Info(0, history_fix.view_z_mip_views[2], VK_IMAGE_LAYOUT_GENERAL),
+					Descriptor_Info(0, history_fix.view_z_mip_views[3], VK_IMAGE_LAYOUT_GENERAL),
+					Descriptor_Info(0, history_fix.view_z_mip_views[4], VK_IMAGE_LAYOUT_GENERAL),
+					Descriptor_Info(0, history_fix.view_z_mip_views[5], VK_IMAGE_LAYOUT_GENERAL),
+					Descriptor_Info(0, history_fix.view_z_mip_views[6], VK_IMAGE_LAYOUT_GENERAL),
+					Descriptor_Info(0, history_fix.view_z_mip_views[7], VK_IMAGE_LAYOUT_GENERAL),
+					Descriptor_Info(history_fix.atomic_counter.buffer, 0, VK_WHOLE_SIZE),
+				};
+				static_assert(HISTORY_FIX_MIP_LEVELS == 8, "history_fix_mip_gen.comp writes exactly 8 levels");
+
+				struct
+				{
+					glm::ivec2 size;
+					float depth_scale;
+					u32 reduction_mode;
+					u32 group_count;
+				} pc;
+
+				pc.size = glm::ivec2(size.x, size.y);
+				pc.depth_scale = scene.current_frame_camera.proj[3][2];
+				pc.reduction_mode = (u32)g_settings.history_fix_reduction;
+				pc.group_count = group_count.x * group_count.y;
+				vkCmdPushConstants(cmd, pipelines[HISTORY_FIX_MIP_GEN].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+
+				vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[HISTORY_FIX_MIP_GEN].update_template, pipelines[HISTORY_FIX_MIP_GEN].layout, 0, descriptor_info);
+				vkCmdDispatch(cmd, group_count.x, group_count.y, 1);
+
+				vkCmdPipelineBarrier(cmd,
+					VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+					VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+					0,
+					1, &memory_barrier,
+					0, nullptr,
+					0, nullptr
+				);
+			}
+
 			// History fix
 
 			constexpr glm::uvec3 group_size = glm::uvec3(8, 8, 1);
@@ -1969,6 +2991,8 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 			0, nullptr
 		);
 
+		vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pools[current_frame_index], BLUR_BEGIN_TIMESTAMP);
+
 		{
 			// Diffuse main blur pass
 
@@ -1977,7 +3001,7 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 			glm::uvec3 group_count = (size + (group_size - 1u)) & ~(group_size - 1u);
 			group_count /= group_size;
 
-			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[BLUR].pipeline);
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[blur_pipeline(BLUR)].pipeline);
 
 			Descriptor_Info descriptor_info[] =
 			{
@@ -2008,9 +3032,9 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 			pc.depth_scale = scene.current_frame_camera.proj[3][2];
 			pc.blur_radius = g_settings.blur_radius;
 			pc.blur_radius_scale = 1.0f;
-			vkCmdPushConstants(cmd, pipelines[BLUR].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+			vkCmdPushConstants(cmd, pipelines[blur_pipeline(BLUR)].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
 
-			vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[BLUR].update_template, pipelines[BLUR].layout, 0, descriptor_info);
+			vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[blur_pipeline(BLUR)].update_template, pipelines[blur_pipeline(BLUR)].layout, 0, descriptor_info);
 			vkCmdDispatch(cmd, group_count.x, group_count.y, 1);
 		}
 
@@ -2022,7 +3046,7 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 			glm::uvec3 group_count = (size + (group_size - 1u)) & ~(group_size - 1u);
 			group_count /= group_size;
 
-			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[BLUR_SPEC].pipeline);
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[blur_pipeline(BLUR_SPEC)].pipeline);
 
 			Descriptor_Info descriptor_info[] =
 			{
@@ -2053,12 +3077,14 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 			pc.depth_scale = scene.current_frame_camera.proj[3][2];
 			pc.blur_radius = g_settings.blur_radius;
 			pc.blur_radius_scale = 1.0f;
-			vkCmdPushConstants(cmd, pipelines[BLUR_SPEC].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+			vkCmdPushConstants(cmd, pipelines[blur_pipeline(BLUR_SPEC)].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
 
-			vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[BLUR_SPEC].update_template, pipelines[BLUR_SPEC].layout, 0, descriptor_info);
+			vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[blur_pipeline(BLUR_SPEC)].update_template, pipelines[blur_pipeline(BLUR_SPEC)].layout, 0, descriptor_info);
 			vkCmdDispatch(cmd, group_count.x, group_count.y, 1);
 		}
 
+		vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pools[current_frame_index], BLUR_END_TIMESTAMP);
+
 		vkCmdPipelineBarrier(cmd,
 			VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
 			VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
@@ -2076,7 +3102,7 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 			glm::uvec3 group_count = (size + (group_size - 1u)) & ~(group_size - 1u);
 			group_count /= group_size;
 
-			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[POST_BLUR].pipeline);
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[blur_pipeline(POST_BLUR)].pipeline);
 
 			Descriptor_Info descriptor_info[] =
 			{
@@ -2107,9 +3133,9 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 			pc.depth_scale = scene.current_frame_camera.proj[3][2];
 			pc.blur_radius = g_settings.blur_radius;
 			pc.blur_radius_scale = g_settings.post_blur_radius_scale;
-			vkCmdPushConstants(cmd, pipelines[POST_BLUR].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+			vkCmdPushConstants(cmd, pipelines[blur_pipeline(POST_BLUR)].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
 
-			vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[POST_BLUR].update_template, pipelines[POST_BLUR].layout, 0, descriptor_info);
+			vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[blur_pipeline(POST_BLUR)].update_template, pipelines[blur_pipeline(POST_BLUR)].layout, 0, descriptor_info);
 			vkCmdDispatch(cmd, group_count.x, group_count.y, 1);
 		}
 
@@ -2121,7 +3147,7 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 			glm::uvec3 group_count = (size + (group_size - 1u)) & ~(group_size - 1u);
 			group_count /= group_size;
 
-			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[POST_BLUR_SPEC].pipeline);
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[blur_pipeline(POST_BLUR_SPEC)].pipeline);
 
 			Descriptor_Info descriptor_info[] =
 			{
@@ -2152,12 +3178,14 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 			pc.depth_scale = scene.current_frame_camera.proj[3][2];
 			pc.blur_radius = g_settings.blur_radius;
 			pc.blur_radius_scale = g_settings.post_blur_radius_scale;
-			vkCmdPushConstants(cmd, pipelines[POST_BLUR_SPEC].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+			vkCmdPushConstants(cmd, pipelines[blur_pipeline(POST_BLUR_SPEC)].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
 
-			vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[POST_BLUR_SPEC].update_template, pipelines[POST_BLUR_SPEC].layout, 0, descriptor_info);
+			vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[blur_pipeline(POST_BLUR_SPEC)].update_template, pipelines[blur_pipeline(POST_BLUR_SPEC)].layout, 0, descriptor_info);
 			vkCmdDispatch(cmd, group_count.x, group_count.y, 1);
 		}
 
+		vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pools[current_frame_index], POST_BLUR_END_TIMESTAMP);
+
 		vkCmdPipelineBarrier(cmd,
 			VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
 			VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
@@ -2182,9 +3210,8 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 				Descriptor_Info(0, framebuffer.render_targets[DENOISER_OUTPUT].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 				Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], framebuffer.render_targets[TEMPORAL_STABILIZATION_HISTORY].images[previous_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 				Descriptor_Info(0, framebuffer.render_targets[TEMPORAL_STABILIZATION_HISTORY].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
-				Descriptor_Info(0, framebuffer.render_targets[WORLD_POSITION].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+				Descriptor_Info(0, framebuffer.render_targets[MOTION_VECTORS].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 				Descriptor_Info(global_constants_buffer.buffer, 0, VK_WHOLE_SIZE),
-				Descriptor_Info(gpu_camera_data.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
 				Descriptor_Info(0, framebuffer.render_targets[DENOISER_HISTORY_LENGTH].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 				Descriptor_Info(0, framebuffer.render_targets[INTERNAL_OCCLUSION_DATA].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 			};
@@ -2216,9 +3243,8 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 				Descriptor_Info(0, framebuffer.render_targets[DENOISER_SPECULAR_OUTPUT].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 				Descriptor_Info(samplers[BILINEAR_SAMPLER_CLAMP], framebuffer.render_targets[TEMPORAL_STABILIZATION_HISTORY_SPEC].images[previous_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 				Descriptor_Info(0, framebuffer.render_targets[TEMPORAL_STABILIZATION_HISTORY_SPEC].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
-				Descriptor_Info(0, framebuffer.render_targets[WORLD_POSITION].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+				Descriptor_Info(0, framebuffer.render_targets[MOTION_VECTORS].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 				Descriptor_Info(global_constants_buffer.buffer, 0, VK_WHOLE_SIZE),
-				Descriptor_Info(gpu_camera_data.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
 				Descriptor_Info(0, framebuffer.render_targets[DENOISER_HISTORY_LENGTH].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 				Descriptor_Info(0, framebuffer.render_targets[INTERNAL_OCCLUSION_DATA].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
 			};
@@ -2244,6 +3270,61 @@ void Renderer::rasterize(VkCommandBuffer cmd, ECS* ecs)
 		0, nullptr,
 		0, nullptr
 	);
+	vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pools[current_frame_index], DENOISER_END_TIMESTAMP);
+
+	bool capture_reference = g_settings.capture_indirect_reference;
+	if (capture_reference || (g_settings.indirect_error_metric && indirect_reference_valid))
+	{
+		// Error of the denoised output against the reference, or a new reference
+
+		vkCmdFillBuffer(cmd, indirect_error_buffer.gpu_buffer.buffer, 0, 3 * sizeof(u32), 0);
+		vkinit::memory_barrier2(cmd,
+			VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT,
+			VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+
+		constexpr glm::uvec3 group_size = glm::uvec3(8, 8, 1);
+		glm::uvec3 size = glm::uvec3(window_width, window_height, 1);
+		glm::uvec3 group_count = (size + (group_size - 1u)) & ~(group_size - 1u);
+		group_count /= group_size;
+
+		vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[INDIRECT_ERROR].pipeline);
+
+		Descriptor_Info descriptor_info[] =
+		{
+			Descriptor_Info(0, framebuffer.render_targets[TEMPORAL_STABILIZATION_HISTORY].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+			Descriptor_Info(0, framebuffer.render_targets[TEMPORAL_STABILIZATION_HISTORY_SPEC].images[current_frame_gbuffer_index].image_view, VK_IMAGE_LAYOUT_GENERAL),
+			Descriptor_Info(0, framebuffer.render_targets[INDIRECT_DIFFUSE_REFERENCE].images[0].image_view, VK_IMAGE_LAYOUT_GENERAL),
+			Descriptor_Info(0, framebuffer.render_targets[INDIRECT_SPECULAR_REFERENCE].images[0].image_view, VK_IMAGE_LAYOUT_GENERAL),
+			Descriptor_Info(indirect_error_buffer.gpu_buffer.buffer, 0, VK_WHOLE_SIZE),
+			Descriptor_Info(0, framebuffer.render_targets[INDIRECT_DIFFUSE].images[0].image_view, VK_IMAGE_LAYOUT_GENERAL),
+		};
+
+		struct
+		{
+			glm::ivec2 size;
+			u32 capture;
+		} pc;
+
+		pc.size = glm::ivec2(window_width, window_height);
+		pc.capture = capture_reference ? 1 : 0;
+		vkCmdPushConstants(cmd, pipelines[INDIRECT_ERROR].layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+
+		vkCmdPushDescriptorSetWithTemplateKHR(cmd, pipelines[INDIRECT_ERROR].update_template, pipelines[INDIRECT_ERROR].layout, 0, descriptor_info);
+		vkCmdDispatch(cmd, group_count.x, group_count.y, 1);
+
+		vkinit::memory_barrier2(cmd,
+			VK_ACCESS_2_SHADER_WRITE_BIT, VK_ACCESS_2_TRANSFER_READ_BIT | VK_ACCESS_2_SHADER_READ_BIT,
+			VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+
+		VkBufferCopy region = { 0, current_frame_index * 3 * sizeof(u32), 3 * sizeof(u32) };
+		vkCmdCopyBuffer(cmd, indirect_error_buffer.gpu_buffer.buffer, indirect_error_readback.buffer, 1, &region);
+
+		if (capture_reference)
+		{
+			g_settings.capture_indirect_reference = false;
+			indirect_reference_valid = true;
+		}
+	}
 }
 
 void Renderer::cleanup()
@@ -2261,8 +3342,10 @@ void Renderer::cleanup()
 			vkDestroySampler(context->device, samplers[i], nullptr);
 	}
 
-	vmaUnmapMemory(context->allocator, global_constants_buffer.allocation);
+	for (int i = 0; i < FRAMES_IN_FLIGHT; ++i)
+		vmaUnmapMemory(context->allocator, global_constants_buffers[i].allocation);
 
+	clear_shader_cache();
 	probe_system.shutdown();
 	ui_overlay.shutdown();
 }
@@ -2295,32 +3378,46 @@ void Renderer::create_render_targets(VkCommandBuffer cmd)
 {
 	i32 w, h;
 	platform->get_window_size(&w, &h);
+
+	// G-buffer targets and final_output change queues with explicit ownership transfers, see transfer_gbuffer_ownership
+	auto allocate_exclusive_image = [&](VkFormat format, VkImageUsageFlags usage, VkImageAspectFlags aspect)
+	{
+		return context->allocate_image({ (u32)w, (u32)h, 1 }, format, usage, aspect, VK_IMAGE_TILING_OPTIMAL, 1, 0, 1, true);
+	};
+
 	Render_Target color_attachments[2];
 	for (size_t i = 0; i < std::size(color_attachments); ++i)
 	{
 		color_attachments[i].format = VK_FORMAT_R32G32B32A32_SFLOAT;
-		color_attachments[i].images[0] = context->allocate_image(
-			{ (uint32_t)w, (uint32_t)h, 1 },
-			color_attachments[i].format,
-			VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT
+	}
+	color_attachments[0].images[0] = context->allocate_image(
+		{ (uint32_t)w, (uint32_t)h, 1 },
+		color_attachments[0].format,
+		VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT
+	);
+	for (u32 i = 0; i < GBUFFER_LAYERS; ++i)
+	{
+		color_attachments[1].images[i] = allocate_exclusive_image(
+			color_attachments[1].format,
+			VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+			VK_IMAGE_ASPECT_COLOR_BIT
 		);
 	}
 	Render_Target depth_attachment;
 	depth_attachment.format = VK_FORMAT_D32_SFLOAT;
 	for (u32 i = 0; i < GBUFFER_LAYERS; ++i)
 	{
-		depth_attachment.images[i] = context->allocate_image(
-			{ (u32)w, (u32)h, 1 },
+		depth_attachment.images[i] = allocate_exclusive_image(
 			depth_attachment.format,
 			VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
 			VK_IMAGE_ASPECT_DEPTH_BIT
 		);
 	}
 
-	final_output = context->allocate_image(
-		{ u32(w), (u32)h, 1 },
+	final_output = allocate_exclusive_image(
 		VK_FORMAT_B8G8R8A8_UNORM,
-		VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+		VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+		VK_IMAGE_ASPECT_COLOR_BIT
 	);
 
 	Render_Target normal_attachment;
@@ -2328,8 +3425,7 @@ void Renderer::create_render_targets(VkCommandBuffer cmd)
 	//normal_attachment.format = VK_FORMAT_R16G16B16A16_SFLOAT;
 	for (u32 i = 0; i < GBUFFER_LAYERS; ++i)
 	{
-		normal_attachment.images[i] = context->allocate_image(
-			{ (u32)w, (u32)h, 1 },
+		normal_attachment.images[i] = allocate_exclusive_image(
 			normal_attachment.format,
 			VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_STORAGE_BIT,
 			VK_IMAGE_ASPECT_COLOR_BIT
@@ -2340,8 +3436,7 @@ void Renderer::create_render_targets(VkCommandBuffer cmd)
 	albedo_attachment.format = VK_FORMAT_R8G8B8A8_UNORM;
 	for (u32 i = 0; i < GBUFFER_LAYERS; ++i)
 	{
-		albedo_attachment.images[i] = context->allocate_image(
-			{ (u32)w, (u32)h, 1 },
+		albedo_attachment.images[i] = allocate_exclusive_image(
 			albedo_attachment.format,
 			VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
 			VK_IMAGE_ASPECT_COLOR_BIT
@@ -2352,14 +3447,24 @@ void Renderer::create_render_targets(VkCommandBuffer cmd)
 	world_pos_attachment.format = VK_FORMAT_R32G32B32A32_SFLOAT;
 	for (u32 i = 0; i < GBUFFER_LAYERS; ++i)
 	{
-		world_pos_attachment.images[i] = context->allocate_image(
-			{ (u32)w, (u32)h, 1 },
+		world_pos_attachment.images[i] = allocate_exclusive_image(
 			world_pos_attachment.format,
 			VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_STORAGE_BIT,
 			VK_IMAGE_ASPECT_COLOR_BIT
 		);
 	}
 
+	Render_Target motion_vectors;
+	motion_vectors.format = MOTION_VECTORS_FORMAT;
+	for (u32 i = 0; i < GBUFFER_LAYERS; ++i)
+	{
+		motion_vectors.images[i] = allocate_exclusive_image(
+			motion_vectors.format,
+			VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_STORAGE_BIT,
+			VK_IMAGE_ASPECT_COLOR_BIT
+		);
+	}
+
 	Render_Target indirect_diffuse_attachment;
 	indirect_diffuse_attachment.format = VK_FORMAT_R32G32B32A32_SFLOAT;
 	indirect_diffuse_attachment.images[0] = context->allocate_image(
@@ -2525,6 +3630,32 @@ void Renderer::create_render_targets(VkCommandBuffer cmd)
 		);
 	}
 
+	// Reduced resolution rays, big enough for every INDIRECT_RESOLUTION_* mode. Only the first image is used
+	Render_Target indirect_rays[2];
+	for (Render_Target& rays : indirect_rays)
+	{
+		rays.format = VK_FORMAT_R32G32B32A32_SFLOAT;
+		rays.images[0] = context->allocate_image(
+			{ (u32)(w + 1) / 2, (u32)h, 1 },
+			rays.format,
+			VK_IMAGE_USAGE_STORAGE_BIT,
+			VK_IMAGE_ASPECT_COLOR_BIT
+		);
+	}
+
+	// Denoised indirect lighting captured for the error metric
+	Render_Target indirect_reference[2];
+	for (Render_Target& reference : indirect_reference)
+	{
+		reference.format = VK_FORMAT_R32G32B32A32_SFLOAT;
+		reference.images[0] = context->allocate_image(
+			{ (u32)w, (u32)h, 1 },
+			reference.format,
+			VK_IMAGE_USAGE_STORAGE_BIT,
+			VK_IMAGE_ASPECT_COLOR_BIT
+		);
+	}
+
 	history_fix.radiance_image = context->allocate_image(
 		{ (u32)w, (u32)h, 1 },
 		VK_FORMAT_R32G32B32A32_SFLOAT,
@@ -2543,6 +3674,10 @@ void Renderer::create_render_targets(VkCommandBuffer cmd)
 		HISTORY_FIX_MIP_LEVELS
 	);
 
+	history_fix.atomic_counter = context->allocate_buffer(sizeof(u32),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, 0);
+	vkCmdFillBuffer(cmd, history_fix.atomic_counter.buffer, 0, sizeof(u32), 0);
+
 	for (int i = 0; i < HISTORY_FIX_MIP_LEVELS; ++i)
 	{
 		VkImageViewCreateInfo info = vkinit::image_view_create_info(history_fix.radiance_image.image, VK_IMAGE_VIEW_TYPE_2D, VK_FORMAT_R32G32B32A32_SFLOAT, i, 1, 0, 1);
@@ -2558,11 +3693,41 @@ void Renderer::create_render_targets(VkCommandBuffer cmd)
 			}, Garbage_Collector::SHUTDOWN);
 		};
 
+	// Rounded down to powers of two so every level halves the previous one exactly
+	depth_pyramid.width = 1u << (u32)floor(log2((double)w));
+	depth_pyramid.height = 1u << (u32)floor(log2((double)h));
+	depth_pyramid.mip_count = (u32)floor(log2((double)std::max(depth_pyramid.width, depth_pyramid.height))) + 1;
+	assert(depth_pyramid.mip_count <= MAX_DEPTH_PYRAMID_LEVELS);
+	depth_pyramid.image = context->allocate_image(
+		{ depth_pyramid.width, depth_pyramid.height, 1 },
+		VK_FORMAT_R32_SFLOAT,
+		VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+		VK_IMAGE_ASPECT_COLOR_BIT,
+		VK_IMAGE_TILING_OPTIMAL,
+		depth_pyramid.mip_count
+	);
+	for (u32 i = 0; i < depth_pyramid.mip_count; ++i)
+	{
+		VkImageViewCreateInfo info = vkinit::image_view_create_info(depth_pyramid.image.image, VK_IMAGE_VIEW_TYPE_2D, VK_FORMAT_R32_SFLOAT, i, 1, 0, 1);
+		vkCreateImageView(context->device, &info, nullptr, &depth_pyramid.mip_views[i]);
+		VkImageView view = depth_pyramid.mip_views[i];
+		g_garbage_collector->push([=]()
+			{
+				vkDestroyImageView(context->device, view, nullptr);
+			}, Garbage_Collector::SHUTDOWN);
+	}
+	depth_pyramid.valid = false;
+
 	vk_begin_command_buffer(cmd);
 
-	for (size_t i = 0; i < std::size(color_attachments); ++i)
+	vk_transition_layout(cmd, color_attachments[0].images[0].image,
+		VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
+		0, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+		VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR);
+
+	for (size_t i = 0; i < GBUFFER_LAYERS; ++i)
 	{
-		vk_transition_layout(cmd, color_attachments[i].images[0].image,
+		vk_transition_layout(cmd, color_attachments[1].images[i].image,
 			VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
 			0, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
 			VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR);
@@ -2615,6 +3780,14 @@ void Renderer::create_render_targets(VkCommandBuffer cmd)
 			VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
 	}
 
+	for (size_t i = 0; i < GBUFFER_LAYERS; ++i)
+	{
+		vk_transition_layout(cmd, motion_vectors.images[i].image,
+			VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
+			0, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+			VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT);
+	}
+
 	for (size_t i = 0; i < GBUFFER_LAYERS; ++i)
 	{
 		vk_transition_layout(cmd, denoiser_history_length.images[i].image,
@@ -2716,6 +3889,18 @@ void Renderer::create_render_targets(VkCommandBuffer cmd)
 		0, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
 		VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
 
+	for (size_t i = 0; i < std::size(indirect_rays); ++i)
+	{
+		vk_transition_layout(cmd, indirect_rays[i].images[0].image,
+			VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
+			0, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+			VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT);
+		vk_transition_layout(cmd, indirect_reference[i].images[0].image,
+			VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
+			0, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+			VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT);
+	}
+
 	vk_transition_layout(cmd, history_fix.radiance_image.image,
 		VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
 		0, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
@@ -2726,6 +3911,11 @@ void Renderer::create_render_targets(VkCommandBuffer cmd)
 		0, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
 		VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT);
 
+	vk_transition_layout(cmd, depth_pyramid.image.image,
+		VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
+		0, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT);
+
 	vkEndCommandBuffer(cmd);
 	vk_command_buffer_single_submit(cmd);
 	vkQueueWaitIdle(context->graphics_queue);
@@ -2742,6 +3932,7 @@ void Renderer::create_render_targets(VkCommandBuffer cmd)
 	framebuffer.render_targets[DENOISER_OUTPUT] = denoiser_output;
 	framebuffer.render_targets[DENOISER_SPECULAR_OUTPUT] = denoiser_specular_output;
 	framebuffer.render_targets[WORLD_POSITION] = world_pos_attachment;
+	framebuffer.render_targets[MOTION_VECTORS] = motion_vectors;
 	framebuffer.render_targets[DENOISER_HISTORY_LENGTH] = denoiser_history_length;
 	framebuffer.render_targets[DENOISER_PING_PONG] = denoiser_ping_pong;
 	framebuffer.render_targets[DENOISER_SPECULAR_PING_PONG] = denoiser_specular_ping_pong;
@@ -2751,6 +3942,10 @@ void Renderer::create_render_targets(VkCommandBuffer cmd)
 	framebuffer.render_targets[INTERNAL_OCCLUSION_DATA] = occlusion_data;
 	framebuffer.render_targets[COMPOSITION_OUTPUT] = composition_output;
 	framebuffer.render_targets[TAA_OUTPUT] = taa_output;
+	framebuffer.render_targets[INDIRECT_DIFFUSE_RAYS] = indirect_rays[0];
+	framebuffer.render_targets[INDIRECT_SPECULAR_RAYS] = indirect_rays[1];
+	framebuffer.render_targets[INDIRECT_DIFFUSE_REFERENCE] = indirect_reference[0];
+	framebuffer.render_targets[INDIRECT_SPECULAR_REFERENCE] = indirect_reference[1];
 }
 
 static bool check_extensions(const std::vector<const char*>& device_exts, const std::vector<VkExtensionProperties>& props)
@@ -2772,219 +3967,241 @@ static bool check_extensions(const std::vector<const char*>& device_exts, const
 }
 
 
-void Renderer::create_bottom_level_acceleration_structure(Mesh* mesh)
+void Renderer::build_bottom_level_acceleration_structures()
 {
-	u32 prim_count = (u32)mesh->primitives.size();
-
-	for (u32 i = 0; i < prim_count; ++i)
-	{
-		assert(!mesh->primitives[i].acceleration_structure.has_value());
-
-		VkAccelerationStructureBuildGeometryInfoKHR build_info{};
-		VkAccelerationStructureGeometryKHR geometry{};
-		VkAccelerationStructureBuildRangeInfoKHR range_info{};
-		VkAccelerationStructureGeometryTrianglesDataKHR triangles{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR };
-		triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
-		triangles.vertexData.deviceAddress = mesh->vertex_buffer_address;
-		triangles.vertexStride = mesh->get_vertex_size();
-		triangles.indexType = VK_INDEX_TYPE_UINT32;
-		triangles.indexData.deviceAddress = mesh->index_buffer_address;
-		triangles.maxVertex = mesh->get_vertex_count() - 1;
-		triangles.transformData = { 0 };
-
-		geometry = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR };
-		geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
-		geometry.geometry.triangles = triangles;
-		geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
-
-		range_info = {};
-		range_info.firstVertex = 0;
-		range_info.primitiveCount = mesh->primitives[i].vertex_count / 3;
-		range_info.primitiveOffset = mesh->primitives[i].vertex_offset * sizeof(u32);
-		range_info.transformOffset = 0;
-
-		build_info = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR };
-		build_info.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-		build_info.geometryCount = 1;
-		build_info.pGeometries = &geometry;
-		build_info.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-		build_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-		build_info.srcAccelerationStructure = VK_NULL_HANDLE;
-
-
-		VkAccelerationStructureBuildSizesInfoKHR size_info{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR };
-		vkGetAccelerationStructureBuildSizesKHR(context->device,
-			VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &build_info, &range_info.primitiveCount, &size_info);
-
-		Vk_Allocated_Buffer buffer_blas = context->allocate_buffer((uint32_t)size_info.accelerationStructureSize,
-			VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-			VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, 0);
-
-		VkAccelerationStructureKHR acceleration_structure;
-		VkAccelerationStructureCreateInfoKHR create_info{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR };
-		create_info.type = build_info.type;
-		create_info.size = size_info.accelerationStructureSize;
-		create_info.buffer = buffer_blas.buffer;
-		create_info.offset = 0;
-		VK_CHECK(vkCreateAccelerationStructureKHR(context->device, &create_info, nullptr, &acceleration_structure));
+	// One BLAS per primitive, all of them built and compacted in one go
+	Blas_Builder builder;
+	builder.init(context);
+
+	blas_memory = 0;
+	blas_memory_full_detail = 0;
+	std::vector<Mesh_Primitive*> primitives;
+	// Entities sharing a mesh share its BLASes
+	for (Mesh* m : scene_meshes)
+	{
+		for (Mesh_Primitive& prim : m->primitives)
+		{
+			assert(!prim.acceleration_structure.has_value());
+
+			VkAccelerationStructureGeometryTrianglesDataKHR triangles{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR };
+			triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
+			triangles.vertexData.deviceAddress = m->vertex_buffer_address;
+			triangles.vertexStride = m->get_vertex_size();
+			triangles.indexType = VK_INDEX_TYPE_UINT32;
+			triangles.indexData.deviceAddress = m->index_buffer_address;
+			triangles.maxVertex = m->get_vertex_count() - 1;
+			triangles.transformData = { 0 };
+
+			Mesh_Lod lod = get_primitive_lod(prim, (u32)std::max(g_settings.ray_tracing_lod, 0));
+			u32 index = builder.add_triangles(triangles, lod.vertex_count / 3, lod.vertex_offset * sizeof(u32));
+			primitives.push_back(&prim);
+
+			// What the full detail primitive would have needed uncompacted, for comparison
+			VkAccelerationStructureBuildGeometryInfoKHR build_info = vkinit::acceleration_structure_build_geometry_info_khr(
+				VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR, 1, &builder.inputs[index].geometry,
+				VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR, VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR);
+			VkAccelerationStructureBuildSizesInfoKHR full_size_info{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR };
+			u32 full_primitive_count = prim.vertex_count / 3;
+			vkGetAccelerationStructureBuildSizesKHR(context->device,
+				VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &build_info, &full_primitive_count, &full_size_info);
+			blas_memory_full_detail += full_size_info.accelerationStructureSize;
+		}
+	}
+
+	builder.build();
+	blas_memory = builder.compacted_size;
+	blas_memory_uncompacted = builder.uncompacted_size;
 
+	for (size_t i = 0; i < primitives.size(); ++i)
+	{
+		VkAccelerationStructureKHR acceleration_structure = builder.results[i].acceleration_structure;
 		g_garbage_collector->push([=]()
 			{
 				vkDestroyAccelerationStructureKHR(context->device, acceleration_structure, nullptr);
 			}, Garbage_Collector::SHUTDOWN);
 
-		Vk_Allocated_Buffer scratch_buffer = context->allocate_buffer((uint32_t)size_info.buildScratchSize,
-			VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-			VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, 0, context->acceleration_structure_properties.minAccelerationStructureScratchOffsetAlignment);
-
-
 		Acceleration_Structure as{};
 		as.level = Acceleration_Structure::Level::BOTTOM_LEVEL;
 		as.acceleration_structure = acceleration_structure;
-		as.scratch_buffer = scratch_buffer;
-		as.scratch_buffer_address = context->get_buffer_device_address(scratch_buffer);
-		as.acceleration_structure_buffer = buffer_blas;
-		as.acceleration_structure_buffer_address = context->get_acceleration_structure_device_address(acceleration_structure);
+		as.acceleration_structure_buffer = builder.storage; // Shared by all of them
+		as.acceleration_structure_buffer_address = builder.results[i].address;
+		primitives[i]->acceleration_structure = as;
+	}
+}
 
-		mesh->primitives[i].acceleration_structure = as;
-	};
+static void write_instance_transform(VkAccelerationStructureInstanceKHR* instance, const glm::mat4& transform)
+{
+	for (int i = 0; i < 4; ++i)
+		for (int j = 0; j < 3; ++j)
+		{
+			instance->transform.matrix[j][i] = transform[i][j];
+		}
+}
+
+void Renderer::create_instance_table(ECS* ecs, glm::vec3* bbmin, glm::vec3* bbmax)
+{
+	instance_table.clear();
+	std::vector<Meshlet_Instance> meshlet_instances;
+	*bbmin = glm::vec3(INFINITY);
+	*bbmax = glm::vec3(-INFINITY);
 
+	std::unordered_map<Mesh*, u32> mesh_indices;
+	for (u32 i = 0; i < (u32)scene_meshes.size(); ++i)
+		mesh_indices[scene_meshes[i]] = i;
 
-}
+	u32 material_count = (u32)material_manager->resources.size();
+	for (auto [mesh, xform] : ecs->filter<Static_Mesh_Component, Transform_Component>())
+	{
+		Mesh* m = mesh->manager->get_resource_with_id(mesh->mesh_id);
+		glm::mat4 transform = xform->get_matrix();
+		u32 first_instance = (u32)instance_table.size();
+		for (u32 i = 0; i < (u32)m->primitives.size(); ++i)
+		{
+			Instance_Data instance{};
+			instance.transform = transform;
+			instance.previous_transform = transform;
+			instance.primitive_index = m->first_primitive + i;
+			instance.material_index = m->primitives[i].material_id;
+			instance.mesh_index = mesh_indices.at(m);
+			assert(instance.material_index < material_count);
+			instance_table.push_back(instance);
+		}
+		for (u32 i = 0; i < (u32)m->meshlets.size(); ++i)
+			meshlet_instances.push_back({ m->first_meshlet + i, first_instance + m->meshlets[i].primitive_index });
+
+		// Corners of the mesh's bounds, for the probe grid
+		for (u32 corner = 0; corner < 8; ++corner)
+		{
+			glm::vec3 p = glm::vec3(corner & 1 ? m->bbmax.x : m->bbmin.x, corner & 2 ? m->bbmax.y : m->bbmin.y, corner & 4 ? m->bbmax.z : m->bbmin.z);
+			p = glm::vec3(transform * glm::vec4(p, 1.0f));
+			*bbmin = glm::min(*bbmin, p);
+			*bbmax = glm::max(*bbmax, p);
+		}
+	}
 
+	// The custom index has 24 bits, past that instances would alias each other
+	u32 instance_count = (u32)instance_table.size();
+	// Fails in every build, not just with asserts
+	if (instance_count > (1u << 24))
+	{
+		LOG_DEBUG("%u instances, the TLAS custom index fits %u\n", instance_count, 1u << 24);
+		abort();
+	}
+	meshlet_instance_count = (u32)meshlet_instances.size();
+	instance_table_buffer = context->create_gpu_buffer((u32)(std::max(instance_count, 1u) * sizeof(Instance_Data)), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	meshlet_instance_buffer = context->create_gpu_buffer((u32)(std::max(meshlet_instance_count, 1u) * sizeof(Meshlet_Instance)), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	instance_lod_buffer = context->create_gpu_buffer((u32)(std::max(instance_count, 1u) * FRAMES_IN_FLIGHT * sizeof(u32)), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	instance_lods.assign(instance_count, 0);
+	if (instance_count != 0)
+		context->upload_ring.upload(&instance_table_buffer, instance_table.data(), instance_count * sizeof(Instance_Data));
+	if (meshlet_instance_count != 0)
+		context->upload_ring.upload(&meshlet_instance_buffer, meshlet_instances.data(), meshlet_instance_count * sizeof(Meshlet_Instance));
+	LOG_DEBUG("Scene instances: %u of %u primitives, %u meshlet instances, %.2f MB\n", instance_count, primitive_count, meshlet_instance_count,
+		(double)(instance_count * sizeof(Instance_Data) + meshlet_instance_count * sizeof(Meshlet_Instance)) / (1024.0 * 1024.0));
+}
 
-void Renderer::build_bottom_level_acceleration_structure(Mesh* mesh, VkCommandBuffer cmd)
+void Renderer::create_emissive_light_table()
 {
-	u32 prim_count = (u32)mesh->primitives.size();
-
-	for (u32 i = 0; i < prim_count; ++i)
-	{
-		VkAccelerationStructureBuildGeometryInfoKHR build_info{};
-		VkAccelerationStructureGeometryKHR geometry{};
-		VkAccelerationStructureBuildRangeInfoKHR range_info{};
-		VkAccelerationStructureGeometryTrianglesDataKHR triangles{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR };
-		triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
-		triangles.vertexData.deviceAddress = mesh->vertex_buffer_address;
-		triangles.vertexStride = mesh->get_vertex_size();
-		triangles.indexType = VK_INDEX_TYPE_UINT32;
-		triangles.indexData.deviceAddress = mesh->index_buffer_address;
-		triangles.maxVertex = mesh->get_vertex_count() - 1;
-		triangles.transformData = { 0 };
-
-		geometry = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR };
-		geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
-		geometry.geometry.triangles = triangles;
-		geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
-
-		range_info = {};
-		range_info.firstVertex = 0;
-		range_info.primitiveCount = mesh->primitives[i].vertex_count / 3;
-		range_info.primitiveOffset = mesh->primitives[i].vertex_offset * sizeof(u32);
-		range_info.transformOffset = 0;
-
-		build_info = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR };
-		build_info.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-		build_info.geometryCount = 1;
-		build_info.pGeometries = &geometry;
-		build_info.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-		build_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-		build_info.srcAccelerationStructure = VK_NULL_HANDLE;
-
-		build_info.dstAccelerationStructure = mesh->primitives[i].acceleration_structure.value().acceleration_structure;
-		build_info.scratchData.deviceAddress = mesh->primitives[i].acceleration_structure.value().scratch_buffer_address;
-
-		VkAccelerationStructureBuildRangeInfoKHR* p_range_info = &range_info;
-		vkCmdBuildAccelerationStructuresKHR(
-			cmd,
-			1,
-			&build_info,
-			&p_range_info
-		);
+	std::vector<Emissive_Triangle> triangles;
+	std::vector<float> powers;
+	u32 rt_lod = (u32)std::max(g_settings.ray_tracing_lod, 0);
+	for (u32 i = 0; i < (u32)instance_table.size(); ++i)
+	{
+		const Instance_Data& instance = instance_table[i];
+		glm::vec3 emission = material_manager->resources[instance.material_index].resource.emissive_factor;
+		if (emitted_power(emission, 1.0f) <= 0.0f)
+			continue;
+
+		// The triangles the BLAS was built from, the shaders index them the same way as ray hits
+		const Mesh* m = scene_meshes[instance.mesh_index];
+		Mesh_Lod lod = get_primitive_lod(*scene_primitives[instance.primitive_index], rt_lod);
+		for (u32 t = 0; t < lod.vertex_count / 3; ++t)
+		{
+			const u32* inds = &m->indices[lod.vertex_offset + t * 3];
+			glm::vec3 p0 = glm::vec3(instance.transform * glm::vec4(m->vertices[inds[0]].pos, 1.0f));
+			glm::vec3 p1 = glm::vec3(instance.transform * glm::vec4(m->vertices[inds[1]].pos, 1.0f));
+			glm::vec3 p2 = glm::vec3(instance.transform * glm::vec4(m->vertices[inds[2]].pos, 1.0f));
+			float power = emitted_power(emission, 0.5f * glm::length(glm::cross(p1 - p0, p2 - p0)));
+			if (power <= 0.0f)
+				continue;
+
+			Emissive_Triangle triangle{};
+			triangle.instance_index = i;
+			triangle.triangle_index = t;
+			triangles.push_back(triangle);
+			powers.push_back(power);
+		}
 	}
+
+	emissive_triangle_count = (u32)triangles.size();
+	emissive_total_power = 0.0f;
+	for (float power : powers)
+		emissive_total_power += power;
+
+	std::vector<float> probabilities(emissive_triangle_count);
+	std::vector<u32> aliases(emissive_triangle_count);
+	build_alias_table(emissive_triangle_count, powers.data(), probabilities.data(), aliases.data());
+	for (u32 i = 0; i < emissive_triangle_count; ++i)
+	{
+		triangles[i].pdf = powers[i] / emissive_total_power;
+		triangles[i].alias_probability = probabilities[i];
+		triangles[i].alias = aliases[i];
+	}
+
+	emissive_triangle_buffer = context->create_gpu_buffer((u32)(std::max(emissive_triangle_count, 1u) * sizeof(Emissive_Triangle)), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	if (emissive_triangle_count != 0)
+		context->upload_ring.upload(&emissive_triangle_buffer, triangles.data(), emissive_triangle_count * sizeof(Emissive_Triangle));
+	LOG_DEBUG("Light table: %u emissive triangles, total power %.2f\n", emissive_triangle_count, emissive_total_power);
 }
 
 void Renderer::create_top_level_acceleration_structure(ECS* ecs, VkCommandBuffer cmd)
 {
-	std::vector<VkAccelerationStructureInstanceKHR> instances;
+	assert(!scene.tlas.has_value());
+	tlas_instances.clear();
 
-	u32 index = 0;
 	for (auto [mesh, xform] : ecs->filter<Static_Mesh_Component, Transform_Component>())
 	{
 		Mesh* m = mesh->manager->get_resource_with_id(mesh->mesh_id);
-
-		glm::mat4 rot = glm::toMat4(xform->rotation);
-		glm::mat4 trans = glm::translate(glm::mat4(1.0), glm::vec3(xform->pos));
-		glm::mat4 scale = glm::scale(glm::mat4(1.0), glm::vec3(xform->scale));
-		//glm::mat4 scale = glm::scale(glm::mat4(1.0), glm::vec3(0.01f));
-		glm::mat4 transform = trans * rot * scale;
+		glm::mat4 transform = xform->get_matrix();
+		xform->dirty = false;
 
 		u32 prim_count = (u32)m->primitives.size();
 		for (u32 i = 0; i < prim_count; ++i)
 		{
 			VkAccelerationStructureInstanceKHR instance{};
-			for (int i = 0; i < 4; ++i)
-				for (int j = 0; j < 3; ++j)
-				{
-					instance.transform.matrix[j][i] = transform[i][j];
-				}
+			write_instance_transform(&instance, transform);
 
-			//i32 mat_id = m->primitives[i].material_id;
-			i32 mat_id = i;
-			i32 mesh_id = mesh->mesh_id;
-
-			instance.instanceCustomIndex = ((mat_id & 0x3FF) << 14) | (mesh_id & 0x3FFF);
+			// Index into the instance table, which has the same order
+			u32 instance_index = (u32)tlas_instances.size();
+			assert(instance_index < (1u << 24) && instance_table[instance_index].primitive_index == m->first_primitive + i);
+			instance.instanceCustomIndex = instance_index;
 			instance.mask = 0xFF;
 			instance.instanceShaderBindingTableRecordOffset = 0;
 			instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
 			instance.accelerationStructureReference = m->primitives[i].acceleration_structure.value().acceleration_structure_buffer_address;
 
-			instances.push_back(instance);
+			tlas_instances.push_back(instance);
 		}
 	}
 
-	size_t size = sizeof(VkAccelerationStructureInstanceKHR) * instances.size();
-	GPU_Buffer instance_buf = context->create_gpu_buffer(
+	size_t size = sizeof(VkAccelerationStructureInstanceKHR) * tlas_instances.size();
+	tlas_instance_buffer = context->create_gpu_buffer(
 		(u32)size,
 		VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR
 		| VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
 		16
 	);
 
-	instance_buf.update_staging_buffer(context->allocator, current_frame_index, instances.data(), size);
-	instance_buf.upload(cmd, current_frame_index);
+	context->upload_ring.upload(&tlas_instance_buffer, tlas_instances.data(), size);
+	context->upload_ring.flush(cmd);
 
 	vkinit::memory_barrier(cmd,
 		VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
 		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR);
 
+	VkAccelerationStructureGeometryKHR geometry{};
 	VkAccelerationStructureBuildRangeInfoKHR range_info{};
-	range_info.primitiveOffset = 0;
-	range_info.primitiveCount = (u32)instances.size();
-	range_info.firstVertex = 0;
-	range_info.transformOffset = 0;
-
-	VkAccelerationStructureGeometryInstancesDataKHR instances_vk{
-		VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR
-	};
-	instances_vk.arrayOfPointers = VK_FALSE;
-	instances_vk.data.deviceAddress = context->get_buffer_device_address(instance_buf.gpu_buffer);
-
-	VkAccelerationStructureGeometryKHR geometry{ 
-		VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR 
-	};
-
-	geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
-	geometry.geometry.instances = instances_vk;
-
-	VkAccelerationStructureBuildGeometryInfoKHR build_info{
-		VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR
-	};
-	build_info.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-	build_info.geometryCount = 1;
-	build_info.pGeometries = &geometry;
-	build_info.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-	build_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-	build_info.srcAccelerationStructure = VK_NULL_HANDLE;
+	VkAccelerationStructureBuildGeometryInfoKHR build_info = get_top_level_build_info(false, &geometry, &range_info);
 
 	VkAccelerationStructureBuildSizesInfoKHR size_info{
 		VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR
@@ -2998,7 +4215,7 @@ void Renderer::create_top_level_acceleration_structure(ECS* ecs, VkCommandBuffer
 	);
 
 	Vk_Allocated_Buffer buffer_tlas = context->allocate_buffer(
-		(u32)size_info.accelerationStructureSize,
+		size_info.accelerationStructureSize,
 		VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR
 		| VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
 		| VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
@@ -3023,38 +4240,183 @@ void Renderer::create_top_level_acceleration_structure(ECS* ecs, VkCommandBuffer
 			vkDestroyAccelerationStructureKHR(context->device, tlas, nullptr);
 		}, Garbage_Collector::SHUTDOWN);
 
-	build_info.dstAccelerationStructure = tlas;
-
+	// Big enough for both full rebuilds and refits
 	Vk_Allocated_Buffer scratch = context->allocate_buffer(
-		(uint32_t)size_info.buildScratchSize,
+		std::max(size_info.buildScratchSize, size_info.updateScratchSize),
 		VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT 
 		| VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-		VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, 0
+		VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, 0,
+		context->acceleration_structure_properties.minAccelerationStructureScratchOffsetAlignment
 	);
 
+	Acceleration_Structure scene_tlas{};
+	scene_tlas.acceleration_structure = tlas;
+	scene_tlas.acceleration_structure_buffer = buffer_tlas;
+	scene_tlas.acceleration_structure_buffer_address = context->get_buffer_device_address(buffer_tlas);
+	scene_tlas.scratch_buffer = scratch;
+	scene_tlas.scratch_buffer_address = context->get_buffer_device_address(scratch);
+	scene_tlas.level = Acceleration_Structure::TOP_LEVEL;
+	scene_tlas.tlas_instances = tlas_instance_buffer.gpu_buffer;
+	scene_tlas.tlas_instances_address = context->get_buffer_device_address(tlas_instance_buffer.gpu_buffer);
+	scene.tlas = scene_tlas;
+
+	build_top_level_acceleration_structure(cmd, false);
+	tlas_updates_since_rebuild = 0;
+}
+
+VkAccelerationStructureBuildGeometryInfoKHR Renderer::get_top_level_build_info(bool refit,
+	VkAccelerationStructureGeometryKHR* geometry, VkAccelerationStructureBuildRangeInfoKHR* range_info)
+{
+	*range_info = {};
+	range_info->primitiveCount = (u32)tlas_instances.size();
+
+	VkAccelerationStructureGeometryInstancesDataKHR instances_vk{
+		VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR
+	};
+	instances_vk.arrayOfPointers = VK_FALSE;
+	instances_vk.data.deviceAddress = context->get_buffer_device_address(tlas_instance_buffer.gpu_buffer);
+
+	*geometry = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR };
+	geometry->geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+	geometry->geometry.instances = instances_vk;
+
+	// Refits need the same flags as the build they start from
+	VkAccelerationStructureBuildGeometryInfoKHR build_info{
+		VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR
+	};
+	build_info.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+	build_info.geometryCount = 1;
+	build_info.pGeometries = geometry;
+	build_info.mode = refit ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR : VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+	build_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+	build_info.srcAccelerationStructure = VK_NULL_HANDLE;
+	if (scene.tlas.has_value())
+	{
+		build_info.dstAccelerationStructure = scene.tlas.value().acceleration_structure;
+		build_info.scratchData.deviceAddress = scene.tlas.value().scratch_buffer_address;
+		// Updated in place
+		if (refit)
+			build_info.srcAccelerationStructure = build_info.dstAccelerationStructure;
+	}
+	return build_info;
+}
 
-	build_info.scratchData.deviceAddress = context->get_buffer_device_address(scratch);
+void Renderer::build_top_level_acceleration_structure(VkCommandBuffer cmd, bool refit)
+{
+	VkAccelerationStructureGeometryKHR geometry{};
+	VkAccelerationStructureBuildRangeInfoKHR range_info{};
+	VkAccelerationStructureBuildGeometryInfoKHR build_info = get_top_level_build_info(refit, &geometry, &range_info);
 
 	VkAccelerationStructureBuildRangeInfoKHR* p_range_info = &range_info;
-	
 	vkCmdBuildAccelerationStructuresKHR(
 		cmd,
 		1, &build_info,
 		&p_range_info
 	);
+}
 
-	Acceleration_Structure scene_tlas{};
-	scene_tlas.acceleration_structure = tlas;
-	scene_tlas.acceleration_structure_buffer = buffer_tlas;
-	scene_tlas.acceleration_structure_buffer_address = context->get_buffer_device_address(buffer_tlas);
-	scene_tlas.scratch_buffer = scratch;
-	scene_tlas.scratch_buffer_address = context->get_buffer_device_address(scratch);
-	scene_tlas.level = Acceleration_Structure::TOP_LEVEL;
-	//scene_tlas.tlas_instances = instance_buf;
-	scene_tlas.tlas_instances_address = context->get_buffer_device_address(instance_buf.gpu_buffer);
+void Renderer::update_top_level_acceleration_structure(ECS* ecs, VkCommandBuffer cmd)
+{
+	double cpu_begin = timer->get_current_time();
+
+	// Only the instances of entities that moved are rewritten, contiguous runs of them go out as one upload.
+	// Entities that stopped moving are rewritten once more so their previous transform catches up and
+	// their motion vectors go back to zero
+	u32 instance_index = 0;
+	u32 dirty_begin = UINT32_MAX;
+	u32 settled_instance_count = 0;
+	tlas_dirty_instance_count = 0;
+	auto upload_dirty_run = [&](u32 end)
+	{
+		if (dirty_begin == UINT32_MAX)
+			return;
+		context->upload_ring.upload(&tlas_instance_buffer, &tlas_instances[dirty_begin],
+			(end - dirty_begin) * sizeof(VkAccelerationStructureInstanceKHR), dirty_begin * sizeof(VkAccelerationStructureInstanceKHR));
+		context->upload_ring.upload(&instance_table_buffer, &instance_table[dirty_begin],
+			(end - dirty_begin) * sizeof(Instance_Data), dirty_begin * sizeof(Instance_Data));
+		dirty_begin = UINT32_MAX;
+	};
 
-	assert(!scene.tlas.has_value());
-	scene.tlas = scene_tlas;
+	for (auto [mesh, xform] : ecs->filter<Static_Mesh_Component, Transform_Component>())
+	{
+		Mesh* m = mesh->manager->get_resource_with_id(mesh->mesh_id);
+		u32 prim_count = (u32)m->primitives.size();
+		if (xform->dirty)
+		{
+			glm::mat4 transform = xform->get_matrix();
+			for (u32 i = 0; i < prim_count; ++i)
+			{
+				write_instance_transform(&tlas_instances[instance_index + i], transform);
+				Instance_Data& instance = instance_table[instance_index + i];
+				instance.previous_transform = instance.transform;
+				instance.transform = transform;
+			}
+			if (dirty_begin == UINT32_MAX)
+				dirty_begin = instance_index;
+			tlas_dirty_instance_count += prim_count;
+			xform->dirty = false;
+		}
+		else if (prim_count > 0 && instance_table[instance_index].previous_transform != instance_table[instance_index].transform)
+		{
+			for (u32 i = 0; i < prim_count; ++i)
+				instance_table[instance_index + i].previous_transform = instance_table[instance_index + i].transform;
+			if (dirty_begin == UINT32_MAX)
+				dirty_begin = instance_index;
+			settled_instance_count += prim_count;
+		}
+		else
+		{
+			upload_dirty_run(instance_index);
+		}
+		instance_index += prim_count;
+	}
+	upload_dirty_run(instance_index);
+	assert(instance_index == tlas_instances.size()); // Adding entities after init_scene isn't supported yet
+
+	if (tlas_dirty_instance_count == 0 && settled_instance_count == 0)
+	{
+		tlas_update_cpu_time = timer->get_current_time() - cpu_begin;
+		tlas_last_update = Tlas_Update::NONE;
+		return;
+	}
+
+	// The instance table is read by culling, raster and hit shaders. Both it and the TLAS instances are single
+	// copies, so the previous frame has to be done reading them before they're overwritten
+	vkinit::memory_barrier2(cmd,
+		0, 0,
+		VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT
+		| VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR,
+		VK_PIPELINE_STAGE_2_TRANSFER_BIT);
+	context->upload_ring.flush(cmd);
+	vkinit::memory_barrier2(cmd,
+		VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_ACCESS_2_SHADER_READ_BIT,
+		VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT
+		| VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR);
+
+	// Only previous transforms changed, the TLAS is already up to date
+	if (tlas_dirty_instance_count == 0)
+	{
+		tlas_update_cpu_time = timer->get_current_time() - cpu_begin;
+		tlas_last_update = Tlas_Update::NONE;
+		return;
+	}
+
+	// Refits keep the tree of the last full build, so its quality drops the further instances move from where
+	// they were. Rebuild every tlas_rebuild_interval updates to bound that
+	bool refit = g_settings.tlas_refit && tlas_updates_since_rebuild < (u32)std::max(g_settings.tlas_rebuild_interval, 0);
+	vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, query_pools[current_frame_index], TLAS_BEGIN_TIMESTAMP);
+	build_top_level_acceleration_structure(cmd, refit);
+	vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pools[current_frame_index], TLAS_END_TIMESTAMP);
+	tlas_updates_since_rebuild = refit ? tlas_updates_since_rebuild + 1 : 0;
+	tlas_last_update = refit ? Tlas_Update::REFIT : Tlas_Update::REBUILD;
+
+	vkinit::memory_barrier2(cmd,
+		VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR,
+		VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+		VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT);
+
+	tlas_update_cpu_time = timer->get_current_time() - cpu_begin;
 }
 
 Vk_Allocated_Image Renderer::prefilter_envmap(VkCommandBuffer cmd, Vk_Allocated_Image envmap)
@@ -3132,6 +4494,34 @@ void Renderer::change_render_mode(Rendering_Mode new_mode)
 {
 	frames_accumulated = 0;
 	needs_history_clear = true;
+	depth_pyramid.valid = false; // Possibly from long ago
+}
+
+Vk_Allocated_Image Renderer::load_blue_noise(const char* name)
+{
+	// Prefer the baked version, fall back to decoding the individual slices
+	std::string baked_path = std::string("data/bluenoise/") + name + ".bnv";
+	File_View view;
+	if (map_file(baked_path.c_str(), &view))
+	{
+		Blue_Noise_Header header;
+		const u8* texels = get_blue_noise_texels(&view, &header);
+		if (texels && header.layer_count == BLUE_NOISE_TEXTURE_COUNT)
+		{
+			Vk_Allocated_Image img = context->create_texture_array({ header.width, header.height }, header.layer_count, 
+				VK_FORMAT_R8G8B8A8_UNORM, texels, view.size - sizeof(header));
+			unmap_file(&view);
+			return img;
+		}
+		unmap_file(&view);
+		LOG_DEBUG("Invalid baked blue noise %s, falling back to pngs\n", baked_path.c_str());
+	}
+
+	std::string png_base = std::string("data/bluenoise/") + name + "_";
+	Blue_Noise_Data data;
+	bool success = decode_blue_noise_pngs(png_base.c_str(), BLUE_NOISE_TEXTURE_COUNT, &data);
+	assert(success);
+	return context->create_texture_array({ data.width, data.height }, data.layer_count, VK_FORMAT_R8G8B8A8_UNORM, data.texels.data(), data.texels.size());
 }
 
 void Renderer::create_lookup_textures()
@@ -9,6 +9,7 @@
 #include <optional>
 #include "defines.h"
 #include "r_vulkan.h"
+#include "geometry_pool.h"
 #include "resource_manager.h"
 #include "material.h"
 #include "gbuffer.h"
@@ -53,11 +54,12 @@ struct Render_Target
 enum Render_Targets
 {
 	PATH_TRACER_COLOR = 0,
-	RASTER_COLOR,
+	RASTER_COLOR, // Per G-buffer layer like the targets below, the async compute frame reads it while the next one is rasterized
 	DEPTH,
 	NORMAL_ROUGHNESS,
 	BASECOLOR_METALNESS,
 	WORLD_POSITION,
+	MOTION_VECTORS, // Current frame only, RG16F. Per G-buffer layer for the async compute frame
 	INDIRECT_DIFFUSE,
 	INDIRECT_DIFFUSE_SH,
 	INDIRECT_SPECULAR,
@@ -72,6 +74,10 @@ enum Render_Targets
 	INTERNAL_OCCLUSION_DATA,
 	COMPOSITION_OUTPUT,
 	TAA_OUTPUT,
+	INDIRECT_DIFFUSE_RAYS, // Reduced resolution rays, upsampled into INDIRECT_DIFFUSE
+	INDIRECT_SPECULAR_RAYS,
+	INDIRECT_DIFFUSE_REFERENCE, // Denoised output with full resolution rays, for the error metric
+	INDIRECT_SPECULAR_REFERENCE,
 	MAX_RENDER_TARGETS
 };
 
@@ -80,14 +86,25 @@ struct Framebuffer
 	Render_Target render_targets[MAX_RENDER_TARGETS];
 };
 
-constexpr u32 HISTORY_FIX_MIP_LEVELS = 5;
-
 struct History_Fix
 {
 	Vk_Allocated_Image radiance_image;
 	Vk_Allocated_Image view_z_image;
 	VkImageView radiance_mip_views[HISTORY_FIX_MIP_LEVELS];
 	VkImageView view_z_mip_views[HISTORY_FIX_MIP_LEVELS];
+	Vk_Allocated_Buffer atomic_counter; // Finished groups of the mip generation
+};
+
+constexpr u32 MAX_DEPTH_PYRAMID_LEVELS = 16;
+
+// Farthest depth mip chain of the last rasterized frame, for occlusion culling
+struct Depth_Pyramid
+{
+	Vk_Allocated_Image image;
+	VkImageView mip_views[MAX_DEPTH_PYRAMID_LEVELS];
+	u32 width, height; // Of level 0, the depth buffer size rounded down to powers of two
+	u32 mip_count;
+	bool valid = false; // Nothing to test against before the first rasterized frame
 };
 
 enum Pipelines
@@ -112,8 +129,22 @@ enum Pipelines
 	PRE_BLUR_SPEC,
 	BLUR_SPEC,
 	POST_BLUR_SPEC,
+	PRE_BLUR_TILED, // Same order as the untiled blur pipelines
+	BLUR_TILED,
+	POST_BLUR_TILED,
+	PRE_BLUR_SPEC_TILED,
+	BLUR_SPEC_TILED,
+	POST_BLUR_SPEC_TILED,
 	TEMPORAL_STABILIZATION,
 	TONEMAP_AND_TAA,
+	CULL_MESHLETS,
+	DEPTH_PYRAMID,
+	UPSAMPLE_INDIRECT,
+	INDIRECT_ERROR,
+	RADIANCE_CACHE_UPDATE,
+	RADIANCE_CACHE_RESOLVE,
+	RESTIR_TEMPORAL,
+	RESTIR_SPATIAL,
 	PIPELINE_COUNT,
 };
 
@@ -156,19 +187,101 @@ struct Renderer
 	VkDescriptorUpdateTemplate descriptor_update_template;
 	Vk_Allocated_Buffer shader_binding_table;
 	Scene scene;
-	GPU_Buffer gpu_camera_data;
+	GPU_Buffer gpu_camera_data; // The current frame's copy of gpu_camera_buffers
+	GPU_Buffer gpu_camera_buffers[FRAMES_IN_FLIGHT];
 	Vk_Allocated_Image environment_map;
 	VkQueryPool query_pools[FRAMES_IN_FLIGHT];
 	Vk_Allocated_Image brdf_lut;
 	Vk_Allocated_Image prefiltered_envmap;
-	Vk_Allocated_Image blue_noise[BLUE_NOISE_TEXTURE_COUNT];
-	Vk_Allocated_Image blue_noise_scalar[BLUE_NOISE_TEXTURE_COUNT];
-	Vk_Allocated_Image blue_noise_vec2[BLUE_NOISE_TEXTURE_COUNT];
+	// 2D arrays with BLUE_NOISE_TEXTURE_COUNT layers, shaders pick the layer from the frame number
+	Vk_Allocated_Image blue_noise;
+	Vk_Allocated_Image blue_noise_scalar;
+	Vk_Allocated_Image blue_noise_vec2;
 	Cubemap cubemap;
+	Geometry_Pool geometry_pool;
+	// Meshlets of every LOD of every primitive, placed by every instance in meshlet_instance_buffer. cull_meshlets.comp
+	// writes a draw per visible meshlet instance of the selected LODs to indirect_draw_buffer and their count to draw_count_buffer
+	GPU_Buffer meshlet_buffer;
+	u32 meshlet_count = 0;
+	GPU_Buffer meshlet_instance_buffer;
+	u32 meshlet_instance_count = 0;
 	GPU_Buffer indirect_draw_buffer;
-	GPU_Buffer instance_data_buffer;
+	GPU_Buffer draw_count_buffer;
+	Vk_Allocated_Buffer draw_count_readback; // FRAMES_IN_FLIGHT counts, read after the frame's fence
+	u32* draw_count_readback_data;
+	u32 primitive_count = 0;
+	std::vector<u32> primitive_lod_meshlet_counts; // [primitive * (MAX_MESH_LODS + 1) + lod]
+	std::vector<Mesh*> scene_meshes; // In primitive info order
+	std::vector<const Mesh_Primitive*> scene_primitives; // By primitive info index
+	// One Instance_Data per primitive of every mesh entity, in ECS order like tlas_instances
+	std::vector<Instance_Data> instance_table;
+	GPU_Buffer instance_table_buffer;
+	GPU_Buffer instance_lod_buffer; // Selected LOD per instance, FRAMES_IN_FLIGHT copies, see select_lods
+	std::vector<u32> instance_lods;
+	// Emissive triangles of the instances with an alias table over their power, see lights.glsl
+	GPU_Buffer emissive_triangle_buffer;
+	u32 emissive_triangle_count = 0;
+	float emissive_total_power = 0.0f;
+	bool emissive_sampling_accumulated = true; // Setting the path tracer's accumulation was started with
+	Depth_Pyramid depth_pyramid;
+	u32 raster_triangle_count = 0; // With the LODs selected this frame, before culling
+	u32 lod_meshlet_counts[FRAMES_IN_FLIGHT] = {}; // Meshlets of the selected LODs, before culling
+	// Read back from the last frame with the same frame index
+	u32 visible_meshlet_count = 0;
+	u32 tested_meshlet_count = 0;
+	double gbuffer_gpu_time = 0.0;
+	u64 blas_memory = 0; // Compacted
+	u64 blas_memory_uncompacted = 0;
+	u64 blas_memory_full_detail = 0; // What the BLASes would take without ray_tracing_lod
+	GPU_Buffer primitive_info_buffer; // Primitive_Info for every primitive in the scene
+	double blas_build_time = 0.0; // Seconds, CPU side including the waits
+	// Same order as instance_table, the custom index is the instance's index. Updated by update_top_level_acceleration_structure
+	std::vector<VkAccelerationStructureInstanceKHR> tlas_instances;
+	GPU_Buffer tlas_instance_buffer;
+	u32 tlas_updates_since_rebuild = 0;
+	enum class Tlas_Update { NONE, REFIT, REBUILD } tlas_last_update = Tlas_Update::NONE;
+	u32 tlas_dirty_instance_count = 0;
+	double tlas_update_cpu_time = 0.0; // Seconds
+	double tlas_update_gpu_time = 0.0; // Nanoseconds like the other GPU times
+	double indirect_gpu_time = 0.0; // Tracing and upsampling, hybrid mode only
+	double denoiser_gpu_time = 0.0;
+	double pre_blur_gpu_time = 0.0; // Both channels
+	double blur_gpu_time = 0.0;
+	double post_blur_gpu_time = 0.0;
+	double radiance_cache_gpu_time = 0.0; // Update and resolve, part of indirect_gpu_time
+	// World space hash grid, see radiance_cache.glsl
+	GPU_Buffer radiance_cache_keys; // RADIANCE_CACHE_SIZE checksums
+	GPU_Buffer radiance_cache_cells; // RADIANCE_CACHE_SIZE Radiance_Cache_Cells
+	bool radiance_cache_valid = false; // Cleared when the cache is turned off, so it starts empty again
+	double restir_gpu_time = 0.0; // Temporal and spatial passes, part of indirect_gpu_time
+	// Last indirect_gpu_time at full resolution with ReSTIR off. ReSTIR's total cost, with the candidates and shadow ray
+	// indirect_diffuse.comp adds, is measured against it
+	double indirect_gpu_time_without_restir = 0.0;
+	// Two slices of per pixel reservoirs each, see restir.glsl
+	GPU_Buffer restir_di_reservoirs;
+	GPU_Buffer restir_gi_reservoirs;
+	bool restir_valid = false; // Cleared when ReSTIR is turned off, so no stale reservoirs get reused
+	// Sample counts behind the final reservoirs, see restir_spatial.comp
+	GPU_Buffer restir_stats_buffer;
+	Vk_Allocated_Buffer restir_stats_readback; // FRAMES_IN_FLIGHT sets of 64-bit emitter and path sample sums and a pixel count
+	u32* restir_stats_readback_data;
+	float restir_direct_spp = 0.0f; // Mean per covered pixel
+	float restir_indirect_spp = 0.0f;
+	// Relative squared error of the denoised indirect lighting against INDIRECT_*_REFERENCE, see indirect_error.comp
+	GPU_Buffer indirect_error_buffer;
+	Vk_Allocated_Buffer indirect_error_readback; // FRAMES_IN_FLIGHT triples of diffuse, specular and noisy diffuse sums
+	u32* indirect_error_readback_data;
+	bool indirect_reference_valid = false;
+	float indirect_diffuse_error = 0.0f; // Mean per pixel
+	float indirect_specular_error = 0.0f;
+	float indirect_noisy_diffuse_error = 0.0f; // Before the denoiser
+	u32 material_capacity = 0; // Of scene.material_buffer
+	u32 uploaded_material_count = 0;
+	// The current frame's copies, the async compute work of the previous frame can still read the other ones
 	Vk_Allocated_Buffer global_constants_buffer;
 	Global_Constants_Data* global_constants_data;
+	Vk_Allocated_Buffer global_constants_buffers[FRAMES_IN_FLIGHT];
+	Global_Constants_Data* global_constants_mapped[FRAMES_IN_FLIGHT];
 
 	History_Fix history_fix;
 
@@ -192,6 +305,23 @@ struct Renderer
 
 	bool needs_history_clear = false;
 
+	// Hybrid frames split over the graphics and async compute queues, see draw. Presenting a frame is deferred to the
+	// end of the next one so the graphics queue never waits for the compute queue before rasterizing
+	bool async_compute_active = false;
+	bool present_pending = false;
+
+	// A group of passes recorded into a command buffer of its own, see record_passes
+	struct Pass_Recording
+	{
+		std::function<void(VkCommandBuffer)> record;
+		bool compute = false; // For the async compute queue
+	};
+
+	// Pass command buffers of the current frame handed out so far, per queue
+	u32 pass_cmds_used = 0;
+	u32 compute_pass_cmds_used = 0;
+	std::vector<VkCommandBuffer> frame_cmds; // Graphics submit of a single queue frame, in order
+
 	Renderer(Vk_Context* context, Platform* platform, 
 		Resource_Manager<Mesh>* mesh_manager, 
 		Resource_Manager<Texture>* texture_manager,
@@ -214,26 +344,54 @@ struct Renderer
 	Vk_Pipeline create_raster_graphics_pipeline(const char* vertex_shader_path, const char* fragment_shader_path, 
 		bool use_bindless_layout, Raster_Options opt = {});
 
-	void create_bottom_level_acceleration_structure(Mesh* mesh);
-	void build_bottom_level_acceleration_structure(Mesh* mesh, VkCommandBuffer cmd);
+	void build_bottom_level_acceleration_structures(); // For scene_meshes, submits and waits
+	// Uploads the materials registered since the last call, reallocating the buffer when they don't fit
+	void update_material_buffer();
+	// Fills instance_table and the meshlet instances from the mesh entities and queues their uploads, returns the scene bounds
+	void create_instance_table(ECS* ecs, glm::vec3* bbmin, glm::vec3* bbmax);
+	// Builds the light table from instance_table and queues its upload
+	void create_emissive_light_table();
 	void create_top_level_acceleration_structure(ECS* ecs, VkCommandBuffer cmd);
+	VkAccelerationStructureBuildGeometryInfoKHR get_top_level_build_info(bool refit,
+		VkAccelerationStructureGeometryKHR* geometry, VkAccelerationStructureBuildRangeInfoKHR* range_info);
+	void build_top_level_acceleration_structure(VkCommandBuffer cmd, bool refit);
+	// Rewrites the instances and instance table entries of entities whose Transform_Component is dirty and refits or rebuilds the TLAS.
+	// Also keeps the instance table previous transforms one frame behind for the motion vectors
+	void update_top_level_acceleration_structure(ECS* ecs, VkCommandBuffer cmd);
 	Vk_Allocated_Image prefilter_envmap(VkCommandBuffer cmd, Vk_Allocated_Image envmap);
 
 	void change_render_mode(Rendering_Mode new_mode);
 
 	void create_lookup_textures();
+	Vk_Allocated_Image load_blue_noise(const char* name);
 	void create_cubemap_from_envmap();
 	void do_frame(ECS* ecs, float dt);
+	void select_queue_mode();
+	void wait_for_frame();
 	void init_scene(ECS* ecs);
 	void pre_frame();
+	void select_lods();
+	void cull_meshlets(VkCommandBuffer cmd);
+	void build_depth_pyramid(VkCommandBuffer cmd);
 	void begin_frame();
 	void render_gbuffer();
 	void trace_primary_rays();
-	void end_frame();
+	void end_frame(float dt);
+	void blit_to_swapchain(VkCommandBuffer cmd);
 	void draw(ECS* ecs, float dt);
+	VkCommandBuffer next_pass_command_buffer(bool compute);
+	// Records every pass into its own command buffer in parallel on the job system, cmds gets them in pass order.
+	// Passes must not write anything another pass of the same call reads while recording
+	void record_passes(std::initializer_list<Pass_Recording> passes, VkCommandBuffer* cmds);
 	void trace_rays(VkCommandBuffer cmd);
 	void composite_and_tonemap(VkCommandBuffer cmd);
 	void rasterize(VkCommandBuffer cmd, ECS* ecs);
+	// Both run on the async compute queue when it's active. trace_indirect ends with temporal accumulation,
+	// the last pass reading the previous G-buffer layer
+	void trace_indirect(VkCommandBuffer cmd);
+	void denoise_indirect(VkCommandBuffer cmd);
+	// Queue family ownership transfer of the current G-buffer layer from the graphics queue to the compute queue
+	void transfer_gbuffer_ownership(VkCommandBuffer cmd, bool acquire);
 	void cleanup();
 };
 
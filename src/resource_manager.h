@@ -21,11 +21,29 @@ struct Resource_Manager
 	std::vector<uint32_t> ids;
 	uint32_t next_id = 0;
 
-	int load_from_disk(const char* filepath)
+	// Materials of OBJ files are registered as "<filepath>:<name>" if material_manager is given
+	int load_from_disk(const char* filepath, Resource_Manager<Material>* material_manager = nullptr)
 	{
 		if constexpr(std::is_same<T, Mesh>::value)
 		{
-			T data = load_obj_from_file(filepath);
+			T data;
+			std::vector<Obj_Material> materials;
+			if (!load_obj_from_file(filepath, &data, material_manager ? &materials : nullptr))
+				return -1;
+			if (material_manager)
+			{
+				std::vector<u32> material_ids(materials.size());
+				for (size_t i = 0; i < materials.size(); ++i)
+				{
+					std::string name = std::string(filepath) + ":" + materials[i].name;
+					int id = material_manager->get_id_from_string(name);
+					if (id == -1)
+						id = material_manager->register_resource(materials[i].material, name);
+					material_ids[i] = (u32)id;
+				}
+				for (auto& prim : data.primitives)
+					prim.material_id = material_ids[prim.material_id];
+			}
 			Resource<T> new_resource = { std::move(data), filepath };
 			resources.emplace_back(std::move(new_resource));
 			return next_id++;
@@ -1 +1,45 @@
-#include "sampling.h"
\ No newline at end of file
+#include "sampling.h"
+#include <vector>
+
+void build_alias_table(u32 count, const float* weights, float* probabilities, u32* aliases)
+{
+	double total = 0.0;
+	for (u32 i = 0; i < count; ++i)
+		total += weights[i];
+
+	// Scaled so the mean is 1, entries below it get topped up from the ones above
+	std::vector<double> scaled(count);
+	std::vector<u32> small, large;
+	for (u32 i = 0; i < count; ++i)
+	{
+		scaled[i] = total > 0.0 ? (double)weights[i] * count / total : 1.0;
+		(scaled[i] < 1.0 ? small : large).push_back(i);
+	}
+
+	while (!small.empty() && !large.empty())
+	{
+		u32 s = small.back();
+		small.pop_back();
+		u32 l = large.back();
+		probabilities[s] = (float)scaled[s];
+		aliases[s] = l;
+		scaled[l] -= 1.0 - scaled[s];
+		if (scaled[l] < 1.0)
+		{
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+
+	// What's left is 1 up to rounding
+	for (u32 i : large)
+	{
+		probabilities[i] = 1.0f;
+		aliases[i] = i;
+	}
+	for (u32 i : small)
+	{
+		probabilities[i] = 1.0f;
+		aliases[i] = i;
+	}
+}
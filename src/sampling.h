@@ -2,6 +2,10 @@
 #include "defines.h"
 #include <algorithm>
 
+// Vose's alias method. Entry i is kept with probabilities[i] and replaced by aliases[i] otherwise, which picks
+// entries in proportion to the weights in O(1). The weights don't need to be normalized
+void build_alias_table(u32 count, const float* weights, float* probabilities, u32* aliases);
+
 constexpr float one_minus_epsilon = 0x1.fffffep-1;
 
 inline u32 reverse_bits_32(u32 n) {
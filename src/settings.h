@@ -47,6 +47,7 @@ struct Settings
     float plane_dist_sensitivity = 0.5f; // percentage
     float occlusion_threshold = 0.005f;
     int blur_kernel_rotation_mode = 1; // 0 = None, 1 = Per frame, 2 = Per pixel
+    bool tiled_blur = false; // Blur taps from a shared memory tile
     bool frame_num_scaling = true;
     bool hit_dist_scaling = true;
     bool use_gaussian_weight = true;
@@ -62,6 +63,7 @@ struct Settings
     bool use_ycocg_color_space = false;
     bool use_alternative_history_fix = true;
     float history_fix_stride = 14.0f;
+    int history_fix_reduction = HISTORY_FIX_REDUCTION_DEPTH_WEIGHTED; // Mip generation for the other history fix
     bool taa = false;
     bool jitter = false;
     bool visualize_probes = false;
@@ -74,6 +76,28 @@ struct Settings
     float spec_accum_curve = 1.0;
     bool indirect_diffuse = true;
     bool indirect_specular = false;
+    int indirect_resolution = INDIRECT_RESOLUTION_FULL; // Rays per pixel of the indirect passes, see indirect_resolution.glsl. The denoiser stays at full resolution
+    bool radiance_cache = false; // World space cache the indirect diffuse rays end in, adds the bounces past the first hit
+    float radiance_cache_cell_scale = 0.02f; // Cell size relative to the distance to the camera
+    int radiance_cache_max_samples = 64; // History length of a cell
+    int radiance_cache_stale_frames = 32; // Cells not updated for this many frames are freed
+    bool restir = false; // Spatiotemporal reservoir resampling of the indirect diffuse samples, full resolution rays only
+    int restir_max_history = 20; // Samples the previous frame's reservoirs count for at most
+    int restir_spatial_samples = 4; // Neighbors merged per pixel
+    float restir_spatial_radius = 30.0f; // Pixels
+    bool emissive_light_sampling = true; // Next event estimation toward emissive triangles, otherwise only hitting them counts
+    bool indirect_error_metric = false; // Compare the denoised indirect lighting against a captured full resolution reference
+    bool capture_indirect_reference = false; // Cleared once captured
+    bool raster_lods = true;
+    float lod_pixel_error = 1.0f; // Largest allowed simplification error on screen
+    int ray_tracing_lod = 0; // LOD the BLASes are built from, read at scene load
+    bool frustum_culling = true;
+    bool backface_culling = true; // Meshlet normal cones
+    bool occlusion_culling = true; // Against the previous frame's depth
+    bool tlas_refit = true; // Refit the TLAS when instances move instead of rebuilding it
+    int tlas_rebuild_interval = 60; // Full rebuild after this many refits
+    bool async_compute = true; // Denoiser chain on a compute queue overlapping the next frame's G-buffer, needs a dedicated compute family
+    bool instanced_import = true; // Unique glTF geometry placed by instances instead of one merged mesh, read at scene load
 };
 
 extern Settings g_settings;
\ No newline at end of file
@@ -1,25 +1,29 @@
 #include "defines.h"
 #include "shaders.h"
 #include "common.h"
+#include "file_system.h"
 #include "r_vulkan.h"
+#include <unordered_map>
+#include <mutex>
+#include <string>
 
-bool load_shader_from_file(Shader* shader, VkDevice device, const char* filepath)
+// Reflection results and SPIR-V are cached by path, the same shader is often used to create multiple
+// pipelines (e.g. blur.comp with different specialization constants)
+struct Shader_Cache_Entry
 {
-	memset(shader, 0, sizeof(Shader));
-	 // FIXME: This should go through some kind of filesystem
-	uint8_t* data;
-	uint32_t bytes_read = read_entire_file(filepath, &data);
-	assert(bytes_read != 0);
-	const size_t spirv_size = bytes_read;
-	const uint32_t* spirv_data = (uint32_t*)data;
+	File_View spirv; // Shader modules are created straight from the mapped file
+	Shader reflection;
+};
 
-	VkShaderModuleCreateInfo create_info{ VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
-	create_info.codeSize = spirv_size;
-	create_info.pCode = spirv_data;
-	SpvReflectShaderModule module;
+static std::unordered_map<std::string, Shader_Cache_Entry> shader_cache;
+static std::mutex shader_cache_mutex;
 
-	SpvReflectResult result = spvReflectCreateShaderModule((size_t)bytes_read, data, &module);
-	assert(result == SPV_REFLECT_RESULT_SUCCESS);
+static bool reflect_shader(Shader* shader, const u8* data, size_t size)
+{
+	SpvReflectShaderModule module;
+	SpvReflectResult result = spvReflectCreateShaderModule(size, data, &module);
+	if (result != SPV_REFLECT_RESULT_SUCCESS)
+		return false;
 
 	assert(module.entry_point_count == 1);
 
@@ -29,11 +33,6 @@ bool load_shader_from_file(Shader* shader, VkDevice device, const char* filepath
 	std::vector<SpvReflectDescriptorBinding*> bindings(binding_count);
 	spvReflectEnumerateDescriptorBindings(&module, &binding_count, bindings.data());
 
-	u32 pc_count = 0;
-	spvReflectEnumeratePushConstantBlocks(&module, &pc_count, nullptr);
-	std::vector<SpvReflectBlockVariable*> push_constants(pc_count);
-	spvReflectEnumeratePushConstantBlocks(&module, &pc_count, push_constants.data());
-
 	for (const auto& b : bindings)
 	{
 		if (b->set != 0) continue; // Ignore everything except set 0 for now; set 1 is currently used for bindless descriptors
@@ -42,11 +41,63 @@ bool load_shader_from_file(Shader* shader, VkDevice device, const char* filepath
 		shader->resource_mask |= (1u << b->binding);
 	}
 
+	spvReflectDestroyShaderModule(&module);
+	return true;
+}
+
+bool load_shader_from_file(Shader* shader, VkDevice device, const char* filepath)
+{
+	memset(shader, 0, sizeof(Shader));
+
+	const Shader_Cache_Entry* entry = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(shader_cache_mutex);
+		auto it = shader_cache.find(filepath);
+		if (it != shader_cache.end())
+			entry = &it->second;
+	}
+
+	if (!entry)
+	{
+		Shader_Cache_Entry new_entry{};
+		bool success = map_file(filepath, &new_entry.spirv);
+		assert(success);
+		if (!success)
+			return false;
+
+		success = reflect_shader(&new_entry.reflection, new_entry.spirv.data, new_entry.spirv.size);
+		assert(success);
+		if (!success)
+		{
+			unmap_file(&new_entry.spirv);
+			return false;
+		}
+
+		// Another thread may have loaded the same file in the meantime, emplace keeps the first one
+		std::lock_guard<std::mutex> lock(shader_cache_mutex);
+		auto result = shader_cache.emplace(filepath, new_entry);
+		if (!result.second)
+			unmap_file(&new_entry.spirv);
+		entry = &result.first->second;
+	}
+
+	*shader = entry->reflection;
+
+	VkShaderModuleCreateInfo create_info{ VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+	create_info.codeSize = entry->spirv.size;
+	create_info.pCode = (const uint32_t*)entry->spirv.data;
+
 	VkShaderModule sm;
 	VK_CHECK(vkCreateShaderModule(device, &create_info, nullptr, &sm));
 	shader->shader = sm;
-
-	free(data);
 	
 	return true;
 }
+
+void clear_shader_cache()
+{
+	std::lock_guard<std::mutex> lock(shader_cache_mutex);
+	for (auto& it : shader_cache)
+		unmap_file(&it.second.spirv);
+	shader_cache.clear();
+}
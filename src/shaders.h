@@ -54,4 +54,6 @@ struct Descriptor_Info
 	}
 };
 
-bool load_shader_from_file(Shader* shader, VkDevice device, const char* filepath);
\ No newline at end of file
+// Reflection results are cached per file path, safe to call from multiple threads
+bool load_shader_from_file(Shader* shader, VkDevice device, const char* filepath);
+void clear_shader_cache();
\ No newline at end of file
@@ -279,6 +279,11 @@ void UI_Overlay::update_and_render(VkCommandBuffer cmd, float dt)
 		ImGui::TextUnformatted("GigaRay");
 		ImGui::TextUnformatted(ctx->physical_device_properties.properties.deviceName);
 		ImGui::Text("%.2f ms/frame (%.1d fps)", smoothed_delta * 1000.0f, (int)std::round(1.0f / smoothed_delta));
+		const Upload_Ring::Stats& upload_stats = ctx->upload_ring.stats;
+		ImGui::Text("Uploads: %.1f KB (peak %.1f) / %.1f KB, %u copies", (double)upload_stats.bytes_used / 1024.0, 
+			(double)upload_stats.peak_bytes_used / 1024.0, (double)ctx->upload_ring.frame_size / 1024.0, upload_stats.copy_command_count);
+		if (upload_stats.overflow_count)
+			ImGui::Text("Upload ring overflows: %u", upload_stats.overflow_count);
 
 		ImGui::PushItemWidth(110.0f * scale);
 		//OnUpdateUIOverlay(&UIOverlay);
@@ -292,10 +297,26 @@ void UI_Overlay::update_and_render(VkCommandBuffer cmd, float dt)
 			ImGui::SliderFloat("Sun intensity", &g_settings.sun_intensity, 0.0f, 999.0f, "%.1f");
 			ImGui::Checkbox("Indirect diffuse", &g_settings.indirect_diffuse);
 			ImGui::Checkbox("Indirect specular", &g_settings.indirect_specular);
+			ImGui::Checkbox("Emissive light sampling", &g_settings.emissive_light_sampling);
+			static const char* indirect_resolutions[] = { "Full", "Half", "Checkerboard" };
+			ImGui::Combo("Indirect rays", &g_settings.indirect_resolution, indirect_resolutions, (int)std::size(indirect_resolutions));
+			ImGui::Checkbox("Error vs reference", &g_settings.indirect_error_metric);
+			// The reference should come from full resolution rays with the camera held still
+			if (g_settings.indirect_resolution == INDIRECT_RESOLUTION_FULL && ImGui::Button("Capture reference"))
+				g_settings.capture_indirect_reference = true;
 		}
 		if (ImGui::CollapsingHeader("Indirect diffuse", ImGuiTreeNodeFlags_CollapsingHeader | ImGuiTreeNodeFlags_DefaultOpen))
 		{
 			ImGui::Checkbox("Animate noise", &g_settings.animate_noise);
+			ImGui::Checkbox("Radiance cache", &g_settings.radiance_cache);
+			ImGui::SliderFloat("Cache cell scale", &g_settings.radiance_cache_cell_scale, 0.005f, 0.1f, "%.3f");
+			ImGui::SliderInt("Cache history", &g_settings.radiance_cache_max_samples, 1, 256);
+			ImGui::SliderInt("Cache stale frames", &g_settings.radiance_cache_stale_frames, 1, 256);
+			// Needs full resolution rays, the reservoirs are per pixel
+			ImGui::Checkbox("ReSTIR", &g_settings.restir);
+			ImGui::SliderInt("ReSTIR history", &g_settings.restir_max_history, 1, 64);
+			ImGui::SliderInt("ReSTIR spatial samples", &g_settings.restir_spatial_samples, 0, 16);
+			ImGui::SliderFloat("ReSTIR spatial radius", &g_settings.restir_spatial_radius, 1.0f, 64.0f, "%.1f");
 		}
 		if (ImGui::CollapsingHeader("Indirect specular", ImGuiTreeNodeFlags_CollapsingHeader | ImGuiTreeNodeFlags_DefaultOpen))
 		{
@@ -342,12 +363,15 @@ void UI_Overlay::update_and_render(VkCommandBuffer cmd, float dt)
 			ImGui::Checkbox("History fix", &g_settings.history_fix);
 			ImGui::Checkbox("Alternative history fix", &g_settings.use_alternative_history_fix);
 			ImGui::SliderFloat("Alt hist fix stride", &g_settings.history_fix_stride, 1.0f, 30.0f, "%.0f");
+			static const char* history_fix_reductions[] = { "Average", "Depth weighted" };
+			ImGui::Combo("Hist fix mip reduction", &g_settings.history_fix_reduction, history_fix_reductions, (int)std::size(history_fix_reductions));
 			ImGui::SliderFloat2("Hit distance params", (float*)&g_settings.hit_distance_params, 0.001f, 100.0f, "%.3f");
 			//ImGui::Combo("Temporal filter", (int*)&g_settings.temporal_filter, temporal_filter_modes, (int)std::size(temporal_filter_modes));
 			//ImGui::SliderFloat("Bicubic sharpness", &g_settings.bicubic_sharpness, 0.0f, 1.0f, "%.2f");
 			ImGui::SliderFloat("Plane distance sensitivity (%)", &g_settings.plane_dist_sensitivity, 0.1f, 5.0f, "%.1f");
 			static const char* blur_kernel_rotation_modes[] = { "None", "Per frame", "Per pixel" };
 			ImGui::Combo("Blur kernel rotation", &g_settings.blur_kernel_rotation_mode, blur_kernel_rotation_modes, (int)std::size(blur_kernel_rotation_modes));
+			ImGui::Checkbox("Tiled blur", &g_settings.tiled_blur);
 			ImGui::Checkbox("Frame count radius scaling", &g_settings.frame_num_scaling);
 			ImGui::Checkbox("Hit distance radius scaling", &g_settings.hit_dist_scaling);
 			ImGui::Checkbox("Use gaussian weight", &g_settings.use_gaussian_weight);
@@ -363,6 +387,17 @@ void UI_Overlay::update_and_render(VkCommandBuffer cmd, float dt)
 
 		}
 
+		if (ImGui::CollapsingHeader("Geometry", ImGuiTreeNodeFlags_CollapsingHeader))
+		{
+			ImGui::Checkbox("Raster LODs", &g_settings.raster_lods);
+			ImGui::SliderFloat("LOD pixel error", &g_settings.lod_pixel_error, 0.1f, 16.0f, "%.1f");
+			ImGui::Checkbox("Frustum culling", &g_settings.frustum_culling);
+			ImGui::Checkbox("Backface culling", &g_settings.backface_culling);
+			ImGui::Checkbox("Occlusion culling", &g_settings.occlusion_culling);
+			ImGui::Checkbox("TLAS refit", &g_settings.tlas_refit);
+			ImGui::SliderInt("TLAS rebuild interval", &g_settings.tlas_rebuild_interval, 1, 600);
+			ImGui::Checkbox("Async compute", &g_settings.async_compute);
+		}
 		if (ImGui::CollapsingHeader("Probes", ImGuiTreeNodeFlags_CollapsingHeader))
 		{
 			ImGui::Checkbox("Show probes", &g_settings.visualize_probes);
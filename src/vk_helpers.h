@@ -678,6 +678,56 @@ namespace vkinit
 		return range;
 	}
 
+	// One half of a queue family ownership transfer of a whole image, the release is recorded on the source queue
+	// and the acquire on the destination queue. The layout is kept
+	inline VkImageMemoryBarrier2 image_ownership_barrier2(VkImage image, u32 src_family, u32 dst_family, bool acquire,
+		VkImageLayout layout = VK_IMAGE_LAYOUT_GENERAL, VkImageAspectFlags aspect = VK_IMAGE_ASPECT_COLOR_BIT)
+	{
+		VkImageMemoryBarrier2 barrier{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 };
+		barrier.image = image;
+		barrier.subresourceRange = image_subresource_range(aspect, 0, VK_REMAINING_ARRAY_LAYERS, 0, VK_REMAINING_MIP_LEVELS);
+		barrier.oldLayout = barrier.newLayout = layout;
+		barrier.srcQueueFamilyIndex = src_family;
+		barrier.dstQueueFamilyIndex = dst_family;
+		if (acquire)
+		{
+			barrier.dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+			barrier.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT;
+		}
+		else
+		{
+			barrier.srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+			barrier.srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT;
+		}
+
+		return barrier;
+	}
+
+	inline VkSemaphoreSubmitInfo semaphore_submit_info(VkSemaphore semaphore, VkPipelineStageFlags2 stage, u64 value = 0)
+	{
+		VkSemaphoreSubmitInfo info{ VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO };
+		info.semaphore = semaphore;
+		info.stageMask = stage;
+		info.value = value;
+
+		return info;
+	}
+
+	inline VkSubmitInfo2 submit_info2(u32 cmd_count, const VkCommandBufferSubmitInfo* cmds,
+		u32 wait_count, const VkSemaphoreSubmitInfo* waits,
+		u32 signal_count, const VkSemaphoreSubmitInfo* signals)
+	{
+		VkSubmitInfo2 info{ VK_STRUCTURE_TYPE_SUBMIT_INFO_2 };
+		info.commandBufferInfoCount = cmd_count;
+		info.pCommandBufferInfos = cmds;
+		info.waitSemaphoreInfoCount = wait_count;
+		info.pWaitSemaphoreInfos = waits;
+		info.signalSemaphoreInfoCount = signal_count;
+		info.pSignalSemaphoreInfos = signals;
+
+		return info;
+	}
+
 	inline VkViewport viewport(float x, float y, float w, float h, float min_depth, float max_depth, bool flip_y = true)
 	{
 		VkViewport vp = {};
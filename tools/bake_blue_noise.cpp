@@ -0,0 +1,75 @@
+// Bakes the per-slice blue noise pngs into single .bnv files (see src/blue_noise.h)
+//
+//   bake_blue_noise [set name]...
+//
+// Run from the data root. Without arguments all sets used by the renderer are baked, e.g.
+//   data/bluenoise/stbn_vec2_2Dx1D_128x128x64_<i>.png -> data/bluenoise/stbn_vec2_2Dx1D_128x128x64.bnv
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb/stb_image.h"
+
+#include "blue_noise.h"
+#include "jobs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+
+#define BLUE_NOISE_LAYER_COUNT 64
+
+static const char* default_sets[] = {
+	"stbn_unitvec3_cosine_2Dx1D_128x128x64",
+	"stbn_scalar_2Dx1Dx1D_128x128x64x1",
+	"stbn_vec2_2Dx1D_128x128x64",
+};
+
+static double now_ms()
+{
+	using namespace std::chrono;
+	return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+static bool bake(const char* name)
+{
+	std::string png_base = std::string("data/bluenoise/") + name + "_";
+	std::string output = std::string("data/bluenoise/") + name + ".bnv";
+
+	double start = now_ms();
+	Blue_Noise_Data data;
+	if (!decode_blue_noise_pngs(png_base.c_str(), BLUE_NOISE_LAYER_COUNT, &data))
+	{
+		printf("Failed to decode %s*.png\n", png_base.c_str());
+		return false;
+	}
+	double decode_time = now_ms() - start;
+
+	if (!write_blue_noise(output.c_str(), &data))
+	{
+		printf("Failed to write %s\n", output.c_str());
+		return false;
+	}
+
+	printf("%s: %ux%ux%u, decode %.1f ms, total %.1f ms\n", output.c_str(), data.width, data.height, data.layer_count, 
+		decode_time, now_ms() - start);
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	g_job_system->init();
+
+	bool success = true;
+	if (argc > 1)
+	{
+		for (int i = 1; i < argc; ++i)
+			success &= bake(argv[i]);
+	}
+	else
+	{
+		for (const char* name : default_sets)
+			success &= bake(name);
+	}
+
+	g_job_system->shutdown();
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
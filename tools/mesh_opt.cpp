@@ -0,0 +1,216 @@
+// Runs the import time mesh optimizations (see src/mesh_optimizer.h) offline and reports what they do
+//
+//   mesh_opt [--cache <size>] <mesh.obj | mesh.gltf | mesh.glb>...
+//
+// Geometry only, materials and node transforms are ignored. Every OBJ shape and glTF primitive is
+// one index range, the same way the renderer draws them.
+
+#define CGLTF_IMPLEMENTATION
+#include "cgltf/cgltf.h"
+#include "tiny_obj_loader.h"
+#include "mesh_optimizer.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <chrono>
+#include <filesystem>
+#include <vector>
+#include <string>
+
+// Same layout as Vertex in r_mesh.h, which can't be included without the renderer
+struct Tool_Vertex
+{
+	float pos[3];
+	float normal[3];
+	float texcoord[2];
+	float tangent[4];
+};
+static_assert(sizeof(Tool_Vertex) == 48, "Tool_Vertex has to match Vertex");
+constexpr u32 PACKED_VERTEX_SIZE = 24; // sizeof(Packed_Vertex) in shared.h
+
+struct Tool_Mesh
+{
+	std::vector<Tool_Vertex> vertices;
+	std::vector<u32> indices;
+	std::vector<Index_Range> ranges;
+};
+
+static double now_ms()
+{
+	using namespace std::chrono;
+	return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+static bool load_obj(const char* path, Tool_Mesh* out)
+{
+	tinyobj::ObjReaderConfig config;
+	config.triangulate = true;
+	tinyobj::ObjReader reader;
+	if (!reader.ParseFromFile(path, config))
+	{
+		printf("%s: %s\n", path, reader.Error().c_str());
+		return false;
+	}
+
+	// One vertex per face corner, so welding is part of what's measured
+	const tinyobj::attrib_t& attrib = reader.GetAttrib();
+	for (const tinyobj::shape_t& shape : reader.GetShapes())
+	{
+		Index_Range range = { (u32)out->indices.size(), (u32)shape.mesh.indices.size() };
+		for (const tinyobj::index_t& idx : shape.mesh.indices)
+		{
+			Tool_Vertex v{};
+			memcpy(v.pos, &attrib.vertices[3 * (size_t)idx.vertex_index], sizeof(v.pos));
+			if (idx.normal_index >= 0)
+				memcpy(v.normal, &attrib.normals[3 * (size_t)idx.normal_index], sizeof(v.normal));
+			if (idx.texcoord_index >= 0)
+				memcpy(v.texcoord, &attrib.texcoords[2 * (size_t)idx.texcoord_index], sizeof(v.texcoord));
+			out->indices.push_back((u32)out->vertices.size());
+			out->vertices.push_back(v);
+		}
+		out->ranges.push_back(range);
+	}
+	return true;
+}
+
+static void read_attribute(cgltf_accessor* acc, std::vector<Tool_Vertex>* vertices, u32 first_vertex, size_t member_offset, u32 component_count)
+{
+	std::vector<float> data(acc->count * component_count);
+	cgltf_accessor_unpack_floats(acc, data.data(), data.size());
+	for (size_t i = 0; i < acc->count; ++i)
+		memcpy((u8*)&(*vertices)[first_vertex + i] + member_offset, &data[i * component_count], component_count * sizeof(float));
+}
+
+static bool load_gltf(const char* path, Tool_Mesh* out)
+{
+	cgltf_options options = {};
+	cgltf_data* data = nullptr;
+	if (cgltf_parse_file(&options, path, &data) != cgltf_result_success)
+	{
+		printf("%s: Failed to parse\n", path);
+		return false;
+	}
+	if (cgltf_load_buffers(&options, data, path) != cgltf_result_success)
+	{
+		printf("%s: Failed to load buffers\n", path);
+		cgltf_free(data);
+		return false;
+	}
+
+	for (cgltf_size m = 0; m < data->meshes_count; ++m)
+	{
+		for (cgltf_size p = 0; p < data->meshes[m].primitives_count; ++p)
+		{
+			cgltf_primitive* prim = &data->meshes[m].primitives[p];
+			if (prim->type != cgltf_primitive_type_triangles)
+				continue;
+
+			u32 first_vertex = (u32)out->vertices.size();
+			u32 vertex_count = 0;
+			for (cgltf_size a = 0; a < prim->attributes_count; ++a)
+				if (prim->attributes[a].type == cgltf_attribute_type_position)
+					vertex_count = (u32)prim->attributes[a].data->count;
+			if (vertex_count == 0)
+				continue;
+
+			out->vertices.resize(first_vertex + vertex_count);
+			for (cgltf_size a = 0; a < prim->attributes_count; ++a)
+			{
+				cgltf_attribute* attr = &prim->attributes[a];
+				if (attr->data->count != vertex_count)
+					continue;
+				if (attr->type == cgltf_attribute_type_position)
+					read_attribute(attr->data, &out->vertices, first_vertex, offsetof(Tool_Vertex, pos), 3);
+				else if (attr->type == cgltf_attribute_type_normal)
+					read_attribute(attr->data, &out->vertices, first_vertex, offsetof(Tool_Vertex, normal), 3);
+				else if (attr->type == cgltf_attribute_type_texcoord && attr->index == 0)
+					read_attribute(attr->data, &out->vertices, first_vertex, offsetof(Tool_Vertex, texcoord), 2);
+				else if (attr->type == cgltf_attribute_type_tangent)
+					read_attribute(attr->data, &out->vertices, first_vertex, offsetof(Tool_Vertex, tangent), 4);
+			}
+
+			Index_Range range = { (u32)out->indices.size(), 0 };
+			if (prim->indices)
+			{
+				range.count = (u32)prim->indices->count;
+				out->indices.resize(range.offset + range.count);
+				cgltf_accessor_unpack_indices(prim->indices, &out->indices[range.offset], sizeof(u32), range.count);
+				for (u32 i = 0; i < range.count; ++i)
+					out->indices[range.offset + i] += first_vertex;
+			}
+			else
+			{
+				range.count = vertex_count;
+				for (u32 i = 0; i < vertex_count; ++i)
+					out->indices.push_back(first_vertex + i);
+			}
+			out->ranges.push_back(range);
+		}
+	}
+	cgltf_free(data);
+	return true;
+}
+
+static int optimize_file(const char* path, u32 cache_size)
+{
+	std::string ext = std::filesystem::path(path).extension().string();
+	Tool_Mesh mesh;
+	bool loaded = false;
+	if (ext == ".obj")
+		loaded = load_obj(path, &mesh);
+	else if (ext == ".gltf" || ext == ".glb")
+		loaded = load_gltf(path, &mesh);
+	else
+		printf("%s: Unsupported file type\n", path);
+	if (!loaded)
+		return EXIT_FAILURE;
+
+	u32 index_count = (u32)mesh.indices.size();
+	u32 range_count = (u32)mesh.ranges.size();
+	double start = now_ms();
+	Mesh_Optimization_Stats stats = optimize_indexed_mesh(mesh.vertices.data(), (u32)mesh.vertices.size(), sizeof(Tool_Vertex),
+		mesh.indices.data(), index_count, mesh.ranges.data(), range_count, cache_size);
+	double time = now_ms() - start;
+	mesh.vertices.resize(stats.vertex_count_after);
+
+	// Index memory if every range that fits used 16-bit indices relative to its first vertex
+	u64 index_bytes_16bit = 0;
+	for (const Index_Range& range : mesh.ranges)
+		index_bytes_16bit += (u64)range.count * (fits_16bit_indices(&mesh.indices[range.offset], range.count) ? 2 : 4);
+
+	auto mb = [](u64 bytes) { return (double)bytes / (1024.0 * 1024.0); };
+	printf("%s: %u ranges, %u triangles, optimized in %.1f ms\n", path, range_count, index_count / 3, time);
+	printf("  Vertices: %u -> %u\n", stats.vertex_count_before, stats.vertex_count_after);
+	printf("  ACMR: %.3f -> %.3f (FIFO cache of %u)\n", stats.acmr_before, stats.acmr_after, cache_size);
+	printf("  ATVR: %.3f\n", stats.vertex_count_after ? stats.acmr_after * (index_count / 3) / stats.vertex_count_after : 0.0f);
+	printf("  Vertex memory: %.2f MB -> %.2f MB (%.2f MB as Packed_Vertex)\n", mb((u64)stats.vertex_count_before * sizeof(Tool_Vertex)),
+		mb((u64)stats.vertex_count_after * sizeof(Tool_Vertex)), mb((u64)stats.vertex_count_after * PACKED_VERTEX_SIZE));
+	printf("  Index memory:  %.2f MB 32-bit, %.2f MB with 16-bit where it fits (%u / %u ranges)\n", mb((u64)index_count * 4),
+		mb(index_bytes_16bit), stats.ranges_fitting_16bit, range_count);
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char** argv)
+{
+	u32 cache_size = DEFAULT_VERTEX_CACHE_SIZE;
+	int first_file = 1;
+	if (argc >= 3 && strcmp(argv[1], "--cache") == 0)
+	{
+		cache_size = (u32)atoi(argv[2]);
+		first_file = 3;
+	}
+	if (first_file >= argc || cache_size == 0)
+	{
+		printf("Usage: %s [--cache <size>] <mesh.obj | mesh.gltf | mesh.glb>...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	int result = EXIT_SUCCESS;
+	for (int i = first_file; i < argc; ++i)
+	{
+		if (optimize_file(argv[i], cache_size) != EXIT_SUCCESS)
+			result = EXIT_FAILURE;
+	}
+	return result;
+}
@@ -0,0 +1,150 @@
+// Builds and inspects asset pack files (see src/pack_file.h)
+//
+//   packer build <out.pak> <file or directory>...
+//   packer list <pack.pak>
+//   packer bench <pack.pak>     Compare reading every entry from the pack vs loose files
+//
+// Paths are stored as given, run from the data root, e.g. 
+//   packer build assets.pak shaders/spirv data/bluenoise data/envmap
+
+#include "pack_file.h"
+#include "file_system.h"
+#include "jobs.h"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <filesystem>
+#include <vector>
+#include <string>
+
+static double now_ms()
+{
+	using namespace std::chrono;
+	return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void collect_files(const char* path, std::vector<std::string>* out)
+{
+	std::filesystem::path p(path);
+	if (std::filesystem::is_directory(p))
+	{
+		for (const auto& entry : std::filesystem::recursive_directory_iterator(p))
+		{
+			if (entry.is_regular_file())
+				out->push_back(entry.path().generic_string());
+		}
+	}
+	else if (std::filesystem::is_regular_file(p))
+	{
+		out->push_back(p.generic_string());
+	}
+	else
+	{
+		printf("Warning: %s not found\n", path);
+	}
+}
+
+static int build(const char* output, int count, char** inputs)
+{
+	std::vector<std::string> files;
+	for (int i = 0; i < count; ++i)
+		collect_files(inputs[i], &files);
+
+	double start = now_ms();
+	Pack_Build_Stats stats{};
+	if (!build_pack(output, files, PACK_DEFAULT_ALIGNMENT, &stats))
+		return EXIT_FAILURE;
+
+	printf("Packed %u files (%u compressed) into %s in %.1f ms\n", stats.file_count, stats.compressed_count, output, now_ms() - start);
+	printf("%.2f MB -> %.2f MB\n", (double)stats.total_size / (1024.0 * 1024.0), (double)stats.stored_size / (1024.0 * 1024.0));
+	return EXIT_SUCCESS;
+}
+
+static int list(const char* pack_path)
+{
+	Pack_File pack;
+	if (!pack.open(pack_path))
+		return EXIT_FAILURE;
+
+	for (u32 i = 0; i < pack.header->entry_count; ++i)
+	{
+		const Pack_Entry* e = &pack.entries[i];
+		printf("%10llu %10llu %s %s\n", (unsigned long long)e->size, (unsigned long long)e->stored_size,
+			(e->flags & PACK_ENTRY_COMPRESSED) ? "lz4 " : "raw ", pack.get_path(e));
+	}
+	pack.close();
+	return EXIT_SUCCESS;
+}
+
+static int bench(const char* pack_path)
+{
+	// NOTE: Both runs are usually from a warm page cache, this measures open + decode overhead 
+	// rather than disk throughput
+	Pack_File pack;
+	double open_start = now_ms();
+	if (!pack.open(pack_path))
+		return EXIT_FAILURE;
+	double open_time = now_ms() - open_start;
+
+	std::vector<std::string> paths;
+	u64 total_size = 0;
+	for (u32 i = 0; i < pack.header->entry_count; ++i)
+	{
+		paths.push_back(pack.get_path(&pack.entries[i]));
+		total_size += pack.entries[i].size;
+	}
+
+	std::vector<u8> buffer;
+	volatile u64 checksum = 0;
+
+	double loose_start = now_ms();
+	u32 loose_found = 0;
+	for (const std::string& path : paths)
+	{
+		File_View view;
+		if (!map_file(path.c_str(), &view))
+			continue;
+		buffer.assign(view.data, view.data + view.size);
+		checksum += buffer[buffer.size() / 2];
+		unmap_file(&view);
+		loose_found++;
+	}
+	double loose_time = now_ms() - loose_start;
+
+	double pack_start = now_ms();
+	double decode_time = 0.0;
+	for (u32 i = 0; i < pack.header->entry_count; ++i)
+	{
+		const Pack_Entry* e = &pack.entries[i];
+		buffer.resize(e->size);
+		double t = now_ms();
+		bool ok = pack.read(e, buffer.data());
+		assert(ok);
+		if (e->flags & PACK_ENTRY_COMPRESSED)
+			decode_time += now_ms() - t;
+		checksum += buffer[buffer.size() / 2];
+	}
+	double pack_time = now_ms() - pack_start;
+	pack.close();
+
+	printf("%u entries, %.2f MB\n", (u32)paths.size(), (double)total_size / (1024.0 * 1024.0));
+	printf("Loose files: %.2f ms (%u found)\n", loose_time, loose_found);
+	printf("Pack:        %.2f ms (open %.3f ms, lz4 decode %.2f ms)\n", pack_time + open_time, open_time, decode_time);
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc >= 4 && strcmp(argv[1], "build") == 0)
+		return build(argv[2], argc - 3, argv + 3);
+	if (argc == 3 && strcmp(argv[1], "list") == 0)
+		return list(argv[2]);
+	if (argc == 3 && strcmp(argv[1], "bench") == 0)
+		return bench(argv[2]);
+
+	printf("Usage:\n");
+	printf("  %s build <out.pak> <file or directory>...\n", argv[0]);
+	printf("  %s list <pack.pak>\n", argv[0]);
+	printf("  %s bench <pack.pak>\n", argv[0]);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,407 @@
+// Runs the CPU port of the ReBLUR denoiser (see src/reblur_cpu.h) without a GPU and checks every pass against goldens
+//
+//   reblur_check synth <capture dir> [frames] [width height]     Writes a synthetic capture
+//   reblur_check bless <capture dir> <golden dir>                 Denoises the capture, stores every pass output
+//   reblur_check check <capture dir> <golden dir> [tolerance]     Denoises the capture, compares every pass output
+//
+// A capture is a directory of frame_<n> directories, each with the G-buffer and noisy radiance as raw images
+// (save_cpu_image) and frame.bin holding Capture_Constants. Frames are denoised in order, so the temporal passes
+// see their history. check exits with a failure if any texel of any pass is further than tolerance from the golden.
+// synth renders a floor, a wall and a sphere analytically under a slowly moving camera, with the renderer's
+// default settings, so the chain can be checked without capturing a real frame.
+
+#include "reblur_cpu.h"
+#include "g_math.h"
+#include "jobs.h"
+#include "settings.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <filesystem>
+#include <iterator>
+#include <string>
+
+static const char* capture_images[] = {
+	"normal_roughness", "world_position", "motion_vectors", "depth", "noisy_diffuse", "noisy_specular"
+};
+
+struct Capture_Constants
+{
+	Camera_Data camera;
+	Camera_Data previous_camera;
+	Global_Constants_Data constants;
+	float history_fix_stride;
+	u32 frame_number;
+};
+
+struct Capture_Frame
+{
+	Reblur_Gbuffer gbuffer;
+	Cpu_Image noisy_diffuse;
+	Cpu_Image noisy_specular;
+	Capture_Constants constants;
+};
+
+static std::string frame_directory(const char* directory, u32 frame)
+{
+	return std::string(directory) + "/frame_" + std::to_string(frame);
+}
+
+static Cpu_Image* get_capture_image(Capture_Frame* frame, u32 i)
+{
+	Cpu_Image* images[] = {
+		&frame->gbuffer.normal_roughness, &frame->gbuffer.world_position, &frame->gbuffer.motion_vectors,
+		&frame->gbuffer.depth, &frame->noisy_diffuse, &frame->noisy_specular
+	};
+	static_assert(sizeof(images) / sizeof(images[0]) == std::size(capture_images), "One image per name");
+	return images[i];
+}
+
+static bool save_capture_frame(const std::string& directory, Capture_Frame* frame)
+{
+	std::filesystem::create_directories(directory);
+	bool success = true;
+	for (u32 i = 0; i < (u32)std::size(capture_images); ++i)
+		success &= save_cpu_image((directory + "/" + capture_images[i] + ".img").c_str(), *get_capture_image(frame, i));
+
+	FILE* f = fopen((directory + "/frame.bin").c_str(), "wb");
+	success = success && f && fwrite(&frame->constants, sizeof(frame->constants), 1, f) == 1;
+	if (f)
+		fclose(f);
+	return success;
+}
+
+static bool load_capture_frame(const std::string& directory, Capture_Frame* frame)
+{
+	for (u32 i = 0; i < (u32)std::size(capture_images); ++i)
+	{
+		if (!load_cpu_image((directory + "/" + capture_images[i] + ".img").c_str(), get_capture_image(frame, i)))
+			return false;
+	}
+
+	FILE* f = fopen((directory + "/frame.bin").c_str(), "rb");
+	bool success = f && fread(&frame->constants, sizeof(frame->constants), 1, f) == 1;
+	if (f)
+		fclose(f);
+	if (!success)
+	{
+		printf("Failed to read %s/frame.bin\n", directory.c_str());
+		return false;
+	}
+
+	const Cpu_Image& depth = frame->gbuffer.depth;
+	for (u32 i = 0; i < (u32)std::size(capture_images); ++i)
+	{
+		const Cpu_Image* image = get_capture_image(frame, i);
+		if (image->width != depth.width || image->height != depth.height)
+		{
+			printf("%s: %s is %dx%d, depth is %dx%d\n", directory.c_str(), capture_images[i], image->width, image->height, depth.width, depth.height);
+			return false;
+		}
+	}
+	return true;
+}
+
+// Inverse of the octahedral decode the denoiser uses, into [0, 1]
+static glm::vec2 encode_unit_vector(glm::vec3 n)
+{
+	n /= fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+	glm::vec2 p = glm::vec2(n.x, n.y);
+	if (n.z < 0.0f)
+	{
+		p = glm::vec2(
+			(1.0f - fabsf(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f),
+			(1.0f - fabsf(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f));
+	}
+	return p * 0.5f + 0.5f;
+}
+
+static float random_float(u32 x, u32 y, u32 frame, u32 stream)
+{
+	u64 seed = ((u64)y << 32 | x) * 0x9E3779B97F4A7C15ull ^ ((u64)frame << 8 | stream);
+	math::pcg32_random_t rng{};
+	math::pcg32_srandom_r(&rng, seed, stream);
+	return (float)(math::pcg32_random_r(&rng) >> 8) * (1.0f / 16777216.0f);
+}
+
+static Camera_Data make_camera(u32 frame, float aspect_ratio, float fov)
+{
+	glm::vec3 origin = glm::vec3(-0.4f + 0.04f * (float)frame, 1.2f, 4.0f);
+	glm::vec3 forward = glm::normalize(glm::vec3(0.0f, -0.2f, -1.0f));
+
+	Camera_Data camera{};
+	camera.view = glm::lookAt(origin, origin + forward, glm::vec3(0.0f, 1.0f, 0.0f));
+	camera.proj = math::make_infinite_reverse_z_proj_rh(glm::radians(fov), aspect_ratio, 0.1f);
+	camera.viewproj = camera.proj * camera.view;
+	camera.inverse_proj = glm::inverse(camera.proj);
+	camera.inverse_view = glm::inverse(camera.view);
+	camera.frame_index = glm::uvec4(frame);
+	return camera;
+}
+
+// The denoiser's share of what Renderer::update_global_constants fills in, from the default settings
+static Global_Constants_Data make_constants(i32 width, i32 height, float fov, const Camera_Data& camera, u32 frame)
+{
+	const Settings& s = g_settings;
+	float unproject = 1.0f / (0.5f * (float)height / tanf(glm::radians(fov * 0.5f)));
+
+	Global_Constants_Data gc{};
+	gc.unproject = unproject;
+	gc.min_rect_dim_mul_unproject = (float)std::min(width, height) * unproject;
+	gc.prepass_blur_radius = s.prepass_blur_radius;
+	gc.blur_radius = s.blur_radius;
+	gc.post_blur_radius_scale = s.post_blur_radius_scale;
+	gc.temporal_accumulation = (int)s.temporal_accumulation;
+	gc.history_fix = (int)s.history_fix;
+	gc.hit_dist_params = s.hit_distance_params;
+	gc.temporal_filtering_mode = (int)s.temporal_filter;
+	gc.bicubic_sharpness = s.bicubic_sharpness;
+	gc.plane_distance_sensitivity = s.plane_dist_sensitivity / 100.0f;
+	gc.camera_origin = glm::vec3(camera.inverse_view[3]);
+	gc.frame_number = frame;
+	gc.blur_kernel_rotation_mode = (u32)s.blur_kernel_rotation_mode;
+	gc.frame_num_scaling = (u32)s.frame_num_scaling;
+	gc.hit_distance_scaling = (u32)s.hit_dist_scaling;
+	gc.use_gaussian_weight = (u32)s.use_gaussian_weight;
+	gc.screen_space_sampling = (u32)s.screen_space_sampling;
+	gc.use_quadratic_distribution = (u32)s.use_quadratic_distribution;
+	gc.use_geometry_weight = (u32)s.use_geometry_weight;
+	gc.use_normal_weight = (u32)s.use_normal_weight;
+	gc.use_hit_distance_weight = (u32)s.use_hit_distance_weight;
+	gc.plane_dist_norm_scale = s.plane_dist_norm_scale;
+	gc.lobe_percentage = s.lobe_percentage;
+	gc.hit_distance_scale = s.hit_distance_scale;
+	gc.stabilization_strength = s.stabilization_strength;
+	gc.use_ycocg_color_space = (u32)s.use_ycocg_color_space;
+	gc.spec_accum_base_power = s.spec_accum_base_power;
+	gc.spec_accum_curve = s.spec_accum_curve;
+	return gc;
+}
+
+// Closest hit of the floor (y = 0), the back wall (z = -3) and a sphere, false on a miss
+static bool trace_scene(glm::vec3 ro, glm::vec3 rd, glm::vec3* position, glm::vec3* normal, float* roughness)
+{
+	float t_max = INFINITY;
+	if (rd.y < 0.0f)
+	{
+		t_max = -ro.y / rd.y;
+		*normal = glm::vec3(0.0f, 1.0f, 0.0f);
+		*roughness = 0.7f;
+	}
+	if (rd.z < 0.0f && (-3.0f - ro.z) / rd.z < t_max)
+	{
+		t_max = (-3.0f - ro.z) / rd.z;
+		*normal = glm::vec3(0.0f, 0.0f, 1.0f);
+		*roughness = 0.2f;
+	}
+
+	glm::vec3 center = glm::vec3(0.0f, 0.75f, 0.0f);
+	glm::vec3 oc = ro - center;
+	float b = glm::dot(oc, rd);
+	float h = b * b - (glm::dot(oc, oc) - 0.75f * 0.75f);
+	if (h > 0.0f && -b - sqrtf(h) > 0.0f && -b - sqrtf(h) < t_max)
+	{
+		t_max = -b - sqrtf(h);
+		*normal = glm::normalize(ro + rd * t_max - center);
+		*roughness = 0.4f;
+	}
+
+	*position = ro + rd * t_max;
+	return t_max < INFINITY;
+}
+
+static void synthesize_frame(i32 width, i32 height, u32 frame, Capture_Frame* out)
+{
+	const float fov = 60.0f;
+	float aspect_ratio = (float)width / (float)height;
+	Camera_Data camera = make_camera(frame, aspect_ratio, fov);
+	Camera_Data previous_camera = make_camera(frame ? frame - 1 : 0, aspect_ratio, fov);
+	glm::vec3 origin = glm::vec3(camera.inverse_view[3]);
+	glm::vec3 light = glm::normalize(glm::vec3(0.5f, 1.0f, 0.3f));
+
+	for (u32 i = 0; i < (u32)std::size(capture_images); ++i)
+		get_capture_image(out, i)->resize(width, height);
+
+	for (i32 y = 0; y < height; ++y)
+	{
+		for (i32 x = 0; x < width; ++x)
+		{
+			glm::ivec2 p = glm::ivec2(x, y);
+			glm::vec2 uv = (glm::vec2(p) + 0.5f) / glm::vec2(width, height);
+			glm::vec4 near_point = camera.inverse_proj * glm::vec4(uv * 2.0f - 1.0f, 1.0f, 1.0f);
+			glm::vec3 rd = glm::normalize(glm::vec3(camera.inverse_view * glm::vec4(glm::vec3(near_point) / near_point.w, 1.0f)) - origin);
+
+			glm::vec3 X, N;
+			float roughness;
+			if (!trace_scene(origin, rd, &X, &N, &roughness))
+				continue; // Sky, depth stays 0
+
+			glm::vec4 clip = camera.viewproj * glm::vec4(X, 1.0f);
+			glm::vec4 previous_clip = previous_camera.viewproj * glm::vec4(X, 1.0f);
+			glm::vec2 previous_uv = glm::vec2(previous_clip) / previous_clip.w * 0.5f + 0.5f;
+
+			out->gbuffer.normal_roughness.store(p, glm::vec4(encode_unit_vector(N), roughness, 0.0f));
+			out->gbuffer.world_position.store(p, glm::vec4(X, 1.0f));
+			out->gbuffer.motion_vectors.store(p, glm::vec4(previous_uv - uv, 0.0f, 0.0f));
+			out->gbuffer.depth.store(p, glm::vec4(clip.z / clip.w, 0.0f, 0.0f, 0.0f));
+
+			// Smooth lighting times exponential noise of mean 1, hit distances in alpha
+			float pattern = 0.6f + 0.3f * sinf(X.x * 3.0f) * cosf(X.z * 3.0f + X.y * 2.0f);
+			glm::vec3 radiance = glm::vec3(0.9f, 0.8f, 0.7f) * pattern * (0.2f + std::max(glm::dot(N, light), 0.0f));
+			float diffuse_noise = -logf(std::max(random_float(x, y, frame, 0), 1e-4f));
+			float specular_noise = -logf(std::max(random_float(x, y, frame, 1), 1e-4f));
+			out->noisy_diffuse.store(p, glm::vec4(radiance * diffuse_noise, 0.1f + 0.8f * random_float(x, y, frame, 2)));
+			out->noisy_specular.store(p, glm::vec4(radiance * specular_noise * (1.0f - roughness), 0.1f + 0.8f * random_float(x, y, frame, 3)));
+		}
+	}
+
+	out->constants.camera = camera;
+	out->constants.previous_camera = previous_camera;
+	out->constants.constants = make_constants(width, height, fov, camera, frame);
+	out->constants.history_fix_stride = g_settings.history_fix_stride;
+	out->constants.frame_number = frame;
+}
+
+static bool synth(const char* capture, u32 frame_count, i32 width, i32 height)
+{
+	for (u32 i = 0; i < frame_count; ++i)
+	{
+		Capture_Frame frame;
+		synthesize_frame(width, height, i, &frame);
+		if (!save_capture_frame(frame_directory(capture, i), &frame))
+			return false;
+	}
+	printf("Wrote %u %dx%d frames to %s\n", frame_count, width, height, capture);
+	return true;
+}
+
+// Largest difference of any channel, NaN on one side only counts as infinitely far
+static float max_difference(const Cpu_Image& a, const Cpu_Image& b)
+{
+	float result = 0.0f;
+	for (size_t i = 0; i < a.texels.size(); ++i)
+	{
+		for (int c = 0; c < 4; ++c)
+		{
+			float x = a.texels[i][c], y = b.texels[i][c];
+			if (isnan(x) != isnan(y))
+				return INFINITY;
+			if (!isnan(x))
+				result = std::max(result, fabsf(x - y));
+		}
+	}
+	return result;
+}
+
+// Denoises every frame of the capture, then stores (bless) or compares (check) the pass outputs
+static bool run(const char* capture, const char* golden, bool bless, float tolerance)
+{
+	Capture_Frame frames[2];
+	Reblur_Cpu reblur;
+	u32 failures = 0;
+	u32 frame_count = 0;
+	for (; std::filesystem::is_directory(frame_directory(capture, frame_count)); ++frame_count)
+	{
+		Capture_Frame& frame = frames[frame_count % 2];
+		const Capture_Frame& previous = frames[(frame_count + 1) % 2];
+		if (!load_capture_frame(frame_directory(capture, frame_count), &frame))
+			return false;
+
+		i32 width = frame.gbuffer.depth.width;
+		i32 height = frame.gbuffer.depth.height;
+		if (frame_count == 0)
+			reblur.init(width, height);
+		else if (width != reblur.width || height != reblur.height)
+		{
+			printf("Frame %u is %dx%d, the first one %dx%d\n", frame_count, width, height, reblur.width, reblur.height);
+			return false;
+		}
+
+		Reblur_Frame input;
+		input.current = &frame.gbuffer;
+		input.previous = frame_count ? &previous.gbuffer : &frame.gbuffer;
+		input.noisy_diffuse = &frame.noisy_diffuse;
+		input.noisy_specular = &frame.noisy_specular;
+		input.camera = frame.constants.camera;
+		input.previous_camera = frame.constants.previous_camera;
+		input.constants = frame.constants.constants;
+		input.history_fix_stride = frame.constants.history_fix_stride;
+		input.frame_number = frame.constants.frame_number;
+		reblur.denoise(input);
+
+		std::string directory = frame_directory(golden, frame_count);
+		if (bless)
+			std::filesystem::create_directories(directory);
+		for (const auto& [name, image] : reblur.get_pass_outputs())
+		{
+			std::string path = directory + "/" + name + ".img";
+			if (bless)
+			{
+				if (!save_cpu_image(path.c_str(), *image))
+					return false;
+				continue;
+			}
+
+			Cpu_Image expected;
+			if (!load_cpu_image(path.c_str(), &expected))
+				return false;
+			float difference = expected.width == image->width && expected.height == image->height ? max_difference(*image, expected) : INFINITY;
+			if (difference > tolerance)
+			{
+				printf("frame %u %s: max difference %g\n", frame_count, name.c_str(), difference);
+				failures++;
+			}
+		}
+	}
+
+	if (frame_count == 0)
+	{
+		printf("No frames in %s\n", capture);
+		return false;
+	}
+	if (bless)
+		printf("Stored the pass outputs of %u frames in %s\n", frame_count, golden);
+	else
+		printf("%u frames, %u pass outputs differ by more than %g\n", frame_count, failures, tolerance);
+	return failures == 0;
+}
+
+static int usage()
+{
+	printf("reblur_check synth <capture dir> [frames] [width height]\n");
+	printf("reblur_check bless <capture dir> <golden dir>\n");
+	printf("reblur_check check <capture dir> <golden dir> [tolerance]\n");
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 3)
+		return usage();
+
+	g_job_system->init();
+
+	std::string command = argv[1];
+	bool success;
+	if (command == "synth")
+	{
+		u32 frames = argc > 3 ? (u32)atoi(argv[3]) : 8;
+		i32 width = argc > 5 ? atoi(argv[4]) : 160;
+		i32 height = argc > 5 ? atoi(argv[5]) : 90;
+		success = frames > 0 && width > 0 && height > 0 && synth(argv[2], frames, width, height);
+	}
+	else if ((command == "bless" || command == "check") && argc >= 4)
+	{
+		float tolerance = argc > 4 ? (float)atof(argv[4]) : 1e-4f;
+		success = run(argv[2], argv[3], command == "bless", tolerance);
+	}
+	else
+	{
+		g_job_system->shutdown();
+		return usage();
+	}
+
+	g_job_system->shutdown();
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}